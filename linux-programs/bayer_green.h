@@ -0,0 +1,51 @@
+// the green sites of raw Bayer frames, private to the modules that
+// measure a frame on its green channel
+//
+// frames hold 12 bit pixels in 16 bit words whose high nibbles may carry
+// embedded data.  Each 2x2 quad has one green site on each row; the
+// loops read a row's two pixels of a quad as one pixel_pair_t, so they
+// vectorise, and shift the green one out with PAIR_SHIFT()
+
+#ifndef _BAYER_GREEN_H_
+#define _BAYER_GREEN_H_ 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include "ahd_bayer.h"
+
+// 12 bit pixels, the high nibbles may hold embedded data
+#define PIXEL_MASK 0x0fff
+
+// a quad's two pixels on one row, read as a unit
+typedef uint32_t __attribute__((__may_alias__)) pixel_pair_t;
+
+// shift to the pixel at x offset 0 or 1 of a pair
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define PAIR_SHIFT(x) (16 * (x))
+#else
+#define PAIR_SHIFT(x) (16 * (1 - (x)))
+#endif
+
+// x of the green site in the even and odd rows of each quad, false with
+// errno EINVAL for tiles without a green site on both rows
+static inline bool bayer_green(BayerTile tile, unsigned int *g0, unsigned int *g1) {
+	switch (tile) {
+	case BAYER_TILE_GRBG:
+	case BAYER_TILE_GBRG:
+		*g0 = 0;
+		*g1 = 1;
+		return true;
+	case BAYER_TILE_RGGB:
+	case BAYER_TILE_BGGR:
+		*g0 = 1;
+		*g1 = 0;
+		return true;
+	default:
+		errno = EINVAL;
+		return false;
+	}
+}
+
+#endif
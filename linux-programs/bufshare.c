@@ -0,0 +1,460 @@
+// share exported capture buffers with other processes without copying
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+
+#include <linux/dma-buf.h>
+
+#include "bufshare.h"
+
+
+// epoll data of the listening socket, clients are their slot number
+#define LISTENER BUFSHARE_MAX_CLIENTS
+
+#define BIT(n) (1ULL << (n))
+
+
+static bool fail(bufshare_t *share, const char *operation) {
+	share->error = operation;
+	return false;
+}
+
+static bool consumer_fail(bufshare_consumer_t *consumer, const char *operation) {
+	consumer->error = operation;
+	return false;
+}
+
+static bool set_address(struct sockaddr_un *address, const char *path) {
+	memset(address, 0, sizeof(*address));
+	address->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address->sun_path)) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	strcpy(address->sun_path, path);
+	return true;
+}
+
+static bool send_message(int fd, const bufshare_message_t *message, const int *fds, unsigned int n_fds) {
+	struct iovec iov = {
+		.iov_base = (void *)message,
+		.iov_len = sizeof(*message),
+	};
+	union {
+		char buffer[CMSG_SPACE(sizeof(int) * BUFSHARE_MAX_BUFFERS)];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (n_fds > 0) {
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buffer;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * n_fds);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n_fds);
+	}
+
+	return sizeof(*message) == sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+
+// exporter
+
+bool bufshare_create(bufshare_t *share, const char *path, const int *fds, unsigned int n_buffers,
+		     size_t length, unsigned int width, unsigned int height) {
+	memset(share, 0, sizeof(*share));
+	share->listen_fd = -1;
+	share->epoll_fd = -1;
+	for (unsigned int i = 0; i < BUFSHARE_MAX_CLIENTS; ++i) {
+		share->client[i].fd = -1;
+	}
+
+	if (n_buffers > BUFSHARE_MAX_BUFFERS) {
+		errno = EINVAL;
+		return fail(share, "too many buffers");
+	}
+	memcpy(share->fds, fds, n_buffers * sizeof(int));
+	share->n_buffers = n_buffers;
+	share->length = length;
+	share->width = width;
+	share->height = height;
+
+	if (!set_address(&share->address, path)) {
+		return fail(share, "socket path");
+	}
+
+	share->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (-1 == share->listen_fd) {
+		return fail(share, "socket");
+	}
+	unlink(path);  // left by an earlier run
+	if (-1 == bind(share->listen_fd, (struct sockaddr *)&share->address, sizeof(share->address))) {
+		return fail(share, "bind");
+	}
+	if (-1 == listen(share->listen_fd, BUFSHARE_MAX_CLIENTS)) {
+		return fail(share, "listen");
+	}
+
+	share->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (-1 == share->epoll_fd) {
+		return fail(share, "epoll_create1");
+	}
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = LISTENER;
+	if (-1 == epoll_ctl(share->epoll_fd, EPOLL_CTL_ADD, share->listen_fd, &ev)) {
+		return fail(share, "epoll_ctl");
+	}
+	return true;
+}
+
+
+// forget a consumer, returning the buffers only it was holding
+static uint64_t drop_client(bufshare_t *share, bufshare_client_t *client) {
+	uint64_t freed = 0;
+	for (unsigned int i = 0; i < share->n_buffers; ++i) {
+		if (0 != (client->held & BIT(i)) && 0 == --share->refs[i]) {
+			freed |= BIT(i);
+		}
+	}
+	close(client->fd);  // also leaves the epoll set
+	client->fd = -1;
+	client->held = 0;
+	return freed;
+}
+
+static void accept_clients(bufshare_t *share) {
+	for (;;) {
+		int fd = accept(share->listen_fd, NULL, NULL);
+		if (-1 == fd) {
+			return;  // EAGAIN or a consumer that has already gone
+		}
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+
+		bufshare_client_t *client = NULL;
+		for (unsigned int i = 0; i < BUFSHARE_MAX_CLIENTS && NULL == client; ++i) {
+			if (-1 == share->client[i].fd) {
+				client = &share->client[i];
+			}
+		}
+
+		bufshare_message_t hello;
+		memset(&hello, 0, sizeof(hello));
+		hello.magic = BUFSHARE_MAGIC;
+		hello.version = BUFSHARE_VERSION;
+		hello.type = BUFSHARE_HELLO;
+		hello.n_buffers = share->n_buffers;
+		hello.length = share->length;
+		hello.width = share->width;
+		hello.height = share->height;
+
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		if (NULL != client) {
+			ev.data.u32 = client - share->client;
+		}
+		if (NULL == client
+		    || !send_message(fd, &hello, share->fds, share->n_buffers)
+		    || -1 == epoll_ctl(share->epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+			close(fd);
+			continue;
+		}
+		client->fd = fd;
+		client->held = 0;
+	}
+}
+
+static uint64_t read_releases(bufshare_t *share, bufshare_client_t *client) {
+	uint64_t freed = 0;
+	for (;;) {
+		bufshare_message_t message;
+		ssize_t n = recv(client->fd, &message, sizeof(message), MSG_DONTWAIT);
+		if (-1 == n && (EAGAIN == errno || EINTR == errno)) {
+			return freed;
+		}
+		if (n != sizeof(message) || BUFSHARE_MAGIC != message.magic
+		    || BUFSHARE_RELEASE != message.type) {
+			// gone, or talking nonsense
+			return freed | drop_client(share, client);
+		}
+		unsigned int i = message.index;
+		if (i < share->n_buffers && 0 != (client->held & BIT(i))) {
+			client->held &= ~BIT(i);
+			if (0 == --share->refs[i]) {
+				freed |= BIT(i);
+			}
+		}
+	}
+}
+
+uint64_t bufshare_service(bufshare_t *share) {
+	struct epoll_event events[BUFSHARE_MAX_CLIENTS + 1];
+	uint64_t freed = 0;
+
+	int r = epoll_wait(share->epoll_fd, events, BUFSHARE_MAX_CLIENTS + 1, 0);
+	for (int i = 0; i < r; ++i) {
+		uint32_t slot = events[i].data.u32;
+		if (LISTENER == slot) {
+			accept_clients(share);
+		} else if (-1 != share->client[slot].fd) {
+			freed |= read_releases(share, &share->client[slot]);
+		}
+	}
+	return freed;
+}
+
+
+uint64_t bufshare_held(const bufshare_t *share) {
+	uint64_t held = 0;
+	for (unsigned int i = 0; i < BUFSHARE_MAX_CLIENTS; ++i) {
+		held |= share->client[i].held;
+	}
+	return held;
+}
+
+
+unsigned int bufshare_publish(bufshare_t *share, unsigned int index, uint32_t sequence,
+			      uint64_t timestamp_us, size_t bytesused) {
+	++share->frames;
+	if (index >= share->n_buffers) {
+		return 0;
+	}
+
+	unsigned int held = __builtin_popcountll(bufshare_held(share));
+	if (held + 1 + BUFSHARE_RESERVE > share->n_buffers) {
+		++share->skipped;
+		return 0;
+	}
+
+	bufshare_message_t message;
+	memset(&message, 0, sizeof(message));
+	message.magic = BUFSHARE_MAGIC;
+	message.type = BUFSHARE_FRAME;
+	message.index = index;
+	message.sequence = sequence;
+	message.frame = share->frames;
+	message.timestamp_us = timestamp_us;
+	message.bytesused = bytesused;
+
+	unsigned int sent = 0;
+	for (unsigned int i = 0; i < BUFSHARE_MAX_CLIENTS; ++i) {
+		bufshare_client_t *client = &share->client[i];
+		if (-1 == client->fd) {
+			continue;
+		}
+		if (!send_message(client->fd, &message, NULL, 0)) {
+			// a full socket just misses the frame, anything else will
+			// show as a hang up to bufshare_service()
+			if (EAGAIN != errno) {
+				shutdown(client->fd, SHUT_RDWR);
+			}
+			continue;
+		}
+		client->held |= BIT(index);
+		++share->refs[index];
+		++sent;
+	}
+	if (sent > 0) {
+		++share->shared;
+	}
+	return sent;
+}
+
+
+void bufshare_close(bufshare_t *share) {
+	for (unsigned int i = 0; i < BUFSHARE_MAX_CLIENTS; ++i) {
+		if (-1 != share->client[i].fd) {
+			close(share->client[i].fd);
+			share->client[i].fd = -1;
+		}
+	}
+	if (-1 != share->epoll_fd) {
+		close(share->epoll_fd);
+		share->epoll_fd = -1;
+	}
+	if (-1 != share->listen_fd) {
+		close(share->listen_fd);
+		share->listen_fd = -1;
+		unlink(share->address.sun_path);
+	}
+}
+
+
+// consumer
+
+// cache maintenance for a real dmabuf, a memfd does not need it
+static void sync_buffer(int fd, uint64_t flags) {
+	struct dma_buf_sync sync = { .flags = flags | DMA_BUF_SYNC_READ };
+	ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+bool bufshare_attach(bufshare_consumer_t *consumer, const char *path) {
+	memset(consumer, 0, sizeof(*consumer));
+	consumer->fd = -1;
+	for (unsigned int i = 0; i < BUFSHARE_MAX_BUFFERS; ++i) {
+		consumer->fds[i] = -1;
+	}
+
+	struct sockaddr_un address;
+	if (!set_address(&address, path)) {
+		return consumer_fail(consumer, "socket path");
+	}
+	consumer->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (-1 == consumer->fd) {
+		return consumer_fail(consumer, "socket");
+	}
+	if (-1 == connect(consumer->fd, (struct sockaddr *)&address, sizeof(address))) {
+		return consumer_fail(consumer, "connect");
+	}
+
+	bufshare_message_t hello;
+	struct iovec iov = {
+		.iov_base = &hello,
+		.iov_len = sizeof(hello),
+	};
+	union {
+		char buffer[CMSG_SPACE(sizeof(int) * BUFSHARE_MAX_BUFFERS)];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = sizeof(control.buffer);
+
+	ssize_t n = recvmsg(consumer->fd, &msg, MSG_CMSG_CLOEXEC);
+	if (-1 == n) {
+		return consumer_fail(consumer, "recvmsg");
+	}
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	unsigned int n_fds = 0;
+	if (NULL != cmsg && SOL_SOCKET == cmsg->cmsg_level && SCM_RIGHTS == cmsg->cmsg_type) {
+		n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(consumer->fds, CMSG_DATA(cmsg), n_fds * sizeof(int));
+	}
+	if (n != sizeof(hello) || BUFSHARE_MAGIC != hello.magic || BUFSHARE_HELLO != hello.type) {
+		errno = EPROTO;
+		return consumer_fail(consumer, "not a buffer share");
+	}
+	if (BUFSHARE_VERSION != hello.version) {
+		errno = EPROTO;
+		return consumer_fail(consumer, "version mismatch");
+	}
+	if (n_fds != hello.n_buffers || n_fds > BUFSHARE_MAX_BUFFERS) {
+		errno = EPROTO;
+		return consumer_fail(consumer, "buffer descriptors missing");
+	}
+
+	consumer->n_buffers = hello.n_buffers;
+	consumer->length = hello.length;
+	consumer->width = hello.width;
+	consumer->height = hello.height;
+	for (unsigned int i = 0; i < consumer->n_buffers; ++i) {
+		void *p = mmap(NULL, consumer->length, PROT_READ, MAP_SHARED, consumer->fds[i], 0);
+		if (MAP_FAILED == p) {
+			return consumer_fail(consumer, "mmap");
+		}
+		consumer->map[i] = p;
+	}
+	return true;
+}
+
+
+int bufshare_next(bufshare_consumer_t *consumer, bufshare_frame_t *frame, int timeout_ms) {
+	struct pollfd pfd = {
+		.fd = consumer->fd,
+		.events = POLLIN,
+	};
+	int r = poll(&pfd, 1, timeout_ms);
+	if (0 == r) {
+		return 0;
+	}
+	if (-1 == r) {
+		consumer_fail(consumer, "poll");
+		return -1;
+	}
+
+	bufshare_message_t message;
+	ssize_t n = recv(consumer->fd, &message, sizeof(message), 0);
+	if (n <= 0) {
+		return -1;  // capture has finished
+	}
+	if (n != sizeof(message) || BUFSHARE_MAGIC != message.magic
+	    || BUFSHARE_FRAME != message.type || message.index >= consumer->n_buffers) {
+		errno = EPROTO;
+		consumer_fail(consumer, "bad message");
+		return -1;
+	}
+
+	if (0 != consumer->last && message.frame > consumer->last + 1) {
+		consumer->gaps += message.frame - consumer->last - 1;
+	}
+	consumer->last = message.frame;
+	++consumer->frames;
+
+	sync_buffer(consumer->fds[message.index], DMA_BUF_SYNC_START);
+	frame->data = consumer->map[message.index];
+	frame->index = message.index;
+	frame->sequence = message.sequence;
+	frame->frame = message.frame;
+	frame->timestamp_us = message.timestamp_us;
+	frame->bytesused = message.bytesused;
+	return 1;
+}
+
+
+bool bufshare_release(bufshare_consumer_t *consumer, const bufshare_frame_t *frame) {
+	sync_buffer(consumer->fds[frame->index], DMA_BUF_SYNC_END);
+
+	bufshare_message_t message;
+	memset(&message, 0, sizeof(message));
+	message.magic = BUFSHARE_MAGIC;
+	message.type = BUFSHARE_RELEASE;
+	message.index = frame->index;
+	if (sizeof(message) != send(consumer->fd, &message, sizeof(message), MSG_NOSIGNAL)) {
+		return consumer_fail(consumer, "send");
+	}
+	return true;
+}
+
+
+void bufshare_detach(bufshare_consumer_t *consumer) {
+	for (unsigned int i = 0; i < consumer->n_buffers; ++i) {
+		if (NULL != consumer->map[i]) {
+			munmap((void *)consumer->map[i], consumer->length);
+			consumer->map[i] = NULL;
+		}
+	}
+	for (unsigned int i = 0; i < BUFSHARE_MAX_BUFFERS; ++i) {
+		if (-1 != consumer->fds[i]) {
+			close(consumer->fds[i]);
+			consumer->fds[i] = -1;
+		}
+	}
+	if (-1 != consumer->fd) {
+		close(consumer->fd);
+		consumer->fd = -1;
+	}
+}
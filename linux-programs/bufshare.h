@@ -0,0 +1,130 @@
+// share exported capture buffers with other processes without copying
+//
+// the exporter listens on a Unix socket.  A consumer that connects is
+// sent the buffer descriptors once (SCM_RIGHTS) and maps them, then for
+// every frame it is sent the buffer index and reads the frame in place.
+// The buffer stays out of the driver queue until every consumer it was
+// sent to has released it.  The exporter never waits: while too few
+// buffers would be left for the driver, frames are not shared
+
+#ifndef _BUFSHARE_H_
+#define _BUFSHARE_H_ 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/un.h>
+
+#define BUFSHARE_MAGIC   0x52485342  // "BSHR"
+#define BUFSHARE_VERSION 1
+
+// bit mask of buffers, so no more than this
+#define BUFSHARE_MAX_BUFFERS 64
+#define BUFSHARE_MAX_CLIENTS 8
+
+// buffers always left for the driver
+#define BUFSHARE_RESERVE 2
+
+typedef enum {
+	BUFSHARE_HELLO = 1,    // to a new consumer, with the descriptors
+	BUFSHARE_FRAME,        // a frame is ready in index
+	BUFSHARE_RELEASE,      // from a consumer, index is finished with
+} bufshare_type_t;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t type;
+	uint32_t index;
+	uint32_t sequence;
+	uint64_t frame;          // from 1
+	uint64_t timestamp_us;
+	uint32_t bytesused;
+	uint32_t n_buffers;      // HELLO only
+	uint64_t length;         // HELLO only, bytes in each buffer
+	uint32_t width;          // HELLO only
+	uint32_t height;
+	uint32_t version;        // HELLO only
+	uint32_t reserved;
+} bufshare_message_t;
+
+typedef struct {
+	int fd;                  // -1 => slot unused
+	uint64_t held;           // mask of buffers sent and not released
+} bufshare_client_t;
+
+typedef struct {
+	struct sockaddr_un address;
+	int listen_fd;
+	int epoll_fd;            // listener and clients, poll this
+	unsigned int n_buffers;
+	int fds[BUFSHARE_MAX_BUFFERS];
+	size_t length;
+	unsigned int width;
+	unsigned int height;
+	bufshare_client_t client[BUFSHARE_MAX_CLIENTS];
+	unsigned int refs[BUFSHARE_MAX_BUFFERS];
+	uint64_t frames;         // published
+	uint64_t shared;         // sent to at least one consumer
+	uint64_t skipped;        // not sent, too few buffers left for the driver
+	const char *error;       // operation that failed, errno has the reason
+} bufshare_t;
+
+// all return false on failure with share->error and errno set
+
+bool bufshare_create(bufshare_t *share, const char *path, const int *fds, unsigned int n_buffers,
+		     size_t length, unsigned int width, unsigned int height);
+
+// offer a frame to every consumer, returns the number it was sent to;
+// a nonzero result means the buffer must not be requeued until it is
+// returned by bufshare_service()
+unsigned int bufshare_publish(bufshare_t *share, unsigned int index, uint32_t sequence,
+			      uint64_t timestamp_us, size_t bytesused);
+
+// accept consumers and read releases once share->epoll_fd is readable,
+// returns the mask of buffers no longer held by anyone
+uint64_t bufshare_service(bufshare_t *share);
+
+// mask of buffers held by consumers
+uint64_t bufshare_held(const bufshare_t *share);
+
+// disconnect everyone and remove the socket
+void bufshare_close(bufshare_t *share);
+
+
+// consumer side
+
+typedef struct {
+	int fd;
+	unsigned int n_buffers;
+	size_t length;
+	unsigned int width;
+	unsigned int height;
+	const void *map[BUFSHARE_MAX_BUFFERS];
+	int fds[BUFSHARE_MAX_BUFFERS];
+	uint64_t frames;         // received
+	uint64_t gaps;           // frames not shared with us
+	uint64_t last;           // frame number of the previous one
+	const char *error;
+} bufshare_consumer_t;
+
+typedef struct {
+	const void *data;
+	uint32_t index;
+	uint32_t sequence;
+	uint64_t frame;
+	uint64_t timestamp_us;
+	uint32_t bytesused;
+} bufshare_frame_t;
+
+bool bufshare_attach(bufshare_consumer_t *consumer, const char *path);
+
+// wait up to timeout_ms (-1 => forever) for the next frame
+// returns 1 for a frame, 0 on timeout and -1 once the exporter has gone
+int bufshare_next(bufshare_consumer_t *consumer, bufshare_frame_t *frame, int timeout_ms);
+
+// hand the buffer back, the frame data must not be used afterwards
+bool bufshare_release(bufshare_consumer_t *consumer, const bufshare_frame_t *frame);
+
+void bufshare_detach(bufshare_consumer_t *consumer);
+
+#endif
@@ -8,45 +8,141 @@
 #if defined(__linux__)
 #include <bsd/string.h>
 #endif
-#include <assert.h>
 #include <getopt.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/sysinfo.h>
 #include <sys/stat.h>
-#include <sys/mman.h>
-#include <sys/ioctl.h>
+#include <sys/epoll.h>
 
 #include <linux/videodev2.h>
 
+#include "bufshare.h"
+#include "controls.h"
+#include "embed.h"
+#include "frame_stats.h"
+#include "framebus.h"
+#include "pipeline.h"
+#include "preview.h"
+#include "segment.h"
+#include "video.h"
+
 
 #define DEFAULT_FRAME_COUNT 70
 
+// maximum number of --device arguments
+#define MAX_DEVICES 8
+
+// seconds without a frame before a device is reported as stalled
+#define DEFAULT_STALL_TIMEOUT 2
+
+// number of consecutive stall reports before a device is abandoned
+#define STALL_LIMIT 5
+
+// unchanged focus steps that count as the motor holding
+#define DEFAULT_HOLD_FRAMES 3
+
 // AR0330 defaults
 #define DEFAULT_BRIGHTNESS    168
 #define DEFAULT_SHARPNESS  0x0080
 #define DEFAULT_CONTRAST        0
 #define DEFAULT_LEDS         0x0f
 
-#define CLEAR(x) memset(&(x), 0, sizeof(x))
+// photometric mode: frames from the one an LED change is sent after to
+// the first one it lights
+#define DEFAULT_LED_LAG 1
+#define MAX_LED_LAG 7
 
-enum io_method {
-	IO_METHOD_READ,
-	IO_METHOD_MMAP,
-	IO_METHOD_USERPTR,
-};
+#define CLEAR(x) memset(&(x), 0, sizeof(x))
 
-struct buffer {
-	void *start;
-	size_t length;
-};
+// one video device and its output stream
+typedef struct {
+	int index;                  // position on the command line
+	const char *device_name;
+	const char *output_name;
+	video_device_t video;
+	controls_t controls;
+	segment_t output;
+	const char *bus_name;       // shared memory frame bus, NULL => none
+	framebus_t bus;
+	pipeline_t pipeline;        // inline processing, jobs NULL => none
+	const char *export_name;    // socket to share buffers on, NULL => none
+	bufshare_t share;
+	bool sharing;
+	video_frame_t held[VIDEO_MAX_FRAME];  // buffers out with consumers
+	const char *preview_name;   // preview server address, NULL => none
+	preview_t preview;
+	unsigned int frames;        // frames received
+	unsigned int empty;         // frames received without data
+	unsigned int stalls;        // consecutive stall timeouts
+	unsigned int total_stalls;
+	struct timespec last_frame; // CLOCK_MONOTONIC of last frame or stream start
+	frame_stats_t stats;
+	embed_t embed;              // embedded data of the latest frame
+	focus_tracker_t focus;
+
+	// pre-trigger ring of the most recent frames
+	uint8_t **ring;
+	size_t *ring_bytes;
+	unsigned int ring_head;     // next slot to fill
+	unsigned int ring_count;    // slots in use
+	bool triggered;
+	unsigned int post_frames;   // frames written since the trigger
+
+	// photometric mode, positions count frames from the first one
+	bool have_sequence;
+	uint32_t first_sequence;
+	uint32_t led_target[MAX_LED_LAG + 1];  // position each recent mask lights first
+	uint8_t led_mask[MAX_LED_LAG + 1];
+	unsigned int led_sends;     // masks sent, the ring holds the latest
+	unsigned int led_changes;   // sends that changed the LEDs
+	uint64_t led_total_ns;      // time spent sending them
+	uint64_t led_max_ns;
+
+	const char *stop_reason;    // set when a stop condition is met
+	bool failed;
+} device_t;
 
 static const char *program_name;
-static char *device_name;
-static enum io_method io = IO_METHOD_MMAP;
-struct buffer *buffers;
-static unsigned int n_buffers;
-static FILE *fout = NULL;
+static video_io_t io = VIDEO_IO_MMAP;
+static device_t devices[MAX_DEVICES];
+static int n_devices = 0;
+
+// trigger mode: hold frames in a ring until a trigger arrives
+static bool trigger_mode = false;
+static unsigned int pre_trigger = 0;     // ring size in frames
+static int trigger_focus = 0;            // hold frames for the focus trigger, 0 => off
+static int trigger_fifo = -1;
+static int embed_offset = EMBED_DEFAULT_OFFSET;
+static unsigned int bus_slots = FRAMEBUS_DEFAULT_SLOTS;
+static unsigned int source_rate = VIDEO_DEFAULT_RATE;  // replay and synthetic
+static unsigned int buffer_count = 0;    // 0 => sized from the latency
+static unsigned int latency_ms = VIDEO_DEFAULT_LATENCY;
+static bool hugepages = false;
+
+// inline processing of each frame as it arrives
+static const pipeline_sink_t *inline_sink = NULL;
+static const char *inline_prefix = "frame";
+static unsigned int inline_workers = 0;  // 0 => one per processor
+static bool inline_hold = false;         // only frames while the focus motor holds
+static unsigned int preview_rate = PREVIEW_DEFAULT_RATE;
+static unsigned int preview_bin = PREVIEW_DEFAULT_BIN;
+static segment_limits_t segment_limits;  // all zero => a single output file
+static volatile sig_atomic_t trigger_signal = 0;
+
+// stop conditions, checked in addition to the frame count, 0 => off
+static unsigned int stop_hold = 0;       // frames after the focus hold
+static unsigned int stop_stable = 0;     // frames with unchanged steps
+static unsigned int stop_timeout = 0;    // seconds of streaming
+
+// photometric mode: the single LEDs of --leds are lit in turn
+static bool photometric = false;
+static uint8_t led_cycle[4];
+static unsigned int n_led_cycle = 0;
+static unsigned int led_lag = DEFAULT_LED_LAG;
 
 
 static void errno_exit(const char *s) {
@@ -54,542 +150,628 @@ static void errno_exit(const char *s) {
 	exit(EXIT_FAILURE);
 }
 
-static int xioctl(int fh, int request, void *arg) {
-	int r;
-
-	do {
-		r = ioctl(fh, request, arg);
-	} while (-1 == r && EINTR == errno);
-
-	return r;
+// report a set up error and exit
+static void video_exit(const device_t *dev) {
+	fprintf(stderr, "%s: %s error %d, %s\n",
+		dev->device_name, dev->video.error, errno, strerror(errno));
+	exit(EXIT_FAILURE);
 }
 
-
-static bool process_image(const void *p, int size) {
-	bool rc = true;
-	if (NULL != fout && NULL != p && size > 0) {
-		fwrite(p, size, 1, fout);
-		fflush(stdout);
-		fprintf(stderr, ".");
-	} else {
-		fprintf(stderr, "0");
-		rc = false;
-	}
-	fflush(stderr);
-	return rc;
+// report a run time error and remove the device from the capture
+// without disturbing any other devices
+static bool device_error(device_t *dev) {
+	fprintf(stderr, "\n%s: %s error %d, %s\n",
+		dev->device_name, dev->video.error, errno, strerror(errno));
+	dev->failed = true;
+	return false;
 }
 
-static bool read_frame(int fd) {
-	struct v4l2_buffer buf;
-	unsigned int i;
-	bool rc = true;
-
-	switch (io) {
-	case IO_METHOD_READ:
-		if (-1 == read(fd, buffers[0].start, buffers[0].length)) {
-			switch (errno) {
-			case EAGAIN:
-				return false;
-
-			case EIO:
-				// Could ignore EIO, see spec
-				// fall through
-
-			default:
-				errno_exit("read");
-			}
-		}
-
-		rc = process_image(buffers[0].start, buffers[0].length);
-		break;
-
-	case IO_METHOD_MMAP:
-		CLEAR(buf);
-
-		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		buf.memory = V4L2_MEMORY_MMAP;
-
-		if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf)) {
-			switch (errno) {
-			case EAGAIN:
-				return 0;
-
-			case EIO:
-				// Could ignore EIO, see spec
-				// fall through
-
-			default:
-				errno_exit("VIDIOC_DQBUF");
-			}
-		}
-
-		assert(buf.index < n_buffers);
-
-		rc = process_image(buffers[buf.index].start, buf.bytesused);
-
-		if (-1 == xioctl(fd, VIDIOC_QBUF, &buf)) {
-			errno_exit("VIDIOC_QBUF");
-		}
-		break;
-
-	case IO_METHOD_USERPTR:
-		CLEAR(buf);
-
-		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		buf.memory = V4L2_MEMORY_USERPTR;
-
-		if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf)) {
-			switch (errno) {
-			case EAGAIN:
-				return 0;
-
-			case EIO:
-				// Could ignore EIO, see spec
-				// fall through
-
-			default:
-				errno_exit("VIDIOC_DQBUF");
-			}
-		}
-
-		for (i = 0; i < n_buffers; ++i) {
-			if (buf.m.userptr == (unsigned long)buffers[i].start
-			    && buf.length == buffers[i].length) {
-				break;
-			}
-		}
-
-		assert(i < n_buffers);
-
-		rc = process_image((void *)buf.m.userptr, buf.bytesused);
+// CLOCK_MONOTONIC in nanoseconds
+static uint64_t monotonic_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-		if (-1 == xioctl(fd, VIDIOC_QBUF, &buf)) {
-			errno_exit("VIDIOC_QBUF");
-		}
+// a count with an optional k, M or G (binary) multiplier
+static bool parse_size(const char *s, uint64_t *value) {
+	char *end;
+	errno = 0;
+	unsigned long long n = strtoull(s, &end, 0);
+	if (0 != errno || end == s) {
+		return false;
+	}
+	switch (*end) {
+	case 'G':
+		n <<= 10;
+		// fall through
+	case 'M':
+		n <<= 10;
+		// fall through
+	case 'k':
+		n <<= 10;
+		++end;
 		break;
 	}
-
-	return rc;
+	*value = n;
+	return '\0' == *end;
 }
 
+// milliseconds elapsed from start to end
+static long elapsed_ms(const struct timespec *start, const struct timespec *end) {
+	return (end->tv_sec - start->tv_sec) * 1000L
+		+ (end->tv_nsec - start->tv_nsec) / 1000000L;
+}
 
-static void mainloop(int fd, unsigned int frame_count) {
-
-	for (unsigned int count = 0; count < frame_count; ++count) {
-		for (;;) {
-			fd_set fds;
-			struct timeval tv;
-			int r;
-
-			FD_ZERO(&fds);
-			FD_SET(fd, &fds);
-
-			// Timeout
-			tv.tv_sec = 2;
-			tv.tv_usec = 0;
-
-			r = select(fd + 1, &fds, NULL, NULL, &tv);
-
-			if (-1 == r) {
-				if (EINTR == errno) {
-					continue;
-				}
-				errno_exit("select");
-			}
-
-			if (0 == r) {
-				fprintf(stderr, "select timeout\n");
-				exit(EXIT_FAILURE);
-			}
 
-			if (read_frame(fd)) {
-				break;
-			}
-			// EAGAIN - continue select loop
+static void write_frame(device_t *dev, const void *p, size_t size) {
+	// with several devices the marker identifies which one delivered,
+	// letters so they are not mistaken for the '0' of an empty frame
+	const char mark = n_devices > 1 ? 'a' + dev->index : '.';
+	if (NULL != dev->output_name) {
+		if (!segment_write(&dev->output, p, size)) {
+			fprintf(stderr, "\n%s: %s: %s error %d, %s\n", dev->device_name,
+				dev->output.name, dev->output.error, errno, strerror(errno));
+			dev->failed = true;
+			return;
 		}
+		fprintf(stderr, "%c", mark);
+	} else {
+		fprintf(stderr, "-");
+	}
+	if (dev->triggered) {
+		++dev->post_frames;
 	}
 }
 
-static void stop_capturing(int fd) {
-	enum v4l2_buf_type type;
-
-	switch (io) {
-	case IO_METHOD_READ:
-		// Nothing to do
-		break;
+// keep a copy of the frame, overwriting the oldest once the ring is full
+static void ring_store(device_t *dev, const void *p, size_t size) {
+	unsigned int slot = dev->ring_head;
+	if (size > dev->video.frame_size) {
+		size = dev->video.frame_size;
+	}
+	memcpy(dev->ring[slot], p, size);
+	dev->ring_bytes[slot] = size;
+	dev->ring_head = (slot + 1) % pre_trigger;
+	if (dev->ring_count < pre_trigger) {
+		++dev->ring_count;
+	}
+	fprintf(stderr, ",");
+}
 
-	case IO_METHOD_MMAP:
-	case IO_METHOD_USERPTR:
-		type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		if (-1 == xioctl(fd, VIDIOC_STREAMOFF, &type)) {
-			errno_exit("VIDIOC_STREAMOFF");
+// write out the ring, oldest first, then let frames pass straight through
+static void trigger_device(device_t *dev) {
+	if (!trigger_mode || dev->triggered || !dev->video.streaming) {
+		return;
+	}
+	fprintf(stderr, "T");
+	if (pre_trigger > 0) {
+		unsigned int slot = (dev->ring_head + pre_trigger - dev->ring_count) % pre_trigger;
+		for (unsigned int i = 0; i < dev->ring_count; ++i) {
+			write_frame(dev, dev->ring[slot], dev->ring_bytes[slot]);
+			slot = (slot + 1) % pre_trigger;
 		}
-		break;
+		dev->ring_count = 0;
 	}
+	dev->triggered = true;
 }
 
-static void start_capturing(int fd) {
-	unsigned int i;
-	enum v4l2_buf_type type;
-
-	switch (io) {
-	case IO_METHOD_READ:
-		// Nothing to do
-		break;
+static bool process_image(device_t *dev, const void *p, int size) {
+	if (NULL == p || size <= 0) {
+		fprintf(stderr, "0");
+		fflush(stderr);
+		++dev->empty;
+		return false;
+	}
 
-	case IO_METHOD_MMAP:
-		for (i = 0; i < n_buffers; ++i) {
-			struct v4l2_buffer buf;
+	embed_decode(p, size / sizeof(uint16_t), embed_offset, &dev->embed);
+	bool focus_hold = focus_tracker_update(&dev->focus, &dev->embed);
 
-			CLEAR(buf);
-			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-			buf.memory = V4L2_MEMORY_MMAP;
-			buf.index = i;
+	if (stop_hold > 0 && dev->focus.hold && dev->focus.held >= stop_hold) {
+		dev->stop_reason = "frames after focus hold";
+	} else if (stop_stable > 0 && dev->focus.stable >= stop_stable) {
+		dev->stop_reason = "focus steps stable";
+	}
 
-			if (-1 == xioctl(fd, VIDIOC_QBUF, &buf)) {
-				errno_exit("VIDIOC_QBUF");
-			}
+	if (trigger_mode && !dev->triggered) {
+		if (pre_trigger > 0) {
+			ring_store(dev, p, size);
 		}
-		type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		if (-1 == xioctl(fd, VIDIOC_STREAMON, &type)) {
-			errno_exit("VIDIOC_STREAMON");
+		if (trigger_focus > 0 && focus_hold) {
+			trigger_device(dev);
 		}
-		break;
-
-	case IO_METHOD_USERPTR:
-		for (i = 0; i < n_buffers; ++i) {
-			struct v4l2_buffer buf;
-
-			CLEAR(buf);
-			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-			buf.memory = V4L2_MEMORY_USERPTR;
-			buf.index = i;
-			buf.m.userptr = (unsigned long)buffers[i].start;
-			buf.length = buffers[i].length;
+	} else {
+		write_frame(dev, p, size);
+	}
+	fflush(stderr);
+	return true;
+}
 
-			if (-1 == xioctl(fd, VIDIOC_QBUF, &buf)) {
-				errno_exit("VIDIOC_QBUF");
-			}
-		}
-		type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		if (-1 == xioctl(fd, VIDIOC_STREAMON, &type)) {
-			errno_exit("VIDIOC_STREAMON");
-		}
-		break;
+// true when the device has delivered everything it was asked for
+static bool device_done(const device_t *dev, unsigned int frame_count) {
+	if (NULL != dev->stop_reason) {
+		return true;
+	}
+	if (trigger_mode) {
+		return dev->triggered && dev->post_frames >= frame_count;
 	}
+	return dev->frames >= frame_count;
 }
 
-static void uninit_device(void) {
-	unsigned int i;
+static void trigger_handler(int signum) {
+	trigger_signal = 1;
+}
 
-	switch (io) {
-	case IO_METHOD_READ:
-		free(buffers[0].start);
-		break;
+// drain the control FIFO, any byte is a trigger
+static bool fifo_triggered(void) {
+	bool triggered = false;
+	char buffer[64];
+	ssize_t n;
+	while ((n = read(trigger_fifo, buffer, sizeof(buffer))) > 0) {
+		triggered = true;
+	}
+	if (-1 == n && EAGAIN != errno && EINTR != errno) {
+		errno_exit("trigger FIFO read");
+	}
+	return triggered;
+}
 
-	case IO_METHOD_MMAP:
-		for (i = 0; i < n_buffers; ++i) {
-			if (-1 == munmap(buffers[i].start, buffers[i].length)) {
-				errno_exit("munmap");
-			}
+// tag the frame with the LEDs lit for it, the mask of the latest send
+// that had reached it, and return its position in the stream.  Frames
+// the driver dropped still count, so positions follow the sensor
+static uint32_t photometric_tag(device_t *dev, const video_frame_t *frame) {
+	if (!dev->have_sequence) {
+		dev->have_sequence = true;
+		dev->first_sequence = frame->sequence;
+	}
+	const uint32_t position = frame->sequence - dev->first_sequence;
+
+	const unsigned int ring = MAX_LED_LAG + 1;
+	const unsigned int n = dev->led_sends < ring ? dev->led_sends : ring;
+	uint8_t leds = dev->led_mask[(dev->led_sends - n) % ring];
+	for (unsigned int i = 1; i <= n; ++i) {
+		const unsigned int slot = (dev->led_sends - i) % ring;
+		if (dev->led_target[slot] <= position) {
+			leds = dev->led_mask[slot];
+			break;
 		}
-		break;
+	}
+	// the buffer is ours until it is requeued
+	if (NULL != frame->data) {
+		embed_tag_leds((uint16_t *)frame->data, frame->bytesused / sizeof(uint16_t),
+			       embed_offset, leds);
+	}
+	return position;
+}
 
-	case IO_METHOD_USERPTR:
-		for (i = 0; i < n_buffers; ++i) {
-			free(buffers[i].start);
+// send the mask for the frame led_lag after this one.  It goes once the
+// buffer is back with the driver, so the stream never waits on it
+static void photometric_switch(device_t *dev, uint32_t position) {
+	const uint32_t target = position + led_lag;
+	const uint8_t leds = led_cycle[target % n_led_cycle];
+	const uint64_t start = monotonic_ns();
+	controls_set(&dev->controls, V4L2_CID_HUE, leds);
+	if (!controls_apply(&dev->controls)) {
+		fprintf(stderr, "\n%s: LEDs: %s error %d, %s\n",
+			dev->device_name, dev->controls.error, errno, strerror(errno));
+		dev->failed = true;
+		return;
+	}
+	const unsigned int slot = dev->led_sends++ % (MAX_LED_LAG + 1);
+	dev->led_target[slot] = target;
+	dev->led_mask[slot] = leds;
+	if (0 != dev->controls.changed) {
+		const uint64_t ns = monotonic_ns() - start;
+		++dev->led_changes;
+		dev->led_total_ns += ns;
+		if (ns > dev->led_max_ns) {
+			dev->led_max_ns = ns;
 		}
-		break;
 	}
-
-	free(buffers);
 }
 
-static void init_read(unsigned int buffer_size) {
-	buffers = calloc(1, sizeof(*buffers));
-
-	if (!buffers) {
-		fprintf(stderr, "Out of memory\n");
-		exit(EXIT_FAILURE);
+// record the timing of one dequeued buffer and flag any frames
+// the driver dropped before it
+static void account_frame(device_t *dev, const video_frame_t *frame,
+			  uint64_t t_dqbuf, uint64_t t_process, uint64_t t_qbuf, uint64_t t_done) {
+	frame_record_t record = {
+		.sequence = frame->sequence,
+		.timestamp_us = frame->timestamp.tv_sec * 1000000ULL + frame->timestamp.tv_usec,
+		.dequeue_us = t_process / 1000,
+		.bytesused = frame->bytesused,
+		.dqbuf_ns = t_process - t_dqbuf,
+		.process_ns = t_qbuf - t_process,
+		.qbuf_ns = t_done - t_qbuf
+	};
+
+	if (0 == dev->stats.frames) {
+		dev->stats.monotonic = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC
+			== (frame->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK);
 	}
-
-	buffers[0].length = buffer_size;
-	buffers[0].start = malloc(buffer_size);
-
-	if (!buffers[0].start) {
-		fprintf(stderr, "Out of memory\n");
-		exit(EXIT_FAILURE);
+	if (frame_stats_record(&dev->stats, &record) > 0) {
+		fprintf(stderr, "!");
+	}
+	if (frame_stats_is_short(&dev->stats, &record)) {
+		fprintf(stderr, "s");
 	}
 }
 
-static void init_mmap(int fd) {
-	struct v4l2_requestbuffers req;
-
-	CLEAR(req);
-
-	req.count = 16;
-	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	req.memory = V4L2_MEMORY_MMAP;
+static bool read_frame(device_t *dev) {
+	video_frame_t frame;
+	uint64_t t_dqbuf = monotonic_ns();
 
-	if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
-		if (EINVAL == errno) {
-			fprintf(stderr, "%s does not support "
-				 "memory mapping\n", device_name);
-			exit(EXIT_FAILURE);
-		} else {
-			errno_exit("VIDIOC_REQBUFS");
-		}
+	switch (video_dequeue(&dev->video, &frame)) {
+	case 0:
+		return false;  // EAGAIN
+	case -1:
+		return device_error(dev);
 	}
 
-	if (req.count < 2) {
-		fprintf(stderr, "Insufficient buffer memory on %s\n",
-			 device_name);
-		exit(EXIT_FAILURE);
+	// tagging is part of the processing, not of the dequeue
+	uint64_t t_process = monotonic_ns();
+	uint32_t position = 0;
+	if (photometric) {
+		position = photometric_tag(dev, &frame);
+	}
+	bool rc = process_image(dev, frame.data, frame.bytesused);
+	if (rc && NULL != dev->bus.header) {
+		// every frame goes on the bus, trigger mode only affects the file
+		framebus_publish(&dev->bus, frame.data, frame.bytesused, frame.sequence,
+				 frame.timestamp.tv_sec * 1000000ULL + frame.timestamp.tv_usec);
+	}
+	if (rc && NULL != dev->pipeline.jobs && (!inline_hold || dev->focus.hold)
+	    && !pipeline_submit(&dev->pipeline, frame.data, frame.bytesused,
+				dev->frames, frame.sequence, &dev->embed)) {
+		fprintf(stderr, "p");  // all workers busy
+	}
+	if (rc && NULL != dev->preview_name) {
+		preview_offer(&dev->preview, frame.data, frame.bytesused);
 	}
 
-	buffers = calloc(req.count, sizeof(*buffers));
-
-	if (!buffers) {
-		fprintf(stderr, "Out of memory\n");
-		exit(EXIT_FAILURE);
+	// a shared buffer is requeued once every consumer has released it
+	bool shared = rc && dev->sharing && frame.index < VIDEO_MAX_FRAME
+		&& bufshare_publish(&dev->share, frame.index, frame.sequence,
+				    frame.timestamp.tv_sec * 1000000ULL + frame.timestamp.tv_usec,
+				    frame.bytesused) > 0;
+	if (shared) {
+		dev->held[frame.index] = frame;
 	}
+	uint64_t t_qbuf = monotonic_ns();
 
-	for (n_buffers = 0; n_buffers < req.count; ++n_buffers) {
-		struct v4l2_buffer buf;
+	if (!shared && !video_requeue(&dev->video, &frame)) {
+		return device_error(dev);
+	}
+	account_frame(dev, &frame, t_dqbuf, t_process, t_qbuf, monotonic_ns());
 
-		CLEAR(buf);
+	if (photometric) {
+		photometric_switch(dev, position);
+	}
+	return rc;
+}
 
-		buf.type        = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		buf.memory      = V4L2_MEMORY_MMAP;
-		buf.index       = n_buffers;
 
-		if (-1 == xioctl(fd, VIDIOC_QUERYBUF, &buf)) {
-			errno_exit("VIDIOC_QUERYBUF");
+// requeue the buffers consumers have finished with
+static bool release_buffers(device_t *dev) {
+	uint64_t released = bufshare_service(&dev->share);
+	for (unsigned int i = 0; i < VIDEO_MAX_FRAME; ++i) {
+		if (0 != (released & (1ULL << i)) && dev->video.streaming
+		    && !video_requeue(&dev->video, &dev->held[i])) {
+			return device_error(dev);
 		}
+	}
+	return true;
+}
 
-		buffers[n_buffers].length = buf.length;
-		buffers[n_buffers].start =
-			mmap(NULL,                   // start anywhere
-			     buf.length,
-			     PROT_READ | PROT_WRITE, // required
-			     MAP_SHARED,             // recommended
-			     fd, buf.m.offset);
-
-		if (MAP_FAILED == buffers[n_buffers].start) {
-			errno_exit("mmap");
+// the device whose buffer share owns an epoll event, NULL if none
+static device_t *share_owner(const void *ptr) {
+	for (int i = 0; i < n_devices; ++i) {
+		if (ptr == &devices[i].share) {
+			return &devices[i];
 		}
 	}
+	return NULL;
 }
 
-static void init_userp(int fd, unsigned int buffer_size) {
-	struct v4l2_requestbuffers req;
-
-	CLEAR(req);
-
-	req.count  = 4;
-	req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	req.memory = V4L2_MEMORY_USERPTR;
+// consumers see the end of the stream, their buffers go with STREAMOFF
+static void stop_sharing(int epfd, device_t *dev) {
+	if (!dev->sharing) {
+		return;
+	}
+	if (-1 != epfd && -1 == epoll_ctl(epfd, EPOLL_CTL_DEL, dev->share.epoll_fd, NULL)) {
+		errno_exit("epoll_ctl");
+	}
+	bufshare_close(&dev->share);
+	dev->sharing = false;
+	fprintf(stderr, "\n%s: shared %llu of %llu frames, %llu kept back for the driver\n",
+		dev->device_name, (unsigned long long)dev->share.shared,
+		(unsigned long long)dev->share.frames, (unsigned long long)dev->share.skipped);
+}
 
-	if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
-		if (EINVAL == errno) {
-			fprintf(stderr, "%s does not support "
-				 "user pointer i/o\n", device_name);
-			exit(EXIT_FAILURE);
-		} else {
-			errno_exit("VIDIOC_REQBUFS");
-		}
+// stop streaming a device that has completed or failed and
+// remove it from the poll set
+static void retire_device(int epfd, device_t *dev) {
+	if (-1 == epoll_ctl(epfd, EPOLL_CTL_DEL, dev->video.fd, NULL)) {
+		errno_exit("epoll_ctl");
+	}
+	stop_sharing(epfd, dev);
+	if (!video_stop(&dev->video)) {
+		device_error(dev);
 	}
+}
 
-	buffers = calloc(req.count, sizeof(*buffers));
 
-	if (!buffers) {
-		fprintf(stderr, "Out of memory\n");
-		exit(EXIT_FAILURE);
-	}
+// service all devices from a single epoll set until each one has
+// delivered frame_count frames, failed or stalled too many times
+static void mainloop(unsigned int frame_count, int stall_timeout) {
 
-	for (n_buffers = 0; n_buffers < req.count; ++n_buffers) {
-		buffers[n_buffers].length = buffer_size;
-		buffers[n_buffers].start = malloc(buffer_size);
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (-1 == epfd) {
+		errno_exit("epoll_create1");
+	}
 
-		if (!buffers[n_buffers].start) {
-			fprintf(stderr, "Out of memory\n");
-			exit(EXIT_FAILURE);
+	if (-1 != trigger_fifo) {
+		// the FIFO is the only source with a NULL pointer
+		struct epoll_event ev;
+		CLEAR(ev);
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, trigger_fifo, &ev)) {
+			errno_exit("epoll_ctl");
 		}
 	}
-}
 
-static void init_device(int fd, int force_format) {
-	struct v4l2_capability cap;
-	struct v4l2_cropcap cropcap;
-	struct v4l2_crop crop;
-	struct v4l2_format fmt;
-	unsigned int min;
-
-	if (-1 == xioctl(fd, VIDIOC_QUERYCAP, &cap)) {
-		if (EINVAL == errno) {
-			fprintf(stderr, "%s is no V4L2 device\n",
-				 device_name);
-			exit(EXIT_FAILURE);
-		} else {
-			errno_exit("VIDIOC_QUERYCAP");
+	int active = 0;
+	for (int i = 0; i < n_devices; ++i) {
+		device_t *dev = &devices[i];
+		struct epoll_event ev;
+		CLEAR(ev);
+		ev.events = EPOLLIN;
+		ev.data.ptr = dev;
+		if (-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, dev->video.fd, &ev)) {
+			errno_exit("epoll_ctl");
 		}
+		if (dev->sharing) {
+			ev.data.ptr = &dev->share;
+			if (-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, dev->share.epoll_fd, &ev)) {
+				errno_exit("epoll_ctl");
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &dev->last_frame);
+		++active;
 	}
 
-	if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
-		fprintf(stderr, "%s is no video capture device\n",
-			 device_name);
-		exit(EXIT_FAILURE);
-	}
+	const long stall_ms = 1000L * stall_timeout;
+	const long timeout_ms = 1000L * stop_timeout;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
-	switch (io) {
-	case IO_METHOD_READ:
-		if (!(cap.capabilities & V4L2_CAP_READWRITE)) {
-			fprintf(stderr, "%s does not support read i/o\n",
-				 device_name);
-			exit(EXIT_FAILURE);
+	while (active > 0) {
+		struct epoll_event events[MAX_DEVICES];
+
+		// wake at least twice per stall period to check for stalls, and
+		// each second to end timed segments while frames are not arriving
+		long wait_ms = stall_ms / 2;
+		if (0 != segment_limits.seconds && wait_ms > 1000) {
+			wait_ms = 1000;
 		}
-		break;
+		if (timeout_ms > 0) {
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			long remaining = timeout_ms - elapsed_ms(&start, &now);
+			if (remaining < 0) {
+				remaining = 0;
+			}
+			if (remaining < wait_ms) {
+				wait_ms = remaining;
+			}
+		}
+		int r = epoll_wait(epfd, events, MAX_DEVICES, wait_ms);
 
-	case IO_METHOD_MMAP:
-	case IO_METHOD_USERPTR:
-		if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
-			fprintf(stderr, "%s does not support streaming i/o\n",
-				 device_name);
-			exit(EXIT_FAILURE);
+		if (-1 == r) {
+			if (EINTR != errno) {
+				errno_exit("epoll_wait");
+			}
+			r = 0; // a signal may be a trigger
 		}
-		break;
-	}
 
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
 
-	// Select video input, video standard and tune here
+		bool triggered = 0 != trigger_signal;
+		trigger_signal = 0;
 
+		bool timed_out = timeout_ms > 0 && elapsed_ms(&start, &now) >= timeout_ms;
 
-	CLEAR(cropcap);
+		for (int i = 0; i < r; ++i) {
+			device_t *dev = events[i].data.ptr;
 
-	cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			if (NULL == dev) {
+				triggered = fifo_triggered() || triggered;
+				continue;
+			}
 
-	if (0 == xioctl(fd, VIDIOC_CROPCAP, &cropcap)) {
-		crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		crop.c = cropcap.defrect; // reset to default
+			device_t *owner = share_owner(events[i].data.ptr);
+			if (NULL != owner) {
+				release_buffers(owner);
+				continue;
+			}
 
-		if (-1 == xioctl(fd, VIDIOC_S_CROP, &crop)) {
-			switch (errno) {
-			case EINVAL:
-				// Cropping not supported
-				break;
-			default:
-				// Errors ignored
-				break;
+			if (read_frame(dev)) {
+				++dev->frames;
+				dev->stalls = 0;
+				dev->last_frame = now;
 			}
+			// otherwise EAGAIN - wait for next event
 		}
-	} else {
-		// Errors ignored
-	}
 
+		for (int i = 0; i < n_devices; ++i) {
+			device_t *dev = &devices[i];
 
-	CLEAR(fmt);
-
-	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	switch (force_format) {
-	case 0:
-		break;
-	case 1:
-		fmt.fmt.pix.width       = 640;
-		fmt.fmt.pix.height      = 480;
-		fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
-		fmt.fmt.pix.field       = V4L2_FIELD_INTERLACED;
-
-		if (-1 == xioctl(fd, VIDIOC_S_FMT, &fmt)) {
-			errno_exit("VIDIOC_S_FMT");
+			if (triggered) {
+				trigger_device(dev);
+			}
+			if (NULL != dev->output_name && !dev->failed && !segment_tick(&dev->output)) {
+				fprintf(stderr, "\n%s: %s: %s error %d, %s\n", dev->device_name,
+					dev->output.name, dev->output.error, errno, strerror(errno));
+				dev->failed = true;
+			}
+			if (timed_out && dev->video.streaming && NULL == dev->stop_reason) {
+				dev->stop_reason = "timeout";
+			}
+			if (dev->video.streaming && (dev->failed || device_done(dev, frame_count))) {
+				if (NULL != dev->stop_reason) {
+					fprintf(stderr, "\n%s: stopped after %u frames: %s\n",
+						dev->device_name, dev->frames, dev->stop_reason);
+				}
+				retire_device(epfd, dev);
+				--active;
+			}
 		}
-		break;
-	case 2:
-		fmt.fmt.pix.width       = 1920;
-		fmt.fmt.pix.height      = 1080;
-		fmt.fmt.pix.field       = V4L2_PIX_FMT_SRGGB12;
-		fmt.fmt.pix.field       = V4L2_FIELD_ANY;
 
-		// Note VIDIOC_S_FMT may change width and height
-		if (-1 == xioctl(fd, VIDIOC_S_FMT, &fmt)) {
-			errno_exit("VIDIOC_S_FMT 1080");
-		}
-		break;
+		for (int i = 0; i < n_devices; ++i) {
+			device_t *dev = &devices[i];
 
-	default:
-		// Preserve original settings as set by v4l2-ctl for example
-		if (-1 == xioctl(fd, VIDIOC_G_FMT, &fmt)) {
-			errno_exit("VIDIOC_G_FMT");
+			if (!dev->video.streaming || elapsed_ms(&dev->last_frame, &now) < stall_ms) {
+				continue;
+			}
+
+			++dev->stalls;
+			++dev->total_stalls;
+			dev->last_frame = now;
+			fprintf(stderr, "\n%s: stalled, no frame for %d s (%u/%d)\n",
+				dev->device_name, stall_timeout, dev->stalls, STALL_LIMIT);
+
+			if (dev->stalls >= STALL_LIMIT) {
+				fprintf(stderr, "%s: abandoned after %u frames\n",
+					dev->device_name, dev->frames);
+				dev->failed = true;
+				retire_device(epfd, dev);
+				--active;
+			}
 		}
 	}
 
-	// Buggy driver paranoia
-	min = fmt.fmt.pix.width * 2;
-	if (fmt.fmt.pix.bytesperline < min) {
-		fmt.fmt.pix.bytesperline = min;
+	close(epfd);
+}
+
+static void init_ring(device_t *dev) {
+	if (0 == pre_trigger) {
+		return;
 	}
-	min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
-	if (fmt.fmt.pix.sizeimage < min) {
-		fmt.fmt.pix.sizeimage = min;
+	dev->ring = calloc(pre_trigger, sizeof(*dev->ring));
+	dev->ring_bytes = calloc(pre_trigger, sizeof(*dev->ring_bytes));
+	if (NULL == dev->ring || NULL == dev->ring_bytes) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
 	}
-
-	switch (io) {
-	case IO_METHOD_READ:
-		init_read(fmt.fmt.pix.sizeimage);
-		break;
-
-	case IO_METHOD_MMAP:
-		init_mmap(fd);
-		break;
-
-	case IO_METHOD_USERPTR:
-		init_userp(fd, fmt.fmt.pix.sizeimage);
-		break;
+	for (unsigned int i = 0; i < pre_trigger; ++i) {
+		dev->ring[i] = malloc(dev->video.frame_size);
+		if (NULL == dev->ring[i]) {
+			fprintf(stderr, "Out of memory for %u frame ring\n", pre_trigger);
+			exit(EXIT_FAILURE);
+		}
 	}
 }
 
-static void close_device(int fd) {
-	if (-1 == close(fd)) {
-		errno_exit("close");
+static void uninit_ring(device_t *dev) {
+	if (NULL != dev->ring) {
+		for (unsigned int i = 0; i < pre_trigger; ++i) {
+			free(dev->ring[i]);
+		}
 	}
-	fd = -1;
+	free(dev->ring);
+	free(dev->ring_bytes);
+	dev->ring = NULL;
+	dev->ring_bytes = NULL;
 }
 
-static int open_device(void) {
-	struct stat st;
-
-	if (-1 == stat(device_name, &st)) {
-		fprintf(stderr, "Cannot identify '%s': %d, %s\n",
-			 device_name, errno, strerror(errno));
+// open, configure and prepare a device for streaming, exit on failure
+static void init_device(device_t *dev, video_format_t format,
+			int32_t brightness, int32_t contrast, int32_t sharpness, int32_t led_value) {
+	if (!video_open(&dev->video, dev->device_name, io)) {
+		video_exit(dev);
+	}
+	dev->video.rate = source_rate;
+	dev->video.buffer_count = buffer_count;
+	dev->video.latency_ms = latency_ms;
+	dev->video.hugepages = hugepages;
+
+	// all four controls go to the firmware in one transfer
+	controls_init(&dev->controls, video_control_fd(&dev->video));
+	controls_set(&dev->controls, V4L2_CID_BRIGHTNESS, brightness);
+	controls_set(&dev->controls, V4L2_CID_CONTRAST, contrast);
+	controls_set(&dev->controls, V4L2_CID_SHARPNESS, sharpness);
+	controls_set(&dev->controls, V4L2_CID_HUE, led_value);
+	if (!controls_apply(&dev->controls)) {
+		fprintf(stderr, "%s: %s 0x%08x error %d, %s\n", dev->device_name,
+			dev->controls.error, dev->controls.error_id, errno, strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 
-	if (!S_ISCHR(st.st_mode)) {
-		fprintf(stderr, "%s is no device\n", device_name);
-		exit(EXIT_FAILURE);
+	if (!video_init(&dev->video, format)) {
+		video_exit(dev);
+	}
+	if (NULL != dev->video.arena) {
+		fprintf(stderr, "%s: %u buffers in %zu MB of %s pages\n", dev->device_name,
+			dev->video.n_buffers, dev->video.arena_size >> 20, dev->video.arena_pages);
 	}
 
-	int fd = open(device_name, O_RDWR /* required */ | O_NONBLOCK, 0);
+	frame_stats_init(&dev->stats, dev->video.frame_size, VIDEO_IO_READ != dev->video.io, true);
+	focus_tracker_init(&dev->focus, trigger_focus > 0 ? trigger_focus : DEFAULT_HOLD_FRAMES);
+	init_ring(dev);
 
-	if (-1 == fd) {
-		fprintf(stderr, "Cannot open '%s': %d, %s\n",
-			 device_name, errno, strerror(errno));
-		exit(EXIT_FAILURE);
+	if (NULL != dev->export_name) {
+		if (!video_export(&dev->video)) {
+			video_exit(dev);
+		}
+		int fds[VIDEO_MAX_FRAME];
+		unsigned int n = dev->video.n_buffers;
+		for (unsigned int i = 0; i < n && i < VIDEO_MAX_FRAME; ++i) {
+			fds[i] = dev->video.buffers[i].export_fd;
+		}
+		if (n > VIDEO_MAX_FRAME
+		    || !bufshare_create(&dev->share, dev->export_name, fds, n,
+					dev->video.buffers[0].length, dev->video.width, dev->video.height)) {
+			fprintf(stderr, "%s: export '%s': %s error %d, %s\n", dev->device_name,
+				dev->export_name, dev->share.error, errno, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		dev->sharing = true;
 	}
-	return fd;
-}
 
+	if (NULL != inline_sink) {
+		// several devices would write the same names
+		char prefix[256];
+		if (n_devices > 1) {
+			snprintf(prefix, sizeof(prefix), "%s%d-", inline_prefix, dev->index);
+		} else {
+			snprintf(prefix, sizeof(prefix), "%s", inline_prefix);
+		}
+		if (!pipeline_start(&dev->pipeline, inline_sink, prefix, inline_workers,
+				    dev->video.width, dev->video.height, embed_offset)) {
+			fprintf(stderr, "%s: inline %s: %s error %d, %s\n", dev->device_name,
+				inline_sink->name, dev->pipeline.error, errno, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
 
-static void set_control(int fd, int parameter, int32_t value) {
-	struct v4l2_control control;
-	memset(&control, 0, sizeof (control));
-	control.id = parameter;
-	control.value = value;
+	if (NULL != dev->bus_name
+	    && !framebus_create(&dev->bus, dev->bus_name, bus_slots, dev->video.frame_size)) {
+		fprintf(stderr, "%s: frame bus '%s': %s error %d, %s\n", dev->device_name,
+			dev->bus_name, dev->bus.error, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
 
-	if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-		errno_exit("VIDIOC_S_CTRL");
+	if (NULL != dev->preview_name
+	    && !preview_start(&dev->preview, dev->preview_name, dev->video.width,
+			      dev->video.height, preview_bin, preview_rate)) {
+		fprintf(stderr, "%s: preview '%s': %s error %d, %s\n", dev->device_name,
+			dev->preview_name, dev->preview.error, errno, strerror(errno));
+		exit(EXIT_FAILURE);
 	}
 }
 
+
 // print usage message and exit
 static void usage(const char *message, ...) {
 	if (NULL != message) {
@@ -602,60 +784,154 @@ static void usage(const char *message, ...) {
 	}
 	fprintf(stderr,
 		"Usage: %s [options]\n\n"
-		"Version 1.3\n"
+		"Version 1.4\n"
 		"Options:\n"
 		"-h | --help          Print this message\n"
-		"-d | --device name   Video device name [%s]\n"
+		"-d | --device name   Video device name, repeat for several [/dev/video0]\n"
+		"                     a regular file is replayed as a fake device,\n"
+		"                     '%s' generates Bayer frames\n"
+		"-x | --rate N        Frames per second of replay and synthetic\n"
+		"                     sources, 0 for as fast as possible [%i]\n"
 		"-m | --mmap          Use memory mapped buffers [default]\n"
 		"-r | --read          Use read() calls\n"
 		"-u | --userp         Use application allocated buffers\n"
-		"-o | --output        Outputs stream to stdout\n"
+		"-g | --hugepages     Use application buffers in 2 MB pages\n"
+		"-q | --buffers N     Number of driver buffers [from --latency]\n"
+		"-y | --latency MS    Size the driver buffers to hold MS of frames [%i]\n"
+		"-o | --output        Output file, one for each --device in order\n"
+		"-N | --segment-frames N  Start a new output segment every N frames\n"
+		"-Z | --segment-size N    or before it would exceed N bytes (k, M, G)\n"
+		"-D | --segment-time S    or every S seconds, segments of frames.data\n"
+		"                         are frames.%0*u.data listed in frames.manifest\n"
 		"-f | --format        Force format to 640x480 YUYV\n"
 		"-t | --ten           Force format to 1920x1080 Bayer12\n"
-		"-c | --count N       Number of frames to grab [%i]\n"
+		"-c | --count N       Number of frames to grab per device,\n"
+		"                     or after the trigger in trigger mode [%i]\n"
+		"-w | --stall N       Seconds without a frame to report a stall [%i]\n"
 		"-b | --brightness N  Brightness value\n"
 		"-s | --sharpness N   Sharpness value\n"
 		"-n | --contrast N    Contrast value\n"
 		"-l | --leds N        LEDs bitmask value\n"
+		"-S | --stats         Print frame timing summary\n"
+		"-j | --json F        Write frame timing summary as JSON to F ('-' for stdout)\n"
+		"-L | --frame-log F   Write per-frame sequence and timing CSV to F\n"
+		"-e | --embed N       Embedded data pixel offset [%i]\n"
+		"-B | --bus NAME      Publish frames to shared memory NAME,\n"
+		"                     one for each --device in order\n"
+		"-R | --bus-slots N   Frames held by each bus [%i]\n"
+		"-X | --export PATH   Share the capture buffers with consumers on\n"
+		"                     Unix socket PATH, one for each --device in order\n"
+		"-V | --preview ADDR  Serve a live preview on loopback TCP port ADDR\n"
+		"                     or Unix socket ADDR, one for each --device in order\n"
+		"-Y | --preview-rate N  Preview frames per second [%i]\n"
+		"-M | --preview-bin N   Preview at 1/N size, 2 or 4 [%i]\n"
+		"Inline processing, each frame is demosaiced as it arrives:\n"
+		"-I | --inline SINK     Write each frame with SINK, one of: %s\n"
+		"-O | --inline-prefix P Prefix of the inline files [%s]\n"
+		"-W | --workers N       Demosaic threads per device [one per processor]\n"
+		"-E | --inline-hold     Only frames while the focus motor holds\n"
+		"Trigger mode, frames are only written once triggered:\n"
+		"-P | --pre-trigger K   Keep the last K frames and write them on trigger\n"
+		"-F | --trigger-fifo F  Any byte written to FIFO F is a trigger\n"
+		"-H | --trigger-focus N Trigger when the focus motor holds for N frames\n"
+		"                       SIGUSR1 is always a trigger in this mode\n"
+		"Stop conditions, capture ends at --count or the first one met:\n"
+		"-A | --stop-hold N     Stop N frames after the focus motor holds\n"
+		"-K | --stop-stable K   Stop once focus steps are unchanged for K frames\n"
+		"-T | --timeout S       Stop after S seconds\n"
+		"Photometric mode, for photometric-stereo:\n"
+		"-p | --photometric     Light the LEDs of --leds one at a time in turn,\n"
+		"                       each frame is tagged with the LED lit for it\n"
+		"-k | --led-lag N       Frames from the one an LED change is sent after\n"
+		"                       to the first it lights, 1 to %d [%d]\n"
 		"",
-		program_name, device_name, DEFAULT_FRAME_COUNT);
+		program_name, VIDEO_SYNTHETIC_NAME, VIDEO_DEFAULT_RATE,
+		VIDEO_DEFAULT_LATENCY, SEGMENT_DIGITS, 0,
+		DEFAULT_FRAME_COUNT, DEFAULT_STALL_TIMEOUT, EMBED_DEFAULT_OFFSET,
+		FRAMEBUS_DEFAULT_SLOTS, PREVIEW_DEFAULT_RATE, PREVIEW_DEFAULT_BIN,
+		pipeline_sink_names(), inline_prefix, MAX_LED_LAG, DEFAULT_LED_LAG);
 	exit(EXIT_FAILURE);
 }
 
 
-static const char short_options[] = "d:hmruo:ftc:b:s:n:l:";
+static const char short_options[] = "d:x:hmrugq:y:o:N:Z:D:ftc:w:b:s:n:l:Sj:L:e:B:R:X:V:Y:M:I:O:W:EP:F:H:A:K:T:pk:";
 
 static const struct option
 long_options[] = {
 	{ "help",       no_argument,       NULL, 'h' },
 	{ "device",     required_argument, NULL, 'd' },
+	{ "rate",       required_argument, NULL, 'x' },
 	{ "mmap",       no_argument,       NULL, 'm' },
 	{ "read",       no_argument,       NULL, 'r' },
 	{ "userp",      no_argument,       NULL, 'u' },
+	{ "hugepages",  no_argument,       NULL, 'g' },
+	{ "buffers",    required_argument, NULL, 'q' },
+	{ "latency",    required_argument, NULL, 'y' },
 	{ "output",     required_argument, NULL, 'o' },
+	{ "segment-frames", required_argument, NULL, 'N' },
+	{ "segment-size",   required_argument, NULL, 'Z' },
+	{ "segment-time",   required_argument, NULL, 'D' },
 	{ "format",     no_argument,       NULL, 'f' },
 	{ "ten",        no_argument,       NULL, 't' },
 	{ "count",      required_argument, NULL, 'c' },
+	{ "stall",      required_argument, NULL, 'w' },
 	{ "brightness", required_argument, NULL, 'b' },
 	{ "sharpness",  required_argument, NULL, 's' },
 	{ "contrast",   required_argument, NULL, 'n' },
 	{ "leds",       required_argument, NULL, 'l' },
+	{ "stats",      no_argument,       NULL, 'S' },
+	{ "json",       required_argument, NULL, 'j' },
+	{ "frame-log",  required_argument, NULL, 'L' },
+	{ "embed",      required_argument, NULL, 'e' },
+	{ "bus",        required_argument, NULL, 'B' },
+	{ "bus-slots",  required_argument, NULL, 'R' },
+	{ "export",     required_argument, NULL, 'X' },
+	{ "preview",      required_argument, NULL, 'V' },
+	{ "preview-rate", required_argument, NULL, 'Y' },
+	{ "preview-bin",  required_argument, NULL, 'M' },
+	{ "inline",        required_argument, NULL, 'I' },
+	{ "inline-prefix", required_argument, NULL, 'O' },
+	{ "workers",       required_argument, NULL, 'W' },
+	{ "inline-hold",   no_argument,       NULL, 'E' },
+	{ "pre-trigger",   required_argument, NULL, 'P' },
+	{ "trigger-fifo",  required_argument, NULL, 'F' },
+	{ "trigger-focus", required_argument, NULL, 'H' },
+	{ "stop-hold",     required_argument, NULL, 'A' },
+	{ "stop-stable",   required_argument, NULL, 'K' },
+	{ "timeout",       required_argument, NULL, 'T' },
+	{ "photometric",   no_argument,       NULL, 'p' },
+	{ "led-lag",       required_argument, NULL, 'k' },
 	{ 0, 0, 0, 0 }
 };
 
 
 int main(int argc, char **argv) {
 	program_name = argv[0];
-	device_name = "/dev/video0";
+
+	const char *device_names[MAX_DEVICES];
+	const char *output_names[MAX_DEVICES];
+	const char *bus_names[MAX_DEVICES];
+	const char *export_names[MAX_DEVICES];
+	const char *preview_names[MAX_DEVICES];
+	int n_device_names = 0;
+	int n_output_names = 0;
+	int n_bus_names = 0;
+	int n_export_names = 0;
+	int n_preview_names = 0;
 
 	unsigned int frame_count = DEFAULT_FRAME_COUNT;
-	int force_format = 0;
+	int stall_timeout = DEFAULT_STALL_TIMEOUT;
+	video_format_t format = VIDEO_FORMAT_CURRENT;
 
 	int32_t brightness = DEFAULT_BRIGHTNESS;
 	int32_t sharpness = DEFAULT_SHARPNESS;
 	int32_t contrast = DEFAULT_CONTRAST;
 	int32_t led_value = DEFAULT_LEDS;
 
+	bool print_stats = false;
+	const char *json_name = NULL;
+	const char *frame_log_name = NULL;
+
 	for (;;) {
 		int idx;
 		int c;
@@ -671,48 +947,90 @@ int main(int argc, char **argv) {
 			break;
 
 		case 'd':
-			device_name = optarg;
+			if (n_device_names >= MAX_DEVICES) {
+				usage("too many devices, maximum is %d", MAX_DEVICES);
+			}
+			device_names[n_device_names++] = optarg;
+			break;
+
+		case 'x':
+			errno = 0;
+			source_rate = strtol(optarg, NULL, 0);
+			if (0 != errno) {
+				usage("invalid rate '%s': %d, %s", optarg, errno, strerror(errno));
+			}
 			break;
 
 		case 'h':
 			usage(NULL);
 
 		case 'm':
-			io = IO_METHOD_MMAP;
+			io = VIDEO_IO_MMAP;
 			break;
 
 		case 'r':
-			io = IO_METHOD_READ;
+			io = VIDEO_IO_READ;
 			break;
 
 		case 'u':
-			io = IO_METHOD_USERPTR;
+			io = VIDEO_IO_USERPTR;
+			break;
+
+		case 'g':
+			io = VIDEO_IO_USERPTR;
+			hugepages = true;
+			break;
+
+		case 'q':
+			errno = 0;
+			buffer_count = strtol(optarg, NULL, 0);
+			if (0 != errno || buffer_count < 2 || buffer_count > VIDEO_MAX_FRAME) {
+				usage("invalid buffer count '%s', 2 to %d", optarg, VIDEO_MAX_FRAME);
+			}
+			break;
+
+		case 'y':
+			errno = 0;
+			latency_ms = strtol(optarg, NULL, 0);
+			if (0 != errno) {
+				usage("invalid latency '%s': %d, %s", optarg, errno, strerror(errno));
+			}
 			break;
 
 		case 'o':
-		{
-			size_t n = strlen(optarg) + 1;
-			if (n < 2) {
+			if (strlen(optarg) < 1) {
 				usage("missing output file name");
 			}
-			char *output_name = malloc(n);
-			if (NULL == output_name) {
-				usage("unable to allocate memory for output file name: '%s'", optarg);
+			if (n_output_names >= MAX_DEVICES) {
+				usage("too many output files, maximum is %d", MAX_DEVICES);
 			}
-			strlcpy(output_name, optarg, n);
-			fout = fopen(output_name, "wb");
-			if (NULL == fout) {
-				usage("unable to create output file name: '%s'\n", optarg);
+			output_names[n_output_names++] = optarg;
+			break;
+
+		case 'N':
+			if (!parse_size(optarg, &segment_limits.frames)) {
+				usage("invalid segment frames '%s'", optarg);
 			}
-		}
-		break;
+			break;
+
+		case 'Z':
+			if (!parse_size(optarg, &segment_limits.bytes)) {
+				usage("invalid segment size '%s'", optarg);
+			}
+			break;
+
+		case 'D':
+			if (!parse_size(optarg, &segment_limits.seconds)) {
+				usage("invalid segment time '%s'", optarg);
+			}
+			break;
 
 		case 'f':
-			force_format = 1;
+			format = VIDEO_FORMAT_YUYV;
 			break;
 
 		case 't':
-			force_format = 2;
+			format = VIDEO_FORMAT_BAYER12;
 			break;
 
 		case 'c':
@@ -723,6 +1041,14 @@ int main(int argc, char **argv) {
 			}
 			break;
 
+		case 'w':
+			errno = 0;
+			stall_timeout = strtol(optarg, NULL, 0);
+			if (0 != errno || stall_timeout <= 0) {
+				usage("invalid stall timeout '%s'", optarg);
+			}
+			break;
+
 		case 'b':
 			errno = 0;
 			brightness = strtol(optarg, NULL, 0);
@@ -754,25 +1080,347 @@ int main(int argc, char **argv) {
 			}
 			break;
 
+		case 'S':
+			print_stats = true;
+			break;
+
+		case 'j':
+			json_name = optarg;
+			break;
+
+		case 'L':
+			frame_log_name = optarg;
+			break;
+
+		case 'e':
+			errno = 0;
+			embed_offset = strtol(optarg, NULL, 0);
+			if (0 != errno || embed_offset < 0) {
+				usage("invalid embed offset '%s'", optarg);
+			}
+			break;
+
+		case 'B':
+			if (n_bus_names >= MAX_DEVICES) {
+				usage("too many buses, maximum is %d", MAX_DEVICES);
+			}
+			bus_names[n_bus_names++] = optarg;
+			break;
+
+		case 'R':
+			errno = 0;
+			bus_slots = strtol(optarg, NULL, 0);
+			if (0 != errno || bus_slots < 2) {
+				usage("invalid bus slots '%s'", optarg);
+			}
+			break;
+
+		case 'X':
+			if (n_export_names >= MAX_DEVICES) {
+				usage("too many exports, maximum is %d", MAX_DEVICES);
+			}
+			export_names[n_export_names++] = optarg;
+			break;
+
+		case 'V':
+			if (n_preview_names >= MAX_DEVICES) {
+				usage("too many previews, maximum is %d", MAX_DEVICES);
+			}
+			preview_names[n_preview_names++] = optarg;
+			break;
+
+		case 'Y':
+			errno = 0;
+			preview_rate = strtol(optarg, NULL, 0);
+			if (0 != errno || preview_rate < 1) {
+				usage("invalid preview rate '%s'", optarg);
+			}
+			break;
+
+		case 'M':
+			errno = 0;
+			preview_bin = strtol(optarg, NULL, 0);
+			if (0 != errno || (2 != preview_bin && 4 != preview_bin)) {
+				usage("invalid preview bin '%s', 2 or 4", optarg);
+			}
+			break;
+
+		case 'I':
+			inline_sink = pipeline_find_sink(optarg);
+			if (NULL == inline_sink) {
+				usage("unknown inline sink '%s', use one of: %s", optarg, pipeline_sink_names());
+			}
+			break;
+
+		case 'O':
+			if (strlen(optarg) < 1) {
+				usage("missing inline prefix");
+			}
+			inline_prefix = optarg;
+			break;
+
+		case 'W':
+			errno = 0;
+			inline_workers = strtol(optarg, NULL, 0);
+			if (0 != errno || inline_workers < 1 || inline_workers > PIPELINE_MAX_WORKERS) {
+				usage("invalid workers '%s', 1 to %d", optarg, PIPELINE_MAX_WORKERS);
+			}
+			break;
+
+		case 'E':
+			inline_hold = true;
+			break;
+
+		case 'P':
+			errno = 0;
+			pre_trigger = strtol(optarg, NULL, 0);
+			if (0 != errno) {
+				usage("invalid pre-trigger count '%s': %d, %s", optarg, errno, strerror(errno));
+			}
+			trigger_mode = true;
+			break;
+
+		case 'F':
+			if (-1 == mkfifo(optarg, 0600) && EEXIST != errno) {
+				usage("cannot create trigger FIFO '%s': %d, %s", optarg, errno, strerror(errno));
+			}
+			// read-write so the FIFO never reports hang up between writers
+			trigger_fifo = open(optarg, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+			if (-1 == trigger_fifo) {
+				usage("cannot open trigger FIFO '%s': %d, %s", optarg, errno, strerror(errno));
+			}
+			trigger_mode = true;
+			break;
+
+		case 'H':
+			errno = 0;
+			trigger_focus = strtol(optarg, NULL, 0);
+			if (0 != errno || trigger_focus <= 0) {
+				usage("invalid focus hold frames '%s'", optarg);
+			}
+			trigger_mode = true;
+			break;
+
+		case 'A':
+			errno = 0;
+			stop_hold = strtol(optarg, NULL, 0);
+			if (0 != errno) {
+				usage("invalid stop hold frames '%s': %d, %s", optarg, errno, strerror(errno));
+			}
+			break;
+
+		case 'K':
+			errno = 0;
+			stop_stable = strtol(optarg, NULL, 0);
+			if (0 != errno) {
+				usage("invalid stop stable frames '%s': %d, %s", optarg, errno, strerror(errno));
+			}
+			break;
+
+		case 'T':
+			errno = 0;
+			stop_timeout = strtol(optarg, NULL, 0);
+			if (0 != errno) {
+				usage("invalid timeout '%s': %d, %s", optarg, errno, strerror(errno));
+			}
+			break;
+
+		case 'p':
+			photometric = true;
+			break;
+
+		case 'k':
+			errno = 0;
+			led_lag = strtol(optarg, NULL, 0);
+			if (0 != errno || led_lag < 1 || led_lag > MAX_LED_LAG) {
+				usage("invalid LED lag '%s', 1 to %d", optarg, MAX_LED_LAG);
+			}
+			break;
+
 		default:
 			usage("invalid option: '%c'", c);
 		}
 	}
 
-	int fd = open_device();
-	set_control(fd, V4L2_CID_BRIGHTNESS, brightness);
-	set_control(fd, V4L2_CID_CONTRAST, contrast);
-	set_control(fd, V4L2_CID_SHARPNESS, sharpness);
-	set_control(fd, V4L2_CID_HUE, led_value);
-	init_device(fd, force_format);
-	start_capturing(fd);
-	mainloop(fd, frame_count);
-	stop_capturing(fd);
-	set_control(fd, V4L2_CID_HUE, 0); // LEDs off
-	uninit_device();
-	close_device(fd);
+	if (0 == n_device_names) {
+		device_names[n_device_names++] = "/dev/video0";
+	}
+	if (0 == inline_workers) {
+		inline_workers = get_nprocs();
+		if (inline_workers > PIPELINE_MAX_WORKERS) {
+			inline_workers = PIPELINE_MAX_WORKERS;
+		}
+	}
+	if (0 != n_output_names && n_output_names != n_device_names) {
+		usage("%d output files given for %d devices", n_output_names, n_device_names);
+	}
+	if (0 == n_output_names && segment_enabled(&segment_limits)) {
+		usage("segments need an output file");
+	}
+	if (0 != n_bus_names && n_bus_names != n_device_names) {
+		usage("%d buses given for %d devices", n_bus_names, n_device_names);
+	}
+	if (0 != n_export_names && n_export_names != n_device_names) {
+		usage("%d exports given for %d devices", n_export_names, n_device_names);
+	}
+	if (0 != n_preview_names && n_preview_names != n_device_names) {
+		usage("%d previews given for %d devices", n_preview_names, n_device_names);
+	}
+	if (photometric) {
+		for (int i = 0; i < 4; ++i) {
+			if (0 != (led_value & (1 << i))) {
+				led_cycle[n_led_cycle++] = 1 << i;
+			}
+		}
+		if (0 == n_led_cycle) {
+			usage("photometric mode needs LEDs in --leds");
+		}
+		// the first frames are lit by the mask set up with the others
+		led_value = led_cycle[0];
+	}
+
+	for (int i = 0; i < n_device_names; ++i) {
+		device_t *dev = &devices[n_devices++];
+		CLEAR(*dev);
+		dev->index = i;
+		dev->video.fd = -1;
+		dev->device_name = device_names[i];
+		dev->output_name = (0 == n_output_names) ? NULL : output_names[i];
+		dev->bus_name = (0 == n_bus_names) ? NULL : bus_names[i];
+		dev->export_name = (0 == n_export_names) ? NULL : export_names[i];
+		dev->preview_name = (0 == n_preview_names) ? NULL : preview_names[i];
+		dev->led_target[0] = 0;
+		dev->led_mask[0] = led_value;
+		dev->led_sends = 1;
+
+		if (NULL != dev->output_name
+		    && !segment_open(&dev->output, dev->output_name, &segment_limits)) {
+			usage("unable to create output file name: '%s': %s error %d, %s",
+			      dev->output_name, dev->output.error, errno, strerror(errno));
+		}
+	}
+
+	for (int i = 0; i < n_devices; ++i) {
+		init_device(&devices[i], format, brightness, contrast, sharpness, led_value);
+	}
+
+	if (trigger_mode) {
+		struct sigaction action;
+		CLEAR(action);
+		action.sa_handler = trigger_handler;
+		sigemptyset(&action.sa_mask);
+		if (-1 == sigaction(SIGUSR1, &action, NULL)) {
+			errno_exit("sigaction");
+		}
+	}
+
+	for (int i = 0; i < n_devices; ++i) {
+		if (!video_start(&devices[i].video)) {
+			video_exit(&devices[i]);
+		}
+	}
+
+	mainloop(frame_count, stall_timeout);
+
 	fprintf(stderr, "\n");
-	fclose(fout);
-	fout = NULL;
-	return 0;
+
+	if (-1 != trigger_fifo) {
+		close(trigger_fifo);
+	}
+
+	if (print_stats) {
+		for (int i = 0; i < n_devices; ++i) {
+			frame_stats_print(&devices[i].stats, devices[i].device_name, stderr);
+		}
+	}
+
+	if (NULL != json_name) {
+		FILE *f = (0 == strcmp(json_name, "-")) ? stdout : fopen(json_name, "w");
+		if (NULL == f) {
+			errno_exit(json_name);
+		}
+		fprintf(f, "{\"devices\":[");
+		for (int i = 0; i < n_devices; ++i) {
+			if (i > 0) {
+				fprintf(f, ",");
+			}
+			frame_stats_json(&devices[i].stats, devices[i].device_name, f);
+		}
+		fprintf(f, "]}\n");
+		if (stdout != f) {
+			fclose(f);
+		}
+	}
+
+	if (NULL != frame_log_name) {
+		FILE *f = fopen(frame_log_name, "w");
+		if (NULL == f) {
+			errno_exit(frame_log_name);
+		}
+		fprintf(f, FRAME_STATS_LOG_HEADER);
+		for (int i = 0; i < n_devices; ++i) {
+			frame_stats_log(&devices[i].stats, devices[i].device_name, f);
+		}
+		fclose(f);
+	}
+
+	int rc = EXIT_SUCCESS;
+	for (int i = 0; i < n_devices; ++i) {
+		device_t *dev = &devices[i];
+		stop_sharing(-1, dev);
+		if (NULL != dev->preview_name) {
+			preview_stop(&dev->preview);
+			fprintf(stderr, "%s: preview sent %llu frames\n", dev->device_name,
+				(unsigned long long)dev->preview.frames);
+		}
+		if (!video_stop(&dev->video)) {
+			device_error(dev);
+		}
+		if (photometric) {
+			fprintf(stderr, "%s: %u LED changes, %.0f us mean %.0f us max to send\n",
+				dev->device_name, dev->led_changes,
+				0 == dev->led_changes ? 0.0 : dev->led_total_ns / 1e3 / dev->led_changes,
+				dev->led_max_ns / 1e3);
+		}
+		if (!dev->failed) {
+			controls_set(&dev->controls, V4L2_CID_HUE, 0); // LEDs off
+			controls_apply(&dev->controls);
+		}
+		video_uninit(&dev->video);
+		uninit_ring(dev);
+		video_close(&dev->video);
+		if (NULL != dev->pipeline.jobs) {
+			pipeline_t *p = &dev->pipeline;
+			pipeline_finish(p);
+			uint64_t processed = p->completed + p->failed;
+			fprintf(stderr, "%s: inline %s %llu frames, %llu dropped, %llu failed,"
+				" latency %.1f ms mean %.1f ms max\n",
+				dev->device_name, inline_sink->name,
+				(unsigned long long)p->completed, (unsigned long long)p->dropped,
+				(unsigned long long)p->failed,
+				0 == processed ? 0.0 : p->latency_total_ns / 1e6 / processed,
+				p->latency_max_ns / 1e6);
+			if (NULL != p->sink_error) {
+				fprintf(stderr, "%s: inline %s error %d, %s\n", dev->device_name,
+					p->sink_error, p->sink_errno, strerror(p->sink_errno));
+				dev->failed = true;
+			}
+		}
+		frame_stats_free(&dev->stats);
+		framebus_close(&dev->bus);
+		if (NULL != dev->output_name && !segment_close(&dev->output)) {
+			fprintf(stderr, "%s: %s: %s error %d, %s\n", dev->device_name,
+				dev->output.name, dev->output.error, errno, strerror(errno));
+			dev->failed = true;
+		}
+		if (n_devices > 1 || dev->failed) {
+			fprintf(stderr, "%s: %u frames, %u empty, %u stalls%s\n",
+				dev->device_name, dev->frames, dev->empty, dev->total_stalls,
+				dev->failed ? ", FAILED" : "");
+		}
+		if (dev->failed) {
+			rc = EXIT_FAILURE;
+		}
+	}
+	return rc;
 }
@@ -0,0 +1,849 @@
+// capture daemon: keep the microscope configured and streaming and
+// write frames to files on request from a Unix domain socket
+//
+// requests are single lines, each answered by a single line:
+//
+//   capture output=PATH [count=N] [skip=N] [leds=N] [brightness=N]
+//           [contrast=N] [sharpness=N]
+//     -> ok frames=N bytes=N first=SEQ dropped=N ms=N
+//   status
+//     -> ok streaming=0|1 frames=N queued=N transfers=N
+//   quit
+//     -> ok
+//
+// any failure is answered with: error MESSAGE
+//
+// capture requests are served in order of arrival, only controls that
+// differ from the current settings are changed and the first frames
+// after a change are skipped to let the sensor settle
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#if defined(__linux__)
+#include <bsd/string.h>
+#endif
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#include <linux/videodev2.h>
+
+#include "controls.h"
+#include "video.h"
+
+
+#define DEFAULT_SOCKET "/tmp/captured.sock"
+#define DEFAULT_FRAME_COUNT 70
+
+// seconds without a frame before a request fails
+#define DEFAULT_STALL_TIMEOUT 2
+
+// frames discarded after a control change unless skip= is given
+#define DEFAULT_SETTLE_FRAMES 2
+
+#define MAX_CLIENTS 16
+#define MAX_LINE 1024
+
+// AR0330 defaults
+#define DEFAULT_BRIGHTNESS    168
+#define DEFAULT_SHARPNESS  0x0080
+#define DEFAULT_CONTRAST        0
+#define DEFAULT_LEDS         0x0f
+
+#define CLEAR(x) memset(&(x), 0, sizeof(x))
+
+// controls that a request may change, with the start up values
+typedef enum {
+	CONTROL_BRIGHTNESS,
+	CONTROL_CONTRAST,
+	CONTROL_SHARPNESS,
+	CONTROL_LEDS,
+	CONTROL_COUNT
+} control_index_t;
+
+typedef struct {
+	const char *name;  // request keyword
+	uint32_t id;
+	int32_t value;
+} control_t;
+
+static control_t parameters[CONTROL_COUNT] = {
+	[CONTROL_BRIGHTNESS] = { "brightness", V4L2_CID_BRIGHTNESS, DEFAULT_BRIGHTNESS },
+	[CONTROL_CONTRAST]   = { "contrast",   V4L2_CID_CONTRAST,   DEFAULT_CONTRAST },
+	[CONTROL_SHARPNESS]  = { "sharpness",  V4L2_CID_SHARPNESS,  DEFAULT_SHARPNESS },
+	[CONTROL_LEDS]       = { "leds",       V4L2_CID_HUE,        DEFAULT_LEDS },
+};
+
+typedef struct client_s client_t;
+
+// one queued capture request
+typedef struct request_s {
+	struct request_s *next;
+	client_t *client;
+	char output[MAX_LINE];
+	FILE *fout;
+	unsigned int count;
+	int skip;                          // -1 => settle only if controls change
+	bool set[CONTROL_COUNT];
+	int32_t value[CONTROL_COUNT];
+
+	// progress once active
+	unsigned int frames;
+	size_t bytes;
+	uint32_t first_sequence;
+	uint32_t last_sequence;
+	unsigned int dropped;
+	struct timespec started;
+} request_t;
+
+struct client_s {
+	int fd;
+	char line[MAX_LINE];
+	size_t length;
+	bool overflow;  // discarding the rest of an over long line
+};
+
+static const char *program_name;
+static video_device_t video;
+static controls_t controls;
+static client_t clients[MAX_CLIENTS];
+static request_t *queue_head = NULL;
+static request_t *queue_tail = NULL;
+static unsigned int total_frames = 0;
+static bool warm = false;   // stop streaming while idle
+static int stall_timeout = DEFAULT_STALL_TIMEOUT;
+static struct timespec last_frame;
+static int video_epfd = -1; // poll set the device is in while streaming
+static volatile sig_atomic_t quit = 0;
+
+
+static void errno_exit(const char *s) {
+	fprintf(stderr, "%s error %d, %s\n", s, errno, strerror(errno));
+	exit(EXIT_FAILURE);
+}
+
+static void video_exit(void) {
+	fprintf(stderr, "%s: %s error %d, %s\n",
+		video.name, video.error, errno, strerror(errno));
+	exit(EXIT_FAILURE);
+}
+
+static void controls_exit(void) {
+	fprintf(stderr, "%s: %s 0x%08x error %d, %s\n",
+		video.name, controls.error, controls.error_id, errno, strerror(errno));
+	exit(EXIT_FAILURE);
+}
+
+static void quit_handler(int sig) {
+	quit = 1;
+}
+
+static long elapsed_ms(const struct timespec *from, const struct timespec *to) {
+	return (to->tv_sec - from->tv_sec) * 1000L + (to->tv_nsec - from->tv_nsec) / 1000000L;
+}
+
+
+// send one reply line, a client that cannot take it is dropped later
+static void reply(client_t *client, const char *format, ...) {
+	char buffer[MAX_LINE];
+	va_list ap;
+	va_start(ap, format);
+	int n = vsnprintf(buffer, sizeof(buffer) - 1, format, ap);
+	va_end(ap);
+	if (n < 0) {
+		return;
+	}
+	if (n > sizeof(buffer) - 2) {
+		n = sizeof(buffer) - 2;
+	}
+	buffer[n++] = '\n';
+	if (-1 == send(client->fd, buffer, n, MSG_NOSIGNAL | MSG_DONTWAIT)) {
+		fprintf(stderr, "client %d: send error %d, %s\n", client->fd, errno, strerror(errno));
+	}
+}
+
+
+// apply the controls a request sets in one transfer
+// returns true if any changed
+static bool apply_controls(const request_t *r) {
+	for (int i = 0; i < CONTROL_COUNT; ++i) {
+		if (r->set[i]) {
+			controls_set(&controls, parameters[i].id, r->value[i]);
+		}
+	}
+	if (!controls_apply(&controls)) {
+		controls_exit();
+	}
+	return controls.changed > 0;
+}
+
+
+// remove and free the head request
+static void request_done(void) {
+	request_t *r = queue_head;
+	queue_head = r->next;
+	if (NULL == queue_head) {
+		queue_tail = NULL;
+	}
+	if (NULL != r->fout) {
+		fclose(r->fout);
+	}
+	free(r);
+}
+
+static void request_fail(const char *format, ...) {
+	request_t *r = queue_head;
+	char message[MAX_LINE];
+	va_list ap;
+	va_start(ap, format);
+	vsnprintf(message, sizeof(message), format, ap);
+	va_end(ap);
+
+	if (NULL != r->fout) {
+		fclose(r->fout);
+		r->fout = NULL;
+		unlink(r->output);
+	}
+	reply(r->client, "error %s", message);
+	request_done();
+}
+
+// the device is only polled while it streams: a stopped queue reports
+// EPOLLERR, which epoll delivers even though only EPOLLIN was asked for
+static void watch_video(void) {
+	if (-1 == video_epfd || !video.streaming) {
+		return;
+	}
+	struct epoll_event ev;
+	CLEAR(ev);
+	ev.events = EPOLLIN;
+	ev.data.ptr = &video;
+	if (-1 == epoll_ctl(video_epfd, EPOLL_CTL_ADD, video.fd, &ev)) {
+		errno_exit("epoll_ctl");
+	}
+}
+
+static void start_streaming(void) {
+	if (!video_start(&video)) {
+		video_exit();
+	}
+	watch_video();
+}
+
+static void stop_streaming(void) {
+	if (-1 != video_epfd && video.streaming
+	    && -1 == epoll_ctl(video_epfd, EPOLL_CTL_DEL, video.fd, NULL)) {
+		errno_exit("epoll_ctl");
+	}
+	if (!video_stop(&video)) {
+		video_exit();
+	}
+}
+
+
+// make the head request active: open its output and set the controls
+// failing requests are answered at once and the next one is tried
+static void request_start(void) {
+	while (NULL != queue_head) {
+		request_t *r = queue_head;
+		r->fout = fopen(r->output, "wb");
+		if (NULL == r->fout) {
+			request_fail("cannot create '%s': %s", r->output, strerror(errno));
+			continue;
+		}
+
+		bool changed = apply_controls(r);
+		if (r->skip < 0) {
+			r->skip = changed ? DEFAULT_SETTLE_FRAMES : 0;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &r->started);
+
+		if (!video.streaming) {
+			start_streaming();
+		}
+		clock_gettime(CLOCK_MONOTONIC, &last_frame);
+		return;
+	}
+
+	if (warm && video.streaming) {
+		stop_streaming();
+	}
+}
+
+
+// forget everything queued by a client that has gone away
+static void cancel_client(client_t *client) {
+	request_t **p = &queue_head;
+	bool active = NULL != queue_head && client == queue_head->client;
+
+	queue_tail = NULL;
+	while (NULL != *p) {
+		request_t *r = *p;
+		if (client == r->client) {
+			*p = r->next;
+			if (NULL != r->fout) {
+				fclose(r->fout);
+				unlink(r->output);
+			}
+			free(r);
+		} else {
+			queue_tail = r;
+			p = &r->next;
+		}
+	}
+	if (active) {
+		request_start();
+	}
+}
+
+
+static bool parse_number(const char *s, long *value) {
+	char *end;
+	errno = 0;
+	*value = strtol(s, &end, 0);
+	return 0 == errno && end != s && '\0' == *end;
+}
+
+// parse the words following "capture" into a new request
+static request_t *parse_capture(client_t *client, char *words) {
+	request_t *r = calloc(1, sizeof(request_t));
+	if (NULL == r) {
+		reply(client, "error out of memory");
+		return NULL;
+	}
+	r->client = client;
+	r->count = DEFAULT_FRAME_COUNT;
+	r->skip = -1;
+
+	char *save = NULL;
+	for (char *word = strtok_r(words, " \t", &save); NULL != word; word = strtok_r(NULL, " \t", &save)) {
+		char *value = strchr(word, '=');
+		if (NULL == value) {
+			reply(client, "error expected key=value: '%s'", word);
+			free(r);
+			return NULL;
+		}
+		*value++ = '\0';
+
+		if (0 == strcmp(word, "output")) {
+			if ('\0' == *value || strlcpy(r->output, value, sizeof(r->output)) >= sizeof(r->output)) {
+				reply(client, "error invalid output");
+				free(r);
+				return NULL;
+			}
+			continue;
+		}
+
+		long n;
+		if (!parse_number(value, &n)) {
+			reply(client, "error invalid number: %s=%s", word, value);
+			free(r);
+			return NULL;
+		}
+
+		if (0 == strcmp(word, "count") && n > 0) {
+			r->count = n;
+			continue;
+		}
+		if (0 == strcmp(word, "skip") && n >= 0) {
+			r->skip = n;
+			continue;
+		}
+		int i;
+		for (i = 0; i < CONTROL_COUNT; ++i) {
+			if (0 == strcmp(word, parameters[i].name)) {
+				r->set[i] = true;
+				r->value[i] = n;
+				break;
+			}
+		}
+		if (CONTROL_COUNT == i) {
+			reply(client, "error invalid parameter: %s=%s", word, value);
+			free(r);
+			return NULL;
+		}
+	}
+
+	if ('\0' == r->output[0]) {
+		reply(client, "error missing output=PATH");
+		free(r);
+		return NULL;
+	}
+	return r;
+}
+
+static void handle_line(client_t *client, char *line) {
+	char *save = NULL;
+	char *command = strtok_r(line, " \t", &save);
+	char *rest = strtok_r(NULL, "", &save);
+
+	if (NULL == command) {
+		return;
+	}
+
+	if (0 == strcmp(command, "capture")) {
+		request_t *r = parse_capture(client, NULL == rest ? "" : rest);
+		if (NULL == r) {
+			return;
+		}
+		if (NULL == queue_tail) {
+			queue_head = queue_tail = r;
+			request_start();
+		} else {
+			queue_tail->next = r;
+			queue_tail = r;
+		}
+	} else if (0 == strcmp(command, "status")) {
+		unsigned int queued = 0;
+		for (request_t *r = queue_head; NULL != r; r = r->next) {
+			++queued;
+		}
+		reply(client, "ok streaming=%d frames=%u queued=%u transfers=%u",
+		      video.streaming, total_frames, queued, controls.transfers);
+	} else if (0 == strcmp(command, "quit")) {
+		reply(client, "ok");
+		quit = 1;
+	} else {
+		reply(client, "error unknown command: '%s'", command);
+	}
+}
+
+
+static void close_client(int epfd, client_t *client) {
+	epoll_ctl(epfd, EPOLL_CTL_DEL, client->fd, NULL);
+	close(client->fd);
+	client->fd = -1;
+	cancel_client(client);
+}
+
+// read from a client and act on each complete line
+static void client_input(int epfd, client_t *client) {
+	char buffer[MAX_LINE];
+	ssize_t n = recv(client->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+
+	if (-1 == n && (EAGAIN == errno || EINTR == errno)) {
+		return;
+	}
+	if (n <= 0) {
+		close_client(epfd, client);
+		return;
+	}
+
+	for (ssize_t i = 0; i < n; ++i) {
+		char c = buffer[i];
+		if ('\n' != c) {
+			if (client->length < sizeof(client->line) - 1) {
+				client->line[client->length++] = c;
+			} else {
+				client->overflow = true;
+			}
+			continue;
+		}
+		if (client->length > 0 && '\r' == client->line[client->length - 1]) {
+			--client->length;
+		}
+		client->line[client->length] = '\0';
+		if (client->overflow) {
+			reply(client, "error line too long");
+		} else {
+			handle_line(client, client->line);
+		}
+		client->length = 0;
+		client->overflow = false;
+	}
+}
+
+static void accept_client(int epfd, int listen_fd) {
+	int fd = accept(listen_fd, NULL, NULL);
+	if (-1 == fd) {
+		return;
+	}
+
+	client_t *client = NULL;
+	for (int i = 0; i < MAX_CLIENTS; ++i) {
+		if (-1 == clients[i].fd) {
+			client = &clients[i];
+			break;
+		}
+	}
+	if (NULL == client) {
+		const char *busy = "error too many clients\n";
+		send(fd, busy, strlen(busy), MSG_NOSIGNAL | MSG_DONTWAIT);
+		close(fd);
+		return;
+	}
+
+	CLEAR(*client);
+	client->fd = fd;
+
+	struct epoll_event ev;
+	CLEAR(ev);
+	ev.events = EPOLLIN;
+	ev.data.ptr = client;
+	if (-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		errno_exit("epoll_ctl");
+	}
+}
+
+
+// write a frame to the active request, or drop it if idle
+static void device_input(void) {
+	video_frame_t frame;
+
+	switch (video_dequeue(&video, &frame)) {
+	case 0:
+		return;
+	case -1:
+		video_exit();
+	}
+	clock_gettime(CLOCK_MONOTONIC, &last_frame);
+	++total_frames;
+
+	request_t *r = queue_head;
+	bool finished = false;
+	if (NULL != r && r->skip > 0) {
+		--r->skip;
+	} else if (NULL != r && 0 != frame.bytesused) {
+		if (0 == r->frames) {
+			r->first_sequence = frame.sequence;
+		} else if (frame.sequence - r->last_sequence > 1) {
+			r->dropped += frame.sequence - r->last_sequence - 1;
+		}
+		r->last_sequence = frame.sequence;
+
+		if (1 != fwrite(frame.data, frame.bytesused, 1, r->fout)) {
+			int error = errno;
+			if (!video_requeue(&video, &frame)) {
+				video_exit();
+			}
+			request_fail("write '%s': %s", r->output, strerror(error));
+			request_start();
+			return;
+		}
+		r->bytes += frame.bytesused;
+		finished = ++r->frames >= r->count;
+	}
+
+	if (!video_requeue(&video, &frame)) {
+		video_exit();
+	}
+
+	if (finished) {
+		if (0 != fflush(r->fout)) {
+			request_fail("write '%s': %s", r->output, strerror(errno));
+		} else {
+			reply(r->client, "ok frames=%u bytes=%zu first=%u dropped=%u ms=%ld",
+			      r->frames, r->bytes, r->first_sequence, r->dropped,
+			      elapsed_ms(&r->started, &last_frame));
+			request_done();
+		}
+		request_start();
+	}
+}
+
+
+static int listen_socket(const char *path) {
+	struct sockaddr_un address;
+	CLEAR(address);
+	address.sun_family = AF_UNIX;
+	if (strlcpy(address.sun_path, path, sizeof(address.sun_path)) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "socket path too long: '%s'\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (-1 == fd) {
+		errno_exit("socket");
+	}
+	unlink(path);  // left over from a previous run
+	if (-1 == bind(fd, (struct sockaddr *)&address, sizeof(address))) {
+		errno_exit(path);
+	}
+	if (-1 == listen(fd, MAX_CLIENTS)) {
+		errno_exit("listen");
+	}
+	return fd;
+}
+
+
+static void mainloop(int listen_fd) {
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (-1 == epfd) {
+		errno_exit("epoll_create1");
+	}
+
+	struct epoll_event ev;
+	CLEAR(ev);
+	ev.events = EPOLLIN;
+	ev.data.ptr = &listen_fd;
+	if (-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev)) {
+		errno_exit("epoll_ctl");
+	}
+	video_epfd = epfd;
+	watch_video();
+
+	while (!quit) {
+		struct epoll_event events[MAX_CLIENTS + 2];
+		int n = epoll_wait(epfd, events, MAX_CLIENTS + 2, 1000);
+
+		if (-1 == n) {
+			if (EINTR == errno) {
+				continue;
+			}
+			errno_exit("epoll_wait");
+		}
+
+		for (int i = 0; i < n; ++i) {
+			void *p = events[i].data.ptr;
+			if (&listen_fd == p) {
+				accept_client(epfd, listen_fd);
+			} else if (&video == p) {
+				device_input();
+			} else {
+				client_t *client = p;
+				if (-1 != client->fd) {
+					client_input(epfd, client);
+				}
+			}
+		}
+
+		if (NULL != queue_head) {
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (elapsed_ms(&last_frame, &now) >= stall_timeout * 1000L) {
+				request_fail("stalled after %u frames", queue_head->frames);
+				request_start();
+			}
+		}
+	}
+
+	while (NULL != queue_head) {
+		request_fail("shutting down");
+	}
+	for (int i = 0; i < MAX_CLIENTS; ++i) {
+		if (-1 != clients[i].fd) {
+			close(clients[i].fd);
+			clients[i].fd = -1;
+		}
+	}
+	stop_streaming();
+	video_epfd = -1;
+	close(epfd);
+}
+
+
+// print usage message and exit
+static void usage(const char *message, ...) {
+	if (NULL != message) {
+		va_list ap;
+		va_start(ap, message);
+		fprintf(stderr, "error: ");
+		vfprintf(stderr, message, ap);
+		fprintf(stderr, "\n");
+		va_end(ap);
+	}
+	fprintf(stderr,
+		"Usage: %s [options]\n\n"
+		"Options:\n"
+		"-h | --help          Print this message\n"
+		"-d | --device name   Video device name [/dev/video0]\n"
+		"                     a regular file is replayed as a fake device,\n"
+		"                     '%s' generates Bayer frames\n"
+		"-x | --rate N        Frames per second of replay and synthetic\n"
+		"                     sources, 0 for as fast as possible [%i]\n"
+		"-k | --socket path   Unix domain socket for requests [%s]\n"
+		"-m | --mmap          Use memory mapped buffers [default]\n"
+		"-r | --read          Use read() calls\n"
+		"-u | --userp         Use application allocated buffers\n"
+		"-f | --format        Force format to 640x480 YUYV\n"
+		"-t | --ten           Force format to 1920x1080 Bayer12\n"
+		"-W | --warm          Stop streaming between requests, keep buffers\n"
+		"-w | --stall N       Seconds without a frame to fail a request [%i]\n"
+		"-b | --brightness N  Initial brightness value\n"
+		"-s | --sharpness N   Initial sharpness value\n"
+		"-n | --contrast N    Initial contrast value\n"
+		"-l | --leds N        Initial LEDs bitmask value\n"
+		"",
+		program_name, VIDEO_SYNTHETIC_NAME, VIDEO_DEFAULT_RATE,
+		DEFAULT_SOCKET, DEFAULT_STALL_TIMEOUT);
+	exit(EXIT_FAILURE);
+}
+
+
+static const char short_options[] = "d:x:k:hmruftWw:b:s:n:l:";
+
+static const struct option
+long_options[] = {
+	{ "help",       no_argument,       NULL, 'h' },
+	{ "device",     required_argument, NULL, 'd' },
+	{ "rate",       required_argument, NULL, 'x' },
+	{ "socket",     required_argument, NULL, 'k' },
+	{ "mmap",       no_argument,       NULL, 'm' },
+	{ "read",       no_argument,       NULL, 'r' },
+	{ "userp",      no_argument,       NULL, 'u' },
+	{ "format",     no_argument,       NULL, 'f' },
+	{ "ten",        no_argument,       NULL, 't' },
+	{ "warm",       no_argument,       NULL, 'W' },
+	{ "stall",      required_argument, NULL, 'w' },
+	{ "brightness", required_argument, NULL, 'b' },
+	{ "sharpness",  required_argument, NULL, 's' },
+	{ "contrast",   required_argument, NULL, 'n' },
+	{ "leds",       required_argument, NULL, 'l' },
+	{ 0, 0, 0, 0 }
+};
+
+
+static int32_t control_argument(const char *name, const char *s) {
+	long value;
+	if (!parse_number(s, &value)) {
+		usage("invalid %s '%s'", name, s);
+	}
+	return value;
+}
+
+
+int main(int argc, char **argv) {
+	program_name = argv[0];
+
+	const char *device_name = "/dev/video0";
+	const char *socket_name = DEFAULT_SOCKET;
+	video_io_t io = VIDEO_IO_MMAP;
+	video_format_t format = VIDEO_FORMAT_CURRENT;
+	unsigned int rate = VIDEO_DEFAULT_RATE;
+
+	for (;;) {
+		int idx;
+		int c;
+
+		c = getopt_long(argc, argv, short_options, long_options, &idx);
+
+		if (-1 == c) {
+			break;
+		}
+
+		switch (c) {
+		case 0: // getopt_long() flag
+			break;
+
+		case 'd':
+			device_name = optarg;
+			break;
+
+		case 'x':
+			rate = control_argument("rate", optarg);
+			break;
+
+		case 'k':
+			socket_name = optarg;
+			break;
+
+		case 'h':
+			usage(NULL);
+
+		case 'm':
+			io = VIDEO_IO_MMAP;
+			break;
+
+		case 'r':
+			io = VIDEO_IO_READ;
+			break;
+
+		case 'u':
+			io = VIDEO_IO_USERPTR;
+			break;
+
+		case 'f':
+			format = VIDEO_FORMAT_YUYV;
+			break;
+
+		case 't':
+			format = VIDEO_FORMAT_BAYER12;
+			break;
+
+		case 'W':
+			warm = true;
+			break;
+
+		case 'w':
+			stall_timeout = control_argument("stall timeout", optarg);
+			if (stall_timeout <= 0) {
+				usage("invalid stall timeout '%s'", optarg);
+			}
+			break;
+
+		case 'b':
+			parameters[CONTROL_BRIGHTNESS].value = control_argument("brightness", optarg);
+			break;
+
+		case 's':
+			parameters[CONTROL_SHARPNESS].value = control_argument("sharpness", optarg);
+			break;
+
+		case 'n':
+			parameters[CONTROL_CONTRAST].value = control_argument("contrast", optarg);
+			break;
+
+		case 'l':
+			parameters[CONTROL_LEDS].value = control_argument("LEDs value", optarg);
+			break;
+
+		default:
+			usage("invalid option: '%c'", c);
+		}
+	}
+
+	for (int i = 0; i < MAX_CLIENTS; ++i) {
+		clients[i].fd = -1;
+	}
+
+	// all setup cost is paid once here rather than per request
+	if (!video_open(&video, device_name, io)) {
+		video_exit();
+	}
+	video.rate = rate;
+	controls_init(&controls, video_control_fd(&video));
+	for (int i = 0; i < CONTROL_COUNT; ++i) {
+		controls_set(&controls, parameters[i].id, parameters[i].value);
+	}
+	if (!controls_apply(&controls)) {
+		controls_exit();
+	}
+	if (!video_init(&video, format)) {
+		video_exit();
+	}
+	if (!warm && !video_start(&video)) {
+		video_exit();
+	}
+
+	struct sigaction action;
+	CLEAR(action);
+	action.sa_handler = quit_handler;
+	sigemptyset(&action.sa_mask);
+	if (-1 == sigaction(SIGINT, &action, NULL) || -1 == sigaction(SIGTERM, &action, NULL)) {
+		errno_exit("sigaction");
+	}
+
+	int listen_fd = listen_socket(socket_name);
+	fprintf(stderr, "%s: %s ready on %s\n", program_name, device_name, socket_name);
+
+	mainloop(listen_fd);
+
+	close(listen_fd);
+	unlink(socket_name);
+
+	controls_set(&controls, V4L2_CID_HUE, 0); // LEDs off
+	controls_apply(&controls);
+	video_uninit(&video);
+	video_close(&video);
+	return EXIT_SUCCESS;
+}
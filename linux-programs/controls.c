@@ -0,0 +1,268 @@
+// V4L2 control access with a cache of the values in the device
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+
+#include <linux/videodev2.h>
+
+#include "controls.h"
+
+
+#define CLEAR(x) memset(&(x), 0, sizeof(x))
+
+
+static bool fail(controls_t *controls, const char *operation, uint32_t id) {
+	controls->error = operation;
+	controls->error_id = id;
+	return false;
+}
+
+static int xioctl(int fh, int request, void *arg) {
+	int r;
+
+	do {
+		r = ioctl(fh, request, arg);
+	} while (-1 == r && EINTR == errno);
+
+	return r;
+}
+
+// find or add the state for a control, NULL if the table is full
+static control_state_t *lookup(controls_t *controls, uint32_t id) {
+	for (unsigned int i = 0; i < controls->n_controls; ++i) {
+		if (id == controls->control[i].id) {
+			return &controls->control[i];
+		}
+	}
+	if (controls->n_controls >= CONTROLS_MAX) {
+		errno = ENOSPC;
+		fail(controls, "too many controls", id);
+		return NULL;
+	}
+	control_state_t *c = &controls->control[controls->n_controls++];
+	CLEAR(*c);
+	c->id = id;
+	return c;
+}
+
+
+void controls_init(controls_t *controls, int fd) {
+	memset(controls, 0, sizeof(*controls));
+	controls->fd = fd;
+}
+
+
+void controls_invalidate(controls_t *controls) {
+	for (unsigned int i = 0; i < controls->n_controls; ++i) {
+		controls->control[i].known = false;
+	}
+}
+
+
+bool controls_query(controls_t *controls, uint32_t id, struct v4l2_queryctrl *query) {
+	for (unsigned int i = 0; i < controls->n_controls; ++i) {
+		if (id == controls->control[i].id && controls->control[i].queried) {
+			*query = controls->control[i].query;
+			return true;
+		}
+	}
+
+	if (-1 == controls->fd) {
+		errno = EINVAL;
+		return fail(controls, "VIDIOC_QUERYCTRL", id);
+	}
+	CLEAR(*query);
+	query->id = id;
+	if (-1 == xioctl(controls->fd, VIDIOC_QUERYCTRL, query)) {
+		return fail(controls, "VIDIOC_QUERYCTRL", id);
+	}
+
+	// only controls that exist take a place in the table
+	control_state_t *c = lookup(controls, id);
+	if (NULL == c) {
+		return false;
+	}
+	c->query = *query;
+	c->queried = true;
+	return true;
+}
+
+
+// one VIDIOC_G_CTRL per control for drivers without extended controls
+static bool read_each(controls_t *controls, const uint32_t *ids, unsigned int n_ids) {
+	for (unsigned int i = 0; i < n_ids; ++i) {
+		struct v4l2_control control;
+		CLEAR(control);
+		control.id = ids[i];
+		if (-1 == xioctl(controls->fd, VIDIOC_G_CTRL, &control)) {
+			return fail(controls, "VIDIOC_G_CTRL", control.id);
+		}
+		control_state_t *c = lookup(controls, ids[i]);
+		if (NULL == c) {
+			return false;
+		}
+		c->value = control.value;
+		c->known = true;
+	}
+	return true;
+}
+
+bool controls_read(controls_t *controls, const uint32_t *ids, unsigned int n_ids) {
+	struct v4l2_ext_control list[CONTROLS_MAX];
+	struct v4l2_ext_controls ext;
+
+	if (n_ids > CONTROLS_MAX) {
+		errno = EINVAL;
+		return fail(controls, "too many controls", 0);
+	}
+	if (0 == n_ids || -1 == controls->fd) {
+		return true;
+	}
+	if (controls->no_ext) {
+		return read_each(controls, ids, n_ids);
+	}
+
+	CLEAR(ext);
+	ext.count = n_ids;
+	ext.controls = list;
+	for (unsigned int i = 0; i < n_ids; ++i) {
+		CLEAR(list[i]);
+		list[i].id = ids[i];
+	}
+
+	if (-1 == xioctl(controls->fd, VIDIOC_G_EXT_CTRLS, &ext)) {
+		if (ENOTTY == errno) {
+			controls->no_ext = true;
+			return read_each(controls, ids, n_ids);
+		}
+		uint32_t id = ext.error_idx < n_ids ? ids[ext.error_idx] : 0;
+		return fail(controls, "VIDIOC_G_EXT_CTRLS", id);
+	}
+
+	for (unsigned int i = 0; i < n_ids; ++i) {
+		control_state_t *c = lookup(controls, ids[i]);
+		if (NULL == c) {
+			return false;
+		}
+		c->value = list[i].value;
+		c->known = true;
+	}
+	return true;
+}
+
+
+bool controls_get(controls_t *controls, uint32_t id, int32_t *value) {
+	control_state_t *c = lookup(controls, id);
+	if (NULL == c) {
+		return false;
+	}
+	if (!c->known) {
+		if (-1 == controls->fd) {
+			errno = ENODATA;
+			return fail(controls, "value not known", id);
+		}
+		if (!controls_read(controls, &id, 1)) {
+			return false;
+		}
+	}
+	*value = c->value;
+	return true;
+}
+
+
+bool controls_set(controls_t *controls, uint32_t id, int32_t value) {
+	control_state_t *c = lookup(controls, id);
+	if (NULL == c) {
+		return false;
+	}
+	c->staged = true;
+	c->staged_value = value;
+	return true;
+}
+
+
+// one VIDIOC_S_CTRL per control for drivers without extended controls
+static bool apply_each(controls_t *controls, control_state_t **changes, unsigned int n) {
+	for (unsigned int i = 0; i < n; ++i) {
+		struct v4l2_control control;
+		CLEAR(control);
+		control.id = changes[i]->id;
+		control.value = changes[i]->staged_value;
+		++controls->transfers;
+		if (-1 == xioctl(controls->fd, VIDIOC_S_CTRL, &control)) {
+			return fail(controls, "VIDIOC_S_CTRL", control.id);
+		}
+		changes[i]->value = changes[i]->staged_value;
+		changes[i]->known = true;
+	}
+	return true;
+}
+
+bool controls_apply(controls_t *controls) {
+	control_state_t *changes[CONTROLS_MAX];
+	struct v4l2_ext_control list[CONTROLS_MAX];
+	unsigned int n = 0;
+
+	controls->changed = 0;
+	for (unsigned int i = 0; i < controls->n_controls; ++i) {
+		control_state_t *c = &controls->control[i];
+		if (!c->staged) {
+			continue;
+		}
+		c->staged = false;
+		if (c->known && c->value == c->staged_value) {
+			continue;
+		}
+		++controls->changed;
+		if (-1 == controls->fd) {
+			c->value = c->staged_value;
+			c->known = true;
+			continue;
+		}
+		changes[n++] = c;
+	}
+	if (0 == n) {
+		return true;
+	}
+
+	if (controls->no_ext) {
+		return apply_each(controls, changes, n);
+	}
+
+	struct v4l2_ext_controls ext;
+	CLEAR(ext);
+	ext.count = n;
+	ext.controls = list;
+	for (unsigned int i = 0; i < n; ++i) {
+		CLEAR(list[i]);
+		list[i].id = changes[i]->id;
+		list[i].value = changes[i]->staged_value;
+	}
+
+	++controls->transfers;
+	if (-1 == xioctl(controls->fd, VIDIOC_S_EXT_CTRLS, &ext)) {
+		if (ENOTTY == errno) {
+			controls->no_ext = true;
+			return apply_each(controls, changes, n);
+		}
+		// some of the batch may have been applied, so trust none of it
+		int error = errno;
+		for (unsigned int i = 0; i < n; ++i) {
+			changes[i]->known = false;
+		}
+		errno = error;
+		return fail(controls, "VIDIOC_S_EXT_CTRLS",
+			    ext.error_idx < n ? changes[ext.error_idx]->id : 0);
+	}
+
+	for (unsigned int i = 0; i < n; ++i) {
+		changes[i]->value = changes[i]->staged_value;
+		changes[i]->known = true;
+	}
+	return true;
+}
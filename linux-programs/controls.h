@@ -0,0 +1,61 @@
+// V4L2 control access with a cache of the values in the device
+//
+// changes are staged with controls_set() and sent together by
+// controls_apply() as a single VIDIOC_S_EXT_CTRLS, controls already
+// holding the requested value are left out
+
+#ifndef _CONTROLS_H_
+#define _CONTROLS_H_ 1
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <linux/videodev2.h>
+
+// controls tracked per device
+#define CONTROLS_MAX 64
+
+typedef struct {
+	uint32_t id;
+	bool known;              // value matches the device
+	int32_t value;
+	bool staged;             // change waiting for controls_apply()
+	int32_t staged_value;
+	bool queried;
+	struct v4l2_queryctrl query;
+} control_state_t;
+
+typedef struct {
+	int fd;                  // -1 => no device, values are only cached
+	control_state_t control[CONTROLS_MAX];
+	unsigned int n_controls;
+	bool no_ext;             // driver lacks extended controls, use VIDIOC_G/S_CTRL
+	unsigned int transfers;  // set ioctls issued
+	unsigned int changed;    // controls changed by the last controls_apply()
+	const char *error;       // operation that failed, errno has the reason
+	uint32_t error_id;       // control that failed, 0 if unknown
+} controls_t;
+
+void controls_init(controls_t *controls, int fd);
+
+// forget the cached values, e.g. after the firmware was reset
+void controls_invalidate(controls_t *controls);
+
+// all return false on failure with controls->error and errno set
+
+// VIDIOC_QUERYCTRL, the result is cached, EINVAL => no such control
+bool controls_query(controls_t *controls, uint32_t id, struct v4l2_queryctrl *query);
+
+// refresh the cache of several controls with one VIDIOC_G_EXT_CTRLS
+bool controls_read(controls_t *controls, const uint32_t *ids, unsigned int n_ids);
+
+// cached value, read from the device if not known
+bool controls_get(controls_t *controls, uint32_t id, int32_t *value);
+
+// stage a change for the next controls_apply()
+bool controls_set(controls_t *controls, uint32_t id, int32_t value);
+
+// send all staged changes that differ from the cache in one transfer
+bool controls_apply(controls_t *controls);
+
+#endif
@@ -0,0 +1,499 @@
+// create-fingerprint.c: print the perceptual fingerprint of every
+// frame in capture files
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "physicalhasher.h"
+
+
+#define FRAME_WIDTH  1920
+#define FRAME_HEIGHT 1080
+
+// frames are numbered on through the inputs
+typedef struct {
+	FILE *out;
+	uint64_t count;          // frames read
+	uint64_t limit;          // 0 => all
+	bool rgb;                // demosaic and use luma, not the green sites
+	int embed_offset;        // -1 => no embedded data
+	unsigned int fuse;       // frames to fuse for each input, 0 => none
+	decoder_t decoder;
+	fusion_t fusion;
+	fpstore_t *store;        // NULL => lines only
+	fpstore_meta_t meta;     // device and LEDs for every record
+	bool align;              // register to the reference before hashing
+	registration_t registration;
+} run_t;
+
+// one command line argument, a manifest is all its segments
+typedef struct {
+	const char *name;
+	framefile_t *files;
+	int n_files;
+	uint64_t frames;
+} input_t;
+
+static const char *program_name;
+static int verbose = 0; // incremented by --verbose / -v
+
+
+// print usage message and exit
+static void usage(const char *message, ...) {
+	if (NULL != message) {
+		va_list ap;
+		va_start(ap, message);
+		fprintf(stderr, "error: ");
+		vfprintf(stderr, message, ap);
+		fprintf(stderr, "\n");
+		va_end(ap);
+	}
+	fprintf(stderr,
+		"Usage: %s [options] FILE...\n\n"
+		"Options:\n"
+		"-h | --help          Print this message\n"
+		"-v | --verbose       Print progress and the rate\n"
+		"-c | --count N       Limit number of frames [no-limit]\n"
+		"-o | --output F      Write to file F [stdout]\n"
+		"-e | --embed N       Embedded data pixel offset, adds the focus steps\n"
+		"                     and contrast to each line\n"
+		"-r | --rgb           Demosaic and hash the luma instead of the raw\n"
+		"                     green sites, much slower\n"
+		"-k | --fuse K        One fingerprint for each input, of the mean of\n"
+		"                     K frames around best focus [%d when given as 0]\n"
+		"-s | --store F       Also append to fingerprint store F, created if\n"
+		"                     needed\n"
+		"-d | --device N      Device number for the store records [0]\n"
+		"-l | --leds MASK     LED mask for the store records [0]\n"
+		"-a | --align F       Register each image to the first frame of capture\n"
+		"                     file F and hash the same area of the sample\n"
+		"-t | --rotation      Estimate rotation as well when aligning\n"
+		"Inputs are capture files or segment manifests.  Each line is:\n"
+		"  frame fingerprint [steps contrast]\n"
+		"with the %d bit fingerprint in hex, the frame is the best focused\n"
+		"one when fusing\n"
+		"",
+		program_name, FUSION_DEFAULT_FRAMES, FINGERPRINT_BITS);
+	exit(EXIT_FAILURE);
+}
+
+
+static const char short_options[] = "hvc:o:e:rk:s:d:l:a:t";
+
+static const struct option
+long_options[] = {
+	{ "help",       no_argument,       NULL, 'h' },
+	{ "verbose",    no_argument,       NULL, 'v' },
+	{ "count",      required_argument, NULL, 'c' },
+	{ "output",     required_argument, NULL, 'o' },
+	{ "embed",      required_argument, NULL, 'e' },
+	{ "rgb",        no_argument,       NULL, 'r' },
+	{ "fuse",       required_argument, NULL, 'k' },
+	{ "store",      required_argument, NULL, 's' },
+	{ "device",     required_argument, NULL, 'd' },
+	{ "leds",       required_argument, NULL, 'l' },
+	{ "align",      required_argument, NULL, 'a' },
+	{ "rotation",   no_argument,       NULL, 't' },
+	{ 0, 0, 0, 0 }
+};
+
+
+// the inputs and their names are kept until exit
+static bool add_file(void *context, char *name) {
+	input_t *input = context;
+	framefile_t *files = realloc(input->files, (input->n_files + 1) * sizeof(framefile_t));
+	if (NULL == files) {
+		usage("failed to allocate input: '%s'", name);
+	}
+	input->files = files;
+
+	framefile_t *file = &files[input->n_files];
+	if (!framefile_open(file, name, FRAME_WIDTH, FRAME_HEIGHT)) {
+		usage("failed to open input file: '%s': %s error %d, %s",
+		      name, file->error, errno, strerror(errno));
+	}
+	++input->n_files;
+	input->frames += file->frames;
+
+	if (verbose > 0) {
+		fprintf(stderr, "%s: %llu frames\n", name, (unsigned long long)file->frames);
+	}
+	return true;
+}
+
+
+// byte offset of frame i of all the input's frames within its file
+static uint64_t frame_offset(const input_t *input, uint64_t i) {
+	const framefile_t *file = input->files;
+	while (i >= file->frames) {
+		i -= file->frames;
+		++file;
+	}
+	return i * file->frame_size;
+}
+
+
+// read frame i of all the input's frames
+static void read_frame(input_t *input, uint64_t i, size_t first, size_t count, uint16_t *pixels) {
+	framefile_t *file = input->files;
+	while (i >= file->frames) {
+		i -= file->frames;
+		++file;
+	}
+	if (!framefile_read_pixels(file, i, first, count, pixels)) {
+		usage("failed to read frame %llu of '%s': %s error %d, %s",
+		      (unsigned long long)i, file->name, file->error, errno, strerror(errno));
+	}
+}
+
+
+static void print_fingerprint(run_t *run, uint64_t frame, const fingerprint_t *fingerprint,
+			      const embed_t *embed) {
+	char hex[FINGERPRINT_HEX + 1];
+	fingerprint_format(fingerprint, hex);
+	fprintf(run->out, "%llu %s", (unsigned long long)frame, hex);
+	if (run->embed_offset >= 0) {
+		if (embed->present) {
+			fprintf(run->out, " %u %u", embed->steps, embed->contrast);
+		} else {
+			fprintf(run->out, " - -");
+		}
+	}
+	fprintf(run->out, "\n");
+}
+
+
+static void store_fingerprint(run_t *run, const input_t *input, uint64_t i,
+			      const fingerprint_t *fingerprint, const embed_t *embed, bool fused) {
+	if (NULL == run->store) {
+		return;
+	}
+	fpstore_meta_t meta = run->meta;
+	meta.frame_offset = frame_offset(input, i);
+	if (fused) {
+		meta.flags |= FPSTORE_FUSED;
+	}
+	if (run->embed_offset >= 0 && embed->present) {
+		meta.flags |= FPSTORE_EMBED;
+		meta.steps = embed->steps;
+		meta.contrast = embed->contrast;
+	}
+	if (!fpstore_append(run->store, fingerprint, &meta, NULL)) {
+		usage("failed to append to store: %s error %d, %s", run->store->error, errno, strerror(errno));
+	}
+}
+
+
+// the fingerprint of the image in the decoder's Bayer buffer
+static void fingerprint_image(run_t *run, fingerprint_t *fingerprint) {
+	decoder_t *decoder = &run->decoder;
+	if (run->align) {
+		fingerprint_transform_t transform;
+		double peak;
+		if (!registration_estimate(&run->registration, decoder->bayer, &transform, &peak)) {
+			usage("failed to register: %s error %d, %s",
+			      run->registration.error, errno, strerror(errno));
+		}
+		if (verbose > 1) {
+			fprintf(stderr, "%llu: shift %.2f %.2f angle %.4f peak %.3f\n",
+				(unsigned long long)run->count, transform.dx, transform.dy,
+				transform.angle, peak);
+		}
+		fingerprint_grid_t grid;
+		if (!fingerprint_green_grid_transformed(decoder->bayer, FRAME_WIDTH, FRAME_HEIGHT,
+							decoder->tile, &transform, grid)) {
+			usage("failed to fingerprint: %d, %s", errno, strerror(errno));
+		}
+		fingerprint_from_grid(grid, fingerprint);
+	} else if (run->rgb) {
+		// demosaic without decode_frame(), whose overlays of the focus
+		// steps would change the fingerprint with them
+		const int offset = run->embed_offset >= 0 ? run->embed_offset : EMBED_DEFAULT_OFFSET;
+		embed_strip(decoder->bayer, FRAME_WIDTH * FRAME_HEIGHT, offset);
+		if (!ahd_decode(decoder->bayer, FRAME_WIDTH, FRAME_HEIGHT, decoder->rgb, decoder->tile)) {
+			usage("failed to demosaic frame %llu", (unsigned long long)run->count);
+		}
+		fingerprint_grid_t grid;
+		if (!fingerprint_rgb_grid(decoder->rgb, FRAME_WIDTH, FRAME_HEIGHT, grid)) {
+			usage("failed to fingerprint: %d, %s", errno, strerror(errno));
+		}
+		fingerprint_from_grid(grid, fingerprint);
+	} else if (!fingerprint_bayer(decoder->bayer, FRAME_WIDTH, FRAME_HEIGHT,
+				      decoder->tile, fingerprint)) {
+		usage("failed to fingerprint: %d, %s", errno, strerror(errno));
+	}
+}
+
+
+static void fingerprint_frames(run_t *run, input_t *input) {
+	decoder_t *decoder = &run->decoder;
+
+	for (uint64_t i = 0; i < input->frames && (0 == run->limit || run->count < run->limit); ++i) {
+		read_frame(input, i, 0, FRAME_WIDTH * FRAME_HEIGHT, decoder->bayer);
+
+		embed_t embed;
+		if (run->embed_offset >= 0) {
+			embed_decode(decoder->bayer, FRAME_WIDTH * FRAME_HEIGHT, run->embed_offset, &embed);
+		}
+
+		fingerprint_t fingerprint;
+		fingerprint_image(run, &fingerprint);
+		print_fingerprint(run, run->count, &fingerprint, &embed);
+		store_fingerprint(run, input, i, &fingerprint, &embed, false);
+		++run->count;
+	}
+}
+
+
+// choose the frames from their embedded data alone, then read only those
+static void fuse_frames(run_t *run, input_t *input) {
+	uint64_t n = input->frames;
+	if (0 != run->limit && run->count + n > run->limit) {
+		n = run->count < run->limit ? run->limit - run->count : 0;
+	}
+	if (0 == n) {
+		return;
+	}
+
+	const int offset = run->embed_offset >= 0 ? run->embed_offset : EMBED_DEFAULT_OFFSET;
+	embed_t *embeds = malloc(n * sizeof(embed_t));
+	if (NULL == embeds) {
+		usage("failed to allocate embedded data for %llu frames", (unsigned long long)n);
+	}
+	for (uint64_t i = 0; i < n; ++i) {
+		uint16_t pixels[EMBED_NIBBLES];
+		read_frame(input, i, offset, EMBED_NIBBLES, pixels);
+		embed_decode(pixels, EMBED_NIBBLES, 0, &embeds[i]);
+	}
+
+	size_t first;
+	size_t best;
+	size_t count = fusion_select(embeds, n, run->fuse, &first, &best);
+
+	fusion_reset(&run->fusion);
+	for (size_t i = first; i < first + count; ++i) {
+		read_frame(input, i, 0, FRAME_WIDTH * FRAME_HEIGHT, run->decoder.bayer);
+		fusion_add(&run->fusion, run->decoder.bayer);
+	}
+	fusion_result(&run->fusion, run->decoder.bayer);
+	if (verbose > 0) {
+		fprintf(stderr, "%s: fused frames %llu to %llu around %llu\n", input->name,
+			(unsigned long long)(run->count + first),
+			(unsigned long long)(run->count + first + count - 1),
+			(unsigned long long)(run->count + best));
+	}
+
+	fingerprint_t fingerprint;
+	fingerprint_image(run, &fingerprint);
+	print_fingerprint(run, run->count + best, &fingerprint, &embeds[best]);
+	store_fingerprint(run, input, best, &fingerprint, &embeds[best], true);
+
+	run->count += n;
+	free(embeds);
+}
+
+
+int main(int argc, char **argv) {
+	program_name = argv[0];
+
+	run_t run = {
+		.out = stdout,
+		.embed_offset = -1,
+	};
+	const char *output_name = NULL;
+	const char *store_name = NULL;
+	const char *align_name = NULL;
+	bool rotation = false;
+	fpstore_t store;
+
+	for (;;) {
+		int idx = 0;
+		int c = getopt_long(argc, argv, short_options, long_options, &idx);
+
+		if (-1 == c) {
+			break;
+		}
+
+		switch (c) {
+		case 0: // getopt_long() flag
+			break;
+
+		case 'h':
+			usage(NULL);
+
+		case 'v':
+			++verbose;
+			break;
+
+		case 'c':
+			errno = 0;
+			run.limit = strtoull(optarg, NULL, 0);
+			if (0 != errno) {
+				usage("invalid count '%s': %d, %s", optarg, errno, strerror(errno));
+			}
+			break;
+
+		case 'o':
+			output_name = optarg;
+			break;
+
+		case 'e':
+			errno = 0;
+			run.embed_offset = strtol(optarg, NULL, 0);
+			if (0 != errno || run.embed_offset < 0) {
+				usage("invalid embed offset '%s'", optarg);
+			}
+			break;
+
+		case 'r':
+			run.rgb = true;
+			break;
+
+		case 'k':
+			errno = 0;
+			run.fuse = strtol(optarg, NULL, 0);
+			if (0 != errno) {
+				usage("invalid fuse count '%s'", optarg);
+			}
+			if (0 == run.fuse) {
+				run.fuse = FUSION_DEFAULT_FRAMES;
+			}
+			break;
+
+		case 's':
+			store_name = optarg;
+			break;
+
+		case 'd':
+			errno = 0;
+			run.meta.device = strtoul(optarg, NULL, 0);
+			if (0 != errno) {
+				usage("invalid device '%s'", optarg);
+			}
+			break;
+
+		case 'l':
+			{
+				errno = 0;
+				unsigned long leds = strtoul(optarg, NULL, 0);
+				if (0 != errno || leds > 0xff) {
+					usage("invalid LED mask '%s'", optarg);
+				}
+				run.meta.leds = leds;
+			}
+			break;
+
+		case 'a':
+			align_name = optarg;
+			break;
+
+		case 't':
+			rotation = true;
+			break;
+
+		default:
+			usage("invalid option: '%c'", c);
+		}
+	}
+
+	if (optind >= argc) {
+		usage("missing arguments");
+	}
+	if (NULL != align_name && run.rgb) {
+		usage("--align works on the raw green sites, not with --rgb");
+	}
+
+	if (NULL != output_name) {
+		run.out = fopen(output_name, "w");
+		if (NULL == run.out) {
+			usage("failed to create output file: '%s': %d, %s", output_name, errno, strerror(errno));
+		}
+	}
+
+	if (NULL != store_name) {
+		if (!fpstore_open(&store, store_name, true, true)) {
+			usage("failed to open store: '%s': %s error %d, %s",
+			      store_name, store.error, errno, strerror(errno));
+		}
+		run.store = &store;
+	}
+
+	// only the buffers are used, the luma path strips the embedded data
+	// itself and demosaics without any overlays
+	decode_options_t options = { 0 };
+	if (!decode_init(&run.decoder, FRAME_WIDTH, FRAME_HEIGHT, &options)) {
+		usage("failed to create decoder: %s error %d, %s", run.decoder.error, errno, strerror(errno));
+	}
+	if (0 != run.fuse && !fusion_init(&run.fusion, FRAME_WIDTH, FRAME_HEIGHT)) {
+		usage("failed to create fusion: %s error %d, %s", run.fusion.error, errno, strerror(errno));
+	}
+	if (NULL != align_name) {
+		registration_t *registration = &run.registration;
+		if (!registration_init(registration, FRAME_WIDTH, FRAME_HEIGHT, run.decoder.tile,
+				       REGISTRATION_DEFAULT_BIN, rotation)) {
+			usage("failed to create registration: %s error %d, %s",
+			      registration->error, errno, strerror(errno));
+		}
+		framefile_t reference;
+		if (!framefile_open(&reference, align_name, FRAME_WIDTH, FRAME_HEIGHT)
+		    || !framefile_read(&reference, 0, run.decoder.bayer)) {
+			usage("failed to read reference: '%s': %s error %d, %s",
+			      align_name, reference.error, errno, strerror(errno));
+		}
+		framefile_close(&reference);
+		registration_reference(registration, run.decoder.bayer);
+		run.align = true;
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (int i = optind; i < argc; ++i) {
+		input_t input = {
+			.name = argv[i],
+		};
+		if (!framefile_is_manifest(argv[i])) {
+			add_file(&input, argv[i]);
+		} else if (!framefile_manifest(argv[i], add_file, &input)) {
+			usage("failed to read manifest: '%s': %d, %s", argv[i], errno, strerror(errno));
+		}
+
+		if (0 != run.fuse) {
+			fuse_frames(&run, &input);
+		} else {
+			fingerprint_frames(&run, &input);
+		}
+
+		for (int j = 0; j < input.n_files; ++j) {
+			framefile_close(&input.files[j]);
+		}
+		free(input.files);
+	}
+
+	if (verbose > 0) {
+		struct timespec end;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		fprintf(stderr, "%llu frames in %.3f s, %.0f frames/s\n", (unsigned long long)run.count,
+			seconds, 0 == seconds ? 0.0 : run.count / seconds);
+	}
+
+	decode_free(&run.decoder);
+	fusion_free(&run.fusion);
+	registration_free(&run.registration);
+	if (NULL != run.store && !fpstore_close(run.store)) {
+		usage("failed to write store: '%s': %s error %d, %s",
+		      store_name, store.error, errno, strerror(errno));
+	}
+	if (stdout != run.out && 0 != fclose(run.out)) {
+		usage("failed to write output file: '%s': %d, %s", output_name, errno, strerror(errno));
+	}
+	return EXIT_SUCCESS;
+}
@@ -1,28 +1,40 @@
 // create-png.c
 
-#include <png.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <string.h>
-#if defined(__linux__)
-#include <bsd/string.h>
-#endif
 #include <errno.h>
 #include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
 
-#include "ahd_bayer.h"
+#include "physicalhasher.h"
 
 
-// image processing oprions
+#define FRAME_WIDTH  1920
+#define FRAME_HEIGHT 1080
+
+#define MAX_JOBS 64
+
+// one capture file, frames are numbered on from the previous files
+typedef struct {
+	framefile_t file;
+	uint64_t first;          // number of its first frame
+} input_t;
+
+// frames of all the inputs shared out between the threads
 typedef struct {
-	bool slider;
-	bool number;
-	bool embed;
-	int offset;
-} image_options_t;
+	input_t *inputs;
+	int n_inputs;
+	uint64_t total;          // frames to create
+	uint64_t next;           // next frame to take, atomic
+	decode_options_t options;
+	const char *prefix;
+	bool failed;             // any frame failed, atomic
+} batch_t;
 
 // global variables
 static const char *program_name;
@@ -30,10 +42,8 @@ static const char *prefix = "frame";
 static int verbose = 0; // incremented by --verbose / -v
 
 // prototypes
-static bool write_png(const ahd_pixel_t *image, int width, int height, const char *path);
-static void fill(ahd_pixel_t *image, int x1, int y1, int x2, int y2, int width, int height, uint16_t red, uint16_t green, uint16_t blue);
-static void number(int value, ahd_pixel_t *image, int start_x, int start_y, int size, int width, int height);
-static int make_frames(int start, int limit, image_options_t options, const char *output_prefix, const char *input_file);
+static bool add_input(void *context, char *input_file);
+static void *make_frames(void *arg);
 
 
 // print usage message and exit
@@ -57,13 +67,16 @@ static void usage(const char *message, ...) {
 		"-p | --prefix T      Prefix [%s]\n"
 		"-c | --count N       Limit number of frames [no-limit]\n"
 		"-e | --embed N       Embedded data offset\n"
+		"-j | --jobs N        Frames to decode at once [one per processor]\n"
+		"Inputs are capture files or segment manifests, frames are numbered\n"
+		"on through the inputs in command line order\n"
 		"",
 		program_name, prefix);
 	exit(EXIT_FAILURE);
 }
 
 
-static const char short_options[] = "hvdsnp:c:e:";
+static const char short_options[] = "hvdsnp:c:e:j:";
 
 static const struct option
 long_options[] = {
@@ -74,6 +87,7 @@ long_options[] = {
 	{ "prefix",     required_argument, NULL, 'p' },
 	{ "count",      required_argument, NULL, 'c' },
 	{ "embed",      required_argument, NULL, 'e' },
+	{ "jobs",       required_argument, NULL, 'j' },
 	{ 0, 0, 0, 0 }
 };
 
@@ -81,13 +95,14 @@ long_options[] = {
 int main(int argc, char **argv) {
 	program_name = argv[0];
 
-	image_options_t options = {
+	decode_options_t options = {
 		.slider = true,
 		.number = true,
 		.embed = false,
-		.offset = 0
+		.embed_offset = 0
 	};
 	int frame_count = 0;
+	int jobs = 0;
 	for (;;) {
 		int idx = 0;
 		int c = getopt_long(argc, argv, short_options, long_options, &idx);
@@ -116,17 +131,10 @@ int main(int argc, char **argv) {
 			break;
 
 		case 'p':
-			{
-				size_t n = strlen(optarg) + 1;
-				if (n < 2) {
-					usage("missing output file name");
-				}
-				char *prefix = malloc(n);
-				if (NULL == prefix) {
-					usage("unable to allocate memory for prefix: '%s'", optarg);
-				}
-				strlcpy(prefix, optarg, n);
+			if (strlen(optarg) < 1) {
+				usage("missing output file name");
 			}
+			prefix = optarg;
 			break;
 
 		case 'c':
@@ -145,7 +153,15 @@ int main(int argc, char **argv) {
 					usage("invalid embed value  '%s': %d, %s", optarg, errno, strerror(errno));
 				}
 				options.embed = true;
-				options.offset = embed_offset;
+				options.embed_offset = embed_offset;
+			}
+			break;
+
+		case 'j':
+			errno = 0;
+			jobs = strtol(optarg, NULL, 0);
+			if (0 != errno || jobs < 1 || jobs > MAX_JOBS) {
+				usage("invalid jobs '%s', 1 to %d", optarg, MAX_JOBS);
 			}
 			break;
 
@@ -161,165 +177,140 @@ int main(int argc, char **argv) {
 	if (verbose > 1) {
 		printf("verbose level: %d\n", verbose);
 	}
-	int count = 0;
+	batch_t batch = {
+		.options = options,
+		.prefix = prefix,
+	};
 	for (int i = optind; i < argc; ++i) {
-		count = make_frames(count, frame_count, options, prefix, argv[i]);
+		if (!framefile_is_manifest(argv[i])) {
+			add_input(&batch, argv[i]);
+		} else if (!framefile_manifest(argv[i], add_input, &batch)) {
+			usage("failed to read manifest: '%s': %d, %s", argv[i], errno, strerror(errno));
+		}
 	}
 
-	return EXIT_SUCCESS;
-}
-
-
-static bool write_png(const ahd_pixel_t *image, const int width, const int height, const char *path) {
-
-	bool rc = false; // assume failure
-
-	const int depth = 8 * sizeof(ahd_pixel_t);       // number of bits in a pixel
-
-	FILE *fp = fopen(path, "wb");
-	if (NULL == fp) {
-		goto fopen_failed;
+	// every frame's number is known before any are decoded
+	uint64_t total = 0;
+	for (int i = 0; i < batch.n_inputs; ++i) {
+		batch.inputs[i].first = total;
+		total += batch.inputs[i].file.frames;
 	}
+	batch.total = (0 != frame_count && frame_count < total) ? frame_count : total;
 
-	png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	if (NULL == png_ptr) {
-		goto png_create_write_struct_failed;
+	if (0 == jobs) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		jobs = n < 1 ? 1 : n > MAX_JOBS ? MAX_JOBS : n;
 	}
-
-	png_infop info_ptr = png_create_info_struct(png_ptr);
-	if (NULL == info_ptr) {
-		goto png_create_info_struct_failed;
+	if (jobs > batch.total) {
+		jobs = 0 == batch.total ? 1 : batch.total;
 	}
-
-	// error handling
-	if (setjmp(png_jmpbuf(png_ptr))) {
-		goto png_failure;
+	if (verbose > 1) {
+		printf("%llu frames from %d inputs on %d threads\n",
+		       (unsigned long long)batch.total, batch.n_inputs, jobs);
 	}
 
-	// image attributes
-	png_set_IHDR(png_ptr, info_ptr,
-		     width, height, depth,
-		     PNG_COLOR_TYPE_RGB,
-		     PNG_INTERLACE_NONE,
-		     PNG_COMPRESSION_TYPE_DEFAULT,
-		     PNG_FILTER_TYPE_DEFAULT);
-
-	// PNG row pointers
-	png_byte **row_pointers = png_malloc(png_ptr, height * sizeof(png_byte *));
-	for (size_t y = 0; y < height; ++y) {
-		row_pointers[y] = (png_byte *)&image[y * width * 3];  // R G B pixel order
+	pthread_t threads[MAX_JOBS];
+	int started = 0;
+	for (; started < jobs; ++started) {
+		int rc = pthread_create(&threads[started], NULL, make_frames, &batch);
+		if (0 != rc) {
+			fprintf(stderr, "pthread_create error %d, %s\n", rc, strerror(rc));
+			__atomic_store_n(&batch.failed, true, __ATOMIC_SEQ_CST);
+			break;
+		}
+	}
+	for (int i = 0; i < started; ++i) {
+		pthread_join(threads[i], NULL);
 	}
 
-	// create PNG
-	png_init_io(png_ptr, fp);
-	png_set_rows(png_ptr, info_ptr, row_pointers);
-	png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
-
-	// no need to free the actual rows as these are owned by the caller
-	png_free(png_ptr, row_pointers);
-
-	rc = true; // success
+	for (int i = 0; i < batch.n_inputs; ++i) {
+		framefile_close(&batch.inputs[i].file);
+	}
+	free(batch.inputs);
 
-png_failure:
-png_create_info_struct_failed:
-	png_destroy_write_struct(&png_ptr, &info_ptr);
-png_create_write_struct_failed:
-	fclose(fp);
-fopen_failed:
-	return rc;  // success if true
+	return batch.failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 
-// fill starting at (x1, y1) to  < (x2, y2) in RGB bitmap of size width, height
-static void fill(ahd_pixel_t *image, int x1, int y1, int x2, int y2, int width, int height, uint16_t red, uint16_t green, uint16_t blue) {
-
-	for (int y = y1; y < y2 && y < height; ++y) {
-		ahd_pixel_t *pixel = &image[3 * x1 + 3 * width * y];
-		for (int x = x1; x < x2 && x < width; ++x) {
-			*pixel++ = red;
-			*pixel++ = green;
-			*pixel++ = blue;
-		}
+// the inputs and their names are kept until exit
+static bool add_input(void *context, char *input_file) {
+	batch_t *batch = context;
+	input_t *inputs = realloc(batch->inputs, (batch->n_inputs + 1) * sizeof(input_t));
+	if (NULL == inputs) {
+		usage("failed to allocate input: '%s'", input_file);
 	}
-}
+	batch->inputs = inputs;
 
+	framefile_t *file = &inputs[batch->n_inputs].file;
+	if (!framefile_open(file, input_file, FRAME_WIDTH, FRAME_HEIGHT)) {
+		usage("failed to open input file: '%s': %s error %d, %s",
+		      input_file, file->error, errno, strerror(errno));
+	}
+	++batch->n_inputs;
 
-// stamp a 4 digit number into the bitmap
-static void number(int value, ahd_pixel_t *image, int start_x, int start_y, int size, int width, int height) {
-	static const uint16_t bitmaps[] = {
-		075557, // 0
-		026227, // 1
-		025127, // 2
-		071717, // 3
-		013571, // 4
-		074616, // 5
-		034652, // 6
-		071122, // 7
-		075757, // 8
-		035311  // 9
-	};
-
-	int divisor = 1000000;
-	value %= 9999999;
+	if (verbose > 1) {
+		printf("opened input file: '%s' %llu frames\n", input_file, (unsigned long long)file->frames);
+	}
+	return true;
+}
 
-	fill(image, start_x, start_y, start_x + size*4*7, start_y + size*5, width, height, 0x00, 0x00, 0x00);
 
-	for (int i = 0; i < 7; ++i, divisor /= 10) {
-		int d = value / divisor;
-		uint16_t bm = bitmaps[d % 10];
-		int x_begin = start_x + 4 * size * i;
-		for (int y = 0, ys = start_y; y < 5; ++y, ys += size) {
-			for (int x = 0, xs = x_begin; x < 3; ++x, xs += size) {
-				if (0 != (040000 & bm)) {
-					fill(image, xs, ys, xs + size, ys + size, width, height, 0xff, 0xff, 0xff);
-				}
-				bm <<= 1;
-			}
+// the input holding a frame number
+static input_t *find_input(const batch_t *batch, uint64_t n) {
+	int low = 0;
+	int high = batch->n_inputs - 1;
+	while (low < high) {
+		int middle = (low + high + 1) / 2;
+		if (batch->inputs[middle].first <= n) {
+			low = middle;
+		} else {
+			high = middle - 1;
 		}
 	}
+	return &batch->inputs[low];
 }
 
 
-static int make_frames(int start, int limit, image_options_t options, const char *output_prefix, const char *input_file) {
-	FILE *fp = fopen(input_file, "rb");
-	if (NULL == fp) {
-		usage("failed to open input file: '%s'", input_file);
-		return 0;
-	}
+static void *make_frames(void *arg) {
+	batch_t *batch = arg;
 
-	if (verbose > 1) {
-		printf("opened input file: '%s'\n", input_file);
-	}
-	const int width = 1920;
-	const int height = 1080;
-	ahd_pixel_t *pixels = malloc(width * height * sizeof(ahd_pixel_t));
-	if (NULL == pixels) {
-		usage("failed to malloc pixels");
-	}
-	ahd_pixel_t *image = malloc(3 * width * height * sizeof(ahd_pixel_t));
-	if (NULL == pixels) {
-		usage("failed to malloc image");
+	decoder_t decoder;
+	if (!decode_init(&decoder, FRAME_WIDTH, FRAME_HEIGHT, &batch->options)) {
+		fprintf(stderr, "failed to create decoder: %s error %d, %s\n",
+			decoder.error, errno, strerror(errno));
+		__atomic_store_n(&batch->failed, true, __ATOMIC_SEQ_CST);
+		return NULL;
 	}
 
-	int rc = limit;
-	for (int count = start; (0 == limit) || (count < limit); ++count) {
+	for (;;) {
+		uint64_t count = __atomic_fetch_add(&batch->next, 1, __ATOMIC_SEQ_CST);
+		if (count >= batch->total) {
+			break;
+		}
+		input_t *input = find_input(batch, count);
+
 		char output_name[256];
-		if (snprintf(output_name, sizeof(output_name), "%s%04d.png", output_prefix, count) >= sizeof(output_name)) {
-			usage("failed to create output name - increase buffer size");
-			rc = count;
+		if (snprintf(output_name, sizeof(output_name), "%s%04llu.png", batch->prefix,
+			     (unsigned long long)count) >= sizeof(output_name)) {
+			fprintf(stderr, "failed to create output name - increase buffer size\n");
+			__atomic_store_n(&batch->failed, true, __ATOMIC_SEQ_CST);
 			break;
 		}
 
 		// extract one frame from the input file
-		if (width * height != fread(pixels, sizeof(ahd_pixel_t), width * height, fp)) {
-			rc = count;
-			break;
+		framefile_t *file = &input->file;
+		if (!framefile_read(file, count - input->first, decoder.bayer)) {
+			fprintf(stderr, "failed to read frame %llu of '%s': %s error %d, %s\n",
+				(unsigned long long)(count - input->first), file->name,
+				file->error, errno, strerror(errno));
+			__atomic_store_n(&batch->failed, true, __ATOMIC_SEQ_CST);
+			continue;
 		}
 
 		if (verbose > 2) {
 			for (int line = 0; line < 8; ++line) {
 				printf("line: %2d: ", line);
-				const uint8_t *p = (uint8_t *)&pixels[width * line];
+				const uint8_t *p = (uint8_t *)&decoder.bayer[decoder.width * line];
 				for (int col = 0; col < 8; ++col) {
 					printf(" %02x", *p++);
 				}
@@ -327,63 +318,31 @@ static int make_frames(int start, int limit, image_options_t options, const char
 			}
 		}
 
-		uint8_t steps = 0;
-		uint32_t contrast = 0;
-		bool embed = false;
-		if (options.embed) {
-			uint8_t nibbles[9];
-			if (verbose > 2) {
-				printf("embed: ");
-			}
-			for (int i = 0; i < sizeof(nibbles); ++i) {
-				ahd_pixel_t *p = &pixels[options.offset + i]  ;
-				nibbles[i] = 0x0f & (*p >> 12);
-				*p &= 0x0fff;
-				if (verbose > 2) {
-					printf(" %01x", nibbles[i]);
-				}
-			}
-			steps = (nibbles[0] << 0) | (nibbles[1] << 4);
-			contrast = (nibbles[2] << 0)
-				| (nibbles[3] << 4)
-				| (nibbles[4] << 8)
-				| (nibbles[5] << 12)
-				| (nibbles[6] << 16)
-				| (nibbles[7] << 20);
-			embed = 0x0a == nibbles[8];
-			if (verbose > 2) {
-				printf("  %s\n", embed ? "EMBED" : "-");
-			}
+		if (!decode_frame(&decoder, count)) {
+			fprintf(stderr, "failed to decode: %s error %d, %s\n",
+				decoder.error, errno, strerror(errno));
+			__atomic_store_n(&batch->failed, true, __ATOMIC_SEQ_CST);
+			continue;
 		}
 
-		if (!ahd_decode(pixels, width, height, image, BAYER_TILE_GRBG)) {
-			usage("failed to demosaic");
-			return 0;
+		if (verbose > 2 && decoder.options.embed) {
+			printf("embed: ");
+			for (int i = 0; i < EMBED_NIBBLES; ++i) {
+				printf(" %01x", decoder.embed.nibbles[i]);
+			}
+			printf("  %s\n", decoder.embed.present ? "EMBED" : "-");
 		}
 
 		if (verbose > 0) {
 			printf("creating: %s\n", output_name);
 		}
 
-		if (options.slider) {
-			fill(image, count + 0, 10, count + 20, 20, width, height, 0x00, 0x00, 0x00);
-			fill(image, count + 5, 10, count + 10, 20, width, height, 0xff, 0xff, 0xff);
-		}
-
-		if(options.number) {
-			number(count, image, 10, 30, 4, width, height);
-		}
-
-		if(embed) {
-			const int steps_scale = 4;
-			fill(image, 10, 50, 12 + 255 * steps_scale, 60, width, height, 0x00, 0x00, 0x00);
-			fill(image, 11, 51, steps*steps_scale + 11, 59, width, height, 0xff, 0xff, 0xff);
-			number((int)steps, image, 300, 30, 4, width, height);
-			number(contrast, image, 500, 30, 4, width, height);
+		if (!image_write_png(decoder.rgb, decoder.width, decoder.height, output_name)) {
+			fprintf(stderr, "failed to write: %s\n", output_name);
+			__atomic_store_n(&batch->failed, true, __ATOMIC_SEQ_CST);
 		}
-		write_png(image, width, height, output_name);
 	}
 
-	fclose(fp);
-	return rc;
+	decode_free(&decoder);
+	return NULL;
 }
@@ -0,0 +1,133 @@
+// turn a raw frame into an annotated RGB image
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ahd_bayer.h"
+#include "decode.h"
+#include "embed.h"
+
+
+static bool fail(decoder_t *decoder, const char *operation) {
+	decoder->error = operation;
+	return false;
+}
+
+
+// fill starting at (x1, y1) to  < (x2, y2) in RGB bitmap of size width, height
+static void fill(ahd_pixel_t *image, int x1, int y1, int x2, int y2, int width, int height, uint16_t red, uint16_t green, uint16_t blue) {
+
+	for (int y = y1; y < y2 && y < height; ++y) {
+		ahd_pixel_t *pixel = &image[3 * x1 + 3 * width * y];
+		for (int x = x1; x < x2 && x < width; ++x) {
+			*pixel++ = red;
+			*pixel++ = green;
+			*pixel++ = blue;
+		}
+	}
+}
+
+
+// stamp a 4 digit number into the bitmap
+static void number(int value, ahd_pixel_t *image, int start_x, int start_y, int size, int width, int height) {
+	static const uint16_t bitmaps[] = {
+		075557, // 0
+		026227, // 1
+		025127, // 2
+		071717, // 3
+		013571, // 4
+		074616, // 5
+		034652, // 6
+		071122, // 7
+		075757, // 8
+		035311  // 9
+	};
+
+	int divisor = 1000000;
+	value %= 9999999;
+
+	fill(image, start_x, start_y, start_x + size*4*7, start_y + size*5, width, height, 0x00, 0x00, 0x00);
+
+	for (int i = 0; i < 7; ++i, divisor /= 10) {
+		int d = value / divisor;
+		uint16_t bm = bitmaps[d % 10];
+		int x_begin = start_x + 4 * size * i;
+		for (int y = 0, ys = start_y; y < 5; ++y, ys += size) {
+			for (int x = 0, xs = x_begin; x < 3; ++x, xs += size) {
+				if (0 != (040000 & bm)) {
+					fill(image, xs, ys, xs + size, ys + size, width, height, 0xff, 0xff, 0xff);
+				}
+				bm <<= 1;
+			}
+		}
+	}
+}
+
+
+bool decode_init(decoder_t *decoder, unsigned int width, unsigned int height,
+		 const decode_options_t *options) {
+	memset(decoder, 0, sizeof(*decoder));
+	decoder->width = width;
+	decoder->height = height;
+	decoder->tile = BAYER_TILE_GRBG;
+	decoder->options = *options;
+
+	decoder->bayer = malloc(width * height * sizeof(uint16_t));
+	decoder->rgb = malloc(3 * width * height * sizeof(ahd_pixel_t));
+	if (NULL == decoder->bayer || NULL == decoder->rgb) {
+		decode_free(decoder);
+		errno = ENOMEM;
+		return fail(decoder, "out of memory");
+	}
+	return true;
+}
+
+
+bool decode_frame(decoder_t *decoder, unsigned int count) {
+	const int width = decoder->width;
+	const int height = decoder->height;
+	const size_t n_pixels = width * height;
+	const decode_options_t *options = &decoder->options;
+
+	memset(&decoder->embed, 0, sizeof(decoder->embed));
+	if (options->embed) {
+		embed_decode(decoder->bayer, n_pixels, options->embed_offset, &decoder->embed);
+		embed_strip(decoder->bayer, n_pixels, options->embed_offset);
+	}
+
+	if (!ahd_decode(decoder->bayer, width, height, decoder->rgb, decoder->tile)) {
+		errno = ENOMEM;
+		return fail(decoder, "demosaic");
+	}
+
+	ahd_pixel_t *image = decoder->rgb;
+	if (options->slider) {
+		fill(image, count + 0, 10, count + 20, 20, width, height, 0x00, 0x00, 0x00);
+		fill(image, count + 5, 10, count + 10, 20, width, height, 0xff, 0xff, 0xff);
+	}
+
+	if (options->number) {
+		number(count, image, 10, 30, 4, width, height);
+	}
+
+	if (decoder->embed.present) {
+		const int steps = decoder->embed.steps;
+		const int steps_scale = 4;
+		fill(image, 10, 50, 12 + 255 * steps_scale, 60, width, height, 0x00, 0x00, 0x00);
+		fill(image, 11, 51, steps*steps_scale + 11, 59, width, height, 0xff, 0xff, 0xff);
+		number(steps, image, 300, 30, 4, width, height);
+		number(decoder->embed.contrast, image, 500, 30, 4, width, height);
+	}
+	return true;
+}
+
+
+void decode_free(decoder_t *decoder) {
+	free(decoder->bayer);
+	decoder->bayer = NULL;
+	free(decoder->rgb);
+	decoder->rgb = NULL;
+}
@@ -0,0 +1,45 @@
+// turn a raw frame into an annotated RGB image
+//
+// a decoder owns its buffers, so each thread decoding frames needs its
+// own.  Load the frame into decoder->bayer, framefile_read() does this,
+// then decode_frame() leaves the image in decoder->rgb and the
+// embedded data in decoder->embed
+
+#ifndef _DECODE_H_
+#define _DECODE_H_ 1
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ahd_bayer.h"
+#include "embed.h"
+
+typedef struct {
+	bool slider;             // frame number as a moving bar
+	bool number;             // frame number as digits
+	bool embed;              // decode, strip and show the firmware data
+	int embed_offset;
+} decode_options_t;
+
+typedef struct {
+	unsigned int width;
+	unsigned int height;
+	BayerTile tile;
+	decode_options_t options;
+	uint16_t *bayer;         // width * height, overwritten by decode_frame()
+	ahd_pixel_t *rgb;        // 3 * width * height
+	embed_t embed;           // of the last frame, present false if none
+	const char *error;       // operation that failed, errno has the reason
+} decoder_t;
+
+// all return false on failure with decoder->error and errno set
+
+bool decode_init(decoder_t *decoder, unsigned int width, unsigned int height,
+		 const decode_options_t *options);
+
+// number is drawn by the slider and number overlays
+bool decode_frame(decoder_t *decoder, unsigned int number);
+
+void decode_free(decoder_t *decoder);
+
+#endif
@@ -0,0 +1,103 @@
+// decode the data the firmware embeds in the high nibbles of a frame
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "embed.h"
+
+
+bool embed_decode(const uint16_t *pixels, size_t n_pixels, int offset, embed_t *embed) {
+	memset(embed, 0, sizeof(*embed));
+
+	if (offset < 0 || offset + EMBED_NIBBLES > n_pixels) {
+		return false;
+	}
+
+	const uint16_t *p = &pixels[offset];
+	for (int i = 0; i < EMBED_NIBBLES; ++i) {
+		embed->nibbles[i] = 0x0f & (p[i] >> 12);
+	}
+
+	const uint8_t *n = embed->nibbles;
+	embed->steps = (n[0] << 0) | (n[1] << 4);
+	embed->contrast = (n[2] << 0)
+		| (n[3] << 4)
+		| (n[4] << 8)
+		| (n[5] << 12)
+		| (n[6] << 16)
+		| (n[7] << 20);
+	embed->present = EMBED_FLAG == n[8];
+
+	// the tag is optional, frames too short for it have none
+	if (offset + EMBED_NIBBLES + EMBED_LEDS_NIBBLES <= n_pixels
+	    && EMBED_LEDS_FLAG == (0x0f & (p[EMBED_NIBBLES + 1] >> 12))) {
+		embed->leds = 0x0f & (p[EMBED_NIBBLES] >> 12);
+		embed->leds_present = true;
+	}
+	return true;
+}
+
+
+void embed_strip(uint16_t *pixels, size_t n_pixels, int offset) {
+	if (offset < 0 || offset + EMBED_NIBBLES > n_pixels) {
+		return;
+	}
+	const int count = offset + EMBED_NIBBLES + EMBED_LEDS_NIBBLES <= n_pixels
+		? EMBED_NIBBLES + EMBED_LEDS_NIBBLES : EMBED_NIBBLES;
+	for (int i = 0; i < count; ++i) {
+		pixels[offset + i] &= 0x0fff;
+	}
+}
+
+
+bool embed_tag_leds(uint16_t *pixels, size_t n_pixels, int offset, uint8_t leds) {
+	if (offset < 0 || offset + EMBED_NIBBLES + EMBED_LEDS_NIBBLES > n_pixels) {
+		return false;
+	}
+	uint16_t *p = &pixels[offset + EMBED_NIBBLES];
+	p[0] = (p[0] & 0x0fff) | ((leds & 0x0f) << 12);
+	p[1] = (p[1] & 0x0fff) | (EMBED_LEDS_FLAG << 12);
+	return true;
+}
+
+
+void focus_tracker_init(focus_tracker_t *tracker, int hold_frames) {
+	memset(tracker, 0, sizeof(*tracker));
+	tracker->hold_frames = hold_frames;
+}
+
+
+bool focus_tracker_update(focus_tracker_t *tracker, const embed_t *embed) {
+	if (!embed->present) {
+		return false;
+	}
+	++tracker->frames;
+
+	if (!tracker->have_steps) {
+		tracker->have_steps = true;
+		tracker->steps = embed->steps;
+		tracker->stable = 0;
+		return false;
+	}
+
+	if (embed->steps != tracker->steps) {
+		// a move after a hold means a new focus cycle started
+		tracker->moved = true;
+		tracker->steps = embed->steps;
+		tracker->stable = 0;
+		tracker->hold = false;
+		tracker->held = 0;
+		return false;
+	}
+
+	++tracker->stable;
+	if (tracker->hold) {
+		++tracker->held;
+	} else if (tracker->moved && tracker->stable >= tracker->hold_frames) {
+		tracker->hold = true;
+		tracker->held = 0;
+		return true;
+	}
+	return false;
+}
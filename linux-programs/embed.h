@@ -0,0 +1,66 @@
+// decode the data the firmware embeds in the high nibbles of a frame
+
+#ifndef _EMBED_H_
+#define _EMBED_H_ 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// pixel offset used by the firmware (EMBED_PIXEL in focus.c)
+#define EMBED_DEFAULT_OFFSET 8192
+
+// focus low/high, 6 reserved (contrast) and the flag
+#define EMBED_NIBBLES 9
+
+// flag nibble value when data is present
+#define EMBED_FLAG 0x0a
+
+// capture's photometric mode tags each frame with the LEDs lit for it
+// in the two nibbles after the firmware's: the LED mask, then a flag
+#define EMBED_LEDS_NIBBLES 2
+#define EMBED_LEDS_FLAG 0x05
+
+typedef struct {
+	uint8_t nibbles[EMBED_NIBBLES];
+	uint8_t steps;      // focus motor position
+	uint32_t contrast;  // 24 bit contrast value
+	bool present;       // flag nibble was EMBED_FLAG
+	uint8_t leds;       // LED mask of the frame
+	bool leds_present;  // the frame was tagged with its LED mask
+} embed_t;
+
+// read the embedded data from a frame of 16 bit little endian pixels
+// returns false if the frame is too short to contain it
+bool embed_decode(const uint16_t *pixels, size_t n_pixels, int offset, embed_t *embed);
+
+// clear the embedded nibbles so they do not disturb image processing
+void embed_strip(uint16_t *pixels, size_t n_pixels, int offset);
+
+// tag a frame with the LED mask lit for it, returns false if the frame
+// is too short to hold the tag
+bool embed_tag_leds(uint16_t *pixels, size_t n_pixels, int offset, uint8_t leds);
+
+
+// follow the focus motor through a sequence of frames
+//
+// the firmware homes the motor, sweeps it out and then holds it at
+// the best position, after which the steps value stops changing
+typedef struct {
+	int hold_frames;       // unchanged frames needed to declare a hold
+	bool moved;            // steps has changed at least once
+	bool have_steps;
+	uint8_t steps;         // last seen value
+	unsigned int stable;   // consecutive frames with unchanged steps
+	unsigned int frames;   // frames with embedded data
+	bool hold;             // motor is holding
+	unsigned int held;     // frames after the hold was declared
+} focus_tracker_t;
+
+void focus_tracker_init(focus_tracker_t *tracker, int hold_frames);
+
+// feed the embedded data of the next frame
+// returns true on the frame where the hold is first detected
+bool focus_tracker_update(focus_tracker_t *tracker, const embed_t *embed);
+
+#endif
@@ -0,0 +1,308 @@
+// fingerprint-index.c: build an index of fingerprints and search it
+//
+// fingerprints are read as lines from create-fingerprint, the first
+// field a label (the frame number) and the second the fingerprint.
+// Each fingerprint's id in the index is its line number from 0
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fingerprint.h"
+#include "fpindex.h"
+
+
+#define DEFAULT_NEAREST 5
+
+// the matches of every query are held at once
+#define MAX_NEAREST 65536
+
+typedef struct {
+	char label[32];
+	fingerprint_t fingerprint;
+} entry_t;
+
+static const char *program_name;
+static int verbose = 0;
+
+
+// print usage message and exit
+static void usage(const char *message, ...) {
+	if (NULL != message) {
+		va_list ap;
+		va_start(ap, message);
+		fprintf(stderr, "error: ");
+		vfprintf(stderr, message, ap);
+		fprintf(stderr, "\n");
+		va_end(ap);
+	}
+	fprintf(stderr,
+		"Usage: %s [options] INDEX [FILE...]\n\n"
+		"Options:\n"
+		"-h | --help          Print this message\n"
+		"-v | --verbose       Print timing\n"
+		"-b | --build         Create INDEX from the fingerprints in the files\n"
+		"                     [stdin], otherwise search it for each of them\n"
+		"-m | --substrings N  Substrings when building, 8, 16 or 32 [%d]\n"
+		"-R | --random N      Add N random fingerprints when building\n"
+		"-k | --nearest K     Print the K nearest [%d]\n"
+		"-r | --radius D      Print all within distance D instead\n"
+		"-j | --jobs N        Search threads [one per processor]\n"
+		"Each search prints the label then id:distance for each match\n"
+		"",
+		program_name, FPINDEX_DEFAULT_SUBSTRINGS, DEFAULT_NEAREST);
+	exit(EXIT_FAILURE);
+}
+
+
+static const char short_options[] = "hvbm:R:k:r:j:";
+
+static const struct option
+long_options[] = {
+	{ "help",       no_argument,       NULL, 'h' },
+	{ "verbose",    no_argument,       NULL, 'v' },
+	{ "build",      no_argument,       NULL, 'b' },
+	{ "substrings", required_argument, NULL, 'm' },
+	{ "random",     required_argument, NULL, 'R' },
+	{ "nearest",    required_argument, NULL, 'k' },
+	{ "radius",     required_argument, NULL, 'r' },
+	{ "jobs",       required_argument, NULL, 'j' },
+	{ 0, 0, 0, 0 }
+};
+
+
+static double seconds_since(const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+// append the fingerprint lines of a file to entries
+static void read_entries(FILE *f, const char *name, entry_t **entries, size_t *n, size_t *allocated) {
+	char line[1024];
+	for (unsigned long number = 1; NULL != fgets(line, sizeof(line), f); ++number) {
+		char label[32];
+		char hex[FINGERPRINT_HEX + 2];
+		if (2 != sscanf(line, "%31s %65s", label, hex)) {
+			continue;
+		}
+		if (*n == *allocated) {
+			*allocated = 0 == *allocated ? 1024 : 2 * *allocated;
+			*entries = realloc(*entries, *allocated * sizeof(entry_t));
+			if (NULL == *entries) {
+				usage("out of memory");
+			}
+		}
+		entry_t *e = &(*entries)[*n];
+		if (!fingerprint_parse(&e->fingerprint, hex)) {
+			usage("%s:%lu: invalid fingerprint '%s'", name, number, hex);
+		}
+		strcpy(e->label, label);
+		++*n;
+	}
+}
+
+
+int main(int argc, char **argv) {
+	program_name = argv[0];
+
+	bool build = false;
+	unsigned int substrings = FPINDEX_DEFAULT_SUBSTRINGS;
+	unsigned long random_count = 0;
+	unsigned int nearest = DEFAULT_NEAREST;
+	long radius = -1;
+	long jobs = 0;
+
+	for (;;) {
+		int idx = 0;
+		int c = getopt_long(argc, argv, short_options, long_options, &idx);
+
+		if (-1 == c) {
+			break;
+		}
+
+		switch (c) {
+		case 0: // getopt_long() flag
+			break;
+
+		case 'h':
+			usage(NULL);
+
+		case 'v':
+			++verbose;
+			break;
+
+		case 'b':
+			build = true;
+			break;
+
+		case 'm':
+			substrings = strtol(optarg, NULL, 0);
+			if (8 != substrings && 16 != substrings && 32 != substrings) {
+				usage("invalid substrings '%s', 8, 16 or 32", optarg);
+			}
+			break;
+
+		case 'R':
+			errno = 0;
+			random_count = strtoul(optarg, NULL, 0);
+			if (0 != errno) {
+				usage("invalid random count '%s'", optarg);
+			}
+			break;
+
+		case 'k':
+			errno = 0;
+			char *end;
+			long k = strtol(optarg, &end, 0);
+			if (0 != errno || end == optarg || '\0' != *end || k < 1 || k > MAX_NEAREST) {
+				usage("invalid nearest '%s', 1 to %d", optarg, MAX_NEAREST);
+			}
+			nearest = k;
+			break;
+
+		case 'r':
+			radius = strtol(optarg, NULL, 0);
+			if (radius < 0 || radius > FINGERPRINT_BITS) {
+				usage("invalid radius '%s', 0 to %d", optarg, FINGERPRINT_BITS);
+			}
+			break;
+
+		case 'j':
+			jobs = strtol(optarg, NULL, 0);
+			if (jobs < 1) {
+				usage("invalid jobs '%s'", optarg);
+			}
+			break;
+
+		default:
+			usage("invalid option: '%c'", c);
+		}
+	}
+
+	if (optind >= argc) {
+		usage("missing index");
+	}
+	const char *index_name = argv[optind++];
+
+	entry_t *entries = NULL;
+	size_t n_entries = 0;
+	size_t allocated = 0;
+	if (optind >= argc) {
+		read_entries(stdin, "stdin", &entries, &n_entries, &allocated);
+	}
+	for (int i = optind; i < argc; ++i) {
+		FILE *f = fopen(argv[i], "r");
+		if (NULL == f) {
+			usage("failed to open: '%s': %d, %s", argv[i], errno, strerror(errno));
+		}
+		read_entries(f, argv[i], &entries, &n_entries, &allocated);
+		fclose(f);
+	}
+
+	fpindex_t index;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (build) {
+		if (!fpindex_init(&index, substrings)) {
+			usage("index: %s error %d, %s", index.error, errno, strerror(errno));
+		}
+		for (size_t i = 0; i < n_entries; ++i) {
+			if (!fpindex_add(&index, &entries[i].fingerprint, NULL)) {
+				usage("index: %s error %d, %s", index.error, errno, strerror(errno));
+			}
+		}
+		for (unsigned long i = 0; i < random_count; ++i) {
+			fingerprint_t f;
+			for (int w = 0; w < FINGERPRINT_WORDS; ++w) {
+				f.bits[w] = (uint64_t)random() << 62 ^ (uint64_t)random() << 31 ^ random();
+			}
+			if (!fpindex_add(&index, &f, NULL)) {
+				usage("index: %s error %d, %s", index.error, errno, strerror(errno));
+			}
+		}
+		if (!fpindex_save(&index, index_name)) {
+			usage("failed to save: '%s': %s error %d, %s", index_name, index.error, errno, strerror(errno));
+		}
+		if (verbose > 0) {
+			fprintf(stderr, "%llu fingerprints indexed in %.3f s\n",
+				(unsigned long long)index.count, seconds_since(&start));
+		}
+		fpindex_free(&index);
+		free(entries);
+		return EXIT_SUCCESS;
+	}
+
+	if (!fpindex_load(&index, index_name)) {
+		usage("failed to load: '%s': %s error %d, %s", index_name, index.error, errno, strerror(errno));
+	}
+	if (verbose > 0) {
+		fprintf(stderr, "%llu fingerprints loaded in %.3f s\n",
+			(unsigned long long)index.count, seconds_since(&start));
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (radius >= 0) {
+		fpindex_match_t *matches = malloc((index.count > 0 ? index.count : 1) * sizeof(fpindex_match_t));
+		if (NULL == matches) {
+			usage("out of memory");
+		}
+		for (size_t i = 0; i < n_entries; ++i) {
+			ssize_t found = fpindex_radius(&index, &entries[i].fingerprint, radius, matches, index.count, NULL);
+			if (found < 0) {
+				usage("search: %d, %s", errno, strerror(errno));
+			}
+			printf("%s", entries[i].label);
+			for (ssize_t j = 0; j < found; ++j) {
+				printf(" %u:%u", matches[j].id, matches[j].distance);
+			}
+			printf("\n");
+		}
+		free(matches);
+	} else {
+		if (0 == jobs) {
+			jobs = sysconf(_SC_NPROCESSORS_ONLN);
+		}
+		fingerprint_t *queries = malloc((n_entries > 0 ? n_entries : 1) * sizeof(fingerprint_t));
+		fpindex_match_t *matches = malloc((n_entries > 0 ? n_entries : 1) * nearest * sizeof(fpindex_match_t));
+		unsigned int *found = malloc((n_entries > 0 ? n_entries : 1) * sizeof(unsigned int));
+		if (NULL == queries || NULL == matches || NULL == found) {
+			usage("out of memory");
+		}
+		for (size_t i = 0; i < n_entries; ++i) {
+			queries[i] = entries[i].fingerprint;
+		}
+		if (!fpindex_nearest_batch(&index, queries, n_entries, nearest, matches, found, jobs)) {
+			usage("search: %d, %s", errno, strerror(errno));
+		}
+		for (size_t i = 0; i < n_entries; ++i) {
+			printf("%s", entries[i].label);
+			for (unsigned int j = 0; j < found[i]; ++j) {
+				const fpindex_match_t *m = &matches[i * nearest + j];
+				printf(" %u:%u", m->id, m->distance);
+			}
+			printf("\n");
+		}
+		free(queries);
+		free(matches);
+		free(found);
+	}
+
+	if (verbose > 0) {
+		double seconds = seconds_since(&start);
+		fprintf(stderr, "%zu searches in %.3f s, %.3f ms each\n", n_entries, seconds,
+			0 == n_entries ? 0.0 : 1e3 * seconds / n_entries);
+	}
+	fpindex_free(&index);
+	free(entries);
+	return EXIT_SUCCESS;
+}
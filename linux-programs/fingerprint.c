@@ -0,0 +1,251 @@
+// perceptual fingerprint of a frame
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "ahd_bayer.h"
+#include "bayer_green.h"
+#include "fingerprint.h"
+
+
+// DCT basis, only the rows for the kept coefficients
+static float basis[FINGERPRINT_BLOCK][FINGERPRINT_SIZE];
+static pthread_once_t basis_once = PTHREAD_ONCE_INIT;
+
+static void basis_init(void) {
+	for (int u = 0; u < FINGERPRINT_BLOCK; ++u) {
+		for (int x = 0; x < FINGERPRINT_SIZE; ++x) {
+			basis[u][x] = cos(M_PI * (2 * x + 1) * u / (2.0 * FINGERPRINT_SIZE));
+		}
+	}
+}
+
+// first source column or row of each cell, edges[FINGERPRINT_SIZE] is n
+static void cell_edges(unsigned int n, unsigned int *edges) {
+	for (unsigned int i = 0; i <= FINGERPRINT_SIZE; ++i) {
+		edges[i] = i * n / FINGERPRINT_SIZE;
+	}
+}
+
+
+bool fingerprint_green_grid(const ahd_pixel_t *bayer, unsigned int width, unsigned int height,
+			    BayerTile tile, fingerprint_grid_t grid) {
+	unsigned int g0, g1;
+	if (!bayer_green(tile, &g0, &g1)) {
+		return false;
+	}
+
+	const unsigned int quad_width = width / 2;
+	const unsigned int quad_height = height / 2;
+	if (quad_width < FINGERPRINT_SIZE || quad_height < FINGERPRINT_SIZE) {
+		errno = EINVAL;
+		return false;
+	}
+
+	unsigned int x_edges[FINGERPRINT_SIZE + 1];
+	unsigned int y_edges[FINGERPRINT_SIZE + 1];
+	cell_edges(quad_width, x_edges);
+	cell_edges(quad_height, y_edges);
+
+	const unsigned int shift0 = PAIR_SHIFT(g0);
+	const unsigned int shift1 = PAIR_SHIFT(g1);
+	for (unsigned int cy = 0; cy < FINGERPRINT_SIZE; ++cy) {
+		uint32_t sums[FINGERPRINT_SIZE] = { 0 };
+		for (unsigned int qy = y_edges[cy]; qy < y_edges[cy + 1]; ++qy) {
+			const pixel_pair_t *row0 = (const pixel_pair_t *)&bayer[2 * qy * width];
+			const pixel_pair_t *row1 = (const pixel_pair_t *)&bayer[(2 * qy + 1) * width];
+			for (unsigned int cx = 0; cx < FINGERPRINT_SIZE; ++cx) {
+				uint32_t s = 0;
+				for (unsigned int qx = x_edges[cx]; qx < x_edges[cx + 1]; ++qx) {
+					s += ((row0[qx] >> shift0) & PIXEL_MASK) + ((row1[qx] >> shift1) & PIXEL_MASK);
+				}
+				sums[cx] += s;
+			}
+		}
+		const unsigned int rows = y_edges[cy + 1] - y_edges[cy];
+		for (unsigned int cx = 0; cx < FINGERPRINT_SIZE; ++cx) {
+			grid[cy][cx] = sums[cx] / (2.0f * rows * (x_edges[cx + 1] - x_edges[cx]));
+		}
+	}
+	return true;
+}
+
+
+bool fingerprint_green_grid_transformed(const ahd_pixel_t *bayer, unsigned int width,
+					unsigned int height, BayerTile tile,
+					const fingerprint_transform_t *transform, fingerprint_grid_t grid) {
+	unsigned int g0, g1;
+	if (!bayer_green(tile, &g0, &g1)) {
+		return false;
+	}
+
+	const unsigned int quad_width = width / 2;
+	const unsigned int quad_height = height / 2;
+	if (quad_width < FINGERPRINT_SIZE || quad_height < FINGERPRINT_SIZE) {
+		errno = EINVAL;
+		return false;
+	}
+
+	unsigned int x_edges[FINGERPRINT_SIZE + 1];
+	unsigned int y_edges[FINGERPRINT_SIZE + 1];
+	cell_edges(quad_width, x_edges);
+	cell_edges(quad_height, y_edges);
+
+	// the same quads as the untransformed grid, each quad's centre mapped
+	// into the frame, so the identity transform gives the same grid
+	const float c = cos(transform->angle);
+	const float s = sin(transform->angle);
+	const float centre_x = width / 2.0f;
+	const float centre_y = height / 2.0f;
+	const float offset_x = centre_x + transform->dx;
+	const float offset_y = centre_y + transform->dy;
+	const unsigned int shift0 = PAIR_SHIFT(g0);
+	const unsigned int shift1 = PAIR_SHIFT(g1);
+	for (unsigned int cy = 0; cy < FINGERPRINT_SIZE; ++cy) {
+		uint32_t sums[FINGERPRINT_SIZE] = { 0 };
+		for (unsigned int qy = y_edges[cy]; qy < y_edges[cy + 1]; ++qy) {
+			const float py = 2 * qy + 1 - centre_y;
+			for (unsigned int cx = 0; cx < FINGERPRINT_SIZE; ++cx) {
+				uint32_t sum = 0;
+				for (unsigned int qx = x_edges[cx]; qx < x_edges[cx + 1]; ++qx) {
+					const float px = 2 * qx + 1 - centre_x;
+					int x = floorf((c * px - s * py + offset_x) / 2);
+					int y = floorf((s * px + c * py + offset_y) / 2);
+					x = x < 0 ? 0 : x >= quad_width ? quad_width - 1 : x;
+					y = y < 0 ? 0 : y >= quad_height ? quad_height - 1 : y;
+					const pixel_pair_t *row0 = (const pixel_pair_t *)&bayer[2 * y * width];
+					const pixel_pair_t *row1 = (const pixel_pair_t *)&bayer[(2 * y + 1) * width];
+					sum += ((row0[x] >> shift0) & PIXEL_MASK) + ((row1[x] >> shift1) & PIXEL_MASK);
+				}
+				sums[cx] += sum;
+			}
+		}
+		const unsigned int rows = y_edges[cy + 1] - y_edges[cy];
+		for (unsigned int cx = 0; cx < FINGERPRINT_SIZE; ++cx) {
+			grid[cy][cx] = sums[cx] / (2.0f * rows * (x_edges[cx + 1] - x_edges[cx]));
+		}
+	}
+	return true;
+}
+
+
+bool fingerprint_rgb_grid(const ahd_pixel_t *rgb, unsigned int width, unsigned int height,
+			  fingerprint_grid_t grid) {
+	if (width < FINGERPRINT_SIZE || height < FINGERPRINT_SIZE) {
+		errno = EINVAL;
+		return false;
+	}
+
+	unsigned int x_edges[FINGERPRINT_SIZE + 1];
+	unsigned int y_edges[FINGERPRINT_SIZE + 1];
+	cell_edges(width, x_edges);
+	cell_edges(height, y_edges);
+
+	for (unsigned int cy = 0; cy < FINGERPRINT_SIZE; ++cy) {
+		uint32_t sums[FINGERPRINT_SIZE] = { 0 };
+		for (unsigned int y = y_edges[cy]; y < y_edges[cy + 1]; ++y) {
+			const ahd_pixel_t *row = &rgb[3 * y * width];
+			for (unsigned int cx = 0; cx < FINGERPRINT_SIZE; ++cx) {
+				uint32_t s = 0;
+				for (unsigned int x = x_edges[cx]; x < x_edges[cx + 1]; ++x) {
+					const ahd_pixel_t *p = &row[3 * x];
+					s += (77 * p[0] + 150 * p[1] + 29 * p[2]) >> 8;  // BT.601 luma
+				}
+				sums[cx] += s;
+			}
+		}
+		const unsigned int rows = y_edges[cy + 1] - y_edges[cy];
+		for (unsigned int cx = 0; cx < FINGERPRINT_SIZE; ++cx) {
+			grid[cy][cx] = sums[cx] / ((float)rows * (x_edges[cx + 1] - x_edges[cx]));
+		}
+	}
+	return true;
+}
+
+
+static int compare_float(const void *a, const void *b) {
+	float x = *(const float *)a;
+	float y = *(const float *)b;
+	return (x > y) - (x < y);
+}
+
+void fingerprint_from_grid(const fingerprint_grid_t grid, fingerprint_t *fingerprint) {
+	pthread_once(&basis_once, basis_init);
+
+	// rows, then columns, of the separable transform
+	float rows[FINGERPRINT_SIZE][FINGERPRINT_BLOCK];
+	for (int y = 0; y < FINGERPRINT_SIZE; ++y) {
+		for (int v = 0; v < FINGERPRINT_BLOCK; ++v) {
+			float s = 0;
+			for (int x = 0; x < FINGERPRINT_SIZE; ++x) {
+				s += grid[y][x] * basis[v][x];
+			}
+			rows[y][v] = s;
+		}
+	}
+	float coefficients[FINGERPRINT_BITS];
+	for (int u = 0; u < FINGERPRINT_BLOCK; ++u) {
+		float s[FINGERPRINT_BLOCK] = { 0 };
+		for (int y = 0; y < FINGERPRINT_SIZE; ++y) {
+			for (int v = 0; v < FINGERPRINT_BLOCK; ++v) {
+				s[v] += basis[u][y] * rows[y][v];
+			}
+		}
+		memcpy(&coefficients[u * FINGERPRINT_BLOCK], s, sizeof(s));
+	}
+
+	float sorted[FINGERPRINT_BITS];
+	memcpy(sorted, coefficients, sizeof(sorted));
+	qsort(sorted, FINGERPRINT_BITS, sizeof(float), compare_float);
+	const float median = (sorted[FINGERPRINT_BITS / 2 - 1] + sorted[FINGERPRINT_BITS / 2]) / 2;
+
+	memset(fingerprint, 0, sizeof(*fingerprint));
+	for (int i = 0; i < FINGERPRINT_BITS; ++i) {
+		if (coefficients[i] > median) {
+			fingerprint->bits[i / 64] |= 1ULL << (i % 64);
+		}
+	}
+}
+
+
+bool fingerprint_bayer(const ahd_pixel_t *bayer, unsigned int width, unsigned int height,
+		       BayerTile tile, fingerprint_t *fingerprint) {
+	fingerprint_grid_t grid;
+	if (!fingerprint_green_grid(bayer, width, height, tile, grid)) {
+		return false;
+	}
+	fingerprint_from_grid(grid, fingerprint);
+	return true;
+}
+
+
+void fingerprint_format(const fingerprint_t *fingerprint, char *hex) {
+	for (int i = 0; i < FINGERPRINT_WORDS; ++i) {
+		sprintf(&hex[16 * i], "%016llx", (unsigned long long)fingerprint->bits[i]);
+	}
+}
+
+bool fingerprint_parse(fingerprint_t *fingerprint, const char *hex) {
+	if (FINGERPRINT_HEX != strlen(hex)) {
+		return false;
+	}
+	for (int i = 0; i < FINGERPRINT_WORDS; ++i) {
+		char word[17];
+		memcpy(word, &hex[16 * i], 16);
+		word[16] = '\0';
+		for (int j = 0; j < 16; ++j) {
+			if (!isxdigit((unsigned char)word[j])) {
+				return false;
+			}
+		}
+		fingerprint->bits[i] = strtoull(word, NULL, 16);
+	}
+	return true;
+}
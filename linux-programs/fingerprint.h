@@ -0,0 +1,81 @@
+// perceptual fingerprint of a frame
+//
+// the image is reduced to a FINGERPRINT_SIZE square grid of cell means,
+// transformed with a 2-D DCT and the lowest FINGERPRINT_BLOCK square of
+// coefficients kept.  Each bit is set when its coefficient is above the
+// median of the block, so the fingerprint does not change with exposure
+// or LED brightness and small amounts of noise move only a few bits.
+// Compare fingerprints by Hamming distance.
+//
+// raw frames are reduced from their green sites alone, so no demosaic
+// is needed.  The embedded firmware data in the high nibbles is ignored
+
+#ifndef _FINGERPRINT_H_
+#define _FINGERPRINT_H_ 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ahd_bayer.h"
+
+#define FINGERPRINT_SIZE  64
+#define FINGERPRINT_BLOCK 16
+#define FINGERPRINT_BITS  (FINGERPRINT_BLOCK * FINGERPRINT_BLOCK)
+#define FINGERPRINT_WORDS (FINGERPRINT_BITS / 64)
+
+// hex digits, without the terminating '\0'
+#define FINGERPRINT_HEX   (FINGERPRINT_BITS / 4)
+
+typedef struct {
+	uint64_t bits[FINGERPRINT_WORDS];
+} fingerprint_t;
+
+typedef float fingerprint_grid_t[FINGERPRINT_SIZE][FINGERPRINT_SIZE];
+
+// where a frame lies relative to a reference, from registration.h: the
+// reference point p is at R(angle) * (p - centre) + centre + (dx, dy) in
+// the frame, in raw pixels about the centre of the frame
+typedef struct {
+	double dx;
+	double dy;
+	double angle;            // radians
+} fingerprint_transform_t;
+
+// mean of the green sites in each cell of a width * height Bayer frame,
+// false for the interlaced tiles or a frame too small for the grid
+bool fingerprint_green_grid(const ahd_pixel_t *bayer, unsigned int width, unsigned int height,
+			    BayerTile tile, fingerprint_grid_t grid);
+
+// the grid of the reference area, sampled through the transform from
+// the nearest quad, positions outside the frame take the edge
+bool fingerprint_green_grid_transformed(const ahd_pixel_t *bayer, unsigned int width,
+					unsigned int height, BayerTile tile,
+					const fingerprint_transform_t *transform, fingerprint_grid_t grid);
+
+// mean luma in each cell of width * height R G B pixels from ahd_decode()
+bool fingerprint_rgb_grid(const ahd_pixel_t *rgb, unsigned int width, unsigned int height,
+			  fingerprint_grid_t grid);
+
+void fingerprint_from_grid(const fingerprint_grid_t grid, fingerprint_t *fingerprint);
+
+// the two steps together
+bool fingerprint_bayer(const ahd_pixel_t *bayer, unsigned int width, unsigned int height,
+		       BayerTile tile, fingerprint_t *fingerprint);
+
+// number of differing bits
+static inline unsigned int fingerprint_distance(const fingerprint_t *a, const fingerprint_t *b) {
+	unsigned int d = 0;
+	for (int i = 0; i < FINGERPRINT_WORDS; ++i) {
+		d += __builtin_popcountll(a->bits[i] ^ b->bits[i]);
+	}
+	return d;
+}
+
+// hex is FINGERPRINT_HEX + 1 bytes
+void fingerprint_format(const fingerprint_t *fingerprint, char *hex);
+
+// false unless hex is exactly FINGERPRINT_HEX digits
+bool fingerprint_parse(fingerprint_t *fingerprint, const char *hex);
+
+#endif
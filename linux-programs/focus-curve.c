@@ -0,0 +1,449 @@
+// focus-curve.c: score the sharpness of every frame of a capture from
+// the raw green sites and pick the best focused
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "physicalhasher.h"
+
+
+#define FRAME_WIDTH  1920
+#define FRAME_HEIGHT 1080
+
+#define MAX_JOBS 64
+#define MAX_ROIS 16
+
+// one capture file, frames are numbered on from the previous files
+typedef struct {
+	framefile_t file;
+	uint64_t first;          // number of its first frame
+} input_t;
+
+// the scores of one frame
+typedef struct {
+	int steps;               // -1 if no embedded data
+	sharpness_t roi[MAX_ROIS];
+} score_t;
+
+// frames of all the inputs shared out between the threads
+typedef struct {
+	input_t *inputs;
+	int n_inputs;
+	uint64_t total;          // frames to score
+	uint64_t next;           // next frame to take, atomic
+	unsigned int embed_offset;
+	sharpness_roi_t rois[MAX_ROIS];
+	int n_rois;
+	unsigned int first_row;  // rows the regions cover, [first_row, last_row)
+	unsigned int last_row;
+	score_t *scores;         // total
+	bool failed;
+} batch_t;
+
+// global variables
+static const char *program_name;
+static int verbose = 0; // incremented by --verbose / -v
+
+// prototypes
+static bool add_input(void *context, char *input_file);
+static void *score_frames(void *arg);
+
+
+// print usage message and exit
+static void usage(const char *message, ...) {
+	if (NULL != message) {
+		va_list ap;
+		va_start(ap, message);
+		fprintf(stderr, "error: ");
+		vfprintf(stderr, message, ap);
+		fprintf(stderr, "\n");
+		va_end(ap);
+	}
+	fprintf(stderr,
+		"Usage: %s [options] FILE...\n\n"
+		"Options:\n"
+		"-h | --help          Print this message\n"
+		"-v | --verbose       Print the rate\n"
+		"-r | --roi X,Y,W,H   Region to score, in pixels, repeat for more [whole frame]\n"
+		"-m | --metric M      tenengrad, laplacian or brenner to rank by [tenengrad]\n"
+		"-b | --best N        Best frames to list for each region [1]\n"
+		"-q | --quiet         Only list the best frames\n"
+		"-e | --embed N       Embedded data pixel offset [%d]\n"
+		"-c | --count N       Limit number of frames [no-limit]\n"
+		"-j | --jobs N        Frames to score at once [one per processor]\n"
+		"Inputs are capture files or segment manifests, frames are numbered\n"
+		"on through the inputs in command line order.  Each frame is a line of\n"
+		"frame, steps and the tenengrad, laplacian and brenner scores of each\n"
+		"region, then the best of each region are lines of\n"
+		"best, region, rank, frame, steps and score\n"
+		"",
+		program_name, EMBED_DEFAULT_OFFSET);
+	exit(EXIT_FAILURE);
+}
+
+
+static const char short_options[] = "hvr:m:b:qe:c:j:";
+
+static const struct option
+long_options[] = {
+	{ "help",       no_argument,       NULL, 'h' },
+	{ "verbose",    no_argument,       NULL, 'v' },
+	{ "roi",        required_argument, NULL, 'r' },
+	{ "metric",     required_argument, NULL, 'm' },
+	{ "best",       required_argument, NULL, 'b' },
+	{ "quiet",      no_argument,       NULL, 'q' },
+	{ "embed",      required_argument, NULL, 'e' },
+	{ "count",      required_argument, NULL, 'c' },
+	{ "jobs",       required_argument, NULL, 'j' },
+	{ 0, 0, 0, 0 }
+};
+
+
+static unsigned long number(const char *name, const char *text) {
+	errno = 0;
+	char *end;
+	unsigned long n = strtoul(text, &end, 0);
+	if (0 != errno || end == text || '\0' != *end) {
+		usage("invalid %s '%s'", name, text);
+	}
+	return n;
+}
+
+
+static sharpness_roi_t parse_roi(const char *text) {
+	sharpness_roi_t roi;
+	int n = 0;
+	if (4 != sscanf(text, "%u,%u,%u,%u%n", &roi.x, &roi.y, &roi.width, &roi.height, &n)
+	    || '\0' != text[n]) {
+		usage("invalid region '%s', X,Y,W,H", text);
+	}
+	if (roi.x >= FRAME_WIDTH || roi.y >= FRAME_HEIGHT
+	    || roi.width < 6 || roi.height < 6
+	    || roi.width > FRAME_WIDTH - roi.x || roi.height > FRAME_HEIGHT - roi.y) {
+		usage("region '%s' is not at least 6x6 inside %dx%d", text, FRAME_WIDTH, FRAME_HEIGHT);
+	}
+	return roi;
+}
+
+
+// for sorting frame numbers by descending score
+static const score_t *sort_scores;
+static int sort_roi;
+static sharpness_metric_t sort_metric;
+
+// ties go to the earlier frame, so the order does not depend on qsort()
+static int by_score(const void *a, const void *b) {
+	const uint64_t fa = *(const uint64_t *)a;
+	const uint64_t fb = *(const uint64_t *)b;
+	const double sa = sort_scores[fa].roi[sort_roi].value[sort_metric];
+	const double sb = sort_scores[fb].roi[sort_roi].value[sort_metric];
+	if (sa != sb) {
+		return sa < sb ? 1 : -1;
+	}
+	return (fa > fb) - (fa < fb);
+}
+
+
+int main(int argc, char **argv) {
+	program_name = argv[0];
+
+	batch_t batch = {
+		.embed_offset = EMBED_DEFAULT_OFFSET,
+	};
+	sharpness_metric_t metric = SHARPNESS_TENENGRAD;
+	uint64_t best = 1;
+	bool quiet = false;
+	uint64_t frame_count = 0;
+	unsigned int jobs = 0;
+
+	for (;;) {
+		int idx = 0;
+		int c = getopt_long(argc, argv, short_options, long_options, &idx);
+
+		if (-1 == c) {
+			break;
+		}
+
+		switch (c) {
+		case 0: // getopt_long() flag
+			break;
+
+		case 'h':
+			usage(NULL);
+
+		case 'v':
+			++verbose;
+			break;
+
+		case 'r':
+			if (batch.n_rois >= MAX_ROIS) {
+				usage("too many regions, at most %d", MAX_ROIS);
+			}
+			batch.rois[batch.n_rois++] = parse_roi(optarg);
+			break;
+
+		case 'm':
+			if (!sharpness_metric_parse(optarg, &metric)) {
+				usage("invalid metric '%s'", optarg);
+			}
+			break;
+
+		case 'b':
+			best = number("best", optarg);
+			break;
+
+		case 'q':
+			quiet = true;
+			break;
+
+		case 'e':
+			batch.embed_offset = number("embed offset", optarg);
+			break;
+
+		case 'c':
+			frame_count = number("count", optarg);
+			break;
+
+		case 'j':
+			jobs = number("jobs", optarg);
+			if (jobs < 1 || jobs > MAX_JOBS) {
+				usage("invalid jobs '%s', 1 to %d", optarg, MAX_JOBS);
+			}
+			break;
+
+		default:
+			usage("invalid option: '%c'", c);
+		}
+	}
+
+	if (optind >= argc) {
+		usage("missing arguments");
+	}
+
+	if (0 == batch.n_rois) {
+		batch.rois[0] = (sharpness_roi_t){ 0, 0, FRAME_WIDTH, FRAME_HEIGHT };
+		batch.n_rois = 1;
+	}
+	// only the rows of whole quads under the regions are read
+	batch.first_row = FRAME_HEIGHT;
+	for (int i = 0; i < batch.n_rois; ++i) {
+		const sharpness_roi_t *roi = &batch.rois[i];
+		const unsigned int first = roi->y & ~1u;
+		const unsigned int last = (roi->y + roi->height + 1) & ~1u;
+		batch.first_row = first < batch.first_row ? first : batch.first_row;
+		batch.last_row = last > batch.last_row ? last : batch.last_row;
+	}
+	if (batch.last_row > FRAME_HEIGHT) {
+		batch.last_row = FRAME_HEIGHT;
+	}
+
+	for (int i = optind; i < argc; ++i) {
+		if (!framefile_is_manifest(argv[i])) {
+			add_input(&batch, argv[i]);
+		} else if (!framefile_manifest(argv[i], add_input, &batch)) {
+			usage("failed to read manifest: '%s': %d, %s", argv[i], errno, strerror(errno));
+		}
+	}
+
+	// every frame's number is known before any are scored
+	uint64_t total = 0;
+	for (int i = 0; i < batch.n_inputs; ++i) {
+		batch.inputs[i].first = total;
+		total += batch.inputs[i].file.frames;
+	}
+	batch.total = (0 != frame_count && frame_count < total) ? frame_count : total;
+	batch.scores = calloc(batch.total ? batch.total : 1, sizeof(score_t));
+	if (NULL == batch.scores) {
+		usage("failed to allocate scores for %llu frames", (unsigned long long)batch.total);
+	}
+
+	if (0 == jobs) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		jobs = n < 1 ? 1 : n > MAX_JOBS ? MAX_JOBS : n;
+	}
+	if (jobs > batch.total) {
+		jobs = 0 == batch.total ? 1 : batch.total;
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pthread_t threads[MAX_JOBS];
+	unsigned int started = 0;
+	for (; started < jobs; ++started) {
+		int rc = pthread_create(&threads[started], NULL, score_frames, &batch);
+		if (0 != rc) {
+			fprintf(stderr, "pthread_create error %d, %s\n", rc, strerror(rc));
+			batch.failed = true;
+			break;
+		}
+	}
+	for (unsigned int i = 0; i < started; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	if (batch.failed) {
+		return EXIT_FAILURE;
+	}
+
+	if (verbose > 0) {
+		struct timespec end;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		fprintf(stderr, "%llu frames from %d inputs on %u threads in %.3f s, %.0f frames/s\n",
+			(unsigned long long)batch.total, batch.n_inputs, jobs, seconds,
+			0 == seconds ? 0.0 : batch.total / seconds);
+	}
+
+	if (!quiet) {
+		for (uint64_t i = 0; i < batch.total; ++i) {
+			const score_t *score = &batch.scores[i];
+			printf("%llu %d", (unsigned long long)i, score->steps);
+			for (int r = 0; r < batch.n_rois; ++r) {
+				for (int m = 0; m < SHARPNESS_METRICS; ++m) {
+					printf(" %.1f", score->roi[r].value[m]);
+				}
+			}
+			printf("\n");
+		}
+	}
+
+	if (best > batch.total) {
+		best = batch.total;
+	}
+	uint64_t *order = malloc((batch.total ? batch.total : 1) * sizeof(uint64_t));
+	if (NULL == order) {
+		usage("failed to allocate ranking for %llu frames", (unsigned long long)batch.total);
+	}
+	sort_scores = batch.scores;
+	sort_metric = metric;
+	for (int r = 0; r < batch.n_rois && best > 0; ++r) {
+		for (uint64_t i = 0; i < batch.total; ++i) {
+			order[i] = i;
+		}
+		sort_roi = r;
+		qsort(order, batch.total, sizeof(uint64_t), by_score);
+		for (uint64_t i = 0; i < best; ++i) {
+			const score_t *score = &batch.scores[order[i]];
+			printf("best %d %llu %llu %d %.1f\n", r, (unsigned long long)i,
+			       (unsigned long long)order[i], score->steps, score->roi[r].value[metric]);
+		}
+	}
+	free(order);
+
+	for (int i = 0; i < batch.n_inputs; ++i) {
+		framefile_close(&batch.inputs[i].file);
+	}
+	free(batch.inputs);
+	free(batch.scores);
+
+	return EXIT_SUCCESS;
+}
+
+
+// the inputs and their names are kept until exit
+static bool add_input(void *context, char *input_file) {
+	batch_t *batch = context;
+	input_t *inputs = realloc(batch->inputs, (batch->n_inputs + 1) * sizeof(input_t));
+	if (NULL == inputs) {
+		usage("failed to allocate input: '%s'", input_file);
+	}
+	batch->inputs = inputs;
+
+	framefile_t *file = &inputs[batch->n_inputs].file;
+	if (!framefile_open(file, input_file, FRAME_WIDTH, FRAME_HEIGHT)) {
+		usage("failed to open input file: '%s': %s error %d, %s",
+		      input_file, file->error, errno, strerror(errno));
+	}
+	++batch->n_inputs;
+
+	if (verbose > 1) {
+		fprintf(stderr, "opened input file: '%s' %llu frames\n",
+			input_file, (unsigned long long)file->frames);
+	}
+	return true;
+}
+
+
+// the input holding a frame number
+static input_t *find_input(const batch_t *batch, uint64_t n) {
+	int low = 0;
+	int high = batch->n_inputs - 1;
+	while (low < high) {
+		int middle = (low + high + 1) / 2;
+		if (batch->inputs[middle].first <= n) {
+			low = middle;
+		} else {
+			high = middle - 1;
+		}
+	}
+	return &batch->inputs[low];
+}
+
+
+// only the embedded data and the rows under the regions are read
+static bool read_frame(const batch_t *batch, framefile_t *file, uint64_t index, uint16_t *bayer,
+		       embed_t *embed) {
+	memset(embed, 0, sizeof(*embed));
+	if (batch->embed_offset + EMBED_NIBBLES <= FRAME_WIDTH * FRAME_HEIGHT) {
+		uint16_t nibbles[EMBED_NIBBLES];
+		if (!framefile_read_pixels(file, index, batch->embed_offset, EMBED_NIBBLES, nibbles)) {
+			return false;
+		}
+		embed_decode(nibbles, EMBED_NIBBLES, 0, embed);
+	}
+	const size_t first = (size_t)batch->first_row * FRAME_WIDTH;
+	const size_t count = (size_t)(batch->last_row - batch->first_row) * FRAME_WIDTH;
+	return framefile_read_pixels(file, index, first, count, bayer + first);
+}
+
+
+static void *score_frames(void *arg) {
+	batch_t *batch = arg;
+
+	uint16_t *bayer = malloc(FRAME_WIDTH * FRAME_HEIGHT * sizeof(uint16_t));
+	if (NULL == bayer) {
+		fprintf(stderr, "failed to allocate frame buffer\n");
+		batch->failed = true;
+		return NULL;
+	}
+
+	for (;;) {
+		uint64_t n = __atomic_fetch_add(&batch->next, 1, __ATOMIC_SEQ_CST);
+		if (n >= batch->total) {
+			break;
+		}
+		input_t *input = find_input(batch, n);
+		framefile_t *file = &input->file;
+		embed_t embed;
+		if (!read_frame(batch, file, n - input->first, bayer, &embed)) {
+			fprintf(stderr, "failed to read frame %llu of '%s': %s error %d, %s\n",
+				(unsigned long long)(n - input->first), file->name,
+				file->error, errno, strerror(errno));
+			batch->failed = true;
+			continue;
+		}
+
+		score_t *score = &batch->scores[n];
+		score->steps = embed.present ? embed.steps : -1;
+		for (int r = 0; r < batch->n_rois; ++r) {
+			if (!sharpness_measure(bayer, FRAME_WIDTH, FRAME_HEIGHT, BAYER_TILE_GRBG,
+					       &batch->rois[r], &score->roi[r])) {
+				fprintf(stderr, "failed to score frame %llu region %d: error %d, %s\n",
+					(unsigned long long)n, r, errno, strerror(errno));
+				batch->failed = true;
+			}
+		}
+	}
+
+	free(bayer);
+	return NULL;
+}
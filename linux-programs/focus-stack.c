@@ -0,0 +1,309 @@
+// focus-stack.c: merge the frames of a focus sweep into one image that
+// is sharp across the whole field
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "physicalhasher.h"
+
+
+#define FRAME_WIDTH  1920
+#define FRAME_HEIGHT 1080
+
+typedef struct {
+	focus_stack_t stack;
+	uint16_t *bayer;
+	int embed_offset;
+	uint64_t count;          // frames read
+	uint64_t limit;          // 0 => all
+} run_t;
+
+static const char *program_name;
+static int verbose = 0; // incremented by --verbose / -v
+
+
+// print usage message and exit
+static void usage(const char *message, ...) {
+	if (NULL != message) {
+		va_list ap;
+		va_start(ap, message);
+		fprintf(stderr, "error: ");
+		vfprintf(stderr, message, ap);
+		fprintf(stderr, "\n");
+		va_end(ap);
+	}
+	fprintf(stderr,
+		"Usage: %s [options] FILE...\n\n"
+		"Options:\n"
+		"-h | --help          Print this message\n"
+		"-v | --verbose       Print each slice and the rate\n"
+		"-o | --output P      Prefix of the files written [stack]\n"
+		"-d | --depth         Also write the depth map as P-depth.png\n"
+		"-r | --raw           Also write the merged raw frame as P.data\n"
+		"-e | --embed N       Embedded data pixel offset [%d]\n"
+		"-w | --window R      Sharpness window radius in quads [%d]\n"
+		"-c | --count N       Limit number of frames [no-limit]\n"
+		"-j | --jobs N        Threads [one per processor]\n"
+		"Inputs are capture files or segment manifests of a sweep, the image\n"
+		"is written to P.png\n"
+		"",
+		program_name, EMBED_DEFAULT_OFFSET, FOCUS_STACK_DEFAULT_RADIUS);
+	exit(EXIT_FAILURE);
+}
+
+
+static const char short_options[] = "hvo:dre:w:c:j:";
+
+static const struct option
+long_options[] = {
+	{ "help",       no_argument,       NULL, 'h' },
+	{ "verbose",    no_argument,       NULL, 'v' },
+	{ "output",     required_argument, NULL, 'o' },
+	{ "depth",      no_argument,       NULL, 'd' },
+	{ "raw",        no_argument,       NULL, 'r' },
+	{ "embed",      required_argument, NULL, 'e' },
+	{ "window",     required_argument, NULL, 'w' },
+	{ "count",      required_argument, NULL, 'c' },
+	{ "jobs",       required_argument, NULL, 'j' },
+	{ 0, 0, 0, 0 }
+};
+
+
+static unsigned long number(const char *name, const char *text) {
+	errno = 0;
+	char *end;
+	unsigned long n = strtoul(text, &end, 0);
+	if (0 != errno || end == text || '\0' != *end) {
+		usage("invalid %s '%s'", name, text);
+	}
+	return n;
+}
+
+
+// stream the frames of one capture file into the stack
+static bool add_file(void *context, char *name) {
+	run_t *run = context;
+	framefile_t file;
+	if (!framefile_open(&file, name, FRAME_WIDTH, FRAME_HEIGHT)) {
+		usage("failed to open input file: '%s': %s error %d, %s",
+		      name, file.error, errno, strerror(errno));
+	}
+	if (verbose > 0) {
+		fprintf(stderr, "%s: %llu frames\n", name, (unsigned long long)file.frames);
+	}
+
+	const size_t pixels = FRAME_WIDTH * FRAME_HEIGHT;
+	for (uint64_t i = 0; i < file.frames && (0 == run->limit || run->count < run->limit); ++i) {
+		if (!framefile_read(&file, i, run->bayer)) {
+			usage("failed to read frame %llu of '%s': %s error %d, %s",
+			      (unsigned long long)i, name, file.error, errno, strerror(errno));
+		}
+		embed_t embed;
+		embed_decode(run->bayer, pixels, run->embed_offset, &embed);
+		embed_strip(run->bayer, pixels, run->embed_offset);
+
+		const int step = embed.present ? embed.steps : FOCUS_STACK_NO_STEP;
+		const unsigned int slices = run->stack.slices;
+		if (!focus_stack_add(&run->stack, run->bayer, step)) {
+			usage("failed to stack: %s error %d, %s", run->stack.error, errno, strerror(errno));
+		}
+		if (verbose > 1 && run->stack.slices != slices) {
+			fprintf(stderr, "slice %u complete\n", run->stack.slices);
+		}
+		++run->count;
+	}
+	framefile_close(&file);
+	free(name);
+	return true;
+}
+
+
+// the depth map as grey levels, nearest steps darkest
+static bool write_depth(const focus_stack_t *stack, const char *path) {
+	const unsigned int width = stack->width / 2;
+	const unsigned int height = stack->height / 2;
+	const size_t quads = (size_t)width * height;
+	int lowest = INT16_MAX;
+	int highest = FOCUS_STACK_NO_STEP;
+	for (size_t i = 0; i < quads; ++i) {
+		const int step = stack->depth[i];
+		if (FOCUS_STACK_NO_STEP != step) {
+			lowest = step < lowest ? step : lowest;
+			highest = step > highest ? step : highest;
+		}
+	}
+	ahd_pixel_t *image = malloc(3 * quads * sizeof(ahd_pixel_t));
+	if (NULL == image) {
+		return false;
+	}
+	const int range = highest > lowest ? highest - lowest : 1;
+	for (size_t i = 0; i < quads; ++i) {
+		const int step = stack->depth[i];
+		const ahd_pixel_t level = FOCUS_STACK_NO_STEP == step ? 0 : (step - lowest) * 4095 / range;
+		image[3 * i] = image[3 * i + 1] = image[3 * i + 2] = level;
+	}
+	const bool rc = image_write_png(image, width, height, path);
+	free(image);
+	return rc;
+}
+
+
+int main(int argc, char **argv) {
+	program_name = argv[0];
+
+	run_t run = {
+		.embed_offset = EMBED_DEFAULT_OFFSET,
+	};
+	const char *prefix = "stack";
+	bool depth = false;
+	bool raw = false;
+	unsigned int radius = FOCUS_STACK_DEFAULT_RADIUS;
+	unsigned int jobs = 0;
+
+	for (;;) {
+		int idx = 0;
+		int c = getopt_long(argc, argv, short_options, long_options, &idx);
+
+		if (-1 == c) {
+			break;
+		}
+
+		switch (c) {
+		case 0: // getopt_long() flag
+			break;
+
+		case 'h':
+			usage(NULL);
+
+		case 'v':
+			++verbose;
+			break;
+
+		case 'o':
+			if (strlen(optarg) < 1) {
+				usage("missing output prefix");
+			}
+			prefix = optarg;
+			break;
+
+		case 'd':
+			depth = true;
+			break;
+
+		case 'r':
+			raw = true;
+			break;
+
+		case 'e':
+			run.embed_offset = number("embed offset", optarg);
+			break;
+
+		case 'w':
+			radius = number("window", optarg);
+			break;
+
+		case 'c':
+			run.limit = number("count", optarg);
+			break;
+
+		case 'j':
+			jobs = number("jobs", optarg);
+			if (jobs < 1 || jobs > FOCUS_STACK_MAX_THREADS) {
+				usage("invalid jobs '%s', 1 to %d", optarg, FOCUS_STACK_MAX_THREADS);
+			}
+			break;
+
+		default:
+			usage("invalid option: '%c'", c);
+		}
+	}
+
+	if (optind >= argc) {
+		usage("missing arguments");
+	}
+
+	if (0 == jobs) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		jobs = n < 1 ? 1 : n > FOCUS_STACK_MAX_THREADS ? FOCUS_STACK_MAX_THREADS : n;
+	}
+	if (!focus_stack_init(&run.stack, FRAME_WIDTH, FRAME_HEIGHT, BAYER_TILE_GRBG, radius, jobs)) {
+		usage("failed to create stack: %s error %d, %s", run.stack.error, errno, strerror(errno));
+	}
+	run.bayer = malloc(FRAME_WIDTH * FRAME_HEIGHT * sizeof(uint16_t));
+	if (NULL == run.bayer) {
+		usage("failed to allocate frame buffer");
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (int i = optind; i < argc; ++i) {
+		if (!framefile_is_manifest(argv[i])) {
+			char *name = strdup(argv[i]);
+			if (NULL == name) {
+				usage("failed to allocate input: '%s'", argv[i]);
+			}
+			add_file(&run, name);
+		} else if (!framefile_manifest(argv[i], add_file, &run)) {
+			usage("failed to read manifest: '%s': %d, %s", argv[i], errno, strerror(errno));
+		}
+	}
+	if (!focus_stack_finish(&run.stack)) {
+		usage("failed to stack: %s error %d, %s", run.stack.error, errno, strerror(errno));
+	}
+
+	if (verbose > 0) {
+		struct timespec end;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		fprintf(stderr, "%llu frames in %u slices in %.3f s, %.0f frames/s\n",
+			(unsigned long long)run.count, run.stack.slices, seconds,
+			0 == seconds ? 0.0 : run.count / seconds);
+	}
+
+	char name[256];
+	if (raw) {
+		snprintf(name, sizeof(name), "%s.data", prefix);
+		FILE *f = fopen(name, "w");
+		if (NULL == f
+		    || FRAME_WIDTH * FRAME_HEIGHT != fwrite(run.stack.result, sizeof(uint16_t),
+							   FRAME_WIDTH * FRAME_HEIGHT, f)
+		    || 0 != fclose(f)) {
+			usage("failed to write: '%s': %d, %s", name, errno, strerror(errno));
+		}
+	}
+
+	if (depth) {
+		snprintf(name, sizeof(name), "%s-depth.png", prefix);
+		if (!write_depth(&run.stack, name)) {
+			usage("failed to write: '%s'", name);
+		}
+	}
+
+	decode_options_t options = { 0 };
+	decoder_t decoder;
+	if (!decode_init(&decoder, FRAME_WIDTH, FRAME_HEIGHT, &options)) {
+		usage("failed to create decoder: %s error %d, %s", decoder.error, errno, strerror(errno));
+	}
+	memcpy(decoder.bayer, run.stack.result, FRAME_WIDTH * FRAME_HEIGHT * sizeof(uint16_t));
+	if (!decode_frame(&decoder, 0)) {
+		usage("failed to decode: %s error %d, %s", decoder.error, errno, strerror(errno));
+	}
+	snprintf(name, sizeof(name), "%s.png", prefix);
+	if (!image_write_png(decoder.rgb, FRAME_WIDTH, FRAME_HEIGHT, name)) {
+		usage("failed to write: '%s'", name);
+	}
+
+	decode_free(&decoder);
+	focus_stack_free(&run.stack);
+	free(run.bayer);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,249 @@
+// focus stacking of sweep frames
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "ahd_bayer.h"
+#include "bayer_green.h"
+#include "focus_stack.h"
+
+
+// one thread's rows of quads, [first, last)
+typedef struct {
+	focus_stack_t *stack;
+	unsigned int first;
+	unsigned int last;
+	float *columns;              // quad width, for the window sums
+} band_t;
+
+static bool fail(focus_stack_t *stack, const char *operation) {
+	stack->error = operation;
+	return false;
+}
+
+
+bool focus_stack_init(focus_stack_t *stack, unsigned int width, unsigned int height, BayerTile tile,
+		      unsigned int radius, unsigned int threads) {
+	memset(stack, 0, sizeof(*stack));
+	stack->step = FOCUS_STACK_NO_STEP;
+
+	unsigned int g0, g1;
+	if (!bayer_green(tile, &g0, &g1)) {
+		return fail(stack, "tile");
+	}
+	if (0 != width % 2 || 0 != height % 2 || width < 4 || height < 4
+	    || threads < 1 || threads > FOCUS_STACK_MAX_THREADS) {
+		errno = EINVAL;
+		return fail(stack, "size");
+	}
+	stack->width = width;
+	stack->height = height;
+	stack->green0 = g0;
+	stack->green1 = g1;
+	stack->radius = radius;
+	stack->threads = threads;
+
+	const size_t pixels = (size_t)width * height;
+	const size_t quads = pixels / 4;
+	stack->sum = calloc(pixels, sizeof(uint32_t));
+	stack->green = malloc(quads * sizeof(float));
+	stack->energy = malloc(quads * sizeof(float));
+	stack->best = malloc(quads * sizeof(float));
+	stack->result = calloc(pixels, sizeof(uint16_t));
+	stack->depth = malloc(quads * sizeof(int16_t));
+	if (NULL == stack->sum || NULL == stack->green || NULL == stack->energy
+	    || NULL == stack->best || NULL == stack->result || NULL == stack->depth) {
+		focus_stack_free(stack);
+		errno = ENOMEM;
+		return fail(stack, "malloc");
+	}
+	for (size_t i = 0; i < quads; ++i) {
+		stack->best[i] = -1;
+		stack->depth[i] = FOCUS_STACK_NO_STEP;
+	}
+	return true;
+}
+
+
+// the slice's green quad image
+static void *green_band(void *arg) {
+	band_t *band = arg;
+	focus_stack_t *stack = band->stack;
+	const unsigned int width = stack->width;
+	const unsigned int quad_width = width / 2;
+	const float scale = 1.0f / (2 * stack->frames);
+	for (unsigned int qy = band->first; qy < band->last; ++qy) {
+		const uint32_t *row0 = &stack->sum[2 * qy * width];
+		const uint32_t *row1 = &stack->sum[(2 * qy + 1) * width];
+		float *green = &stack->green[qy * quad_width];
+		for (unsigned int qx = 0; qx < quad_width; ++qx) {
+			green[qx] = (row0[2 * qx + stack->green0] + row1[2 * qx + stack->green1]) * scale;
+		}
+	}
+	return NULL;
+}
+
+// the squared Laplacian, a pass of its own as it needs the green of
+// the rows either side of the band
+static void *energy_band(void *arg) {
+	band_t *band = arg;
+	focus_stack_t *stack = band->stack;
+	const unsigned int quad_width = stack->width / 2;
+	const unsigned int quad_height = stack->height / 2;
+	for (unsigned int qy = band->first; qy < band->last; ++qy) {
+		const float *above = &stack->green[(qy > 0 ? qy - 1 : qy + 1) * quad_width];
+		const float *row = &stack->green[qy * quad_width];
+		const float *below = &stack->green[(qy + 1 < quad_height ? qy + 1 : qy - 1) * quad_width];
+		float *energy = &stack->energy[qy * quad_width];
+		for (unsigned int qx = 0; qx < quad_width; ++qx) {
+			// edges reflect
+			const unsigned int left = qx > 0 ? qx - 1 : qx + 1;
+			const unsigned int right = qx + 1 < quad_width ? qx + 1 : qx - 1;
+			const float l = above[qx] + below[qx] + row[left] + row[right] - 4 * row[qx];
+			energy[qx] = l * l;
+		}
+	}
+	return NULL;
+}
+
+// the window sum of the energy decides which quads are taken
+static void *merge_band(void *arg) {
+	band_t *band = arg;
+	focus_stack_t *stack = band->stack;
+	const unsigned int width = stack->width;
+	const int quad_width = width / 2;
+	const int quad_height = stack->height / 2;
+	const int radius = stack->radius;
+	const uint32_t frames = stack->frames;
+	float *columns = band->columns;
+	for (int qy = band->first; qy < band->last; ++qy) {
+		memset(columns, 0, quad_width * sizeof(float));
+		const int top = qy - radius < 0 ? 0 : qy - radius;
+		const int bottom = qy + radius >= quad_height ? quad_height - 1 : qy + radius;
+		for (int y = top; y <= bottom; ++y) {
+			const float *energy = &stack->energy[y * quad_width];
+			for (int qx = 0; qx < quad_width; ++qx) {
+				columns[qx] += energy[qx];
+			}
+		}
+
+		float window = 0;
+		for (int qx = 0; qx < radius && qx < quad_width; ++qx) {
+			window += columns[qx];
+		}
+		float *best = &stack->best[qy * quad_width];
+		int16_t *depth = &stack->depth[qy * quad_width];
+		for (int qx = 0; qx < quad_width; ++qx) {
+			if (qx + radius < quad_width) {
+				window += columns[qx + radius];
+			}
+			if (window > best[qx]) {
+				best[qx] = window;
+				depth[qx] = stack->step;
+				for (unsigned int y = 2 * qy; y < 2 * qy + 2; ++y) {
+					const uint32_t *sum = &stack->sum[y * width + 2 * qx];
+					uint16_t *result = &stack->result[y * width + 2 * qx];
+					result[0] = (sum[0] + frames / 2) / frames;
+					result[1] = (sum[1] + frames / 2) / frames;
+				}
+			}
+			if (qx - radius >= 0) {
+				window -= columns[qx - radius];
+			}
+		}
+	}
+	return NULL;
+}
+
+// run a pass on every band, false if a thread could not be started
+static bool run_bands(focus_stack_t *stack, band_t *bands, void *(*pass)(void *)) {
+	pthread_t threads[FOCUS_STACK_MAX_THREADS];
+	unsigned int started = 0;
+	bool rc = true;
+	for (unsigned int i = 1; i < stack->threads; ++i) {
+		int e = pthread_create(&threads[started], NULL, pass, &bands[i]);
+		if (0 != e) {
+			errno = e;
+			rc = false;
+			break;
+		}
+		++started;
+	}
+	pass(&bands[0]);
+	for (unsigned int i = 0; i < started; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	return rc;
+}
+
+static bool complete_slice(focus_stack_t *stack) {
+	if (0 == stack->frames) {
+		return true;
+	}
+
+	const unsigned int quad_width = stack->width / 2;
+	const unsigned int quad_height = stack->height / 2;
+	band_t bands[FOCUS_STACK_MAX_THREADS];
+	float *columns = malloc(stack->threads * quad_width * sizeof(float));
+	if (NULL == columns) {
+		errno = ENOMEM;
+		return fail(stack, "malloc");
+	}
+	for (unsigned int i = 0; i < stack->threads; ++i) {
+		bands[i].stack = stack;
+		bands[i].first = quad_height * i / stack->threads;
+		bands[i].last = quad_height * (i + 1) / stack->threads;
+		bands[i].columns = &columns[i * quad_width];
+	}
+
+	const bool rc = run_bands(stack, bands, green_band)
+		&& run_bands(stack, bands, energy_band)
+		&& run_bands(stack, bands, merge_band);
+	free(columns);
+	if (!rc) {
+		return fail(stack, "pthread_create");
+	}
+
+	memset(stack->sum, 0, (size_t)stack->width * stack->height * sizeof(uint32_t));
+	stack->frames = 0;
+	++stack->slices;
+	return true;
+}
+
+
+bool focus_stack_add(focus_stack_t *stack, const uint16_t *bayer, int step) {
+	if (stack->frames > 0 && (step != stack->step || FOCUS_STACK_NO_STEP == step)) {
+		if (!complete_slice(stack)) {
+			return false;
+		}
+	}
+	stack->step = step;
+
+	const size_t pixels = (size_t)stack->width * stack->height;
+	uint32_t *sum = stack->sum;
+	for (size_t i = 0; i < pixels; ++i) {
+		sum[i] += bayer[i] & PIXEL_MASK;
+	}
+	++stack->frames;
+	return true;
+}
+
+
+bool focus_stack_finish(focus_stack_t *stack) {
+	return complete_slice(stack);
+}
+
+
+void focus_stack_free(focus_stack_t *stack) {
+	free(stack->sum);
+	free(stack->green);
+	free(stack->energy);
+	free(stack->best);
+	free(stack->result);
+	free(stack->depth);
+	memset(stack, 0, sizeof(*stack));
+}
@@ -0,0 +1,65 @@
+// extended depth of field from the frames of a focus sweep
+//
+// the firmware steps the lens through its range and embeds the step in
+// every frame.  Consecutive frames at the same step are averaged into
+// a slice; as each slice completes, every Bayer quad of it is scored by
+// the energy of the Laplacian of the green sites over a small window,
+// and the quad is copied into the result wherever it is sharper than
+// any earlier slice was there.  The depth map records the step each
+// quad came from.
+//
+// frames are streamed through, so memory is a few frame buffers
+// however long the sweep.  Scoring and merging run on horizontal bands
+// of the frame, one thread for each
+
+#ifndef _FOCUS_STACK_H_
+#define _FOCUS_STACK_H_ 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ahd_bayer.h"
+
+#define FOCUS_STACK_DEFAULT_RADIUS 2
+#define FOCUS_STACK_MAX_THREADS    64
+
+// a slice with no embedded step
+#define FOCUS_STACK_NO_STEP -1
+
+typedef struct {
+	unsigned int width;          // of the Bayer frames
+	unsigned int height;
+	unsigned int green0;         // x of the green site in each row of a quad
+	unsigned int green1;
+	unsigned int radius;         // of the scoring window, in quads
+	unsigned int threads;
+
+	uint32_t *sum;               // of the frames in the current slice
+	unsigned int frames;         // in the current slice
+	int step;                    // of the current slice
+
+	float *green;                // quad image of the slice
+	float *energy;               // squared Laplacian of it
+	float *best;                 // highest windowed energy of each quad so far
+	uint16_t *result;            // Bayer frame of the sharpest quads
+	int16_t *depth;              // step of each quad in the result
+
+	unsigned int slices;
+	const char *error;           // operation that failed, errno has the reason
+} focus_stack_t;
+
+// returns false with stack->error and errno set
+bool focus_stack_init(focus_stack_t *stack, unsigned int width, unsigned int height, BayerTile tile,
+		      unsigned int radius, unsigned int threads);
+
+// the next frame of the sweep, with its embedded data stripped, and its
+// step or FOCUS_STACK_NO_STEP.  A change of step completes a slice
+bool focus_stack_add(focus_stack_t *stack, const uint16_t *bayer, int step);
+
+// complete the last slice, the result and depth map are then final
+bool focus_stack_finish(focus_stack_t *stack);
+
+void focus_stack_free(focus_stack_t *stack);
+
+#endif
@@ -0,0 +1,588 @@
+// index of fingerprints for nearest neighbour search by Hamming distance
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "fingerprint.h"
+#include "fpindex.h"
+
+
+// grow the fingerprint array by this many at least
+#define MIN_ALLOCATION 1024
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t bits;           // FINGERPRINT_BITS
+	uint32_t substrings;
+	uint64_t count;
+	uint64_t indexed;
+} fpindex_header_t;
+
+
+static bool fail(fpindex_t *index, const char *operation) {
+	index->error = operation;
+	return false;
+}
+
+static uint32_t substring(const fpindex_t *index, const fingerprint_t *fingerprint, unsigned int i) {
+	const unsigned int bits = index->substring_bits;
+	const unsigned int first = i * bits;
+	uint64_t word = fingerprint->bits[first / 64] >> (first % 64);
+	return 32 == bits ? (uint32_t)word : (uint32_t)word & ((1U << bits) - 1);
+}
+
+
+// checking candidates is most of a query, use the instruction if there
+// is one without making it a requirement of the build
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("popcnt")))
+static unsigned int distance_popcnt(const fingerprint_t *a, const fingerprint_t *b) {
+	return fingerprint_distance(a, b);
+}
+#endif
+
+static unsigned int (*distance)(const fingerprint_t *a, const fingerprint_t *b);
+static pthread_once_t distance_once = PTHREAD_ONCE_INIT;
+
+static unsigned int distance_generic(const fingerprint_t *a, const fingerprint_t *b) {
+	return fingerprint_distance(a, b);
+}
+
+static void distance_init(void) {
+	distance = distance_generic;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("popcnt")) {
+		distance = distance_popcnt;
+	}
+#endif
+}
+
+
+bool fpindex_init(fpindex_t *index, unsigned int substrings) {
+	memset(index, 0, sizeof(*index));
+	pthread_once(&distance_once, distance_init);
+
+	if (8 != substrings && 16 != substrings && 32 != substrings) {
+		errno = EINVAL;
+		return fail(index, "substrings");
+	}
+	index->substrings = substrings;
+	index->substring_bits = FINGERPRINT_BITS / substrings;
+	return true;
+}
+
+
+bool fpindex_add(fpindex_t *index, const fingerprint_t *fingerprint, uint32_t *id) {
+	if (index->count >= UINT32_MAX) {
+		errno = EOVERFLOW;
+		return fail(index, "index full");
+	}
+	if (index->count == index->allocated) {
+		uint64_t allocated = 2 * index->allocated;
+		if (allocated < MIN_ALLOCATION) {
+			allocated = MIN_ALLOCATION;
+		}
+		fingerprint_t *codes = realloc(index->codes, allocated * sizeof(fingerprint_t));
+		if (NULL == codes) {
+			errno = ENOMEM;
+			return fail(index, "out of memory");
+		}
+		index->codes = codes;
+		index->allocated = allocated;
+	}
+	if (NULL != id) {
+		*id = index->count;
+	}
+	index->codes[index->count++] = *fingerprint;
+	return true;
+}
+
+
+static void free_tables(fpindex_t *index) {
+	for (unsigned int i = 0; i < FPINDEX_MAX_SUBSTRINGS; ++i) {
+		free(index->table[i].keys);
+		free(index->table[i].ids);
+		index->table[i].keys = NULL;
+		index->table[i].ids = NULL;
+	}
+	index->indexed = 0;
+}
+
+// stable radix sort of (key << 32 | id) on the key bytes, the ids are
+// already in order so they stay in order within a key
+static void sort_entries(uint64_t *entries, uint64_t *scratch, uint64_t n, unsigned int key_bits) {
+	for (unsigned int shift = 32; shift < 32 + key_bits; shift += 8) {
+		uint64_t counts[257] = { 0 };
+		for (uint64_t i = 0; i < n; ++i) {
+			++counts[((entries[i] >> shift) & 0xff) + 1];
+		}
+		for (int d = 0; d < 256; ++d) {
+			counts[d + 1] += counts[d];
+		}
+		for (uint64_t i = 0; i < n; ++i) {
+			scratch[counts[(entries[i] >> shift) & 0xff]++] = entries[i];
+		}
+		uint64_t *t = entries;
+		entries = scratch;
+		scratch = t;
+	}
+	// an odd number of passes leaves the result in the scratch buffer
+	if (0 != (key_bits / 8) % 2) {
+		memcpy(scratch, entries, n * sizeof(uint64_t));
+	}
+}
+
+bool fpindex_build(fpindex_t *index) {
+	const uint64_t n = index->count;
+	if (n == index->indexed) {
+		return true;
+	}
+
+	uint64_t *entries = malloc(n * sizeof(uint64_t));
+	uint64_t *scratch = malloc(n * sizeof(uint64_t));
+	if (NULL == entries || NULL == scratch) {
+		free(entries);
+		free(scratch);
+		errno = ENOMEM;
+		return fail(index, "out of memory");
+	}
+
+	free_tables(index);
+	for (unsigned int t = 0; t < index->substrings; ++t) {
+		fpindex_table_t *table = &index->table[t];
+		table->keys = malloc(n * sizeof(uint32_t));
+		table->ids = malloc(n * sizeof(uint32_t));
+		if (NULL == table->keys || NULL == table->ids) {
+			free(entries);
+			free(scratch);
+			free_tables(index);
+			errno = ENOMEM;
+			return fail(index, "out of memory");
+		}
+
+		for (uint64_t i = 0; i < n; ++i) {
+			entries[i] = (uint64_t)substring(index, &index->codes[i], t) << 32 | i;
+		}
+		sort_entries(entries, scratch, n, index->substring_bits);
+		for (uint64_t i = 0; i < n; ++i) {
+			table->keys[i] = entries[i] >> 32;
+			table->ids[i] = (uint32_t)entries[i];
+		}
+	}
+	free(entries);
+	free(scratch);
+
+	index->indexed = n;
+	return true;
+}
+
+
+// queries
+
+// matches kept nearest first, for a k nearest query or a radius query
+typedef struct {
+	fpindex_match_t *matches;
+	size_t n;
+	size_t max;              // size of matches
+	bool grow;               // radius: grow rather than drop the farthest
+	unsigned int radius;     // ignore anything farther
+} result_t;
+
+// a radius result is gathered unordered with repeats and sorted at the end
+static bool result_add(result_t *result, uint32_t id, unsigned int d) {
+	if (d > result->radius) {
+		return true;
+	}
+	if (result->grow) {
+		if (result->n == result->max) {
+			size_t max = 0 == result->max ? 64 : 2 * result->max;
+			fpindex_match_t *m = realloc(result->matches, max * sizeof(fpindex_match_t));
+			if (NULL == m) {
+				errno = ENOMEM;
+				return false;
+			}
+			result->matches = m;
+			result->max = max;
+		}
+		result->matches[result->n].id = id;
+		result->matches[result->n++].distance = d;
+		return true;
+	}
+
+	// candidates from several tables repeat, k is small enough to look
+	for (size_t i = 0; i < result->n; ++i) {
+		if (id == result->matches[i].id) {
+			return true;
+		}
+	}
+	// nearest first, ties by id so the answer does not depend on the search
+	if (result->n == result->max) {
+		const fpindex_match_t *last = &result->matches[result->n - 1];
+		if (d > last->distance || (d == last->distance && id > last->id)) {
+			return true;
+		}
+		--result->n;
+	}
+	size_t i = result->n++;
+	for (; i > 0 && (result->matches[i - 1].distance > d
+			 || (result->matches[i - 1].distance == d && result->matches[i - 1].id > id)); --i) {
+		result->matches[i] = result->matches[i - 1];
+	}
+	result->matches[i].id = id;
+	result->matches[i].distance = d;
+	return true;
+}
+
+static int compare_id(const void *a, const void *b) {
+	const fpindex_match_t *x = a;
+	const fpindex_match_t *y = b;
+	return (x->id > y->id) - (x->id < y->id);
+}
+
+static int compare_distance(const void *a, const void *b) {
+	const fpindex_match_t *x = a;
+	const fpindex_match_t *y = b;
+	if (x->distance != y->distance) {
+		return (x->distance > y->distance) - (x->distance < y->distance);
+	}
+	return compare_id(a, b);
+}
+
+// drop the repeats of a radius result and put it nearest first
+static void result_finish(result_t *result) {
+	if (!result->grow || 0 == result->n) {
+		return;
+	}
+	qsort(result->matches, result->n, sizeof(fpindex_match_t), compare_id);
+	size_t n = 1;
+	for (size_t i = 1; i < result->n; ++i) {
+		if (result->matches[i].id != result->matches[n - 1].id) {
+			result->matches[n++] = result->matches[i];
+		}
+	}
+	result->n = n;
+	qsort(result->matches, result->n, sizeof(fpindex_match_t), compare_distance);
+}
+
+// a binary search for each key probed costs about this many candidate
+// checks, past which a search is better done by checking everything
+#define LOOKUP_COST 32
+
+// true if probing every table at this distance costs more than a scan
+static bool probe_too_costly(const fpindex_t *index, unsigned int flips) {
+	// keys at exactly flips bits from one key
+	double keys = 1;
+	for (unsigned int i = 0; i < flips; ++i) {
+		keys = keys * (index->substring_bits - i) / (i + 1);
+	}
+	return keys * index->substrings * LOOKUP_COST > (double)index->indexed;
+}
+
+static bool scan(const fpindex_t *index, uint64_t first, const fingerprint_t *query, result_t *result) {
+	for (uint64_t id = first; id < index->count; ++id) {
+		if (!result_add(result, id, distance(query, &index->codes[id]))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// check every fingerprint with this key in table t
+static bool lookup(const fpindex_t *index, unsigned int t, uint32_t key, const fingerprint_t *query,
+		   result_t *result) {
+	const fpindex_table_t *table = &index->table[t];
+	uint64_t low = 0;
+	uint64_t high = index->indexed;
+	while (low < high) {
+		uint64_t middle = low + (high - low) / 2;
+		if (table->keys[middle] < key) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	for (uint64_t i = low; i < index->indexed && key == table->keys[i]; ++i) {
+		uint32_t id = table->ids[i];
+		if (!result_add(result, id, distance(query, &index->codes[id]))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// look up every key at exactly distance flips from key, flipping bits
+// from first on
+static bool probe(const fpindex_t *index, unsigned int t, uint32_t key, unsigned int first,
+		  unsigned int flips, const fingerprint_t *query, result_t *result) {
+	if (0 == flips) {
+		return lookup(index, t, key, query, result);
+	}
+	for (unsigned int bit = first; bit + flips <= index->substring_bits; ++bit) {
+		if (!probe(index, t, key ^ (1U << bit), bit + 1, flips - 1, query, result)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+
+ssize_t fpindex_radius(const fpindex_t *index, const fingerprint_t *query, unsigned int radius,
+		       fpindex_match_t *matches, size_t max, size_t *total) {
+	result_t result = {
+		.grow = true,
+		.radius = radius,
+	};
+	// by pigeonhole one substring is this close
+	const unsigned int reach = radius / index->substrings;
+	bool ok;
+	if (reach >= index->substring_bits || probe_too_costly(index, reach)) {
+		ok = scan(index, 0, query, &result);
+	} else {
+		ok = scan(index, index->indexed, query, &result);
+		for (unsigned int t = 0; ok && t < index->substrings; ++t) {
+			uint32_t key = substring(index, query, t);
+			for (unsigned int flips = 0; ok && flips <= reach; ++flips) {
+				ok = probe(index, t, key, 0, flips, query, &result);
+			}
+		}
+	}
+	size_t n = 0;
+	if (ok) {
+		// drop the repeats found through several tables before counting
+		result_finish(&result);
+		n = result.n < max ? result.n : max;
+		memcpy(matches, result.matches, n * sizeof(fpindex_match_t));
+		if (NULL != total) {
+			*total = result.n;
+		}
+	}
+	free(result.matches);
+	return ok ? (ssize_t)n : -1;
+}
+
+
+ssize_t fpindex_nearest(const fpindex_t *index, const fingerprint_t *query, unsigned int k,
+			fpindex_match_t *matches) {
+	result_t result = {
+		.matches = matches,
+		.max = k,
+		.radius = FINGERPRINT_BITS,
+	};
+	if (0 == k) {
+		return 0;
+	}
+	if (!scan(index, index->indexed, query, &result)) {
+		return -1;
+	}
+
+	// after every table is searched to substring distance s, everything
+	// closer than substrings * (s + 1) has been seen
+	for (unsigned int flips = 0; flips <= index->substring_bits; ++flips) {
+		if (result.n == k && result.matches[k - 1].distance < index->substrings * flips) {
+			break;
+		}
+		if (result.n == index->count) {
+			break;
+		}
+		if (probe_too_costly(index, flips)) {
+			if (!scan(index, 0, query, &result)) {
+				return -1;
+			}
+			break;
+		}
+		for (unsigned int t = 0; t < index->substrings; ++t) {
+			if (!probe(index, t, substring(index, query, t), 0, flips, query, &result)) {
+				return -1;
+			}
+		}
+	}
+	return result.n;
+}
+
+
+typedef struct {
+	const fpindex_t *index;
+	const fingerprint_t *queries;
+	size_t n;
+	unsigned int k;
+	fpindex_match_t *matches;
+	unsigned int *found;
+	size_t next;             // next query to take, atomic
+	int error;               // errno of the first failed query, 0 => none, atomic
+} batch_t;
+
+static void *batch_worker(void *arg) {
+	batch_t *batch = arg;
+	for (;;) {
+		size_t i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_SEQ_CST);
+		if (i >= batch->n) {
+			break;
+		}
+		ssize_t found = fpindex_nearest(batch->index, &batch->queries[i], batch->k,
+						&batch->matches[i * batch->k]);
+		if (found < 0) {
+			int none = 0;
+			__atomic_compare_exchange_n(&batch->error, &none, 0 != errno ? errno : EIO, false,
+						    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+			found = 0;
+		}
+		batch->found[i] = found;
+	}
+	return NULL;
+}
+
+bool fpindex_nearest_batch(const fpindex_t *index, const fingerprint_t *queries, size_t n,
+			   unsigned int k, fpindex_match_t *matches, unsigned int *found,
+			   unsigned int threads) {
+	batch_t batch = {
+		.index = index,
+		.queries = queries,
+		.n = n,
+		.k = k,
+		.matches = matches,
+		.found = found,
+	};
+	pthread_t thread[64];
+	if (threads < 1) {
+		threads = 1;
+	} else if (threads > sizeof(thread) / sizeof(thread[0])) {
+		threads = sizeof(thread) / sizeof(thread[0]);
+	}
+
+	// the calling thread is one of them
+	unsigned int started = 0;
+	for (; started + 1 < threads; ++started) {
+		if (0 != pthread_create(&thread[started], NULL, batch_worker, &batch)) {
+			break;
+		}
+	}
+	batch_worker(&batch);
+	for (unsigned int i = 0; i < started; ++i) {
+		pthread_join(thread[i], NULL);
+	}
+	if (0 != batch.error) {
+		errno = batch.error;
+		return false;
+	}
+	return true;
+}
+
+
+// files
+
+static bool write_all(FILE *f, const void *data, size_t size, size_t n) {
+	return n == fwrite(data, size, n, f);
+}
+
+bool fpindex_save(fpindex_t *index, const char *path) {
+	if (!fpindex_build(index)) {
+		return false;
+	}
+	FILE *f = fopen(path, "wb");
+	if (NULL == f) {
+		return fail(index, "open");
+	}
+	fpindex_header_t header = {
+		.magic = FPINDEX_MAGIC,
+		.version = FPINDEX_VERSION,
+		.bits = FINGERPRINT_BITS,
+		.substrings = index->substrings,
+		.count = index->count,
+		.indexed = index->indexed,
+	};
+	bool ok = write_all(f, &header, sizeof(header), 1)
+		&& write_all(f, index->codes, sizeof(fingerprint_t), index->count);
+	for (unsigned int t = 0; ok && t < index->substrings; ++t) {
+		ok = write_all(f, index->table[t].keys, sizeof(uint32_t), index->indexed)
+			&& write_all(f, index->table[t].ids, sizeof(uint32_t), index->indexed);
+	}
+	if (0 != fclose(f)) {
+		ok = false;
+	}
+	if (!ok) {
+		if (0 == errno) {
+			errno = EIO;
+		}
+		return fail(index, "write");
+	}
+	return true;
+}
+
+bool fpindex_load(fpindex_t *index, const char *path) {
+	FILE *f = fopen(path, "rb");
+	if (NULL == f) {
+		memset(index, 0, sizeof(*index));
+		return fail(index, "open");
+	}
+	fpindex_header_t header;
+	if (1 != fread(&header, sizeof(header), 1, f)
+	    || FPINDEX_MAGIC != header.magic || FPINDEX_VERSION != header.version
+	    || FINGERPRINT_BITS != header.bits || header.indexed != header.count
+	    || header.count > UINT32_MAX) {
+		fclose(f);
+		memset(index, 0, sizeof(*index));
+		errno = EINVAL;
+		return fail(index, "not an index");
+	}
+	if (!fpindex_init(index, header.substrings)) {
+		fclose(f);
+		return false;
+	}
+
+	const uint64_t n = header.count;
+	index->codes = malloc((n > 0 ? n : 1) * sizeof(fingerprint_t));
+	bool ok = NULL != index->codes;
+	for (unsigned int t = 0; ok && t < index->substrings; ++t) {
+		index->table[t].keys = malloc((n > 0 ? n : 1) * sizeof(uint32_t));
+		index->table[t].ids = malloc((n > 0 ? n : 1) * sizeof(uint32_t));
+		ok = NULL != index->table[t].keys && NULL != index->table[t].ids;
+	}
+	if (!ok) {
+		fclose(f);
+		fpindex_free(index);
+		errno = ENOMEM;
+		return fail(index, "out of memory");
+	}
+	index->count = index->allocated = index->indexed = n;
+
+	ok = n == fread(index->codes, sizeof(fingerprint_t), n, f);
+	for (unsigned int t = 0; ok && t < index->substrings; ++t) {
+		ok = n == fread(index->table[t].keys, sizeof(uint32_t), n, f)
+			&& n == fread(index->table[t].ids, sizeof(uint32_t), n, f);
+	}
+	fclose(f);
+	if (!ok) {
+		fpindex_free(index);
+		errno = EIO;
+		return fail(index, "short index");
+	}
+
+	// queries trust the tables, so a damaged file must not get this far
+	for (unsigned int t = 0; t < index->substrings; ++t) {
+		const fpindex_table_t *table = &index->table[t];
+		for (uint64_t i = 0; i < n; ++i) {
+			if (table->ids[i] >= n || (i > 0 && table->keys[i] < table->keys[i - 1])) {
+				fpindex_free(index);
+				errno = EINVAL;
+				return fail(index, "corrupt index");
+			}
+		}
+	}
+	return true;
+}
+
+
+void fpindex_free(fpindex_t *index) {
+	free_tables(index);
+	free(index->codes);
+	index->codes = NULL;
+	index->count = index->allocated = 0;
+}
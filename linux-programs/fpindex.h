@@ -0,0 +1,92 @@
+// index of fingerprints for nearest neighbour search by Hamming distance
+//
+// multi-index hashing: each fingerprint is cut into substrings and each
+// substring position has its own table of the fingerprints sorted by
+// that substring.  Two fingerprints within distance r must agree to
+// within r / substrings bits on at least one substring, so a query only
+// looks up the few keys near its own substrings and checks the
+// candidates found against the whole fingerprint.  The substrings
+// should be about log2 of the number of fingerprints long: 32 bits
+// (8 substrings) suits millions to billions, 16 bits up to a million.
+//
+// the tables are sorted arrays searched by bisection rather than hash
+// tables: 8 bytes an entry with no empty buckets, and saved and loaded
+// as they are
+//
+// fingerprints added since the last fpindex_build() are not in the
+// tables yet and are checked one by one, so build after adding in bulk.
+// Queries only read the index and may run from many threads at once
+
+#ifndef _FPINDEX_H_
+#define _FPINDEX_H_ 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "fingerprint.h"
+
+#define FPINDEX_MAGIC   0x58495046  // "FPIX"
+#define FPINDEX_VERSION 1
+
+#define FPINDEX_DEFAULT_SUBSTRINGS 8
+#define FPINDEX_MAX_SUBSTRINGS     (FINGERPRINT_BITS / 8)
+
+typedef struct {
+	uint32_t id;             // order the fingerprint was added in, from 0
+	unsigned int distance;
+} fpindex_match_t;
+
+typedef struct {
+	uint32_t *keys;          // substring values, ascending
+	uint32_t *ids;           // fingerprint of each key
+} fpindex_table_t;
+
+typedef struct {
+	unsigned int substrings;
+	unsigned int substring_bits;
+	fingerprint_t *codes;    // every fingerprint, by id
+	uint64_t count;
+	uint64_t allocated;
+	uint64_t indexed;        // codes[0 .. indexed) are in the tables
+	fpindex_table_t table[FPINDEX_MAX_SUBSTRINGS];
+	const char *error;       // operation that failed, errno has the reason
+} fpindex_t;
+
+// all return false on failure with index->error and errno set
+
+// substrings is 8, 16 or 32
+bool fpindex_init(fpindex_t *index, unsigned int substrings);
+
+// id may be NULL
+bool fpindex_add(fpindex_t *index, const fingerprint_t *fingerprint, uint32_t *id);
+
+// put every fingerprint added so far into the tables
+bool fpindex_build(fpindex_t *index);
+
+// queries return the number of matches, or -1 with errno set, and
+// fill matches nearest first
+
+// every fingerprint within distance radius, the nearest max of them if
+// there are more.  total gets the number there are, if not NULL
+ssize_t fpindex_radius(const fpindex_t *index, const fingerprint_t *query, unsigned int radius,
+		       fpindex_match_t *matches, size_t max, size_t *total);
+
+// the k nearest, fewer only if the index holds fewer
+ssize_t fpindex_nearest(const fpindex_t *index, const fingerprint_t *query, unsigned int k,
+			fpindex_match_t *matches);
+
+// fpindex_nearest() for each of n queries spread over threads, matches
+// holds k for each query and found gets the number of each
+bool fpindex_nearest_batch(const fpindex_t *index, const fingerprint_t *queries, size_t n,
+			   unsigned int k, fpindex_match_t *matches, unsigned int *found,
+			   unsigned int threads);
+
+// the file holds the fingerprints and the tables, so a load is only reads
+bool fpindex_save(fpindex_t *index, const char *path);
+bool fpindex_load(fpindex_t *index, const char *path);
+
+void fpindex_free(fpindex_t *index);
+
+#endif
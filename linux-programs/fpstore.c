@@ -0,0 +1,311 @@
+// append-only store of fingerprints and where they came from
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fingerprint.h"
+#include "fpstore.h"
+
+
+// each header slot has a page to itself
+#define SLOT_SIZE   4096
+#define DATA_OFFSET (2 * SLOT_SIZE)
+#define BLOCK_BYTES ((size_t)FPSTORE_BLOCK * (sizeof(fingerprint_t) + sizeof(fpstore_meta_t)))
+
+// growth is a block at first, doubling up to this many at once
+#define MAX_GROWTH_BLOCKS 64
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t block;          // FPSTORE_BLOCK
+	uint32_t fingerprint_size;
+	uint32_t meta_size;
+	uint32_t reserved;
+	uint64_t generation;     // the slot with the highest valid one is current
+	uint64_t count;          // committed records
+	uint64_t checksum;       // of everything above
+} fpstore_header_t;
+
+
+static bool fail(fpstore_t *store, const char *operation) {
+	store->error = operation;
+	return false;
+}
+
+// FNV-1a
+static uint64_t checksum(const void *data, size_t size) {
+	const uint8_t *p = data;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < size; ++i) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static bool header_valid(const fpstore_header_t *h) {
+	return FPSTORE_MAGIC == h->magic
+		&& FPSTORE_VERSION == h->version
+		&& FPSTORE_BLOCK == h->block
+		&& sizeof(fingerprint_t) == h->fingerprint_size
+		&& sizeof(fpstore_meta_t) == h->meta_size
+		&& checksum(h, offsetof(fpstore_header_t, checksum)) == h->checksum;
+}
+
+static void header_fill(fpstore_header_t *h, uint64_t generation, uint64_t count) {
+	memset(h, 0, sizeof(*h));
+	h->magic = FPSTORE_MAGIC;
+	h->version = FPSTORE_VERSION;
+	h->block = FPSTORE_BLOCK;
+	h->fingerprint_size = sizeof(fingerprint_t);
+	h->meta_size = sizeof(fpstore_meta_t);
+	h->generation = generation;
+	h->count = count;
+	h->checksum = checksum(h, offsetof(fpstore_header_t, checksum));
+}
+
+static size_t fingerprint_offset(uint64_t index) {
+	return DATA_OFFSET + (index / FPSTORE_BLOCK) * BLOCK_BYTES
+		+ (index % FPSTORE_BLOCK) * sizeof(fingerprint_t);
+}
+
+static size_t meta_offset(uint64_t index) {
+	return DATA_OFFSET + (index / FPSTORE_BLOCK) * BLOCK_BYTES
+		+ FPSTORE_BLOCK * sizeof(fingerprint_t)
+		+ (index % FPSTORE_BLOCK) * sizeof(fpstore_meta_t);
+}
+
+
+// map the whole file as it is now
+static bool map_file(fpstore_t *store) {
+	struct stat st;
+	if (-1 == fstat(store->fd, &st)) {
+		return fail(store, "fstat");
+	}
+	if (st.st_size < DATA_OFFSET) {
+		errno = EINVAL;
+		return fail(store, "not a store");
+	}
+	if (NULL != store->map) {
+		munmap(store->map, store->map_size);
+		store->map = NULL;
+	}
+	int protection = store->writable ? PROT_READ | PROT_WRITE : PROT_READ;
+	void *map = mmap(NULL, st.st_size, protection, MAP_SHARED, store->fd, 0);
+	if (MAP_FAILED == map) {
+		return fail(store, "mmap");
+	}
+	store->map = map;
+	store->map_size = st.st_size;
+	store->capacity = (st.st_size - DATA_OFFSET) / BLOCK_BYTES * FPSTORE_BLOCK;
+	return true;
+}
+
+// true if nothing was ever written to the header slots
+static bool slots_empty(const fpstore_t *store) {
+	for (size_t i = 0; i < DATA_OFFSET; ++i) {
+		if (0 != store->map[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// the current header from the mapping
+static bool read_header(fpstore_t *store) {
+	const fpstore_header_t *current = NULL;
+	for (int slot = 0; slot < 2; ++slot) {
+		const fpstore_header_t *h = (const fpstore_header_t *)(store->map + slot * SLOT_SIZE);
+		if (header_valid(h) && (NULL == current || h->generation > current->generation)) {
+			current = h;
+			store->slot = slot;
+		}
+	}
+	if (NULL == current && slots_empty(store)) {
+		// created but the first header never reached the disk, an empty
+		// store whose first commit goes to slot 0
+		store->slot = 1;
+		store->generation = 0;
+		store->committed = 0;
+		return true;
+	}
+	if (NULL == current || current->count > store->capacity) {
+		errno = EINVAL;
+		return fail(store, "not a store");
+	}
+	store->generation = current->generation;
+	store->committed = current->count;
+	return true;
+}
+
+
+bool fpstore_open(fpstore_t *store, const char *path, bool writable, bool create) {
+	memset(store, 0, sizeof(*store));
+	store->writable = writable || create;
+	store->sync_every = FPSTORE_DEFAULT_SYNC;
+
+	int flags = (store->writable ? O_RDWR : O_RDONLY) | (create ? O_CREAT : 0) | O_CLOEXEC;
+	store->fd = open(path, flags, 0644);
+	if (-1 == store->fd) {
+		return fail(store, "open");
+	}
+
+	// a second writer would commit over the first one's records
+	if (store->writable && -1 == flock(store->fd, LOCK_EX | LOCK_NB)) {
+		int saved = EWOULDBLOCK == errno ? EBUSY : errno;
+		close(store->fd);
+		errno = saved;
+		return fail(store, "lock");
+	}
+
+	struct stat st;
+	if (-1 == fstat(store->fd, &st)) {
+		int saved = errno;
+		close(store->fd);
+		errno = saved;
+		return fail(store, "fstat");
+	}
+	if (create && 0 == st.st_size) {
+		// a fresh store is one empty block and a header
+		fpstore_header_t header;
+		header_fill(&header, 1, 0);
+		if (-1 == ftruncate(store->fd, DATA_OFFSET + BLOCK_BYTES)
+		    || sizeof(header) != pwrite(store->fd, &header, sizeof(header), 0)
+		    || -1 == fsync(store->fd)) {
+			int saved = errno;
+			close(store->fd);
+			errno = saved;
+			return fail(store, "create");
+		}
+	}
+
+	if (!map_file(store) || !read_header(store)) {
+		int saved = errno;
+		if (NULL != store->map) {
+			munmap(store->map, store->map_size);
+		}
+		close(store->fd);
+		errno = saved;
+		return false;
+	}
+
+	// anything past the committed count is from an append that never
+	// committed and will be overwritten
+	store->count = store->committed;
+	return true;
+}
+
+
+static bool grow(fpstore_t *store) {
+	uint64_t blocks = store->capacity / FPSTORE_BLOCK;
+	uint64_t more = blocks < 1 ? 1 : blocks > MAX_GROWTH_BLOCKS ? MAX_GROWTH_BLOCKS : blocks;
+	if (-1 == ftruncate(store->fd, DATA_OFFSET + (blocks + more) * BLOCK_BYTES)) {
+		return fail(store, "ftruncate");
+	}
+	return map_file(store);
+}
+
+
+bool fpstore_append(fpstore_t *store, const fingerprint_t *fingerprint, const fpstore_meta_t *meta,
+		    uint64_t *index) {
+	if (!store->writable) {
+		errno = EBADF;
+		return fail(store, "read only");
+	}
+	if (store->count == store->capacity && !grow(store)) {
+		return false;
+	}
+	memcpy(store->map + fingerprint_offset(store->count), fingerprint, sizeof(*fingerprint));
+	memcpy(store->map + meta_offset(store->count), meta, sizeof(*meta));
+	if (NULL != index) {
+		*index = store->count;
+	}
+	++store->count;
+
+	if (0 != store->sync_every && store->count - store->committed >= store->sync_every) {
+		return fpstore_sync(store);
+	}
+	return true;
+}
+
+
+bool fpstore_sync(fpstore_t *store) {
+	if (!store->writable || store->count == store->committed) {
+		return true;
+	}
+
+	// the records first, in the blocks they were appended to
+	size_t first = DATA_OFFSET + (store->committed / FPSTORE_BLOCK) * BLOCK_BYTES;
+	size_t last = DATA_OFFSET + ((store->count - 1) / FPSTORE_BLOCK + 1) * BLOCK_BYTES;
+	if (-1 == msync(store->map + first, last - first, MS_SYNC)) {
+		return fail(store, "msync records");
+	}
+
+	// then the slot not in use, so the current header survives a torn write
+	uint64_t generation = store->generation + 1;
+	unsigned int next = 1 - store->slot;
+	uint8_t *slot = store->map + next * SLOT_SIZE;
+	fpstore_header_t header;
+	header_fill(&header, generation, store->count);
+	memcpy(slot, &header, sizeof(header));
+	if (-1 == msync(slot, SLOT_SIZE, MS_SYNC)) {
+		return fail(store, "msync header");
+	}
+	store->generation = generation;
+	store->slot = next;
+	store->committed = store->count;
+	return true;
+}
+
+
+bool fpstore_refresh(fpstore_t *store) {
+	if (store->writable) {
+		return true;  // the only writer already knows
+	}
+	if (!map_file(store) || !read_header(store)) {
+		return false;
+	}
+	store->count = store->committed;
+	return true;
+}
+
+
+bool fpstore_close(fpstore_t *store) {
+	bool rc = fpstore_sync(store);
+	if (NULL != store->map) {
+		munmap(store->map, store->map_size);
+		store->map = NULL;
+	}
+	if (-1 != store->fd) {
+		if (-1 == close(store->fd) && rc) {
+			rc = fail(store, "close");
+		}
+		store->fd = -1;
+	}
+	return rc;
+}
+
+
+const fingerprint_t *fpstore_fingerprint(const fpstore_t *store, uint64_t index) {
+	return (const fingerprint_t *)(store->map + fingerprint_offset(index));
+}
+
+const fpstore_meta_t *fpstore_meta(const fpstore_t *store, uint64_t index) {
+	return (const fpstore_meta_t *)(store->map + meta_offset(index));
+}
+
+const fingerprint_t *fpstore_fingerprints(const fpstore_t *store, uint64_t index, uint64_t *n) {
+	uint64_t end = (index / FPSTORE_BLOCK + 1) * FPSTORE_BLOCK;
+	*n = (end < store->count ? end : store->count) - index;
+	return fpstore_fingerprint(store, index);
+}
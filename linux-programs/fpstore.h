@@ -0,0 +1,92 @@
+// append-only store of fingerprints and where they came from
+//
+// the file is two header slots followed by blocks of FPSTORE_BLOCK
+// records.  Each block holds its fingerprints together and then their
+// metadata, so a scan of the fingerprints reads nothing else.  The
+// whole file is mapped: opening it reads one header, however many
+// records it holds.
+//
+// appends go into the mapping beyond the committed count and only
+// become part of the store when committed: the new records are synced
+// and then the other header slot is written with the new count, a
+// higher generation and a checksum.  Opening takes the valid slot with
+// the highest generation, so a crash at any point loses at most the
+// uncommitted records.  Commits happen every sync_every appends and on
+// fpstore_sync() and fpstore_close().  A file whose slots are both
+// still zero, from a crash while it was being created, is an empty
+// store
+
+#ifndef _FPSTORE_H_
+#define _FPSTORE_H_ 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "fingerprint.h"
+
+#define FPSTORE_MAGIC   0x54535046  // "FPST"
+#define FPSTORE_VERSION 1
+
+// records in each block
+#define FPSTORE_BLOCK 16384
+
+#define FPSTORE_DEFAULT_SYNC 1024
+
+// where and how a fingerprint was captured
+typedef struct {
+	uint64_t timestamp_us;   // capture time, 0 if not known
+	uint64_t frame_offset;   // byte offset of the frame in its capture file
+	uint32_t device;         // the caller's device number
+	uint32_t contrast;       // from the embedded data
+	uint8_t leds;            // LED mask
+	uint8_t steps;           // focus position
+	uint8_t flags;           // FPSTORE_*
+	uint8_t reserved[5];
+} fpstore_meta_t;
+
+#define FPSTORE_EMBED 0x01   // steps and contrast are from embedded data
+#define FPSTORE_FUSED 0x02   // fingerprint of several frames fused
+
+typedef struct {
+	int fd;
+	bool writable;
+	uint8_t *map;
+	size_t map_size;
+	uint64_t capacity;       // records the file has room for
+	uint64_t count;          // records, including uncommitted appends
+	uint64_t committed;      // records a reopen would find
+	uint64_t generation;     // of the current header
+	unsigned int slot;       // holding the current header, commits use the other
+	unsigned int sync_every; // commit after this many appends, 0 => only when asked
+	const char *error;       // operation that failed, errno has the reason
+} fpstore_t;
+
+// all return false on failure with store->error and errno set
+
+// opens read only unless writable, create implies writable.  Only one
+// writer may have a store open, another fails with EBUSY
+bool fpstore_open(fpstore_t *store, const char *path, bool writable, bool create);
+
+// the record number is returned in index if not NULL
+bool fpstore_append(fpstore_t *store, const fingerprint_t *fingerprint, const fpstore_meta_t *meta,
+		    uint64_t *index);
+
+// commit the appends so far
+bool fpstore_sync(fpstore_t *store);
+
+// see the records committed by a writer since opening
+bool fpstore_refresh(fpstore_t *store);
+
+// commits, then closes
+bool fpstore_close(fpstore_t *store);
+
+// pointers into the mapping, valid until the next append or refresh
+const fingerprint_t *fpstore_fingerprint(const fpstore_t *store, uint64_t index);
+const fpstore_meta_t *fpstore_meta(const fpstore_t *store, uint64_t index);
+
+// the fingerprints of the block holding index onwards, and how many
+// follow in that block, for scanning block by block
+const fingerprint_t *fpstore_fingerprints(const fpstore_t *store, uint64_t index, uint64_t *n);
+
+#endif
@@ -0,0 +1,327 @@
+// frame timing and drop statistics
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "frame_stats.h"
+
+
+// latency histogram bucket upper limits in milliseconds, last is open
+static const unsigned int histogram_limits[] = {
+	1, 2, 4, 8, 16, 32, 64, 128, 256, 0
+};
+#define HISTOGRAM_BUCKETS (sizeof(histogram_limits) / sizeof(histogram_limits[0]))
+
+// percentiles reported for each distribution
+typedef struct {
+	size_t count;
+	double mean;
+	double p50;
+	double p90;
+	double p99;
+	double max;
+} distribution_t;
+
+// the computed summary
+typedef struct {
+	double seconds;
+	double fps;
+	distribution_t interval;  // ms between timestamps
+	distribution_t jitter;    // ms deviation of interval from median
+	distribution_t latency;   // ms from timestamp to dequeue
+	distribution_t dqbuf;     // µs
+	distribution_t process;   // µs
+	distribution_t qbuf;      // µs
+	unsigned int histogram[HISTOGRAM_BUCKETS];
+} summary_t;
+
+
+void frame_stats_init(frame_stats_t *stats, size_t frame_size, bool sequenced, bool monotonic) {
+	memset(stats, 0, sizeof(*stats));
+	stats->frame_size = frame_size;
+	stats->sequenced = sequenced;
+	stats->monotonic = monotonic;
+}
+
+
+void frame_stats_free(frame_stats_t *stats) {
+	free(stats->records);
+	stats->records = NULL;
+	stats->n_records = 0;
+	stats->capacity = 0;
+}
+
+
+bool frame_stats_is_short(const frame_stats_t *stats, const frame_record_t *record) {
+	return 0 != stats->frame_size && record->bytesused < stats->frame_size;
+}
+
+
+uint32_t frame_stats_record(frame_stats_t *stats, const frame_record_t *record) {
+	uint32_t dropped = 0;
+
+	if (stats->sequenced && stats->frames > 0) {
+		// unsigned subtraction copes with sequence wrap
+		uint32_t delta = record->sequence - stats->last_sequence;
+		if (delta > 1) {
+			dropped = delta - 1;
+			stats->dropped += dropped;
+			++stats->gaps;
+		}
+	}
+	stats->last_sequence = record->sequence;
+	++stats->frames;
+	if (frame_stats_is_short(stats, record)) {
+		++stats->short_frames;
+	}
+
+	if (stats->incomplete) {
+		return dropped;
+	}
+	if (stats->n_records >= stats->capacity) {
+		size_t capacity = 0 == stats->capacity ? 1024 : 2 * stats->capacity;
+		frame_record_t *records = realloc(stats->records, capacity * sizeof(frame_record_t));
+		if (NULL == records) {
+			// stop rather than leave holes, so the records stay a run of
+			// consecutive frames
+			stats->incomplete = true;
+			return dropped;
+		}
+		stats->records = records;
+		stats->capacity = capacity;
+	}
+	stats->records[stats->n_records++] = *record;
+
+	return dropped;
+}
+
+
+static int compare_double(const void *a, const void *b) {
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+
+// nearest rank percentile of sorted data
+static double percentile(const double *sorted, size_t n, unsigned int pc) {
+	if (0 == n) {
+		return 0;
+	}
+	size_t rank = (pc * n + 99) / 100;
+	if (rank < 1) {
+		rank = 1;
+	}
+	return sorted[rank - 1];
+}
+
+
+// sorts the values in place
+static distribution_t distribution(double *values, size_t n) {
+	distribution_t d;
+	memset(&d, 0, sizeof(d));
+	if (0 == n) {
+		return d;
+	}
+	double sum = 0;
+	for (size_t i = 0; i < n; ++i) {
+		sum += values[i];
+	}
+	qsort(values, n, sizeof(double), compare_double);
+	d.count = n;
+	d.mean = sum / n;
+	d.p50 = percentile(values, n, 50);
+	d.p90 = percentile(values, n, 90);
+	d.p99 = percentile(values, n, 99);
+	d.max = values[n - 1];
+	return d;
+}
+
+
+static bool summarise(const frame_stats_t *stats, summary_t *s) {
+	memset(s, 0, sizeof(*s));
+
+	const size_t n = stats->n_records;
+	if (0 == n) {
+		return true;
+	}
+
+	double *values = malloc(n * sizeof(double));
+	if (NULL == values) {
+		return false;
+	}
+	const frame_record_t *r = stats->records;
+
+	s->seconds = (r[n - 1].timestamp_us - r[0].timestamp_us) / 1e6;
+	if (s->seconds > 0) {
+		s->fps = (n - 1) / s->seconds;
+	}
+
+	// intervals, then their deviation from the median interval
+	for (size_t i = 1; i < n; ++i) {
+		values[i - 1] = (double)(r[i].timestamp_us - r[i - 1].timestamp_us) / 1e3;
+	}
+	s->interval = distribution(values, n - 1);
+	for (size_t i = 1; i < n; ++i) {
+		double d = (double)(r[i].timestamp_us - r[i - 1].timestamp_us) / 1e3 - s->interval.p50;
+		values[i - 1] = d < 0 ? -d : d;
+	}
+	s->jitter = distribution(values, n - 1);
+
+	if (stats->monotonic) {
+		for (size_t i = 0; i < n; ++i) {
+			double ms = (double)(int64_t)(r[i].dequeue_us - r[i].timestamp_us) / 1e3;
+			values[i] = ms;
+			size_t b = 0;
+			while (b < HISTOGRAM_BUCKETS - 1 && ms >= histogram_limits[b]) {
+				++b;
+			}
+			++s->histogram[b];
+		}
+		s->latency = distribution(values, n);
+	}
+
+	for (size_t i = 0; i < n; ++i) {
+		values[i] = r[i].dqbuf_ns / 1e3;
+	}
+	s->dqbuf = distribution(values, n);
+	for (size_t i = 0; i < n; ++i) {
+		values[i] = r[i].process_ns / 1e3;
+	}
+	s->process = distribution(values, n);
+	for (size_t i = 0; i < n; ++i) {
+		values[i] = r[i].qbuf_ns / 1e3;
+	}
+	s->qbuf = distribution(values, n);
+
+	free(values);
+	return true;
+}
+
+
+static void print_distribution(FILE *f, const char *title, const char *units, const distribution_t *d) {
+	fprintf(f, "  %-10s %-3s mean %9.3f  p50 %9.3f  p90 %9.3f  p99 %9.3f  max %9.3f\n",
+		title, units, d->mean, d->p50, d->p90, d->p99, d->max);
+}
+
+
+void frame_stats_print(const frame_stats_t *stats, const char *name, FILE *f) {
+	summary_t s;
+	if (!summarise(stats, &s)) {
+		fprintf(f, "%s: out of memory for statistics\n", name);
+		return;
+	}
+
+	fprintf(f, "%s: %llu frames, %u dropped in %u gaps, %u short\n",
+		name, (unsigned long long)stats->frames, stats->dropped, stats->gaps, stats->short_frames);
+	if (stats->incomplete) {
+		fprintf(f, "  timing of the first %zu frames only, out of memory for more\n", stats->n_records);
+	}
+	fprintf(f, "  fps: %.3f over %.3f s\n", s.fps, s.seconds);
+	print_distribution(f, "interval", "ms", &s.interval);
+	print_distribution(f, "jitter", "ms", &s.jitter);
+	print_distribution(f, "dqbuf", "us", &s.dqbuf);
+	print_distribution(f, "process", "us", &s.process);
+	print_distribution(f, "qbuf", "us", &s.qbuf);
+
+	if (!stats->monotonic) {
+		fprintf(f, "  latency: unavailable, timestamps are not monotonic\n");
+		return;
+	}
+	print_distribution(f, "latency", "ms", &s.latency);
+
+	unsigned int largest = 1;
+	for (size_t b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+		if (s.histogram[b] > largest) {
+			largest = s.histogram[b];
+		}
+	}
+	for (size_t b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+		char label[16];
+		if (0 == histogram_limits[b]) {
+			snprintf(label, sizeof(label), ">= %u", histogram_limits[b - 1]);
+		} else {
+			snprintf(label, sizeof(label), "< %u", histogram_limits[b]);
+		}
+		int bar = (40 * s.histogram[b] + largest - 1) / largest;
+		fprintf(f, "  %8s ms %8u |%.*s\n", label, s.histogram[b], bar,
+			"########################################");
+	}
+}
+
+
+// a quoted string with quotes, backslashes and control characters escaped
+static void json_string(FILE *f, const char *s) {
+	fputc('"', f);
+	for (; '\0' != *s; ++s) {
+		const unsigned char c = *s;
+		if ('"' == c || '\\' == c) {
+			fprintf(f, "\\%c", c);
+		} else if (c < 0x20) {
+			fprintf(f, "\\u%04x", c);
+		} else {
+			fputc(c, f);
+		}
+	}
+	fputc('"', f);
+}
+
+static void json_distribution(FILE *f, const char *title, const distribution_t *d) {
+	fprintf(f, ",\"%s\":{\"mean\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f}",
+		title, d->mean, d->p50, d->p90, d->p99, d->max);
+}
+
+
+void frame_stats_json(const frame_stats_t *stats, const char *name, FILE *f) {
+	summary_t s;
+	if (!summarise(stats, &s)) {
+		fprintf(f, "{\"device\":");
+		json_string(f, name);
+		fprintf(f, ",\"error\":\"out of memory\"}");
+		return;
+	}
+
+	fprintf(f, "{\"device\":");
+	json_string(f, name);
+	fprintf(f, ",\"frames\":%llu,\"dropped\":%u,\"gaps\":%u,\"short\":%u",
+		(unsigned long long)stats->frames, stats->dropped, stats->gaps, stats->short_frames);
+	// timed is the frames the distributions cover
+	fprintf(f, ",\"timed\":%zu,\"incomplete\":%s", stats->n_records, stats->incomplete ? "true" : "false");
+	fprintf(f, ",\"seconds\":%.3f,\"fps\":%.3f", s.seconds, s.fps);
+	json_distribution(f, "interval_ms", &s.interval);
+	json_distribution(f, "jitter_ms", &s.jitter);
+	json_distribution(f, "dqbuf_us", &s.dqbuf);
+	json_distribution(f, "process_us", &s.process);
+	json_distribution(f, "qbuf_us", &s.qbuf);
+	if (stats->monotonic) {
+		json_distribution(f, "latency_ms", &s.latency);
+		fprintf(f, ",\"latency_histogram\":[");
+		for (size_t b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+			fprintf(f, "%s{\"below_ms\":", 0 == b ? "" : ",");
+			if (0 == histogram_limits[b]) {
+				fprintf(f, "null");
+			} else {
+				fprintf(f, "%u", histogram_limits[b]);
+			}
+			fprintf(f, ",\"count\":%u}", s.histogram[b]);
+		}
+		fprintf(f, "]");
+	}
+	fprintf(f, "}");
+}
+
+
+void frame_stats_log(const frame_stats_t *stats, const char *name, FILE *f) {
+	for (size_t i = 0; i < stats->n_records; ++i) {
+		const frame_record_t *r = &stats->records[i];
+		fprintf(f, "%s,%zu,%u,%llu,%llu,%u,%u,%u,%u,%d\n",
+			name, i, r->sequence,
+			(unsigned long long)r->timestamp_us,
+			(unsigned long long)r->dequeue_us,
+			r->bytesused, r->dqbuf_ns, r->process_ns, r->qbuf_ns,
+			frame_stats_is_short(stats, r));
+	}
+}
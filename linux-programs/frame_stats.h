@@ -0,0 +1,57 @@
+// frame timing and drop statistics
+
+#ifndef _FRAME_STATS_H_
+#define _FRAME_STATS_H_ 1
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// one dequeued buffer
+typedef struct {
+	uint32_t sequence;      // V4L2 sequence number
+	uint64_t timestamp_us;  // V4L2 buffer timestamp
+	uint64_t dequeue_us;    // CLOCK_MONOTONIC when DQBUF returned
+	uint32_t bytesused;
+	uint32_t dqbuf_ns;      // time spent in VIDIOC_DQBUF
+	uint32_t process_ns;    // time spent processing the frame
+	uint32_t qbuf_ns;       // time spent in VIDIOC_QBUF
+} frame_record_t;
+
+// accumulated records for one device
+typedef struct {
+	frame_record_t *records;
+	size_t n_records;
+	size_t capacity;
+	uint64_t frames;        // all recorded, n_records falls short if incomplete
+	bool incomplete;        // out of memory, records stopped after n_records
+	uint32_t last_sequence; // of the latest frame, for the gap check
+	size_t frame_size;      // expected bytesused, 0 => unknown
+	bool monotonic;         // timestamps are comparable with dequeue_us
+	bool sequenced;         // sequence numbers are valid
+	uint32_t dropped;       // frames missing from sequence gaps
+	uint32_t gaps;          // number of sequence gaps
+	uint32_t short_frames;  // frames with bytesused < frame_size
+} frame_stats_t;
+
+void frame_stats_init(frame_stats_t *stats, size_t frame_size, bool sequenced, bool monotonic);
+void frame_stats_free(frame_stats_t *stats);
+
+// add a record, returns the number of frames dropped before it.  The
+// counters keep going when the records cannot grow, the timing
+// summaries and the log then cover only the frames before that
+uint32_t frame_stats_record(frame_stats_t *stats, const frame_record_t *record);
+
+bool frame_stats_is_short(const frame_stats_t *stats, const frame_record_t *record);
+
+// summaries
+void frame_stats_print(const frame_stats_t *stats, const char *name, FILE *f);
+void frame_stats_json(const frame_stats_t *stats, const char *name, FILE *f);
+
+// one CSV line per record, the columns of FRAME_STATS_LOG_HEADER
+#define FRAME_STATS_LOG_HEADER \
+	"device,frame,sequence,timestamp_us,dequeue_us,bytesused,dqbuf_ns,process_ns,qbuf_ns,short\n"
+void frame_stats_log(const frame_stats_t *stats, const char *name, FILE *f);
+
+#endif
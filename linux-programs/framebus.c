@@ -0,0 +1,296 @@
+// shared memory frame bus: one publisher, any number of readers
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <linux/futex.h>
+
+#include "framebus.h"
+
+
+#define ROUND_UP(n, a) (((n) + (a) - 1) / (a) * (a))
+
+
+static bool fail(framebus_t *bus, const char *operation) {
+	bus->error = operation;
+	return false;
+}
+
+static bool fail_errno(framebus_t *bus, const char *operation, int error) {
+	errno = error;
+	return fail(bus, operation);
+}
+
+static int futex(uint32_t *word, int op, uint32_t value, const struct timespec *timeout) {
+	return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+static void wake_readers(framebus_header_t *h) {
+	__atomic_add_fetch(&h->wake, 1, __ATOMIC_SEQ_CST);
+	if (0 != __atomic_load_n(&h->waiters, __ATOMIC_SEQ_CST)) {
+		futex(&h->wake, FUTEX_WAKE, INT_MAX, NULL);
+	}
+}
+
+static bool set_name(framebus_t *bus, const char *name) {
+	int n = snprintf(bus->name, sizeof(bus->name), "%s%s", '/' == name[0] ? "" : "/", name);
+	if (n < 0 || n >= sizeof(bus->name)) {
+		return fail_errno(bus, "name too long", ENAMETOOLONG);
+	}
+	return true;
+}
+
+static void *map(framebus_t *bus, int fd, size_t size) {
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (MAP_FAILED == p) {
+		fail(bus, "mmap");
+		return NULL;
+	}
+	return p;
+}
+
+
+// tell readers of a bus left by an earlier publisher that it has gone
+static void close_stale(const char *name) {
+	int fd = shm_open(name, O_RDWR, 0);
+	if (-1 == fd) {
+		return;
+	}
+	struct stat st;
+	if (0 == fstat(fd, &st) && st.st_size >= sizeof(framebus_header_t)) {
+		framebus_header_t *h = mmap(NULL, sizeof(*h), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (MAP_FAILED != h) {
+			if (FRAMEBUS_MAGIC == h->magic) {
+				__atomic_store_n(&h->closed, 1, __ATOMIC_SEQ_CST);
+				wake_readers(h);
+			}
+			munmap(h, sizeof(*h));
+		}
+	}
+	close(fd);
+	shm_unlink(name);
+}
+
+
+bool framebus_create(framebus_t *bus, const char *name, unsigned int slots, size_t slot_size) {
+	memset(bus, 0, sizeof(*bus));
+	bus->publisher = true;
+
+	if (!set_name(bus, name)) {
+		return false;
+	}
+	if (slots < 2) {
+		return fail_errno(bus, "at least two slots are needed", EINVAL);
+	}
+
+	size_t header_size = sizeof(framebus_header_t) + slots * sizeof(framebus_slot_t);
+	size_t data_offset = ROUND_UP(header_size, FRAMEBUS_ALIGN);
+	slot_size = ROUND_UP(slot_size, FRAMEBUS_ALIGN);
+	bus->size = data_offset + slots * slot_size;
+
+	close_stale(bus->name);
+
+	int fd = shm_open(bus->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (-1 == fd) {
+		return fail(bus, "shm_open");
+	}
+	if (-1 == ftruncate(fd, bus->size)) {
+		int error = errno;
+		close(fd);
+		shm_unlink(bus->name);
+		return fail_errno(bus, "ftruncate", error);
+	}
+	bus->header = map(bus, fd, bus->size);
+	close(fd);
+	if (NULL == bus->header) {
+		shm_unlink(bus->name);
+		return false;
+	}
+
+	// ftruncate zero filled everything, publish the layout last
+	framebus_header_t *h = bus->header;
+	h->version = FRAMEBUS_VERSION;
+	h->slots = slots;
+	h->slot_size = slot_size;
+	h->data_offset = data_offset;
+	__atomic_store_n(&h->magic, FRAMEBUS_MAGIC, __ATOMIC_RELEASE);
+	return true;
+}
+
+
+bool framebus_publish(framebus_t *bus, const void *data, size_t size,
+		      uint32_t sequence, uint64_t timestamp_us) {
+	framebus_header_t *h = bus->header;
+	uint64_t frame = h->published + 1;
+	uint32_t index = (frame - 1) % h->slots;
+	framebus_slot_t *s = &h->slot[index];
+
+	if (size > h->slot_size) {
+		size = h->slot_size;
+	}
+
+	// odd lock: readers holding the old frame in this slot will see the change
+	uint32_t lock = s->lock + 1;
+	__atomic_store_n(&s->lock, lock, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memcpy((uint8_t *)h + h->data_offset + index * h->slot_size, data, size);
+	s->sequence = sequence;
+	s->frame = frame;
+	s->timestamp_us = timestamp_us;
+	s->bytesused = size;
+
+	__atomic_store_n(&s->lock, lock + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&h->published, frame, __ATOMIC_SEQ_CST);
+	wake_readers(h);
+	return true;
+}
+
+
+bool framebus_attach(framebus_t *bus, const char *name) {
+	memset(bus, 0, sizeof(*bus));
+
+	if (!set_name(bus, name)) {
+		return false;
+	}
+
+	int fd = shm_open(bus->name, O_RDWR, 0);
+	if (-1 == fd) {
+		return fail(bus, "shm_open");
+	}
+
+	struct stat st;
+	if (-1 == fstat(fd, &st)) {
+		int error = errno;
+		close(fd);
+		return fail_errno(bus, "fstat", error);
+	}
+	if (st.st_size < sizeof(framebus_header_t)) {
+		close(fd);
+		return fail_errno(bus, "not a frame bus", EINVAL);
+	}
+	bus->size = st.st_size;
+	bus->header = map(bus, fd, bus->size);
+	close(fd);
+	if (NULL == bus->header) {
+		return false;
+	}
+
+	framebus_header_t *h = bus->header;
+	if (FRAMEBUS_MAGIC != __atomic_load_n(&h->magic, __ATOMIC_ACQUIRE)
+	    || FRAMEBUS_VERSION != h->version
+	    || h->data_offset + (uint64_t)h->slots * h->slot_size > bus->size) {
+		munmap(bus->header, bus->size);
+		bus->header = NULL;
+		return fail_errno(bus, "not a frame bus", EINVAL);
+	}
+
+	// start with the next frame to be published
+	bus->next = __atomic_load_n(&h->published, __ATOMIC_ACQUIRE) + 1;
+	return true;
+}
+
+
+// block until the wake counter moves on from wake
+// returns false on timeout
+static bool wait_for_publish(framebus_header_t *h, uint32_t wake, int timeout_ms) {
+	struct timespec timeout;
+	struct timespec *t = NULL;
+	if (timeout_ms >= 0) {
+		timeout.tv_sec = timeout_ms / 1000;
+		timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+		t = &timeout;
+	}
+
+	int r = futex(&h->wake, FUTEX_WAIT, wake, t);
+	return !(-1 == r && ETIMEDOUT == errno);
+}
+
+int framebus_next(framebus_t *bus, framebus_frame_t *frame, int timeout_ms) {
+	framebus_header_t *h = bus->header;
+
+	for (;;) {
+		uint32_t wake = __atomic_load_n(&h->wake, __ATOMIC_SEQ_CST);
+		uint64_t published = __atomic_load_n(&h->published, __ATOMIC_SEQ_CST);
+
+		if (published < bus->next) {
+			if (__atomic_load_n(&h->closed, __ATOMIC_SEQ_CST)) {
+				return -1;
+			}
+			if (0 == timeout_ms) {
+				return 0;
+			}
+			__atomic_add_fetch(&h->waiters, 1, __ATOMIC_SEQ_CST);
+			bool woken = true;
+			if (__atomic_load_n(&h->published, __ATOMIC_SEQ_CST) < bus->next) {
+				woken = wait_for_publish(h, wake, timeout_ms);
+			}
+			__atomic_sub_fetch(&h->waiters, 1, __ATOMIC_SEQ_CST);
+			if (!woken) {
+				return 0;
+			}
+			continue;
+		}
+
+		// fallen behind: skip to the oldest frame still in the ring
+		uint64_t oldest = published >= h->slots ? published - h->slots + 1 : 1;
+		if (bus->next < oldest) {
+			++bus->gaps;
+			bus->missed += oldest - bus->next;
+			bus->next = oldest;
+		}
+
+		uint32_t index = (bus->next - 1) % h->slots;
+		framebus_slot_t *s = &h->slot[index];
+		uint32_t lock = __atomic_load_n(&s->lock, __ATOMIC_ACQUIRE);
+		if (0 != (lock & 1)) {
+			continue;  // being overwritten, so this reader is behind
+		}
+		frame->frame = s->frame;
+		frame->sequence = s->sequence;
+		frame->timestamp_us = s->timestamp_us;
+		frame->bytesused = s->bytesused;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (lock != __atomic_load_n(&s->lock, __ATOMIC_RELAXED) || frame->frame != bus->next) {
+			continue;
+		}
+
+		frame->lock = lock;
+		frame->slot = index;
+		frame->data = (const uint8_t *)h + h->data_offset + index * h->slot_size;
+		++bus->next;
+		++bus->frames;
+		return 1;
+	}
+}
+
+
+bool framebus_valid(const framebus_t *bus, const framebus_frame_t *frame) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return frame->lock == __atomic_load_n(&bus->header->slot[frame->slot].lock, __ATOMIC_RELAXED);
+}
+
+
+void framebus_close(framebus_t *bus) {
+	if (NULL == bus->header) {
+		return;
+	}
+	if (bus->publisher) {
+		__atomic_store_n(&bus->header->closed, 1, __ATOMIC_SEQ_CST);
+		wake_readers(bus->header);
+		shm_unlink(bus->name);
+	}
+	munmap(bus->header, bus->size);
+	bus->header = NULL;
+}
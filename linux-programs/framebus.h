@@ -0,0 +1,94 @@
+// shared memory frame bus: one publisher, any number of readers
+//
+// frames are copied once into fixed slots of a POSIX shared memory
+// ring, readers look at them in place.  Each slot has a seqlock so a
+// reader can tell if the publisher overwrote the frame while it was in
+// use; the publisher never waits for readers, a reader that falls
+// behind skips to the oldest frame still in the ring and counts a gap
+
+#ifndef _FRAMEBUS_H_
+#define _FRAMEBUS_H_ 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define FRAMEBUS_MAGIC   0x53554246  // "FBUS"
+#define FRAMEBUS_VERSION 1
+
+#define FRAMEBUS_DEFAULT_SLOTS 8
+
+// slot data is page aligned
+#define FRAMEBUS_ALIGN 4096
+
+// per slot header, lock is odd while the slot is being written
+typedef struct {
+	uint32_t lock;
+	uint32_t sequence;       // V4L2 sequence
+	uint64_t frame;          // bus frame number, from 1
+	uint64_t timestamp_us;
+	uint32_t bytesused;
+	uint32_t reserved;
+} framebus_slot_t;
+
+// start of the shared memory
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;
+	uint32_t reserved;
+	uint64_t slot_size;      // bytes of data per slot
+	uint64_t data_offset;    // of slot 0 data from the start of the header
+	uint64_t published;      // frame number of the latest complete frame
+	uint32_t wake;           // futex, changes on every publish
+	uint32_t waiters;        // readers blocked on the futex
+	uint32_t closed;         // publisher has finished
+	uint32_t padding;
+	framebus_slot_t slot[];
+} framebus_header_t;
+
+typedef struct {
+	char name[256];
+	framebus_header_t *header;
+	size_t size;             // of the mapping
+	bool publisher;
+	const char *error;       // operation that failed, errno has the reason
+
+	// reader state
+	uint64_t next;           // frame number wanted next
+	uint64_t frames;         // frames delivered
+	uint64_t gaps;           // times the reader fell behind
+	uint64_t missed;         // frames skipped over
+} framebus_t;
+
+// a frame still inside the shared memory
+typedef struct {
+	const void *data;
+	uint32_t bytesused;
+	uint32_t sequence;
+	uint64_t frame;
+	uint64_t timestamp_us;
+	uint32_t lock;           // seqlock value when fetched
+	uint32_t slot;
+} framebus_frame_t;
+
+// all return false on failure with bus->error and errno set
+
+// name is a shared memory object name, the leading '/' is optional
+bool framebus_create(framebus_t *bus, const char *name, unsigned int slots, size_t slot_size);
+bool framebus_publish(framebus_t *bus, const void *data, size_t size,
+		      uint32_t sequence, uint64_t timestamp_us);
+
+bool framebus_attach(framebus_t *bus, const char *name);
+
+// wait up to timeout_ms (-1 => forever) for the next frame
+// returns 1 for a frame, 0 on timeout and -1 once the publisher has closed
+int framebus_next(framebus_t *bus, framebus_frame_t *frame, int timeout_ms);
+
+// true if the frame was not overwritten while it was being used
+bool framebus_valid(const framebus_t *bus, const framebus_frame_t *frame);
+
+// the publisher marks the bus closed and removes the name
+void framebus_close(framebus_t *bus);
+
+#endif
@@ -0,0 +1,162 @@
+// read frames from a capture output file
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "framefile.h"
+
+
+static bool fail(framefile_t *file, const char *operation) {
+	file->error = operation;
+	return false;
+}
+
+
+bool framefile_open(framefile_t *file, const char *name, unsigned int width, unsigned int height) {
+	memset(file, 0, sizeof(*file));
+	file->name = name;
+	file->width = width;
+	file->height = height;
+	file->frame_size = width * height * sizeof(uint16_t);
+
+	if (0 == file->frame_size) {
+		file->fd = -1;
+		errno = EINVAL;
+		return fail(file, "frame size");
+	}
+
+	file->fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (-1 == file->fd) {
+		return fail(file, "open");
+	}
+	struct stat st;
+	if (-1 == fstat(file->fd, &st)) {
+		int saved = errno;
+		close(file->fd);
+		file->fd = -1;
+		errno = saved;
+		return fail(file, "fstat");
+	}
+	file->frames = st.st_size / file->frame_size;
+	return true;
+}
+
+
+bool framefile_read(framefile_t *file, uint64_t index, uint16_t *pixels) {
+	return framefile_read_pixels(file, index, 0, file->width * file->height, pixels);
+}
+
+
+bool framefile_read_pixels(framefile_t *file, uint64_t index, size_t first, size_t count,
+			   uint16_t *pixels) {
+	if (index >= file->frames || first + count > file->width * file->height) {
+		errno = ERANGE;
+		return fail(file, "frame index");
+	}
+	uint8_t *p = (uint8_t *)pixels;
+	size_t remaining = count * sizeof(uint16_t);
+	off_t offset = index * file->frame_size + first * sizeof(uint16_t);
+	while (remaining > 0) {
+		ssize_t n = pread(file->fd, p, remaining, offset);
+		if (-1 == n && EINTR == errno) {
+			continue;
+		}
+		if (-1 == n) {
+			return fail(file, "pread");
+		}
+		if (0 == n) {
+			errno = EIO;  // truncated since it was opened
+			return fail(file, "short read");
+		}
+		p += n;
+		offset += n;
+		remaining -= n;
+	}
+	return true;
+}
+
+
+void framefile_close(framefile_t *file) {
+	if (-1 != file->fd) {
+		close(file->fd);
+		file->fd = -1;
+	}
+}
+
+
+bool framefile_is_manifest(const char *name) {
+	static const char extension[] = ".manifest";
+	size_t n = strlen(name);
+	return n > sizeof(extension) - 1 && 0 == strcmp(name + n - (sizeof(extension) - 1), extension);
+}
+
+
+// each line is: segment-name first-frame frames bytes.  Segments are
+// only listed once closed, so each must hold whole frames of one size
+// and be as long as listed; a short trailing frame or a lost tail fails
+// the whole manifest rather than shifting the frame numbers after it
+bool framefile_manifest(const char *manifest, bool (*add)(void *context, char *path), void *context) {
+	FILE *fp = fopen(manifest, "r");
+	if (NULL == fp) {
+		return false;
+	}
+
+	// segment names are relative to the manifest
+	const char *slash = strrchr(manifest, '/');
+	int dir_length = NULL == slash ? 0 : slash - manifest + 1;
+
+	bool rc = true;
+	uint64_t next_frame = 0;
+	char line[512];
+	while (rc && NULL != fgets(line, sizeof(line), fp)) {
+		char name[320];
+		unsigned long long first;
+		unsigned long long frames;
+		unsigned long long bytes;
+		const int fields = sscanf(line, "%319s %llu %llu %llu", name, &first, &frames, &bytes);
+		if (fields <= 0) {
+			continue;
+		}
+		if (4 != fields || first != next_frame || 0 == frames || 0 != bytes % frames) {
+			errno = EINVAL;
+			rc = false;
+			break;
+		}
+		next_frame += frames;
+		char *path = malloc(dir_length + strlen(name) + 1);
+		if (NULL == path) {
+			errno = ENOMEM;
+			rc = false;
+			break;
+		}
+		if ('/' == name[0]) {
+			strcpy(path, name);
+		} else {
+			sprintf(path, "%.*s%s", dir_length, manifest, name);
+		}
+		struct stat st;
+		const bool found = 0 == stat(path, &st);
+		if (!found || (uint64_t)st.st_size != bytes) {
+			if (found) {
+				errno = EIO;
+			}
+			free(path);
+			rc = false;
+			break;
+		}
+		rc = add(context, path);
+	}
+	if (rc && ferror(fp)) {
+		errno = EIO;
+		rc = false;
+	}
+	fclose(fp);
+	return rc;
+}
@@ -0,0 +1,52 @@
+// read frames from a capture output file
+//
+// a capture file is raw frames back to back with no header.  Frames are
+// read by index with pread(), so any number of threads can share one
+// open file.  A partial frame at the end, as left by an interrupted
+// capture, is not counted
+
+#ifndef _FRAMEFILE_H_
+#define _FRAMEFILE_H_ 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+	int fd;
+	const char *name;
+	unsigned int width;
+	unsigned int height;
+	size_t frame_size;       // bytes, 16 bit pixels
+	uint64_t frames;         // complete frames in the file
+	const char *error;       // operation that failed, errno has the reason
+} framefile_t;
+
+// all return false on failure with file->error and errno set
+
+bool framefile_open(framefile_t *file, const char *name, unsigned int width, unsigned int height);
+
+// read frame index into pixels, which holds width * height
+bool framefile_read(framefile_t *file, uint64_t index, uint16_t *pixels);
+
+// read count pixels from first on of frame index, such as the embedded data
+bool framefile_read_pixels(framefile_t *file, uint64_t index, size_t first, size_t count,
+			   uint16_t *pixels);
+
+void framefile_close(framefile_t *file);
+
+
+// segment manifests written by capture (see segment.h) stand for the
+// segments they list
+
+// true if name ends in ".manifest"
+bool framefile_is_manifest(const char *name);
+
+// call add with the path of each segment in order, relative names are
+// made relative to the manifest.  path is malloc()ed and belongs to add.
+// Returns false with errno set if the manifest cannot be read or add
+// returns false, and with EINVAL or EIO if a line is damaged or a
+// segment is not the whole frames it lists
+bool framefile_manifest(const char *manifest, bool (*add)(void *context, char *path), void *context);
+
+#endif
@@ -0,0 +1,139 @@
+// fuse several frames of a still sample into one with less noise
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "bayer_green.h"
+#include "embed.h"
+#include "fusion.h"
+
+
+// unchanged frames that make a focus hold, as capture uses
+#define HOLD_FRAMES 3
+
+
+static bool fail(fusion_t *fusion, const char *operation) {
+	fusion->error = operation;
+	return false;
+}
+
+
+bool fusion_init(fusion_t *fusion, unsigned int width, unsigned int height) {
+	memset(fusion, 0, sizeof(*fusion));
+	fusion->width = width;
+	fusion->height = height;
+	fusion->sum = calloc(width * height, sizeof(uint32_t));
+	if (NULL == fusion->sum) {
+		errno = ENOMEM;
+		return fail(fusion, "out of memory");
+	}
+	return true;
+}
+
+
+void fusion_add(fusion_t *fusion, const uint16_t *bayer) {
+	const size_t n = fusion->width * fusion->height;
+	uint32_t *restrict sum = fusion->sum;
+	for (size_t i = 0; i < n; ++i) {
+		sum[i] += bayer[i] & PIXEL_MASK;
+	}
+	++fusion->frames;
+}
+
+
+bool fusion_result(const fusion_t *fusion, uint16_t *bayer) {
+	const uint32_t frames = fusion->frames;
+	if (0 == frames) {
+		return false;
+	}
+	const size_t n = fusion->width * fusion->height;
+	const uint32_t *restrict sum = fusion->sum;
+	for (size_t i = 0; i < n; ++i) {
+		bayer[i] = (sum[i] + frames / 2) / frames;
+	}
+	return true;
+}
+
+
+void fusion_reset(fusion_t *fusion) {
+	memset(fusion->sum, 0, fusion->width * fusion->height * sizeof(uint32_t));
+	fusion->frames = 0;
+}
+
+
+void fusion_free(fusion_t *fusion) {
+	free(fusion->sum);
+	fusion->sum = NULL;
+}
+
+
+// end of the run of frames at the same focus position starting at i
+static size_t run_end(const embed_t *embeds, size_t n, size_t i) {
+	size_t end = i + 1;
+	if (embeds[i].present) {
+		while (end < n && embeds[end].present && embeds[i].steps == embeds[end].steps) {
+			++end;
+		}
+	}
+	return end;
+}
+
+
+size_t fusion_select(const embed_t *embeds, size_t n, size_t k, size_t *first, size_t *best) {
+	if (0 == n || 0 == k) {
+		*first = *best = 0;
+		return 0;
+	}
+
+	// the run holding the highest contrast, the longest of equals, as
+	// the motor holds at the best position the sweep passed through.
+	// The contrast nibbles are zero unless the firmware measures it
+	size_t b = n;
+	size_t low = 0;
+	size_t high = n;
+	for (size_t i = 0; i < n; i = run_end(embeds, n, i)) {
+		size_t end = run_end(embeds, n, i);
+		size_t top = i;
+		for (size_t j = i + 1; j < end; ++j) {
+			if (embeds[j].contrast > embeds[top].contrast) {
+				top = j;
+			}
+		}
+		if (!embeds[top].present || 0 == embeds[top].contrast) {
+			continue;
+		}
+		if (n == b || embeds[top].contrast > embeds[b].contrast
+		    || (embeds[top].contrast == embeds[b].contrast && end - i > high - low)) {
+			b = top;
+			low = i;
+			high = end;
+		}
+	}
+	if (n == b) {
+		focus_tracker_t tracker;
+		focus_tracker_init(&tracker, HOLD_FRAMES);
+		for (size_t i = 0; i < n; ++i) {
+			if (focus_tracker_update(&tracker, &embeds[i])) {
+				b = i;
+			}
+		}
+		if (n == b) {
+			b = n - 1;
+		}
+		for (low = b; low > 0 && run_end(embeds, n, low - 1) > b; --low) {
+		}
+		high = run_end(embeds, n, b);
+	}
+
+	// centred on the best where the run allows
+	size_t start = b - low > k / 2 ? b - k / 2 : low;
+	size_t end = high - start > k ? start + k : high;
+	start = end - low > k ? end - k : low;
+
+	*first = start;
+	*best = b;
+	return end - start;
+}
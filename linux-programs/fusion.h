@@ -0,0 +1,51 @@
+// fuse several frames of a still sample into one with less noise
+//
+// frames are added one at a time into a per-pixel sum, so memory does
+// not grow with the number fused, and the result is their mean.  All
+// the frames should be at the same focus position: fusion_select()
+// chooses them around best focus from the embedded data
+
+#ifndef _FUSION_H_
+#define _FUSION_H_ 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "embed.h"
+
+// frames to fuse when not told
+#define FUSION_DEFAULT_FRAMES 8
+
+typedef struct {
+	unsigned int width;
+	unsigned int height;
+	uint32_t *sum;           // width * height
+	unsigned int frames;     // added since the last reset
+	const char *error;       // operation that failed, errno has the reason
+} fusion_t;
+
+// returns false with fusion->error and errno set
+bool fusion_init(fusion_t *fusion, unsigned int width, unsigned int height);
+
+// add a raw frame, the embedded data in the high nibbles is ignored
+void fusion_add(fusion_t *fusion, const uint16_t *bayer);
+
+// the rounded mean of the frames added, as a raw frame
+// returns false if none were added
+bool fusion_result(const fusion_t *fusion, uint16_t *bayer);
+
+// start again with no frames
+void fusion_reset(fusion_t *fusion);
+
+void fusion_free(fusion_t *fusion);
+
+
+// choose up to k consecutive frames at one focus position around the
+// best focused of n frames, given their embedded data.  Best focus is
+// the highest contrast when the firmware reports it, else where the
+// focus motor last came to hold, else the last frame.  Returns the
+// number chosen, which start at *first, and the best frame in *best
+size_t fusion_select(const embed_t *embeds, size_t n, size_t k, size_t *first, size_t *best);
+
+#endif
@@ -0,0 +1,70 @@
+// write a demosaiced image as a 16 bit RGB PNG
+
+#include <png.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ahd_bayer.h"
+#include "image_png.h"
+
+
+bool image_write_png(const ahd_pixel_t *image, const int width, const int height, const char *path) {
+
+	bool rc = false; // assume failure
+
+	const int depth = 8 * sizeof(ahd_pixel_t);       // number of bits in a pixel
+
+	FILE *fp = fopen(path, "wb");
+	if (NULL == fp) {
+		goto fopen_failed;
+	}
+
+	png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (NULL == png_ptr) {
+		goto png_create_write_struct_failed;
+	}
+
+	png_infop info_ptr = png_create_info_struct(png_ptr);
+	if (NULL == info_ptr) {
+		goto png_create_info_struct_failed;
+	}
+
+	// error handling
+	if (setjmp(png_jmpbuf(png_ptr))) {
+		goto png_failure;
+	}
+
+	// image attributes
+	png_set_IHDR(png_ptr, info_ptr,
+		     width, height, depth,
+		     PNG_COLOR_TYPE_RGB,
+		     PNG_INTERLACE_NONE,
+		     PNG_COMPRESSION_TYPE_DEFAULT,
+		     PNG_FILTER_TYPE_DEFAULT);
+
+	// PNG row pointers
+	png_byte **row_pointers = png_malloc(png_ptr, height * sizeof(png_byte *));
+	for (size_t y = 0; y < height; ++y) {
+		row_pointers[y] = (png_byte *)&image[y * width * 3];  // R G B pixel order
+	}
+
+	// create PNG
+	png_init_io(png_ptr, fp);
+	png_set_rows(png_ptr, info_ptr, row_pointers);
+	png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+
+	// no need to free the actual rows as these are owned by the caller
+	png_free(png_ptr, row_pointers);
+
+	rc = true; // success
+
+png_failure:
+png_create_info_struct_failed:
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+png_create_write_struct_failed:
+	fclose(fp);
+fopen_failed:
+	return rc;  // success if true
+}
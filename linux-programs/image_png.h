@@ -0,0 +1,13 @@
+// write a demosaiced image as a 16 bit RGB PNG
+
+#ifndef _IMAGE_PNG_H_
+#define _IMAGE_PNG_H_ 1
+
+#include <stdbool.h>
+
+#include "ahd_bayer.h"
+
+// image is width * height R G B pixels as produced by ahd_decode()
+bool image_write_png(const ahd_pixel_t *image, int width, int height, const char *path);
+
+#endif
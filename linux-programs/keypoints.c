@@ -0,0 +1,395 @@
+// FAST keypoints with oriented binary descriptors
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "ahd_bayer.h"
+#include "bayer_green.h"
+#include "keypoints.h"
+
+
+// FAST circle size and the arc that makes a corner
+#define CIRCLE 16
+#define ARC    9
+
+// sixteen pixels and the masks from comparing them
+typedef uint8_t pixels_t __attribute__((vector_size(16)));
+typedef int8_t mask_t __attribute__((vector_size(16)));
+
+// the circle of radius 3, clockwise from the top
+static const int circle_x[CIRCLE] = { 0, 1, 2, 3, 3, 3, 2, 1, 0, -1, -2, -3, -3, -3, -2, -1 };
+static const int circle_y[CIRCLE] = { -3, -3, -2, -1, 0, 1, 2, 3, 3, 3, 2, 1, 0, -1, -2, -3 };
+
+// descriptor test pairs, x1 y1 x2 y2, and the half widths of the
+// orientation patch
+static int8_t pattern[KEYPOINTS_DESCRIPTOR_BITS][4];
+static int patch_half_width[KEYPOINTS_PATCH_RADIUS + 1];
+static pthread_once_t pattern_once = PTHREAD_ONCE_INIT;
+
+
+static bool fail(keypoints_t *keypoints, const char *operation) {
+	keypoints->error = operation;
+	return false;
+}
+
+// isotropic Gaussian points as in BRIEF, from a fixed seed so that
+// descriptors are the same in every process, clipped to the patch
+static void pattern_init(void) {
+	uint64_t state = 0x2545f4914f6cdd1dULL;
+	const double sigma = (2 * KEYPOINTS_PATCH_RADIUS + 1) / 5.0;
+	const int limit = KEYPOINTS_PATCH_RADIUS * KEYPOINTS_PATCH_RADIUS;
+	for (int i = 0; i < KEYPOINTS_DESCRIPTOR_BITS; ++i) {
+		for (int j = 0; j < 4; j += 2) {
+			int x, y;
+			do {
+				double u[2];
+				for (int k = 0; k < 2; ++k) {
+					state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+					u[k] = ((state >> 11) + 0.5) / 9007199254740992.0;
+				}
+				const double r = sigma * sqrt(-2 * log(u[0]));
+				x = lround(r * cos(2 * M_PI * u[1]));
+				y = lround(r * sin(2 * M_PI * u[1]));
+			} while (x * x + y * y > limit);
+			pattern[i][j] = x;
+			pattern[i][j + 1] = y;
+		}
+	}
+	for (int v = 0; v <= KEYPOINTS_PATCH_RADIUS; ++v) {
+		patch_half_width[v] = floor(sqrt(limit - v * v));
+	}
+}
+
+
+bool keypoints_init(keypoints_t *keypoints, unsigned int width, unsigned int height, unsigned int scale,
+		   unsigned int threshold, unsigned int max_keypoints) {
+	memset(keypoints, 0, sizeof(*keypoints));
+	pthread_once(&pattern_once, pattern_init);
+
+	if (width < 2 * KEYPOINTS_BORDER + 16 || height < 2 * KEYPOINTS_BORDER + 1
+	    || threshold < 1 || threshold > 255 || max_keypoints < 1) {
+		errno = EINVAL;
+		return fail(keypoints, "size");
+	}
+	keypoints->width = width;
+	keypoints->height = height;
+	keypoints->scale = scale;
+	keypoints->threshold = threshold;
+	keypoints->max_keypoints = max_keypoints;
+
+	const size_t pixels = (size_t)width * height;
+	keypoints->image = malloc(pixels);
+	keypoints->smooth = malloc(pixels);
+	keypoints->columns = malloc(width * sizeof(uint16_t));
+	keypoints->scores = calloc(pixels, sizeof(uint16_t));
+	keypoints->points = malloc(max_keypoints * sizeof(keypoints_point_t));
+	keypoints->descriptors = malloc(max_keypoints * sizeof(keypoints_descriptor_t));
+	keypoints->tests = malloc(KEYPOINTS_ANGLES * KEYPOINTS_DESCRIPTOR_BITS * 2 * sizeof(int32_t));
+	if (NULL == keypoints->tests || NULL == keypoints->image || NULL == keypoints->smooth || NULL == keypoints->columns
+	    || NULL == keypoints->scores || NULL == keypoints->points || NULL == keypoints->descriptors) {
+		keypoints_free(keypoints);
+		errno = ENOMEM;
+		return fail(keypoints, "malloc");
+	}
+
+	// the pattern rotated to each orientation, as offsets in this image
+	for (int a = 0; a < KEYPOINTS_ANGLES; ++a) {
+		const double c = cos(2 * M_PI * a / KEYPOINTS_ANGLES);
+		const double s = sin(2 * M_PI * a / KEYPOINTS_ANGLES);
+		int32_t *tests = &keypoints->tests[a * KEYPOINTS_DESCRIPTOR_BITS * 2];
+		for (int i = 0; i < KEYPOINTS_DESCRIPTOR_BITS; ++i) {
+			for (int j = 0; j < 2; ++j) {
+				const int x = pattern[i][2 * j];
+				const int y = pattern[i][2 * j + 1];
+				tests[2 * i + j] = lround(s * x + c * y) * (int)width + lround(c * x - s * y);
+			}
+		}
+	}
+	return true;
+}
+
+
+bool keypoints_green_image(keypoints_t *keypoints, const ahd_pixel_t *bayer, BayerTile tile) {
+	unsigned int g0, g1;
+	if (!bayer_green(tile, &g0, &g1)) {
+		return fail(keypoints, "tile");
+	}
+
+	const unsigned int width = keypoints->width;
+	const unsigned int raw_width = 2 * width;
+	for (unsigned int y = 0; y < keypoints->height; ++y) {
+		const ahd_pixel_t *row0 = &bayer[2 * y * raw_width];
+		const ahd_pixel_t *row1 = &bayer[(2 * y + 1) * raw_width];
+		uint8_t *out = &keypoints->image[y * width];
+		for (unsigned int x = 0; x < width; ++x) {
+			// two 12 bit greens to 8 bits
+			out[x] = ((row0[2 * x + g0] & PIXEL_MASK) + (row1[2 * x + g1] & PIXEL_MASK)) >> 5;
+		}
+	}
+	return true;
+}
+
+
+void keypoints_rgb_image(keypoints_t *keypoints, const ahd_pixel_t *rgb) {
+	const size_t pixels = (size_t)keypoints->width * keypoints->height;
+	for (size_t i = 0; i < pixels; ++i) {
+		const ahd_pixel_t *p = &rgb[3 * i];
+		// BT.601 luma, demosaic overshoot past 12 bits saturates
+		const uint32_t v = (77 * p[0] + 150 * p[1] + 29 * p[2]) >> 12;
+		keypoints->image[i] = v > 255 ? 255 : v;
+	}
+}
+
+
+// 5 by 5 box filter, edges repeated
+static void smooth(keypoints_t *keypoints) {
+	const int width = keypoints->width;
+	const int height = keypoints->height;
+	const uint8_t *image = keypoints->image;
+	uint16_t *columns = keypoints->columns;
+	for (int y = 0; y < height; ++y) {
+		memset(columns, 0, width * sizeof(uint16_t));
+		for (int dy = -2; dy <= 2; ++dy) {
+			const int sy = y + dy < 0 ? 0 : y + dy >= height ? height - 1 : y + dy;
+			const uint8_t *row = &image[sy * width];
+			for (int x = 0; x < width; ++x) {
+				columns[x] += row[x];
+			}
+		}
+		uint8_t *out = &keypoints->smooth[y * width];
+		unsigned int sum = 3 * columns[0] + columns[1] + columns[2];
+		for (int x = 0; x < width; ++x) {
+			out[x] = sum / 25;
+			const int add = x + 3 >= width ? width - 1 : x + 3;
+			const int drop = x - 2 < 0 ? 0 : x - 2;
+			sum += columns[add] - columns[drop];
+		}
+	}
+}
+
+
+static bool any(mask_t m) {
+	uint64_t words[2];
+	memcpy(words, &m, sizeof(words));
+	return 0 != (words[0] | words[1]);
+}
+
+// lanes where ARC contiguous entries of the circle are set
+static mask_t arc(const mask_t *set) {
+	mask_t pairs[CIRCLE];
+	mask_t fours[CIRCLE];
+	for (int i = 0; i < CIRCLE; ++i) {
+		pairs[i] = set[i] & set[(i + 1) % CIRCLE];
+	}
+	for (int i = 0; i < CIRCLE; ++i) {
+		fours[i] = pairs[i] & pairs[(i + 2) % CIRCLE];
+	}
+	mask_t found = { 0 };
+	for (int i = 0; i < CIRCLE; ++i) {
+		found |= fours[i] & fours[(i + 4) % CIRCLE] & set[(i + 8) % CIRCLE];
+	}
+	return found;
+}
+
+static void add_candidate(keypoints_t *keypoints, unsigned int x, unsigned int y, uint16_t score) {
+	if (keypoints->n_candidates == keypoints->candidates_allocated) {
+		size_t allocated = 0 == keypoints->candidates_allocated ? 4096 : 2 * keypoints->candidates_allocated;
+		keypoints_point_t *candidates = realloc(keypoints->candidates, allocated * sizeof(keypoints_point_t));
+		if (NULL == candidates) {
+			return;  // keep the corners found so far
+		}
+		keypoints->candidates = candidates;
+		keypoints->candidates_allocated = allocated;
+	}
+	keypoints_point_t *k = &keypoints->candidates[keypoints->n_candidates++];
+	k->x = x;
+	k->y = y;
+	k->angle = 0;
+	k->score = score;
+	keypoints->scores[y * keypoints->width + x] = score;
+}
+
+// the larger of the sums of the differences beyond the threshold of
+// the brighter and the darker pixels
+static uint16_t corner_score(const uint8_t *p, const int *offsets, int threshold) {
+	int brighter = 0;
+	int darker = 0;
+	for (int i = 0; i < CIRCLE; ++i) {
+		const int d = p[offsets[i]] - p[0];
+		if (d > threshold) {
+			brighter += d - threshold;
+		} else if (d < -threshold) {
+			darker += -d - threshold;
+		}
+	}
+	return brighter > darker ? brighter : darker;
+}
+
+static void detect_corners(keypoints_t *keypoints) {
+	const unsigned int width = keypoints->width;
+	const unsigned int end = width - KEYPOINTS_BORDER;
+	int offsets[CIRCLE];
+	for (int i = 0; i < CIRCLE; ++i) {
+		offsets[i] = circle_y[i] * (int)width + circle_x[i];
+	}
+	pixels_t threshold;
+	memset(&threshold, keypoints->threshold, sizeof(threshold));
+
+	for (unsigned int y = KEYPOINTS_BORDER; y < keypoints->height - KEYPOINTS_BORDER; ++y) {
+		const uint8_t *row = &keypoints->image[y * width];
+		for (unsigned int x = KEYPOINTS_BORDER; x < end; x += 16) {
+			const uint8_t *centre_row = &row[x];
+			pixels_t centre;
+			memcpy(&centre, centre_row, sizeof(centre));
+			mask_t brighter[CIRCLE];
+			mask_t darker[CIRCLE];
+			for (int i = 0; i < CIRCLE; i += 4) {
+				pixels_t p;
+				memcpy(&p, &centre_row[offsets[i]], sizeof(p));
+				brighter[i] = (mask_t)(p > centre) & (mask_t)(p - centre > threshold);
+				darker[i] = (mask_t)(centre > p) & (mask_t)(centre - p > threshold);
+			}
+
+			// any arc of ARC holds two adjacent compass points
+			mask_t possible = { 0 };
+			for (int i = 0; i < CIRCLE; i += 4) {
+				const int j = (i + 4) % CIRCLE;
+				possible |= (brighter[i] & brighter[j]) | (darker[i] & darker[j]);
+			}
+			if (!any(possible)) {
+				continue;
+			}
+
+			for (int i = 0; i < CIRCLE; ++i) {
+				if (0 == i % 4) {
+					continue;
+				}
+				pixels_t p;
+				memcpy(&p, &centre_row[offsets[i]], sizeof(p));
+				brighter[i] = (mask_t)(p > centre) & (mask_t)(p - centre > threshold);
+				darker[i] = (mask_t)(centre > p) & (mask_t)(centre - p > threshold);
+			}
+			const mask_t corners = arc(brighter) | arc(darker);
+			if (!any(corners)) {
+				continue;
+			}
+			for (unsigned int lane = 0; lane < 16 && x + lane < end; ++lane) {
+				if (0 != corners[lane]) {
+					add_candidate(keypoints, x + lane, y,
+						      corner_score(&row[x + lane], offsets, keypoints->threshold));
+				}
+			}
+		}
+	}
+}
+
+// no neighbour scores higher, ties go to the first in raster order
+static bool local_maximum(const keypoints_t *keypoints, const keypoints_point_t *k) {
+	const unsigned int width = keypoints->width;
+	const uint16_t *s = &keypoints->scores[(unsigned int)k->y * width + (unsigned int)k->x];
+	const uint16_t score = k->score;
+	return s[-(int)width - 1] < score && s[-(int)width] < score && s[-(int)width + 1] < score
+		&& s[-1] < score && s[1] <= score
+		&& s[width - 1] <= score && s[width] <= score && s[width + 1] <= score;
+}
+
+static int compare_score(const void *a, const void *b) {
+	const keypoints_point_t *x = a;
+	const keypoints_point_t *y = b;
+	if (x->score != y->score) {
+		return x->score < y->score ? 1 : -1;
+	}
+	if (x->y != y->y) {
+		return x->y < y->y ? -1 : 1;
+	}
+	return (x->x > y->x) - (x->x < y->x);
+}
+
+// intensity centroid of the patch
+static float orientation(const keypoints_t *keypoints, const keypoints_point_t *k) {
+	const int width = keypoints->width;
+	const uint8_t *centre = &keypoints->image[(int)k->y * width + (int)k->x];
+	int m10 = 0;
+	int m01 = 0;
+	for (int v = -KEYPOINTS_PATCH_RADIUS; v <= KEYPOINTS_PATCH_RADIUS; ++v) {
+		const int half = patch_half_width[abs(v)];
+		const uint8_t *row = &centre[v * width];
+		int sum = 0;
+		for (int u = -half; u <= half; ++u) {
+			m10 += u * row[u];
+			sum += row[u];
+		}
+		m01 += v * sum;
+	}
+	return atan2f(m01, m10);
+}
+
+static void describe(const keypoints_t *keypoints, const keypoints_point_t *k,
+		     keypoints_descriptor_t *descriptor) {
+	const uint8_t *centre = &keypoints->smooth[(int)k->y * keypoints->width + (int)k->x];
+
+	// angle is -pi to pi
+	const int a = (int)(k->angle * (KEYPOINTS_ANGLES / (2 * M_PI)) + KEYPOINTS_ANGLES + 0.5) % KEYPOINTS_ANGLES;
+	const int32_t *tests = &keypoints->tests[a * KEYPOINTS_DESCRIPTOR_BITS * 2];
+	for (int w = 0; w < KEYPOINTS_DESCRIPTOR_WORDS; ++w) {
+		uint64_t bits = 0;
+		for (int i = 0; i < 64; ++i, tests += 2) {
+			bits |= (uint64_t)(centre[tests[0]] < centre[tests[1]]) << i;
+		}
+		descriptor->bits[w] = bits;
+	}
+}
+
+
+bool keypoints_detect(keypoints_t *keypoints) {
+	keypoints->n_candidates = 0;
+	keypoints->count = 0;
+	smooth(keypoints);
+	detect_corners(keypoints);
+
+	// a corner always scores at least ARC, so 0 marks the suppressed
+	keypoints_point_t *candidates = keypoints->candidates;
+	for (size_t i = 0; i < keypoints->n_candidates; ++i) {
+		if (!local_maximum(keypoints, &candidates[i])) {
+			candidates[i].score = 0;
+		}
+	}
+	size_t kept = 0;
+	for (size_t i = 0; i < keypoints->n_candidates; ++i) {
+		keypoints->scores[(unsigned int)candidates[i].y * keypoints->width + (unsigned int)candidates[i].x] = 0;
+		if (0 != candidates[i].score) {
+			candidates[kept++] = candidates[i];
+		}
+	}
+	if (kept > keypoints->max_keypoints) {
+		qsort(candidates, kept, sizeof(keypoints_point_t), compare_score);
+		kept = keypoints->max_keypoints;
+	}
+
+	for (size_t i = 0; i < kept; ++i) {
+		keypoints_point_t *k = &keypoints->points[i];
+		*k = candidates[i];
+		k->angle = orientation(keypoints, k);
+		describe(keypoints, k, &keypoints->descriptors[i]);
+	}
+	keypoints->count = kept;
+	return true;
+}
+
+
+void keypoints_free(keypoints_t *keypoints) {
+	free(keypoints->image);
+	free(keypoints->smooth);
+	free(keypoints->columns);
+	free(keypoints->scores);
+	free(keypoints->candidates);
+	free(keypoints->points);
+	free(keypoints->descriptors);
+	free(keypoints->tests);
+	memset(keypoints, 0, sizeof(*keypoints));
+}
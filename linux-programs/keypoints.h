@@ -0,0 +1,175 @@
+// keypoints and binary descriptors, for matching a sample that is
+// partly hidden or has moved too far for a whole image fingerprint
+//
+// corners are FAST: a pixel is one when 9 contiguous pixels of the
+// circle of 16 around it are all brighter, or all darker, than it by
+// more than the threshold.  The circle tests run on 16 pixels at once
+// with vector extensions, only the corners found are scored, and a
+// corner is kept only when no neighbour scores higher.  Each keypoint
+// has an orientation from the intensity centroid of the patch around
+// it, and a 256 bit descriptor of pixel comparisons at pairs of points
+// rotated to that orientation in a smoothed copy of the image, so the
+// descriptors match whatever the rotation.
+//
+// images are 8 bit, either the green sites of a raw frame at half
+// resolution or the luma of an ahd_decode() frame.  Keypoints are in
+// image pixels, scale converts them to raw pixels
+
+#ifndef _KEYPOINTS_H_
+#define _KEYPOINTS_H_ 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "ahd_bayer.h"
+#include "fingerprint.h"
+
+#define KEYPOINTS_DEFAULT_THRESHOLD 20
+#define KEYPOINTS_DEFAULT_MAX 2000
+
+#define KEYPOINTS_DESCRIPTOR_BITS  256
+#define KEYPOINTS_DESCRIPTOR_WORDS (KEYPOINTS_DESCRIPTOR_BITS / 64)
+
+// descriptors are steered to the nearest of this many orientations
+#define KEYPOINTS_ANGLES 30
+
+// descriptor points lie within this radius, keypoints are kept clear
+// of the edges by it and the box filter
+#define KEYPOINTS_PATCH_RADIUS 15
+#define KEYPOINTS_BORDER       (KEYPOINTS_PATCH_RADIUS + 3)
+
+typedef struct {
+	uint64_t bits[KEYPOINTS_DESCRIPTOR_WORDS];
+} keypoints_descriptor_t;
+
+typedef struct {
+	float x;                 // image pixels
+	float y;
+	float angle;             // radians
+	uint32_t score;          // sum of the circle's differences beyond the threshold
+} keypoints_point_t;
+
+typedef struct {
+	unsigned int width;      // of the image
+	unsigned int height;
+	unsigned int scale;      // raw pixels across an image pixel
+	unsigned int threshold;
+	unsigned int max_keypoints;
+
+	uint8_t *image;          // width * height, filled by keypoints_*_image()
+	uint8_t *smooth;         // box filtered for the descriptors
+	uint16_t *columns;       // width, for the box filter
+	uint16_t *scores;        // width * height, of corners only
+	int32_t *tests;          // pixel offsets of each test pair at each angle
+	keypoints_point_t *candidates;
+	size_t n_candidates;
+	size_t candidates_allocated;
+
+	keypoints_point_t *points;     // best max_keypoints, by score
+	keypoints_descriptor_t *descriptors;  // one for each point
+	size_t count;
+
+	const char *error;       // operation that failed, errno has the reason
+} keypoints_t;
+
+// returns false with keypoints->error and errno set
+bool keypoints_init(keypoints_t *keypoints, unsigned int width, unsigned int height, unsigned int scale,
+		   unsigned int threshold, unsigned int max_keypoints);
+
+// the mean of the green sites of each quad of a 2 * width by 2 * height Bayer frame
+bool keypoints_green_image(keypoints_t *keypoints, const ahd_pixel_t *bayer, BayerTile tile);
+
+// the luma of a width by height frame from ahd_decode()
+void keypoints_rgb_image(keypoints_t *keypoints, const ahd_pixel_t *rgb);
+
+// keypoints and descriptors of the image
+bool keypoints_detect(keypoints_t *keypoints);
+
+void keypoints_free(keypoints_t *keypoints);
+
+static inline unsigned int keypoints_distance(const keypoints_descriptor_t *a, const keypoints_descriptor_t *b) {
+	unsigned int d = 0;
+	for (int i = 0; i < KEYPOINTS_DESCRIPTOR_WORDS; ++i) {
+		d += __builtin_popcountll(a->bits[i] ^ b->bits[i]);
+	}
+	return d;
+}
+
+
+// matching, in keypoints_match.c
+//
+// a query descriptor matches its nearest train descriptor when that is
+// within max_distance and clearly nearer than the second nearest
+// (Lowe's ratio test).  Brute force compares every pair; the LSH index
+// only compares descriptors that agree on all the sampled bits of at
+// least one of its tables, missing a few matches for far less work
+
+#define KEYPOINTS_DEFAULT_MAX_DISTANCE 64
+#define KEYPOINTS_DEFAULT_RATIO        0.8
+
+#define KEYPOINTS_LSH_TABLES 8
+#define KEYPOINTS_LSH_BITS   24
+
+typedef struct {
+	uint32_t query;
+	uint32_t train;
+	unsigned int distance;
+} keypoints_match_t;
+
+typedef struct {
+	uint8_t bit[KEYPOINTS_LSH_BITS];   // descriptor bits in the key
+	uint32_t *keys;                   // ascending
+	uint32_t *ids;
+} keypoints_lsh_table_t;
+
+typedef struct {
+	const keypoints_descriptor_t *descriptors;  // not copied
+	size_t count;
+	keypoints_lsh_table_t table[KEYPOINTS_LSH_TABLES];
+	uint32_t *seen;                   // stamp of the last query that checked each id
+	uint32_t stamp;
+	uint32_t *candidates;             // ids a query will check
+	const char *error;
+} keypoints_lsh_t;
+
+// matches holds n_query entries, returns how many were filled
+size_t keypoints_match_brute(const keypoints_descriptor_t *query, size_t n_query,
+			    const keypoints_descriptor_t *train, size_t n_train,
+			    unsigned int max_distance, double ratio, keypoints_match_t *matches);
+
+// the index keeps a pointer to the train descriptors
+bool keypoints_lsh_build(keypoints_lsh_t *lsh, const keypoints_descriptor_t *train, size_t n_train);
+
+size_t keypoints_lsh_match(keypoints_lsh_t *lsh, const keypoints_descriptor_t *query, size_t n_query,
+			  unsigned int max_distance, double ratio, keypoints_match_t *matches);
+
+void keypoints_lsh_free(keypoints_lsh_t *lsh);
+
+
+// a similarity taking train points to query points,
+// x' = a x - b y + tx,  y' = b x + a y + ty
+typedef struct {
+	double a;
+	double b;
+	double tx;
+	double ty;
+	size_t inliers;
+} keypoints_model_t;
+
+#define KEYPOINTS_DEFAULT_TOLERANCE 3.0
+#define KEYPOINTS_RANSAC_ITERATIONS 1000
+
+// RANSAC over pairs of matches, then a least squares fit to the inliers
+// of the best; false if fewer than 3 matches agree.  inlier may be NULL
+bool keypoints_ransac(const keypoints_point_t *query, const keypoints_point_t *train,
+		     const keypoints_match_t *matches, size_t n, double tolerance,
+		     keypoints_model_t *model, bool *inlier);
+
+// the model as the transform the fingerprint applies, for frames of
+// width by height raw pixels with keypoints scale raw pixels apart
+void keypoints_model_transform(const keypoints_model_t *model, unsigned int scale,
+			      unsigned int width, unsigned int height, fingerprint_transform_t *transform);
+
+#endif
@@ -0,0 +1,381 @@
+// matching descriptors and fitting a similarity to the matches
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "keypoints.h"
+
+
+// a pair of matches gives a similarity, frames are not expected to
+// change scale by more than this
+#define MIN_SCALE 0.5
+#define MAX_SCALE 2.0
+
+// stop once a model is this likely to have been found
+#define RANSAC_CONFIDENCE 0.999
+
+
+// nearest and second nearest of the train descriptors listed in ids,
+// or of the first n when ids is NULL, with the popcount instruction if
+// there is one, as in fpindex.c
+typedef void nearest_function(const keypoints_descriptor_t *query, const keypoints_descriptor_t *train,
+			      const uint32_t *ids, size_t n, unsigned int *best, unsigned int *second,
+			      uint32_t *id);
+
+static inline void nearest_inline(const keypoints_descriptor_t *query, const keypoints_descriptor_t *train,
+				  const uint32_t *ids, size_t n, unsigned int *best, unsigned int *second,
+				  uint32_t *id) {
+	for (size_t i = 0; i < n; ++i) {
+		const uint32_t t = NULL == ids ? i : ids[i];
+		const unsigned int d = keypoints_distance(query, &train[t]);
+		if (d < *best) {
+			*second = *best;
+			*best = d;
+			*id = t;
+		} else if (d < *second) {
+			*second = d;
+		}
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("popcnt")))
+static void nearest_popcnt(const keypoints_descriptor_t *query, const keypoints_descriptor_t *train,
+			   const uint32_t *ids, size_t n, unsigned int *best, unsigned int *second,
+			   uint32_t *id) {
+	nearest_inline(query, train, ids, n, best, second, id);
+}
+#endif
+
+static void nearest_generic(const keypoints_descriptor_t *query, const keypoints_descriptor_t *train,
+			    const uint32_t *ids, size_t n, unsigned int *best, unsigned int *second,
+			    uint32_t *id) {
+	nearest_inline(query, train, ids, n, best, second, id);
+}
+
+static nearest_function *nearest;
+static pthread_once_t nearest_once = PTHREAD_ONCE_INIT;
+
+static void nearest_init(void) {
+	nearest = nearest_generic;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("popcnt")) {
+		nearest = nearest_popcnt;
+	}
+#endif
+}
+
+static bool accept(unsigned int best, unsigned int second, unsigned int max_distance, double ratio) {
+	return best <= max_distance && (UINT_MAX == second || best < ratio * second);
+}
+
+
+size_t keypoints_match_brute(const keypoints_descriptor_t *query, size_t n_query,
+			    const keypoints_descriptor_t *train, size_t n_train,
+			    unsigned int max_distance, double ratio, keypoints_match_t *matches) {
+	pthread_once(&nearest_once, nearest_init);
+	size_t n = 0;
+	for (size_t q = 0; q < n_query; ++q) {
+		unsigned int best = UINT_MAX;
+		unsigned int second = UINT_MAX;
+		uint32_t id = 0;
+		nearest(&query[q], train, NULL, n_train, &best, &second, &id);
+		if (accept(best, second, max_distance, ratio)) {
+			matches[n].query = q;
+			matches[n].train = id;
+			matches[n].distance = best;
+			++n;
+		}
+	}
+	return n;
+}
+
+
+static uint32_t lsh_key(const keypoints_lsh_table_t *table, const keypoints_descriptor_t *descriptor) {
+	uint32_t key = 0;
+	for (int i = 0; i < KEYPOINTS_LSH_BITS; ++i) {
+		const unsigned int bit = table->bit[i];
+		key |= ((descriptor->bits[bit / 64] >> (bit % 64)) & 1) << i;
+	}
+	return key;
+}
+
+static int compare_entry(const void *a, const void *b) {
+	const uint64_t x = *(const uint64_t *)a;
+	const uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+bool keypoints_lsh_build(keypoints_lsh_t *lsh, const keypoints_descriptor_t *train, size_t n_train) {
+	memset(lsh, 0, sizeof(*lsh));
+	pthread_once(&nearest_once, nearest_init);
+	lsh->descriptors = train;
+	lsh->count = n_train;
+
+	uint64_t *entries = malloc((n_train + 1) * sizeof(uint64_t));
+	lsh->seen = calloc(n_train + 1, sizeof(uint32_t));
+	lsh->candidates = malloc((n_train + 1) * sizeof(uint32_t));
+	if (NULL == entries || NULL == lsh->seen || NULL == lsh->candidates) {
+		free(entries);
+		keypoints_lsh_free(lsh);
+		errno = ENOMEM;
+		lsh->error = "malloc";
+		return false;
+	}
+
+	// each table samples its own distinct bits, the same in every process
+	uint64_t state = 0x9e3779b97f4a7c15ULL;
+	for (int t = 0; t < KEYPOINTS_LSH_TABLES; ++t) {
+		keypoints_lsh_table_t *table = &lsh->table[t];
+		bool used[KEYPOINTS_DESCRIPTOR_BITS] = { false };
+		for (int i = 0; i < KEYPOINTS_LSH_BITS; ++i) {
+			unsigned int bit;
+			do {
+				state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+				bit = (state >> 33) % KEYPOINTS_DESCRIPTOR_BITS;
+			} while (used[bit]);
+			used[bit] = true;
+			table->bit[i] = bit;
+		}
+
+		table->keys = malloc((n_train + 1) * sizeof(uint32_t));
+		table->ids = malloc((n_train + 1) * sizeof(uint32_t));
+		if (NULL == table->keys || NULL == table->ids) {
+			free(entries);
+			keypoints_lsh_free(lsh);
+			errno = ENOMEM;
+			lsh->error = "malloc";
+			return false;
+		}
+		for (size_t i = 0; i < n_train; ++i) {
+			entries[i] = (uint64_t)lsh_key(table, &train[i]) << 32 | i;
+		}
+		qsort(entries, n_train, sizeof(uint64_t), compare_entry);
+		for (size_t i = 0; i < n_train; ++i) {
+			table->keys[i] = entries[i] >> 32;
+			table->ids[i] = (uint32_t)entries[i];
+		}
+	}
+	free(entries);
+	return true;
+}
+
+
+size_t keypoints_lsh_match(keypoints_lsh_t *lsh, const keypoints_descriptor_t *query, size_t n_query,
+			  unsigned int max_distance, double ratio, keypoints_match_t *matches) {
+	size_t n = 0;
+	for (size_t q = 0; q < n_query; ++q) {
+		if (0 == ++lsh->stamp) {
+			memset(lsh->seen, 0, lsh->count * sizeof(uint32_t));
+			lsh->stamp = 1;
+		}
+		size_t n_candidates = 0;
+		for (int t = 0; t < KEYPOINTS_LSH_TABLES; ++t) {
+			const keypoints_lsh_table_t *table = &lsh->table[t];
+			const uint32_t key = lsh_key(table, &query[q]);
+			size_t low = 0;
+			size_t high = lsh->count;
+			while (low < high) {
+				const size_t middle = (low + high) / 2;
+				if (table->keys[middle] < key) {
+					low = middle + 1;
+				} else {
+					high = middle;
+				}
+			}
+			for (size_t i = low; i < lsh->count && key == table->keys[i]; ++i) {
+				const uint32_t candidate = table->ids[i];
+				if (lsh->stamp != lsh->seen[candidate]) {
+					lsh->seen[candidate] = lsh->stamp;
+					lsh->candidates[n_candidates++] = candidate;
+				}
+			}
+		}
+		unsigned int best = UINT_MAX;
+		unsigned int second = UINT_MAX;
+		uint32_t id = 0;
+		nearest(&query[q], lsh->descriptors, lsh->candidates, n_candidates, &best, &second, &id);
+		if (accept(best, second, max_distance, ratio)) {
+			matches[n].query = q;
+			matches[n].train = id;
+			matches[n].distance = best;
+			++n;
+		}
+	}
+	return n;
+}
+
+
+void keypoints_lsh_free(keypoints_lsh_t *lsh) {
+	for (int t = 0; t < KEYPOINTS_LSH_TABLES; ++t) {
+		free(lsh->table[t].keys);
+		free(lsh->table[t].ids);
+		lsh->table[t].keys = NULL;
+		lsh->table[t].ids = NULL;
+	}
+	free(lsh->seen);
+	free(lsh->candidates);
+	lsh->seen = NULL;
+	lsh->candidates = NULL;
+}
+
+
+// matches within tolerance of the model
+static size_t count_inliers(const keypoints_point_t *query, const keypoints_point_t *train,
+			    const keypoints_match_t *matches, size_t n, double tolerance,
+			    const keypoints_model_t *model, bool *inlier) {
+	const double limit = tolerance * tolerance;
+	size_t count = 0;
+	for (size_t i = 0; i < n; ++i) {
+		const keypoints_point_t *p = &train[matches[i].train];
+		const keypoints_point_t *q = &query[matches[i].query];
+		const double x = model->a * p->x - model->b * p->y + model->tx - q->x;
+		const double y = model->b * p->x + model->a * p->y + model->ty - q->y;
+		const bool in = x * x + y * y <= limit;
+		if (NULL != inlier) {
+			inlier[i] = in;
+		}
+		count += in;
+	}
+	return count;
+}
+
+// least squares similarity for the inliers
+static void fit(const keypoints_point_t *query, const keypoints_point_t *train,
+		const keypoints_match_t *matches, size_t n, const bool *inlier, keypoints_model_t *model) {
+	double px = 0, py = 0, qx = 0, qy = 0;
+	size_t count = 0;
+	for (size_t i = 0; i < n; ++i) {
+		if (inlier[i]) {
+			px += train[matches[i].train].x;
+			py += train[matches[i].train].y;
+			qx += query[matches[i].query].x;
+			qy += query[matches[i].query].y;
+			++count;
+		}
+	}
+	px /= count;
+	py /= count;
+	qx /= count;
+	qy /= count;
+
+	double dot = 0, cross = 0, norm = 0;
+	for (size_t i = 0; i < n; ++i) {
+		if (inlier[i]) {
+			const double x = train[matches[i].train].x - px;
+			const double y = train[matches[i].train].y - py;
+			const double u = query[matches[i].query].x - qx;
+			const double v = query[matches[i].query].y - qy;
+			dot += x * u + y * v;
+			cross += x * v - y * u;
+			norm += x * x + y * y;
+		}
+	}
+	if (norm <= 0) {
+		return;
+	}
+	model->a = dot / norm;
+	model->b = cross / norm;
+	model->tx = qx - (model->a * px - model->b * py);
+	model->ty = qy - (model->b * px + model->a * py);
+}
+
+bool keypoints_ransac(const keypoints_point_t *query, const keypoints_point_t *train,
+		     const keypoints_match_t *matches, size_t n, double tolerance,
+		     keypoints_model_t *model, bool *inlier) {
+	memset(model, 0, sizeof(*model));
+	if (n < 3) {
+		return false;
+	}
+
+	// the same matches always give the same model
+	uint64_t state = 0xda942042e4dd58b5ULL;
+	size_t iterations = KEYPOINTS_RANSAC_ITERATIONS;
+	keypoints_model_t best = { 0 };
+	for (size_t iteration = 0; iteration < iterations; ++iteration) {
+		state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+		const size_t i = (state >> 33) % n;
+		state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+		const size_t j = (state >> 33) % n;
+		if (i == j) {
+			continue;
+		}
+
+		// q = z p + t with complex z = a + ib from the two pairs
+		const keypoints_point_t *p1 = &train[matches[i].train];
+		const keypoints_point_t *p2 = &train[matches[j].train];
+		const keypoints_point_t *q1 = &query[matches[i].query];
+		const keypoints_point_t *q2 = &query[matches[j].query];
+		const double px = p2->x - p1->x;
+		const double py = p2->y - p1->y;
+		const double qx = q2->x - q1->x;
+		const double qy = q2->y - q1->y;
+		const double norm = px * px + py * py;
+		if (norm < 1) {
+			continue;
+		}
+		keypoints_model_t candidate = {
+			.a = (qx * px + qy * py) / norm,
+			.b = (qy * px - qx * py) / norm,
+		};
+		const double scale = hypot(candidate.a, candidate.b);
+		if (scale < MIN_SCALE || scale > MAX_SCALE) {
+			continue;
+		}
+		candidate.tx = q1->x - (candidate.a * p1->x - candidate.b * p1->y);
+		candidate.ty = q1->y - (candidate.b * p1->x + candidate.a * p1->y);
+		candidate.inliers = count_inliers(query, train, matches, n, tolerance, &candidate, NULL);
+
+		if (candidate.inliers > best.inliers) {
+			best = candidate;
+			const double w = (double)best.inliers / n;
+			const double needed = log(1 - RANSAC_CONFIDENCE) / log(1 - w * w);
+			if (needed < iterations) {
+				iterations = needed < iteration + 1 ? iteration + 1 : needed;
+			}
+		}
+	}
+	if (best.inliers < 3) {
+		return false;
+	}
+
+	bool *flags = NULL != inlier ? inlier : malloc(n * sizeof(bool));
+	if (NULL == flags) {
+		*model = best;
+		return true;
+	}
+	count_inliers(query, train, matches, n, tolerance, &best, flags);
+	fit(query, train, matches, n, flags, &best);
+	best.inliers = count_inliers(query, train, matches, n, tolerance, &best, flags);
+	if (flags != inlier) {
+		free(flags);
+	}
+	*model = best;
+	return best.inliers >= 3;
+}
+
+
+void keypoints_model_transform(const keypoints_model_t *model, unsigned int scale,
+			      unsigned int width, unsigned int height, fingerprint_transform_t *transform) {
+	// image pixel x is centred on raw pixel scale * x + scale / 2
+	const double half = scale / 2.0;
+	const double tx = scale * model->tx + half * (1 - model->a) + half * model->b;
+	const double ty = scale * model->ty + half * (1 - model->a) - half * model->b;
+
+	// the fingerprint rotates about the centre and does not scale
+	const double angle = atan2(model->b, model->a);
+	const double c = cos(angle);
+	const double s = sin(angle);
+	const double cx = width / 2.0;
+	const double cy = height / 2.0;
+	transform->angle = angle;
+	transform->dx = tx - cx + (c * cx - s * cy);
+	transform->dy = ty - cy + (s * cx + c * cy);
+}
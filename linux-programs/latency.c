@@ -0,0 +1,58 @@
+// request latency percentiles
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "latency.h"
+
+
+void latency_init(latency_t *latency) {
+	memset(latency, 0, sizeof(*latency));
+}
+
+
+void latency_record(latency_t *latency, double ms) {
+	latency->samples[latency->count % LATENCY_WINDOW] = ms;
+	++latency->count;
+	latency->total += ms;
+	if (ms > latency->max) {
+		latency->max = ms;
+	}
+}
+
+
+static int compare_double(const void *a, const void *b) {
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+
+// nearest rank percentile of sorted data
+static double percentile(const double *sorted, size_t n, unsigned int pc) {
+	size_t rank = (pc * n + 99) / 100;
+	if (rank < 1) {
+		rank = 1;
+	}
+	return sorted[rank - 1];
+}
+
+
+void latency_summary(const latency_t *latency, latency_summary_t *summary) {
+	memset(summary, 0, sizeof(*summary));
+	const size_t n = latency->count < LATENCY_WINDOW ? latency->count : LATENCY_WINDOW;
+	if (0 == n) {
+		return;
+	}
+	double sorted[LATENCY_WINDOW];
+	memcpy(sorted, latency->samples, n * sizeof(double));
+	qsort(sorted, n, sizeof(double), compare_double);
+	summary->count = n;
+	summary->mean = latency->total / latency->count;
+	summary->p50 = percentile(sorted, n, 50);
+	summary->p90 = percentile(sorted, n, 90);
+	summary->p99 = percentile(sorted, n, 99);
+	summary->max = latency->max;
+}
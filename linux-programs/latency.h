@@ -0,0 +1,39 @@
+// request latency percentiles over a window of the most recent requests
+//
+// recording is constant time into a ring of the last LATENCY_WINDOW
+// samples, a summary sorts a copy of them, so the cost falls on
+// whoever asks.  Not locked: record and summarise from one thread
+
+#ifndef _LATENCY_H_
+#define _LATENCY_H_ 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define LATENCY_WINDOW 4096
+
+typedef struct {
+	double samples[LATENCY_WINDOW];  // milliseconds
+	uint64_t count;                  // recorded since init
+	double total;                    // of every sample recorded
+	double max;
+} latency_t;
+
+// percentiles of the samples in the window, mean and max of every sample
+typedef struct {
+	size_t count;
+	double mean;
+	double p50;
+	double p90;
+	double p99;
+	double max;
+} latency_summary_t;
+
+void latency_init(latency_t *latency);
+
+void latency_record(latency_t *latency, double ms);
+
+void latency_summary(const latency_t *latency, latency_summary_t *summary);
+
+#endif
@@ -19,6 +19,8 @@
 
 #include <linux/videodev2.h>
 
+#include "controls.h"
+
 static char *program_name = NULL;
 static char *device_name = NULL;
 
@@ -145,54 +147,59 @@ int main(int argc, char *argv[]) {
 
 	int fd = open_device(device_name);
 
-	// iterate through all controls and display their data
+	controls_t controls;
+	controls_init(&controls, fd);
+
+	// find all the controls, then fetch their values together
+	uint32_t ids[CONTROLS_MAX];
+	unsigned int n_ids = 0;
 	struct v4l2_queryctrl queryctrl;
-	memset(&queryctrl, 0, sizeof(queryctrl));
 
-	for (queryctrl.id = V4L2_CID_BASE; queryctrl.id < V4L2_CID_LASTP1; ++queryctrl.id) {
-		if (0 == ioctl(fd, VIDIOC_QUERYCTRL, &queryctrl)) {
-			if (queryctrl.flags & V4L2_CTRL_FLAG_DISABLED) {
-				continue;
+	for (uint32_t id = V4L2_CID_BASE; id < V4L2_CID_LASTP1; ++id) {
+		if (controls_query(&controls, id, &queryctrl)) {
+			if (!(queryctrl.flags & V4L2_CTRL_FLAG_DISABLED) && n_ids < CONTROLS_MAX) {
+				ids[n_ids++] = id;
 			}
+		} else if (errno != EINVAL) {
+			usage("VIDIOC_QUERYCTRL error: (%d) '%s'", errno, strerror(errno));
+		}
+	}
 
-			struct v4l2_control control;
-			memset (&control, 0, sizeof (control));
-			control.id = queryctrl.id;
+	// on failure each value is read separately below
+	controls_read(&controls, ids, n_ids);
 
-			if (0 != ioctl(fd, VIDIOC_G_CTRL, &control)) {
-				usage("VIDIOC_G_CTRL error: (%d) '%s'", errno, strerror(errno));
-			}
-
-			printf("Control %s type: 0x%08x:\n"
-			       "  value:   0x%08x  %10d\n"
-			       "  minimum: 0x%08x  %10d\n"
-			       "  maximum: 0x%08x  %10d\n"
-			       "  step :   0x%08x  %10d\n"
-			       "  default: 0x%08x  %10d\n"
-			       "  flags:   0x%08x  %10d\n"
-			       "",
-			       queryctrl.name, queryctrl.type,
-			       control.value, control.value,
-			       queryctrl.minimum, queryctrl.minimum,
-			       queryctrl.maximum, queryctrl.maximum,
-			       queryctrl.step, queryctrl.step,
-			       queryctrl.default_value, queryctrl.default_value,
-			       queryctrl.flags, queryctrl.flags);
+	// display the data of each control
+	for (unsigned int i = 0; i < n_ids; ++i) {
+		int32_t value;
+		controls_query(&controls, ids[i], &queryctrl);  // cached above
+		if (!controls_get(&controls, ids[i], &value)) {
+			usage("VIDIOC_G_CTRL error: (%d) '%s'", errno, strerror(errno));
+		}
 
-			if (queryctrl.type == V4L2_CTRL_TYPE_MENU) {
-				enumerate_menu(fd, &queryctrl);
-			}
-		} else {
-			if (errno == EINVAL) {
-				continue;
-			}
-			usage("VIDIOC_QUERYCTRL error: (%d) '%s'", errno, strerror(errno));
+		printf("Control %s type: 0x%08x:\n"
+		       "  value:   0x%08x  %10d\n"
+		       "  minimum: 0x%08x  %10d\n"
+		       "  maximum: 0x%08x  %10d\n"
+		       "  step :   0x%08x  %10d\n"
+		       "  default: 0x%08x  %10d\n"
+		       "  flags:   0x%08x  %10d\n"
+		       "",
+		       queryctrl.name, queryctrl.type,
+		       value, value,
+		       queryctrl.minimum, queryctrl.minimum,
+		       queryctrl.maximum, queryctrl.maximum,
+		       queryctrl.step, queryctrl.step,
+		       queryctrl.default_value, queryctrl.default_value,
+		       queryctrl.flags, queryctrl.flags);
+
+		if (queryctrl.type == V4L2_CTRL_TYPE_MENU) {
+			enumerate_menu(fd, &queryctrl);
 		}
 	}
 
 	// check for any private controls
-	for (queryctrl.id = V4L2_CID_PRIVATE_BASE; ; ++queryctrl.id) {
-		if (0 == ioctl(fd, VIDIOC_QUERYCTRL, &queryctrl)) {
+	for (uint32_t id = V4L2_CID_PRIVATE_BASE; ; ++id) {
+		if (controls_query(&controls, id, &queryctrl)) {
 			if (queryctrl.flags & V4L2_CTRL_FLAG_DISABLED) {
 				continue;
 			}
@@ -0,0 +1,242 @@
+// match-keypoints.c: match the keypoints of every frame in capture
+// files against a reference frame and fit the displacement
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "physicalhasher.h"
+
+
+#define FRAME_WIDTH  1920
+#define FRAME_HEIGHT 1080
+
+static const char *program_name;
+static int verbose = 0; // incremented by --verbose / -v
+
+
+// print usage message and exit
+static void usage(const char *message, ...) {
+	if (NULL != message) {
+		va_list ap;
+		va_start(ap, message);
+		fprintf(stderr, "error: ");
+		vfprintf(stderr, message, ap);
+		fprintf(stderr, "\n");
+		va_end(ap);
+	}
+	fprintf(stderr,
+		"Usage: %s [options] REFERENCE FILE...\n\n"
+		"Options:\n"
+		"-h | --help          Print this message\n"
+		"-v | --verbose       Print the time taken by each stage\n"
+		"-f | --frame N       Frame of REFERENCE to match against [0]\n"
+		"-c | --count N       Limit number of frames [no-limit]\n"
+		"-t | --threshold N   Corner threshold, 8 bit levels [%d]\n"
+		"-n | --keypoints N   Most keypoints in a frame [%d]\n"
+		"-d | --distance N    Most differing descriptor bits in a match [%d]\n"
+		"-b | --brute         Compare every pair of descriptors instead of\n"
+		"                     looking them up in an LSH index\n"
+		"Keypoints are found in the green sites.  Each line is:\n"
+		"  frame keypoints matches inliers dx dy angle scale\n"
+		"with the displacement of the frame from the reference in raw pixels\n"
+		"about its centre and the angle in radians, or '-' when no\n"
+		"displacement fits\n"
+		"",
+		program_name, KEYPOINTS_DEFAULT_THRESHOLD, KEYPOINTS_DEFAULT_MAX,
+		KEYPOINTS_DEFAULT_MAX_DISTANCE);
+	exit(EXIT_FAILURE);
+}
+
+
+static const char short_options[] = "hvf:c:t:n:d:b";
+
+static const struct option
+long_options[] = {
+	{ "help",       no_argument,       NULL, 'h' },
+	{ "verbose",    no_argument,       NULL, 'v' },
+	{ "frame",      required_argument, NULL, 'f' },
+	{ "count",      required_argument, NULL, 'c' },
+	{ "threshold",  required_argument, NULL, 't' },
+	{ "keypoints",  required_argument, NULL, 'n' },
+	{ "distance",   required_argument, NULL, 'd' },
+	{ "brute",      no_argument,       NULL, 'b' },
+	{ 0, 0, 0, 0 }
+};
+
+
+static unsigned long number(const char *name, const char *text) {
+	errno = 0;
+	char *end;
+	unsigned long n = strtoul(text, &end, 0);
+	if (0 != errno || end == text || '\0' != *end) {
+		usage("invalid %s '%s'", name, text);
+	}
+	return n;
+}
+
+static double elapsed_ms(const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+
+int main(int argc, char **argv) {
+	program_name = argv[0];
+
+	uint64_t reference_frame = 0;
+	uint64_t limit = 0;
+	unsigned int threshold = KEYPOINTS_DEFAULT_THRESHOLD;
+	unsigned int max_keypoints = KEYPOINTS_DEFAULT_MAX;
+	unsigned int max_distance = KEYPOINTS_DEFAULT_MAX_DISTANCE;
+	bool brute = false;
+
+	for (;;) {
+		int idx = 0;
+		int c = getopt_long(argc, argv, short_options, long_options, &idx);
+
+		if (-1 == c) {
+			break;
+		}
+
+		switch (c) {
+		case 0: // getopt_long() flag
+			break;
+
+		case 'h':
+			usage(NULL);
+
+		case 'v':
+			++verbose;
+			break;
+
+		case 'f':
+			reference_frame = number("frame", optarg);
+			break;
+
+		case 'c':
+			limit = number("count", optarg);
+			break;
+
+		case 't':
+			threshold = number("threshold", optarg);
+			break;
+
+		case 'n':
+			max_keypoints = number("keypoints", optarg);
+			break;
+
+		case 'd':
+			max_distance = number("distance", optarg);
+			break;
+
+		case 'b':
+			brute = true;
+			break;
+
+		default:
+			usage("invalid option: '%c'", c);
+		}
+	}
+
+	if (optind + 1 >= argc) {
+		usage("missing arguments");
+	}
+
+	uint16_t *bayer = malloc(FRAME_WIDTH * FRAME_HEIGHT * sizeof(uint16_t));
+	keypoints_match_t *matches = malloc(max_keypoints * sizeof(keypoints_match_t));
+	if (NULL == bayer || NULL == matches) {
+		usage("failed to allocate frame buffers");
+	}
+	keypoints_t reference;
+	keypoints_t frame;
+	if (!keypoints_init(&reference, FRAME_WIDTH / 2, FRAME_HEIGHT / 2, 2, threshold, max_keypoints)
+	    || !keypoints_init(&frame, FRAME_WIDTH / 2, FRAME_HEIGHT / 2, 2, threshold, max_keypoints)) {
+		usage("failed to create keypoints: %d, %s", errno, strerror(errno));
+	}
+
+	framefile_t file;
+	const char *reference_name = argv[optind];
+	if (!framefile_open(&file, reference_name, FRAME_WIDTH, FRAME_HEIGHT)
+	    || !framefile_read(&file, reference_frame, bayer)) {
+		usage("failed to read reference: '%s': %s error %d, %s",
+		      reference_name, file.error, errno, strerror(errno));
+	}
+	framefile_close(&file);
+	keypoints_green_image(&reference, bayer, BAYER_TILE_GRBG);
+	keypoints_detect(&reference);
+
+	keypoints_lsh_t lsh;
+	if (!brute && !keypoints_lsh_build(&lsh, reference.descriptors, reference.count)) {
+		usage("failed to index reference: %s error %d, %s", lsh.error, errno, strerror(errno));
+	}
+	if (verbose > 0) {
+		fprintf(stderr, "%s: %zu keypoints\n", reference_name, reference.count);
+	}
+
+	uint64_t count = 0;
+	for (int i = optind + 1; i < argc; ++i) {
+		if (!framefile_open(&file, argv[i], FRAME_WIDTH, FRAME_HEIGHT)) {
+			usage("failed to open input file: '%s': %s error %d, %s",
+			      argv[i], file.error, errno, strerror(errno));
+		}
+		for (uint64_t j = 0; j < file.frames && (0 == limit || count < limit); ++j, ++count) {
+			if (!framefile_read(&file, j, bayer)) {
+				usage("failed to read frame %llu of '%s': %s error %d, %s",
+				      (unsigned long long)j, file.name, file.error, errno, strerror(errno));
+			}
+
+			struct timespec start;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			keypoints_green_image(&frame, bayer, BAYER_TILE_GRBG);
+			keypoints_detect(&frame);
+			const double detect_ms = elapsed_ms(&start);
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			const size_t n = brute
+				? keypoints_match_brute(frame.descriptors, frame.count, reference.descriptors,
+							reference.count, max_distance, KEYPOINTS_DEFAULT_RATIO, matches)
+				: keypoints_lsh_match(&lsh, frame.descriptors, frame.count, max_distance,
+						      KEYPOINTS_DEFAULT_RATIO, matches);
+			const double match_ms = elapsed_ms(&start);
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			keypoints_model_t model;
+			const bool fitted = keypoints_ransac(frame.points, reference.points, matches, n,
+							     KEYPOINTS_DEFAULT_TOLERANCE, &model, NULL);
+			const double ransac_ms = elapsed_ms(&start);
+
+			printf("%llu %zu %zu", (unsigned long long)count, frame.count, n);
+			if (fitted) {
+				fingerprint_transform_t transform;
+				keypoints_model_transform(&model, frame.scale, FRAME_WIDTH, FRAME_HEIGHT, &transform);
+				printf(" %zu %.2f %.2f %.4f %.4f\n", model.inliers, transform.dx, transform.dy,
+				       transform.angle, hypot(model.a, model.b));
+			} else {
+				printf(" - - - - -\n");
+			}
+			if (verbose > 0) {
+				fprintf(stderr, "%llu: detect %.2f ms match %.2f ms fit %.2f ms\n",
+					(unsigned long long)count, detect_ms, match_ms, ransac_ms);
+			}
+		}
+		framefile_close(&file);
+	}
+
+	if (!brute) {
+		keypoints_lsh_free(&lsh);
+	}
+	keypoints_free(&reference);
+	keypoints_free(&frame);
+	free(matches);
+	free(bayer);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,320 @@
+// photometric-stereo.c: recover the albedo and surface normals of a
+// sample from frames captured with capture --photometric
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "physicalhasher.h"
+
+
+#define FRAME_WIDTH  1920
+#define FRAME_HEIGHT 1080
+
+// a light for each bit of the LED mask
+#define LIGHTS 4
+
+typedef struct {
+	photometric_t photometric;
+	uint16_t *bayer;
+	int embed_offset;
+	uint64_t count;          // frames read
+	uint64_t skipped;        // not tagged with a single LED
+	uint64_t limit;          // 0 => all
+} run_t;
+
+static const char *program_name;
+static int verbose = 0; // incremented by --verbose / -v
+
+
+// print usage message and exit
+static void usage(const char *message, ...) {
+	if (NULL != message) {
+		va_list ap;
+		va_start(ap, message);
+		fprintf(stderr, "error: ");
+		vfprintf(stderr, message, ap);
+		fprintf(stderr, "\n");
+		va_end(ap);
+	}
+	fprintf(stderr,
+		"Usage: %s [options] FILE...\n\n"
+		"Options:\n"
+		"-h | --help          Print this message\n"
+		"-v | --verbose       Print the frames under each LED and the time\n"
+		"-o | --output P      Prefix of the files written [surface]\n"
+		"-r | --raw           Also write the albedo and normal x, y and z as\n"
+		"                     planes of floats at half size to P.data\n"
+		"-a | --elevation D   LED elevation above the sample in degrees [%.0f]\n"
+		"-t | --rotation D    Direction of LED 1 clockwise from the image x\n"
+		"                     axis in degrees, LED 2 is 90 further on [0]\n"
+		"-e | --embed N       Embedded data pixel offset [%d]\n"
+		"-c | --count N       Limit number of frames [no-limit]\n"
+		"Inputs are capture files or segment manifests, frames tagged with a\n"
+		"single LED are used and at least three LEDs are needed.  The albedo\n"
+		"is written to P-albedo.png and the normals to P-normal.png with x, y\n"
+		"and z from -1 to 1 as red, green and blue\n"
+		"",
+		program_name, PHOTOMETRIC_DEFAULT_ELEVATION, EMBED_DEFAULT_OFFSET);
+	exit(EXIT_FAILURE);
+}
+
+
+static const char short_options[] = "hvo:ra:t:e:c:";
+
+static const struct option
+long_options[] = {
+	{ "help",       no_argument,       NULL, 'h' },
+	{ "verbose",    no_argument,       NULL, 'v' },
+	{ "output",     required_argument, NULL, 'o' },
+	{ "raw",        no_argument,       NULL, 'r' },
+	{ "elevation",  required_argument, NULL, 'a' },
+	{ "rotation",   required_argument, NULL, 't' },
+	{ "embed",      required_argument, NULL, 'e' },
+	{ "count",      required_argument, NULL, 'c' },
+	{ 0, 0, 0, 0 }
+};
+
+
+static unsigned long number(const char *name, const char *text) {
+	errno = 0;
+	char *end;
+	unsigned long n = strtoul(text, &end, 0);
+	if (0 != errno || end == text || '\0' != *end) {
+		usage("invalid %s '%s'", name, text);
+	}
+	return n;
+}
+
+static double angle(const char *name, const char *text, double low, double high) {
+	errno = 0;
+	char *end;
+	double a = strtod(text, &end);
+	if (0 != errno || end == text || '\0' != *end || a < low || a > high) {
+		usage("invalid %s '%s', %.0f to %.0f", name, text, low, high);
+	}
+	return a;
+}
+
+
+// add the frames of one capture file under the LED each was tagged with
+static bool add_file(void *context, char *name) {
+	run_t *run = context;
+	framefile_t file;
+	if (!framefile_open(&file, name, FRAME_WIDTH, FRAME_HEIGHT)) {
+		usage("failed to open input file: '%s': %s error %d, %s",
+		      name, file.error, errno, strerror(errno));
+	}
+	if (verbose > 0) {
+		fprintf(stderr, "%s: %llu frames\n", name, (unsigned long long)file.frames);
+	}
+
+	const size_t pixels = FRAME_WIDTH * FRAME_HEIGHT;
+	for (uint64_t i = 0; i < file.frames && (0 == run->limit || run->count < run->limit); ++i) {
+		if (!framefile_read(&file, i, run->bayer)) {
+			usage("failed to read frame %llu of '%s': %s error %d, %s",
+			      (unsigned long long)i, name, file.error, errno, strerror(errno));
+		}
+		++run->count;
+		embed_t embed;
+		embed_decode(run->bayer, pixels, run->embed_offset, &embed);
+		const unsigned int leds = embed.leds;
+		if (!embed.leds_present || 0 == leds || 0 != (leds & (leds - 1))) {
+			++run->skipped;
+			continue;
+		}
+		if (!photometric_add(&run->photometric, run->bayer, __builtin_ctz(leds))) {
+			usage("failed to add frame: %s error %d, %s",
+			      run->photometric.error, errno, strerror(errno));
+		}
+	}
+	framefile_close(&file);
+	free(name);
+	return true;
+}
+
+
+static bool write_albedo(const photometric_t *photometric, const char *path) {
+	const unsigned int width = photometric->width / 2;
+	const unsigned int height = photometric->height / 2;
+	const size_t quads = (size_t)width * height;
+	ahd_pixel_t *image = malloc(3 * quads * sizeof(ahd_pixel_t));
+	if (NULL == image) {
+		return false;
+	}
+	for (size_t i = 0; i < quads; ++i) {
+		const float a = photometric->albedo[i];
+		const ahd_pixel_t level = a > 4095 ? 4095 : a + 0.5f;
+		image[3 * i] = image[3 * i + 1] = image[3 * i + 2] = level;
+	}
+	const bool rc = image_write_png(image, width, height, path);
+	free(image);
+	return rc;
+}
+
+static bool write_normals(const photometric_t *photometric, const char *path) {
+	const unsigned int width = photometric->width / 2;
+	const unsigned int height = photometric->height / 2;
+	const size_t quads = (size_t)width * height;
+	ahd_pixel_t *image = malloc(3 * quads * sizeof(ahd_pixel_t));
+	if (NULL == image) {
+		return false;
+	}
+	for (size_t i = 0; i < quads; ++i) {
+		for (int c = 0; c < 3; ++c) {
+			image[3 * i + c] = (photometric->normal[c][i] + 1) * 2047.5f + 0.5f;
+		}
+	}
+	const bool rc = image_write_png(image, width, height, path);
+	free(image);
+	return rc;
+}
+
+static bool write_raw(const photometric_t *photometric, const char *path) {
+	const size_t quads = (size_t)photometric->width * photometric->height / 4;
+	FILE *f = fopen(path, "w");
+	if (NULL == f) {
+		return false;
+	}
+	bool rc = quads == fwrite(photometric->albedo, sizeof(float), quads, f);
+	for (int c = 0; c < 3 && rc; ++c) {
+		rc = quads == fwrite(photometric->normal[c], sizeof(float), quads, f);
+	}
+	return 0 == fclose(f) && rc;
+}
+
+
+int main(int argc, char **argv) {
+	program_name = argv[0];
+
+	run_t run = {
+		.embed_offset = EMBED_DEFAULT_OFFSET,
+	};
+	const char *prefix = "surface";
+	bool raw = false;
+	double elevation = PHOTOMETRIC_DEFAULT_ELEVATION;
+	double rotation = 0;
+
+	for (;;) {
+		int idx = 0;
+		int c = getopt_long(argc, argv, short_options, long_options, &idx);
+
+		if (-1 == c) {
+			break;
+		}
+
+		switch (c) {
+		case 0: // getopt_long() flag
+			break;
+
+		case 'h':
+			usage(NULL);
+
+		case 'v':
+			++verbose;
+			break;
+
+		case 'o':
+			if (strlen(optarg) < 1) {
+				usage("missing output prefix");
+			}
+			prefix = optarg;
+			break;
+
+		case 'r':
+			raw = true;
+			break;
+
+		case 'a':
+			elevation = angle("elevation", optarg, 1, 89);
+			break;
+
+		case 't':
+			rotation = angle("rotation", optarg, -360, 360);
+			break;
+
+		case 'e':
+			run.embed_offset = number("embed offset", optarg);
+			break;
+
+		case 'c':
+			run.limit = number("count", optarg);
+			break;
+
+		default:
+			usage("invalid option: '%c'", c);
+		}
+	}
+
+	if (optind >= argc) {
+		usage("missing arguments");
+	}
+
+	float direction[LIGHTS][3];
+	photometric_ring(direction, LIGHTS, elevation, rotation);
+	if (!photometric_init(&run.photometric, FRAME_WIDTH, FRAME_HEIGHT, BAYER_TILE_GRBG, direction, LIGHTS)) {
+		usage("failed to create solver: %s error %d, %s", run.photometric.error, errno, strerror(errno));
+	}
+	run.bayer = malloc(FRAME_WIDTH * FRAME_HEIGHT * sizeof(uint16_t));
+	if (NULL == run.bayer) {
+		usage("failed to allocate frame buffer");
+	}
+
+	for (int i = optind; i < argc; ++i) {
+		if (!framefile_is_manifest(argv[i])) {
+			char *name = strdup(argv[i]);
+			if (NULL == name) {
+				usage("failed to allocate input: '%s'", argv[i]);
+			}
+			add_file(&run, name);
+		} else if (!framefile_manifest(argv[i], add_file, &run)) {
+			usage("failed to read manifest: '%s': %d, %s", argv[i], errno, strerror(errno));
+		}
+	}
+	if (verbose > 0) {
+		fprintf(stderr, "%llu frames, %llu without a single LED tag\n",
+			(unsigned long long)run.count, (unsigned long long)run.skipped);
+		for (int i = 0; i < LIGHTS; ++i) {
+			fprintf(stderr, "LED %d (mask 0x%x): %u frames\n", i + 1, 1 << i, run.photometric.frames[i]);
+		}
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (!photometric_solve(&run.photometric)) {
+		usage("failed to solve: %s error %d, %s, frames of %u LEDs",
+		      run.photometric.error, errno, strerror(errno), run.photometric.used);
+	}
+	if (verbose > 0) {
+		struct timespec end;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		fprintf(stderr, "solved from %u LEDs in %.1f ms\n", run.photometric.used,
+			(end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+	}
+
+	char name[256];
+	snprintf(name, sizeof(name), "%s-albedo.png", prefix);
+	if (!write_albedo(&run.photometric, name)) {
+		usage("failed to write: '%s'", name);
+	}
+	snprintf(name, sizeof(name), "%s-normal.png", prefix);
+	if (!write_normals(&run.photometric, name)) {
+		usage("failed to write: '%s'", name);
+	}
+	if (raw) {
+		snprintf(name, sizeof(name), "%s.data", prefix);
+		if (!write_raw(&run.photometric, name)) {
+			usage("failed to write: '%s': %d, %s", name, errno, strerror(errno));
+		}
+	}
+
+	photometric_free(&run.photometric);
+	free(run.bayer);
+	return EXIT_SUCCESS;
+}
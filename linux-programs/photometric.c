@@ -0,0 +1,215 @@
+// photometric stereo from frames each lit by a single LED
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "ahd_bayer.h"
+#include "bayer_green.h"
+#include "photometric.h"
+
+
+// determinant below which the lights are taken to be in one plane
+#define SINGULAR 1e-6
+
+static bool fail(photometric_t *photometric, const char *operation) {
+	photometric->error = operation;
+	return false;
+}
+
+
+void photometric_ring(float direction[][3], unsigned int lights, double elevation, double rotation) {
+	const double e = elevation * M_PI / 180;
+	for (unsigned int i = 0; i < lights; ++i) {
+		// y is down the image, so clockwise as seen is a positive angle
+		const double a = (rotation + 90.0 * i) * M_PI / 180;
+		direction[i][0] = cos(e) * cos(a);
+		direction[i][1] = cos(e) * sin(a);
+		direction[i][2] = sin(e);
+	}
+}
+
+
+bool photometric_init(photometric_t *photometric, unsigned int width, unsigned int height, BayerTile tile,
+		      const float direction[][3], unsigned int lights) {
+	memset(photometric, 0, sizeof(*photometric));
+
+	unsigned int g0, g1;
+	if (!bayer_green(tile, &g0, &g1)) {
+		return fail(photometric, "tile");
+	}
+	photometric->shift0 = PAIR_SHIFT(g0);
+	photometric->shift1 = PAIR_SHIFT(g1);
+	if (0 != width % 2 || 0 != height % 2 || width < 2 || height < 2
+	    || lights < 3 || lights > PHOTOMETRIC_MAX_LIGHTS) {
+		errno = EINVAL;
+		return fail(photometric, "size");
+	}
+	photometric->width = width;
+	photometric->height = height;
+	photometric->lights = lights;
+
+	for (unsigned int i = 0; i < lights; ++i) {
+		const float *d = direction[i];
+		const float length = sqrtf(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+		if (!(length > 0)) {
+			errno = EINVAL;
+			return fail(photometric, "direction");
+		}
+		for (int c = 0; c < 3; ++c) {
+			photometric->direction[i][c] = d[c] / length;
+		}
+	}
+
+	const size_t quads = (size_t)width * height / 4;
+	bool ok = true;
+	for (unsigned int i = 0; i < lights; ++i) {
+		photometric->sum[i] = calloc(quads, sizeof(uint32_t));
+		ok = ok && NULL != photometric->sum[i];
+	}
+	photometric->albedo = malloc(quads * sizeof(float));
+	for (int c = 0; c < 3; ++c) {
+		photometric->normal[c] = malloc(quads * sizeof(float));
+		ok = ok && NULL != photometric->normal[c];
+	}
+	if (!ok || NULL == photometric->albedo) {
+		photometric_free(photometric);
+		errno = ENOMEM;
+		return fail(photometric, "malloc");
+	}
+	return true;
+}
+
+
+bool photometric_add(photometric_t *photometric, const uint16_t *bayer, unsigned int light) {
+	if (light >= photometric->lights) {
+		errno = EINVAL;
+		return fail(photometric, "light");
+	}
+	const unsigned int width = photometric->width;
+	const unsigned int quad_width = width / 2;
+	const unsigned int shift0 = photometric->shift0;
+	const unsigned int shift1 = photometric->shift1;
+	for (unsigned int qy = 0; qy < photometric->height / 2; ++qy) {
+		const pixel_pair_t *row0 = (const pixel_pair_t *)&bayer[(size_t)2 * qy * width];
+		const pixel_pair_t *row1 = (const pixel_pair_t *)&bayer[(size_t)(2 * qy + 1) * width];
+		uint32_t *sum = &photometric->sum[light][(size_t)qy * quad_width];
+		for (unsigned int qx = 0; qx < quad_width; ++qx) {
+			sum[qx] += ((row0[qx] >> shift0) & PIXEL_MASK) + ((row1[qx] >> shift1) & PIXEL_MASK);
+		}
+	}
+	++photometric->frames[light];
+	return true;
+}
+
+
+bool photometric_solve(photometric_t *photometric) {
+	// the lights with frames
+	unsigned int used[PHOTOMETRIC_MAX_LIGHTS];
+	unsigned int n = 0;
+	for (unsigned int i = 0; i < photometric->lights; ++i) {
+		if (photometric->frames[i] > 0) {
+			used[n++] = i;
+		}
+	}
+	photometric->used = n;
+	if (n < 3) {
+		errno = EINVAL;
+		return fail(photometric, "lights");
+	}
+
+	// L^T L and its inverse from the cofactors
+	double m[3][3] = { { 0 } };
+	for (unsigned int k = 0; k < n; ++k) {
+		const float *d = photometric->direction[used[k]];
+		for (int r = 0; r < 3; ++r) {
+			for (int c = 0; c < 3; ++c) {
+				m[r][c] += (double)d[r] * d[c];
+			}
+		}
+	}
+	double inverse[3][3];
+	for (int r = 0; r < 3; ++r) {
+		for (int c = 0; c < 3; ++c) {
+			const int r1 = (c + 1) % 3, r2 = (c + 2) % 3;
+			const int c1 = (r + 1) % 3, c2 = (r + 2) % 3;
+			inverse[r][c] = m[r1][c1] * m[r2][c2] - m[r1][c2] * m[r2][c1];
+		}
+	}
+	const double determinant = m[0][0] * inverse[0][0] + m[0][1] * inverse[1][0] + m[0][2] * inverse[2][0];
+	if (fabs(determinant) < SINGULAR) {
+		errno = EDOM;
+		return fail(photometric, "directions");
+	}
+
+	// the pseudo inverse, with the averaging over the two green sites
+	// and the frames of each light folded in
+	float p[3][PHOTOMETRIC_MAX_LIGHTS];
+	for (unsigned int k = 0; k < n; ++k) {
+		const float *d = photometric->direction[used[k]];
+		const double scale = 1.0 / (determinant * 2 * photometric->frames[used[k]]);
+		for (int c = 0; c < 3; ++c) {
+			p[c][k] = (inverse[c][0] * d[0] + inverse[c][1] * d[1] + inverse[c][2] * d[2]) * scale;
+		}
+	}
+
+	const unsigned int quad_width = photometric->width / 2;
+	for (unsigned int qy = 0; qy < photometric->height / 2; ++qy) {
+		const size_t first = (size_t)qy * quad_width;
+		float *restrict albedo = &photometric->albedo[first];
+		float *restrict x = &photometric->normal[0][first];
+		float *restrict y = &photometric->normal[1][first];
+		float *restrict z = &photometric->normal[2][first];
+
+		// g = P I, one light at a time over the row
+		memset(x, 0, quad_width * sizeof(float));
+		memset(y, 0, quad_width * sizeof(float));
+		memset(z, 0, quad_width * sizeof(float));
+		for (unsigned int k = 0; k < n; ++k) {
+			const uint32_t *restrict sum = &photometric->sum[used[k]][first];
+			const float px = p[0][k];
+			const float py = p[1][k];
+			const float pz = p[2][k];
+			for (unsigned int qx = 0; qx < quad_width; ++qx) {
+				const float intensity = sum[qx];
+				x[qx] += px * intensity;
+				y[qx] += py * intensity;
+				z[qx] += pz * intensity;
+			}
+		}
+
+		for (unsigned int qx = 0; qx < quad_width; ++qx) {
+			albedo[qx] = x[qx] * x[qx] + y[qx] * y[qx] + z[qx] * z[qx];
+		}
+		// sqrtf() only vectorises without errno, so this loop stays scalar
+		for (unsigned int qx = 0; qx < quad_width; ++qx) {
+			albedo[qx] = sqrtf(albedo[qx]);
+		}
+		// the bias keeps the loop free of branches, black points get a
+		// zero normal
+		for (unsigned int qx = 0; qx < quad_width; ++qx) {
+			const float scale = 1.0f / (albedo[qx] + 1e-6f);
+			x[qx] *= scale;
+			y[qx] *= scale;
+			z[qx] *= scale;
+		}
+	}
+	return true;
+}
+
+
+void photometric_free(photometric_t *photometric) {
+	for (unsigned int i = 0; i < PHOTOMETRIC_MAX_LIGHTS; ++i) {
+		free(photometric->sum[i]);
+		photometric->sum[i] = NULL;
+	}
+	free(photometric->albedo);
+	photometric->albedo = NULL;
+	for (int c = 0; c < 3; ++c) {
+		free(photometric->normal[c]);
+		photometric->normal[c] = NULL;
+	}
+}
@@ -0,0 +1,69 @@
+// photometric stereo from frames each lit by a single LED
+//
+// a matte surface lit from the unit direction l returns albedo * (n . l)
+// of the light, so with three or more lights the scaled normal
+// g = albedo * n of each point is the least squares solution of L g = I,
+// where L holds a light direction in each row and I the intensities
+// seen under them.  The pseudo inverse (L^T L)^-1 L^T depends only on
+// the lights, so it is found once and each point then costs three dot
+// products, taken a row at a time over planes of floats so the loops
+// vectorise.  The albedo is |g| and the normal g / |g|.
+//
+// intensities are the green sites of each Bayer quad, as in
+// sharpness.h, averaged over all the frames under the same light.
+// Shadows and highlights are not detected, they bias the points they
+// fall on
+
+#ifndef _PHOTOMETRIC_H_
+#define _PHOTOMETRIC_H_ 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ahd_bayer.h"
+
+// one per LED of the four bit mask
+#define PHOTOMETRIC_MAX_LIGHTS 4
+
+// elevation of the LEDs above the sample plane
+#define PHOTOMETRIC_DEFAULT_ELEVATION 45.0  // degrees
+
+typedef struct {
+	unsigned int width;          // of the Bayer frames
+	unsigned int height;
+	unsigned int shift0;         // of the green site in each row of a quad
+	unsigned int shift1;
+	unsigned int lights;
+	float direction[PHOTOMETRIC_MAX_LIGHTS][3];  // unit vectors towards each light
+
+	uint32_t *sum[PHOTOMETRIC_MAX_LIGHTS];  // green of each quad over the frames
+	unsigned int frames[PHOTOMETRIC_MAX_LIGHTS];
+
+	// quad images, valid after photometric_solve()
+	float *albedo;               // in 12 bit levels
+	float *normal[3];            // x right, y down and z towards the camera
+	unsigned int used;           // lights that had frames
+	const char *error;           // operation that failed, errno has the reason
+} photometric_t;
+
+// directions of lights in a ring around the optical axis, light i at
+// rotation + 90 * i degrees clockwise from the x axis as seen in the
+// image, and elevation degrees above the sample plane
+void photometric_ring(float direction[][3], unsigned int lights, double elevation, double rotation);
+
+// all return false with photometric->error and errno set
+
+bool photometric_init(photometric_t *photometric, unsigned int width, unsigned int height, BayerTile tile,
+		      const float direction[][3], unsigned int lights);
+
+// add a frame lit by light, the embedded data is ignored
+bool photometric_add(photometric_t *photometric, const uint16_t *bayer, unsigned int light);
+
+// the albedo and normals from the frames so far.  Needs frames from three
+// lights whose directions are not all in one plane
+bool photometric_solve(photometric_t *photometric);
+
+void photometric_free(photometric_t *photometric);
+
+#endif
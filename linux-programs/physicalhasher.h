@@ -0,0 +1,36 @@
+// libphysicalhasher, everything the command line programs are built on
+//
+// every module works on a handle owned by the caller and keeps no
+// global state, so a program can run any number of decoders, captures
+// and pipelines at once.  Functions that can fail return false and set
+// the handle's error to the operation that failed, with errno holding
+// the reason
+
+#ifndef _PHYSICALHASHER_H_
+#define _PHYSICALHASHER_H_ 1
+
+#include "ahd_bayer.h"
+#include "bufshare.h"
+#include "controls.h"
+#include "decode.h"
+#include "embed.h"
+#include "focus_stack.h"
+#include "fingerprint.h"
+#include "fpindex.h"
+#include "fpstore.h"
+#include "frame_stats.h"
+#include "framebus.h"
+#include "framefile.h"
+#include "fusion.h"
+#include "image_png.h"
+#include "keypoints.h"
+#include "latency.h"
+#include "photometric.h"
+#include "pipeline.h"
+#include "preview.h"
+#include "registration.h"
+#include "segment.h"
+#include "sharpness.h"
+#include "video.h"
+
+#endif
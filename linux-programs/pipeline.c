@@ -0,0 +1,359 @@
+// in-process frame processing on a pool of worker threads
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ahd_bayer.h"
+#include "embed.h"
+#include "fingerprint.h"
+#include "image_png.h"
+#include "pipeline.h"
+
+
+static bool fail(pipeline_t *pipeline, const char *operation) {
+	pipeline->error = operation;
+	return false;
+}
+
+static uint64_t monotonic_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// sinks
+
+static bool png_write(const pipeline_sink_t *sink, const char *path, const pipeline_frame_t *frame) {
+	if (!image_write_png(frame->rgb, frame->width, frame->height, path)) {
+		if (0 == errno) {
+			errno = EIO;
+		}
+		return false;
+	}
+	return true;
+}
+
+// 16 bit R G B pixels in host order with no header
+static bool raw_write(const pipeline_sink_t *sink, const char *path, const pipeline_frame_t *frame) {
+	FILE *f = fopen(path, "wb");
+	if (NULL == f) {
+		return false;
+	}
+	size_t n = 3 * frame->width * frame->height;
+	bool ok = n == fwrite(frame->rgb, sizeof(ahd_pixel_t), n, f);
+	if (0 != fclose(f)) {
+		ok = false;
+	}
+	return ok;
+}
+
+// one line, as printed by create-fingerprint with the V4L2 sequence added:
+//   frame sequence fingerprint steps contrast
+static bool fingerprint_write(const pipeline_sink_t *sink, const char *path, const pipeline_frame_t *frame) {
+	fingerprint_t fingerprint;
+	if (!fingerprint_bayer(frame->bayer, frame->width, frame->height, BAYER_TILE_GRBG, &fingerprint)) {
+		return false;
+	}
+	char hex[FINGERPRINT_HEX + 1];
+	fingerprint_format(&fingerprint, hex);
+
+	FILE *f = fopen(path, "w");
+	if (NULL == f) {
+		return false;
+	}
+	fprintf(f, "%llu %u %s", (unsigned long long)frame->frame, frame->sequence, hex);
+	if (frame->embed.present) {
+		fprintf(f, " %u %u\n", frame->embed.steps, frame->embed.contrast);
+	} else {
+		fprintf(f, " - -\n");
+	}
+	return 0 == fclose(f);
+}
+
+const pipeline_sink_t pipeline_png_sink = {
+	.name = "png",
+	.extension = ".png",
+	.needs_rgb = true,
+	.write = png_write,
+};
+
+const pipeline_sink_t pipeline_raw_sink = {
+	.name = "raw",
+	.extension = ".rgb",
+	.needs_rgb = true,
+	.write = raw_write,
+};
+
+const pipeline_sink_t pipeline_fingerprint_sink = {
+	.name = "fingerprint",
+	.extension = ".fp",
+	.needs_rgb = false,
+	.write = fingerprint_write,
+};
+
+static const pipeline_sink_t *const sinks[] = {
+	&pipeline_png_sink,
+	&pipeline_raw_sink,
+	&pipeline_fingerprint_sink,
+};
+
+#define SIZE_OF_ARRAY(a) (sizeof(a) / sizeof((a)[0]))
+
+const pipeline_sink_t *pipeline_find_sink(const char *name) {
+	for (size_t i = 0; i < SIZE_OF_ARRAY(sinks); ++i) {
+		if (0 == strcmp(name, sinks[i]->name)) {
+			return sinks[i];
+		}
+	}
+	return NULL;
+}
+
+const char *pipeline_sink_names(void) {
+	static char names[128];
+	if ('\0' == names[0]) {
+		for (size_t i = 0; i < SIZE_OF_ARRAY(sinks); ++i) {
+			if (0 != i) {
+				strncat(names, ", ", sizeof(names) - strlen(names) - 1);
+			}
+			strncat(names, sinks[i]->name, sizeof(names) - strlen(names) - 1);
+		}
+	}
+	return names;
+}
+
+
+// workers
+
+// oldest queued job, NULL if none, called with the lock held
+static pipeline_job_t *next_job(pipeline_t *pipeline) {
+	pipeline_job_t *job = NULL;
+	for (unsigned int i = 0; i < pipeline->n_jobs; ++i) {
+		pipeline_job_t *j = &pipeline->jobs[i];
+		if (PIPELINE_JOB_QUEUED == j->state && (NULL == job || j->frame < job->frame)) {
+			job = j;
+		}
+	}
+	return job;
+}
+
+static bool run_job(pipeline_t *pipeline, pipeline_job_t *job, ahd_pixel_t *rgb,
+		    const char **error) {
+	const size_t n_pixels = pipeline->width * pipeline->height;
+
+	if (job->bytes < n_pixels * sizeof(uint16_t)) {
+		*error = "short frame";
+		errno = EINVAL;
+		return false;
+	}
+
+	// the firmware data would show as bright pixels
+	embed_strip(job->bayer, n_pixels, pipeline->embed_offset);
+
+	if (pipeline->sink->needs_rgb
+	    && !ahd_decode(job->bayer, pipeline->width, pipeline->height, rgb, BAYER_TILE_GRBG)) {
+		*error = "demosaic";
+		errno = ENOMEM;
+		return false;
+	}
+
+	pipeline_frame_t frame = {
+		.frame = job->frame,
+		.sequence = job->sequence,
+		.embed = job->embed,
+		.bayer = job->bayer,
+		.rgb = rgb,
+		.width = pipeline->width,
+		.height = pipeline->height,
+	};
+	char path[sizeof(pipeline->prefix) + 32];
+	snprintf(path, sizeof(path), "%s%04llu%s", pipeline->prefix,
+		 (unsigned long long)job->frame, pipeline->sink->extension);
+
+	errno = 0;
+	if (!pipeline->sink->write(pipeline->sink, path, &frame)) {
+		*error = pipeline->sink->name;
+		return false;
+	}
+	return true;
+}
+
+static void *worker(void *arg) {
+	pipeline_t *pipeline = arg;
+
+	pthread_mutex_lock(&pipeline->lock);
+	ahd_pixel_t *rgb = pipeline->rgb[pipeline->started++];
+
+	for (;;) {
+		pipeline_job_t *job;
+		while (NULL == (job = next_job(pipeline)) && !pipeline->stopping) {
+			pthread_cond_wait(&pipeline->queued, &pipeline->lock);
+		}
+		if (NULL == job) {
+			break;  // stopping with nothing left to do
+		}
+		job->state = PIPELINE_JOB_BUSY;
+		pthread_mutex_unlock(&pipeline->lock);
+
+		const char *error = NULL;
+		bool ok = run_job(pipeline, job, rgb, &error);
+		int saved_errno = errno;
+		uint64_t latency = monotonic_ns() - job->submit_ns;
+
+		pthread_mutex_lock(&pipeline->lock);
+		if (ok) {
+			++pipeline->completed;
+		} else {
+			++pipeline->failed;
+			if (NULL == pipeline->sink_error) {
+				pipeline->sink_error = error;
+				pipeline->sink_errno = saved_errno;
+			}
+		}
+		pipeline->latency_total_ns += latency;
+		if (latency > pipeline->latency_max_ns) {
+			pipeline->latency_max_ns = latency;
+		}
+		job->state = PIPELINE_JOB_FREE;
+	}
+
+	pthread_mutex_unlock(&pipeline->lock);
+	return NULL;
+}
+
+
+static void free_buffers(pipeline_t *pipeline) {
+	if (NULL != pipeline->jobs) {
+		for (unsigned int i = 0; i < pipeline->n_jobs; ++i) {
+			free(pipeline->jobs[i].bayer);
+		}
+		free(pipeline->jobs);
+		pipeline->jobs = NULL;
+	}
+	for (unsigned int i = 0; i < PIPELINE_MAX_WORKERS; ++i) {
+		free(pipeline->rgb[i]);
+		pipeline->rgb[i] = NULL;
+	}
+}
+
+
+bool pipeline_start(pipeline_t *pipeline, const pipeline_sink_t *sink, const char *prefix,
+		    unsigned int workers, unsigned int width, unsigned int height, int embed_offset) {
+	memset(pipeline, 0, sizeof(*pipeline));
+	pipeline->sink = sink;
+	pipeline->width = width;
+	pipeline->height = height;
+	pipeline->embed_offset = embed_offset;
+
+	if (0 == workers || workers > PIPELINE_MAX_WORKERS) {
+		errno = EINVAL;
+		return fail(pipeline, "worker count");
+	}
+	if (strlen(prefix) >= sizeof(pipeline->prefix)) {
+		errno = ENAMETOOLONG;
+		return fail(pipeline, "prefix too long");
+	}
+	strcpy(pipeline->prefix, prefix);
+
+	const size_t n_pixels = width * height;
+	pipeline->n_jobs = PIPELINE_JOBS_PER_WORKER * workers;
+	pipeline->jobs = calloc(pipeline->n_jobs, sizeof(*pipeline->jobs));
+	if (NULL == pipeline->jobs) {
+		errno = ENOMEM;
+		return fail(pipeline, "out of memory");
+	}
+	for (unsigned int i = 0; i < pipeline->n_jobs; ++i) {
+		pipeline->jobs[i].bayer = malloc(n_pixels * sizeof(uint16_t));
+		if (NULL == pipeline->jobs[i].bayer) {
+			free_buffers(pipeline);
+			errno = ENOMEM;
+			return fail(pipeline, "out of memory");
+		}
+	}
+	for (unsigned int i = 0; i < workers && sink->needs_rgb; ++i) {
+		pipeline->rgb[i] = malloc(3 * n_pixels * sizeof(ahd_pixel_t));
+		if (NULL == pipeline->rgb[i]) {
+			free_buffers(pipeline);
+			errno = ENOMEM;
+			return fail(pipeline, "out of memory");
+		}
+	}
+
+	pthread_mutex_init(&pipeline->lock, NULL);
+	pthread_cond_init(&pipeline->queued, NULL);
+
+	for (pipeline->workers = 0; pipeline->workers < workers; ++pipeline->workers) {
+		int rc = pthread_create(&pipeline->thread[pipeline->workers], NULL, worker, pipeline);
+		if (0 != rc) {
+			pipeline_finish(pipeline);
+			errno = rc;
+			return fail(pipeline, "pthread_create");
+		}
+	}
+	return true;
+}
+
+
+bool pipeline_submit(pipeline_t *pipeline, const void *data, size_t size,
+		     uint64_t frame, uint32_t sequence, const embed_t *embed) {
+	const size_t frame_bytes = pipeline->width * pipeline->height * sizeof(uint16_t);
+
+	pthread_mutex_lock(&pipeline->lock);
+	pipeline_job_t *job = NULL;
+	for (unsigned int i = 0; i < pipeline->n_jobs; ++i) {
+		if (PIPELINE_JOB_FREE == pipeline->jobs[i].state) {
+			job = &pipeline->jobs[i];
+			break;
+		}
+	}
+	if (NULL == job) {
+		++pipeline->dropped;
+		pthread_mutex_unlock(&pipeline->lock);
+		return false;
+	}
+	// workers only take queued jobs, so the copy can be made unlocked
+	job->state = PIPELINE_JOB_BUSY;
+	pthread_mutex_unlock(&pipeline->lock);
+
+	job->bytes = size < frame_bytes ? size : frame_bytes;
+	memcpy(job->bayer, data, job->bytes);
+	job->frame = frame;
+	job->sequence = sequence;
+	job->embed = *embed;
+	job->submit_ns = monotonic_ns();
+
+	pthread_mutex_lock(&pipeline->lock);
+	job->state = PIPELINE_JOB_QUEUED;
+	++pipeline->submitted;
+	pthread_cond_signal(&pipeline->queued);
+	pthread_mutex_unlock(&pipeline->lock);
+	return true;
+}
+
+
+void pipeline_finish(pipeline_t *pipeline) {
+	if (NULL == pipeline->jobs) {
+		return;
+	}
+
+	pthread_mutex_lock(&pipeline->lock);
+	pipeline->stopping = true;
+	pthread_cond_broadcast(&pipeline->queued);
+	pthread_mutex_unlock(&pipeline->lock);
+
+	// workers drain the queue before they exit
+	for (unsigned int i = 0; i < pipeline->workers; ++i) {
+		pthread_join(pipeline->thread[i], NULL);
+	}
+	pipeline->workers = 0;
+
+	pthread_cond_destroy(&pipeline->queued);
+	pthread_mutex_destroy(&pipeline->lock);
+	free_buffers(pipeline);
+}
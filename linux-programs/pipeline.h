@@ -0,0 +1,113 @@
+// in-process frame processing: demosaic on a pool of worker threads
+// and hand each result to a sink
+//
+// a submitted frame is copied into a free job slot so the capture
+// buffer can go straight back to the driver.  If every slot is busy
+// the frame is dropped and counted rather than stalling capture
+
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_ 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "ahd_bayer.h"
+#include "embed.h"
+
+#define PIPELINE_MAX_WORKERS 16
+
+// job slots for each worker, one being decoded and one waiting
+#define PIPELINE_JOBS_PER_WORKER 2
+
+// one decoded frame as seen by a sink
+typedef struct {
+	uint64_t frame;             // capture frame number, from 0
+	uint32_t sequence;          // V4L2 sequence
+	embed_t embed;
+	const uint16_t *bayer;      // embedded data stripped
+	const ahd_pixel_t *rgb;     // width * height R G B pixels
+	unsigned int width;
+	unsigned int height;
+} pipeline_frame_t;
+
+typedef struct pipeline_sink_s pipeline_sink_t;
+
+struct pipeline_sink_s {
+	const char *name;
+	const char *extension;      // of the files written
+	bool needs_rgb;             // false => the demosaic is skipped
+
+	// called from several workers at once, returns false with errno set
+	bool (*write)(const pipeline_sink_t *sink, const char *path, const pipeline_frame_t *frame);
+};
+
+extern const pipeline_sink_t pipeline_png_sink;
+extern const pipeline_sink_t pipeline_raw_sink;
+extern const pipeline_sink_t pipeline_fingerprint_sink;
+
+// a sink by name, NULL if not known
+const pipeline_sink_t *pipeline_find_sink(const char *name);
+
+// "png, raw, fingerprint"
+const char *pipeline_sink_names(void);
+
+typedef enum {
+	PIPELINE_JOB_FREE,
+	PIPELINE_JOB_QUEUED,
+	PIPELINE_JOB_BUSY,
+} pipeline_job_state_t;
+
+typedef struct {
+	pipeline_job_state_t state;
+	uint16_t *bayer;
+	size_t bytes;
+	uint64_t frame;
+	uint32_t sequence;
+	embed_t embed;
+	uint64_t submit_ns;         // CLOCK_MONOTONIC
+} pipeline_job_t;
+
+typedef struct {
+	const pipeline_sink_t *sink;
+	char prefix[256];           // output names are prefix, frame, extension
+	unsigned int width;
+	unsigned int height;
+	int embed_offset;
+
+	unsigned int workers;
+	pthread_t thread[PIPELINE_MAX_WORKERS];
+	ahd_pixel_t *rgb[PIPELINE_MAX_WORKERS];
+	unsigned int started;       // workers that have taken an rgb buffer
+	pipeline_job_t *jobs;
+	unsigned int n_jobs;
+	pthread_mutex_t lock;
+	pthread_cond_t queued;      // a job is waiting or stopping is set
+	bool stopping;
+
+	// counts, under the lock
+	uint64_t submitted;
+	uint64_t completed;
+	uint64_t dropped;           // no free job slot
+	uint64_t failed;            // demosaic or sink errors
+	uint64_t latency_total_ns;  // submit to sink finished
+	uint64_t latency_max_ns;
+	const char *sink_error;     // first failure
+	int sink_errno;
+
+	const char *error;          // operation that failed, errno has the reason
+} pipeline_t;
+
+// returns false with pipeline->error and errno set
+bool pipeline_start(pipeline_t *pipeline, const pipeline_sink_t *sink, const char *prefix,
+		    unsigned int workers, unsigned int width, unsigned int height, int embed_offset);
+
+// copy a frame in for processing, false if it was dropped
+bool pipeline_submit(pipeline_t *pipeline, const void *data, size_t size,
+		     uint64_t frame, uint32_t sequence, const embed_t *embed);
+
+// finish all submitted frames, then stop the workers and free everything
+void pipeline_finish(pipeline_t *pipeline);
+
+#endif
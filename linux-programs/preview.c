@@ -0,0 +1,444 @@
+// live preview of a capture as an HTTP multipart stream of PNG images
+
+#include <png.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "preview.h"
+
+
+#define BOUNDARY "frame"
+
+// viewers that cannot take a frame in this time are dropped
+#define SEND_TIMEOUT_S 2
+
+
+static bool fail(preview_t *preview, const char *operation) {
+	preview->error = operation;
+	return false;
+}
+
+static uint64_t monotonic_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool is_port(const char *address) {
+	if ('\0' == *address) {
+		return false;
+	}
+	for (const char *p = address; '\0' != *p; ++p) {
+		if (*p < '0' || *p > '9') {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool listen_on(preview_t *preview, const char *address) {
+	int one = 1;
+
+	if (is_port(address)) {
+		struct sockaddr_in in;
+		memset(&in, 0, sizeof(in));
+		in.sin_family = AF_INET;
+		in.sin_port = htons(atoi(address));
+		in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);  // operators on this machine only
+
+		preview->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (-1 == preview->listen_fd) {
+			return fail(preview, "socket");
+		}
+		setsockopt(preview->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (-1 == bind(preview->listen_fd, (struct sockaddr *)&in, sizeof(in))) {
+			return fail(preview, "bind");
+		}
+	} else {
+		struct sockaddr_un un;
+		memset(&un, 0, sizeof(un));
+		un.sun_family = AF_UNIX;
+		if (strlen(address) >= sizeof(un.sun_path)) {
+			errno = ENAMETOOLONG;
+			return fail(preview, "socket path");
+		}
+		strcpy(un.sun_path, address);
+		strcpy(preview->path, address);
+
+		preview->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (-1 == preview->listen_fd) {
+			return fail(preview, "socket");
+		}
+		unlink(address);  // left by an earlier run
+		if (-1 == bind(preview->listen_fd, (struct sockaddr *)&un, sizeof(un))) {
+			return fail(preview, "bind");
+		}
+	}
+	if (-1 == listen(preview->listen_fd, PREVIEW_MAX_CLIENTS)) {
+		return fail(preview, "listen");
+	}
+	return true;
+}
+
+
+// PNG into a growing memory buffer
+typedef struct {
+	uint8_t *data;
+	size_t size;
+	size_t allocated;
+} png_buffer_t;
+
+static void png_buffer_write(png_structp png_ptr, png_bytep data, png_size_t length) {
+	png_buffer_t *b = png_get_io_ptr(png_ptr);
+	if (b->size + length > b->allocated) {
+		size_t allocated = 2 * (b->size + length);
+		uint8_t *p = realloc(b->data, allocated);
+		if (NULL == p) {
+			png_error(png_ptr, "out of memory");
+		}
+		b->data = p;
+		b->allocated = allocated;
+	}
+	memcpy(b->data + b->size, data, length);
+	b->size += length;
+}
+
+static void png_buffer_flush(png_structp png_ptr) {
+}
+
+static bool encode_png(const uint8_t *rgb, unsigned int width, unsigned int height, png_buffer_t *out) {
+	out->size = 0;
+
+	png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (NULL == png_ptr) {
+		return false;
+	}
+	png_infop info_ptr = png_create_info_struct(png_ptr);
+	if (NULL == info_ptr || setjmp(png_jmpbuf(png_ptr))) {
+		png_destroy_write_struct(&png_ptr, &info_ptr);
+		return false;
+	}
+
+	png_set_write_fn(png_ptr, out, png_buffer_write, png_buffer_flush);
+	png_set_compression_level(png_ptr, 1);  // latency matters more than size
+	png_set_IHDR(png_ptr, info_ptr, width, height, 8,
+		     PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+		     PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_write_info(png_ptr, info_ptr);
+	for (unsigned int y = 0; y < height; ++y) {
+		png_write_row(png_ptr, (png_bytep)&rgb[3 * width * y]);
+	}
+	png_write_end(png_ptr, info_ptr);
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+	return true;
+}
+
+
+// each output pixel is the mean of the GRBG quads under it
+static void render(const preview_t *preview, uint8_t *rgb) {
+	const unsigned int quads = preview->bin / 2;  // per side
+	const unsigned int out_width = preview->width / preview->bin;
+	const unsigned int out_height = preview->height / preview->bin;
+	const unsigned int n = quads * quads;
+
+	for (unsigned int oy = 0; oy < out_height; ++oy) {
+		for (unsigned int ox = 0; ox < out_width; ++ox) {
+			uint32_t r = 0, g = 0, b = 0;
+			for (unsigned int qy = 0; qy < quads; ++qy) {
+				unsigned int y = oy * preview->bin + 2 * qy;
+				const uint16_t *row0 = &preview->raw[y * preview->width];
+				const uint16_t *row1 = row0 + preview->width;
+				for (unsigned int qx = 0; qx < quads; ++qx) {
+					unsigned int x = ox * preview->bin + 2 * qx;
+					g += (row0[x] & 0x0fff) + (row1[x + 1] & 0x0fff);
+					r += row0[x + 1] & 0x0fff;
+					b += row1[x] & 0x0fff;
+				}
+			}
+			*rgb++ = preview->lut[r / n];
+			*rgb++ = preview->lut[g / (2 * n)];
+			*rgb++ = preview->lut[b / n];
+		}
+	}
+}
+
+
+static void drop_client(preview_t *preview, unsigned int i) {
+	close(preview->client[i]);
+	preview->client[i] = -1;
+	__atomic_sub_fetch(&preview->clients, 1, __ATOMIC_SEQ_CST);
+}
+
+static bool send_all(int fd, const void *data, size_t size) {
+	const uint8_t *p = data;
+	while (size > 0) {
+		ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+		if (n <= 0) {
+			if (-1 == n && EINTR == errno) {
+				continue;
+			}
+			return false;
+		}
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+static void accept_client(preview_t *preview) {
+	int fd = accept(preview->listen_fd, NULL, NULL);
+	if (-1 == fd) {
+		return;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	struct timeval timeout = { .tv_sec = SEND_TIMEOUT_S };
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	// whatever was asked for, the answer is the stream
+	char request[2048];
+	size_t used = 0;
+	while (used < sizeof(request) - 1) {
+		ssize_t n = recv(fd, request + used, sizeof(request) - 1 - used, 0);
+		if (n <= 0) {
+			close(fd);
+			return;
+		}
+		used += n;
+		request[used] = '\0';
+		if (NULL != strstr(request, "\r\n\r\n") || NULL != strstr(request, "\n\n")) {
+			break;
+		}
+	}
+
+	int slot = -1;
+	for (int i = 0; i < PREVIEW_MAX_CLIENTS; ++i) {
+		if (-1 == preview->client[i]) {
+			slot = i;
+			break;
+		}
+	}
+	static const char busy[] =
+		"HTTP/1.0 503 Service Unavailable\r\n"
+		"Content-Type: text/plain\r\n\r\n"
+		"too many viewers\r\n";
+	static const char header[] =
+		"HTTP/1.0 200 OK\r\n"
+		"Cache-Control: no-cache\r\n"
+		"Connection: close\r\n"
+		"Content-Type: multipart/x-mixed-replace; boundary=" BOUNDARY "\r\n\r\n";
+	if (-1 == slot) {
+		send_all(fd, busy, sizeof(busy) - 1);
+		close(fd);
+		return;
+	}
+	if (!send_all(fd, header, sizeof(header) - 1)) {
+		close(fd);
+		return;
+	}
+	preview->client[slot] = fd;
+	__atomic_add_fetch(&preview->clients, 1, __ATOMIC_SEQ_CST);
+}
+
+static void send_frame(preview_t *preview, const png_buffer_t *png) {
+	char part[128];
+	int n = snprintf(part, sizeof(part),
+			 "--" BOUNDARY "\r\n"
+			 "Content-Type: image/png\r\n"
+			 "Content-Length: %zu\r\n\r\n", png->size);
+	for (int i = 0; i < PREVIEW_MAX_CLIENTS; ++i) {
+		int fd = preview->client[i];
+		if (-1 == fd) {
+			continue;
+		}
+		if (!send_all(fd, part, n) || !send_all(fd, png->data, png->size)
+		    || !send_all(fd, "\r\n", 2)) {
+			drop_client(preview, i);
+		}
+	}
+	++preview->frames;
+}
+
+static void *preview_thread(void *arg) {
+	preview_t *preview = arg;
+	const unsigned int out_width = preview->width / preview->bin;
+	const unsigned int out_height = preview->height / preview->bin;
+	uint8_t *rgb = malloc(3 * out_width * out_height);
+	png_buffer_t png = { NULL, 0, 0 };
+
+	while (NULL != rgb) {
+		struct pollfd pfd[2 + PREVIEW_MAX_CLIENTS];
+		int map[2 + PREVIEW_MAX_CLIENTS];
+		nfds_t n = 0;
+		pfd[n].fd = preview->wake_fd;
+		pfd[n++].events = POLLIN;
+		pfd[n].fd = preview->listen_fd;
+		pfd[n++].events = POLLIN;
+		for (int i = 0; i < PREVIEW_MAX_CLIENTS; ++i) {
+			if (-1 != preview->client[i]) {
+				map[n] = i;
+				pfd[n].fd = preview->client[i];
+				pfd[n++].events = POLLIN;
+			}
+		}
+
+		if (-1 == poll(pfd, n, -1)) {
+			if (EINTR == errno) {
+				continue;
+			}
+			break;
+		}
+
+		if (0 != pfd[0].revents) {
+			uint64_t count;
+			if (-1 == read(preview->wake_fd, &count, sizeof(count)) && EAGAIN != errno) {
+				break;
+			}
+			if (__atomic_load_n(&preview->stopping, __ATOMIC_SEQ_CST)) {
+				break;
+			}
+			if (__atomic_load_n(&preview->busy, __ATOMIC_SEQ_CST)) {
+				render(preview, rgb);
+				__atomic_store_n(&preview->busy, false, __ATOMIC_SEQ_CST);
+				if (encode_png(rgb, out_width, out_height, &png)) {
+					send_frame(preview, &png);
+				}
+			}
+		}
+		if (0 != pfd[1].revents) {
+			accept_client(preview);
+		}
+		// viewers never send anything more, so this is a hang up
+		for (nfds_t i = 2; i < n; ++i) {
+			if (0 != pfd[i].revents) {
+				char discard[256];
+				if (recv(pfd[i].fd, discard, sizeof(discard), MSG_DONTWAIT) <= 0) {
+					drop_client(preview, map[i]);
+				}
+			}
+		}
+	}
+
+	free(png.data);
+	free(rgb);
+	return NULL;
+}
+
+
+bool preview_start(preview_t *preview, const char *address, unsigned int width,
+		   unsigned int height, unsigned int bin, unsigned int rate) {
+	memset(preview, 0, sizeof(*preview));
+	preview->listen_fd = -1;
+	preview->wake_fd = -1;
+	for (int i = 0; i < PREVIEW_MAX_CLIENTS; ++i) {
+		preview->client[i] = -1;
+	}
+
+	if ((2 != bin && 4 != bin) || 0 == rate || width < bin || height < bin) {
+		errno = EINVAL;
+		return fail(preview, "preview settings");
+	}
+	preview->width = width;
+	preview->height = height;
+	preview->bin = bin;
+	preview->rate = rate;
+	preview->period_ns = 1000000000ULL / rate;
+
+	for (int i = 0; i < 4096; ++i) {
+		preview->lut[i] = (uint8_t)(255.0 * pow(i / 4095.0, 1.0 / PREVIEW_GAMMA) + 0.5);
+	}
+
+	preview->raw = malloc(width * height * sizeof(uint16_t));
+	if (NULL == preview->raw) {
+		errno = ENOMEM;
+		return fail(preview, "out of memory");
+	}
+	preview->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (-1 == preview->wake_fd) {
+		return fail(preview, "eventfd");
+	}
+	if (!listen_on(preview, address)) {
+		return false;
+	}
+
+	int rc = pthread_create(&preview->thread, NULL, preview_thread, preview);
+	if (0 != rc) {
+		errno = rc;
+		return fail(preview, "pthread_create");
+	}
+	preview->running = true;
+	return true;
+}
+
+
+void preview_offer(preview_t *preview, const void *data, size_t size) {
+	if (0 == __atomic_load_n(&preview->clients, __ATOMIC_SEQ_CST)
+	    || __atomic_load_n(&preview->busy, __ATOMIC_SEQ_CST)) {
+		return;
+	}
+	uint64_t now = monotonic_ns();
+	if (now < preview->due_ns) {
+		return;
+	}
+	preview->due_ns = now + preview->period_ns;
+
+	const size_t frame_size = preview->width * preview->height * sizeof(uint16_t);
+	if (size < frame_size) {
+		return;
+	}
+	memcpy(preview->raw, data, frame_size);
+	__atomic_store_n(&preview->busy, true, __ATOMIC_SEQ_CST);
+
+	uint64_t one = 1;
+	if (-1 == write(preview->wake_fd, &one, sizeof(one))) {
+		// the counter cannot overflow at one a frame, nothing to do
+	}
+}
+
+
+void preview_stop(preview_t *preview) {
+	if (preview->running) {
+		__atomic_store_n(&preview->stopping, true, __ATOMIC_SEQ_CST);
+		uint64_t one = 1;
+		if (-1 == write(preview->wake_fd, &one, sizeof(one))) {
+			// the thread is woken by the counter being nonzero either way
+		}
+		pthread_join(preview->thread, NULL);
+		preview->running = false;
+	}
+	for (int i = 0; i < PREVIEW_MAX_CLIENTS; ++i) {
+		if (-1 != preview->client[i]) {
+			close(preview->client[i]);
+			preview->client[i] = -1;
+		}
+	}
+	if (-1 != preview->listen_fd) {
+		close(preview->listen_fd);
+		preview->listen_fd = -1;
+	}
+	if ('\0' != preview->path[0]) {
+		unlink(preview->path);
+		preview->path[0] = '\0';
+	}
+	if (-1 != preview->wake_fd) {
+		close(preview->wake_fd);
+		preview->wake_fd = -1;
+	}
+	free(preview->raw);
+	preview->raw = NULL;
+}
@@ -0,0 +1,60 @@
+// live preview of a capture as an HTTP multipart stream of PNG images
+//
+// the capture loop offers every frame, but only takes a copy when a
+// viewer is connected, the preview thread is idle and the preview
+// period has passed.  Binning, gamma and PNG encoding all happen on the
+// preview thread, so full rate capture is not disturbed.  Each binned
+// pixel is the mean of its Bayer quads, so there is no demosaic
+//
+// view with a browser at http://localhost:PORT/ or, for a Unix socket,
+// curl --unix-socket PATH http://preview/ > stream
+
+#ifndef _PREVIEW_H_
+#define _PREVIEW_H_ 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define PREVIEW_DEFAULT_RATE 5
+#define PREVIEW_DEFAULT_BIN  4
+#define PREVIEW_GAMMA        2.2
+
+#define PREVIEW_MAX_CLIENTS 8
+
+typedef struct {
+	unsigned int width;         // of the Bayer frame
+	unsigned int height;
+	unsigned int bin;           // 2 or 4
+	unsigned int rate;          // preview frames per second
+	uint64_t period_ns;
+	uint64_t due_ns;            // next frame may be taken from here on
+
+	char path[108];             // Unix socket to remove, empty for TCP
+	int listen_fd;
+	int wake_fd;                // eventfd, a frame is waiting or stopping
+	int client[PREVIEW_MAX_CLIENTS];
+	unsigned int clients;       // connected viewers, read by the capture loop
+	pthread_t thread;
+	bool running;
+
+	uint16_t *raw;              // copy of the offered frame
+	bool busy;                  // raw is in use by the preview thread
+	bool stopping;
+	uint8_t lut[4096];          // 12 bit to gamma corrected 8 bit
+
+	uint64_t frames;            // sent to viewers
+	const char *error;          // operation that failed, errno has the reason
+} preview_t;
+
+// address is a TCP port on the loopback interface or a Unix socket path
+bool preview_start(preview_t *preview, const char *address, unsigned int width,
+		   unsigned int height, unsigned int bin, unsigned int rate);
+
+// called for every frame, cheap unless a preview is due
+void preview_offer(preview_t *preview, const void *data, size_t size);
+
+void preview_stop(preview_t *preview);
+
+#endif
@@ -0,0 +1,478 @@
+// phase correlation registration of Bayer frames
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "ahd_bayer.h"
+#include "bayer_green.h"
+#include "fingerprint.h"
+#include "registration.h"
+
+
+// FFT sizes that may be in use at once
+#define MAX_PLANS 8
+
+// the polar spectrum leaves out the lowest frequencies, which are
+// mostly the window and the illumination
+#define POLAR_LOW 16
+
+struct registration_plan_s {
+	unsigned int n;
+	unsigned int *reverse;              // bit reversed indices
+	registration_complex_t *twiddle;    // n / 2 of exp(-2 pi i k / n)
+};
+
+static registration_plan_t *plans[MAX_PLANS];
+static pthread_mutex_t plans_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static bool fail(registration_t *registration, const char *operation) {
+	registration->error = operation;
+	return false;
+}
+
+static registration_plan_t *plan_create(unsigned int n) {
+	registration_plan_t *plan = malloc(sizeof(registration_plan_t));
+	if (NULL == plan) {
+		return NULL;
+	}
+	plan->n = n;
+	plan->reverse = malloc(n * sizeof(unsigned int));
+	plan->twiddle = malloc(n / 2 * sizeof(registration_complex_t));
+	if (NULL == plan->reverse || NULL == plan->twiddle) {
+		free(plan->reverse);
+		free(plan->twiddle);
+		free(plan);
+		return NULL;
+	}
+
+	unsigned int bits = 0;
+	while ((1U << bits) < n) {
+		++bits;
+	}
+	for (unsigned int i = 0; i < n; ++i) {
+		unsigned int r = 0;
+		for (unsigned int b = 0; b < bits; ++b) {
+			r |= ((i >> b) & 1) << (bits - 1 - b);
+		}
+		plan->reverse[i] = r;
+	}
+	for (unsigned int k = 0; k < n / 2; ++k) {
+		plan->twiddle[k].re = cos(2 * M_PI * k / n);
+		plan->twiddle[k].im = -sin(2 * M_PI * k / n);
+	}
+	return plan;
+}
+
+// plans are kept until exit
+static const registration_plan_t *plan_get(unsigned int n) {
+	pthread_mutex_lock(&plans_lock);
+	registration_plan_t *plan = NULL;
+	int i = 0;
+	for (; i < MAX_PLANS && NULL != plans[i] && NULL == plan; ++i) {
+		if (n == plans[i]->n) {
+			plan = plans[i];
+		}
+	}
+	if (NULL == plan && MAX_PLANS == i) {
+		errno = ENOSPC;
+	} else if (NULL == plan) {
+		plan = plans[i] = plan_create(n);
+		if (NULL == plan) {
+			errno = ENOMEM;
+		}
+	}
+	pthread_mutex_unlock(&plans_lock);
+	return plan;
+}
+
+
+// in place radix 2, the inverse is not scaled
+static void fft(const registration_plan_t *plan, registration_complex_t *x, bool inverse) {
+	const unsigned int n = plan->n;
+	for (unsigned int i = 0; i < n; ++i) {
+		const unsigned int j = plan->reverse[i];
+		if (i < j) {
+			registration_complex_t t = x[i];
+			x[i] = x[j];
+			x[j] = t;
+		}
+	}
+	const float sign = inverse ? -1.0f : 1.0f;
+	for (unsigned int half = 1; half < n; half *= 2) {
+		const unsigned int step = n / (2 * half);
+		for (unsigned int start = 0; start < n; start += 2 * half) {
+			for (unsigned int k = 0; k < half; ++k) {
+				const float wr = plan->twiddle[k * step].re;
+				const float wi = sign * plan->twiddle[k * step].im;
+				registration_complex_t *a = &x[start + k];
+				registration_complex_t *b = &x[start + k + half];
+				const float re = b->re * wr - b->im * wi;
+				const float im = b->re * wi + b->im * wr;
+				b->re = a->re - re;
+				b->im = a->im - im;
+				a->re += re;
+				a->im += im;
+			}
+		}
+	}
+}
+
+// rows then columns, rows from used on are zero on the way in
+static void fft_2d(registration_t *registration, registration_complex_t *data, unsigned int used,
+		   bool inverse) {
+	const unsigned int n = registration->n;
+	for (unsigned int y = 0; y < used; ++y) {
+		fft(registration->plan, &data[y * n], inverse);
+	}
+	registration_complex_t *line = registration->line;
+	for (unsigned int x = 0; x < n; ++x) {
+		for (unsigned int y = 0; y < n; ++y) {
+			line[y] = data[y * n + x];
+		}
+		fft(registration->plan, line, inverse);
+		for (unsigned int y = 0; y < n; ++y) {
+			data[y * n + x] = line[y];
+		}
+	}
+}
+
+
+// green cell means with the mean of all of them removed
+static void reduce(registration_t *registration, const ahd_pixel_t *bayer) {
+	const unsigned int width = registration->width;
+	const unsigned int cols = registration->cols;
+	const unsigned int quads = registration->bin / 2;  // across a cell
+	const float scale = 1.0f / (2 * quads * quads);
+	uint32_t *sums = registration->sums;
+	double total = 0;
+	for (unsigned int cy = 0; cy < registration->rows; ++cy) {
+		memset(sums, 0, cols * sizeof(uint32_t));
+		for (unsigned int qy = cy * quads; qy < (cy + 1) * quads; ++qy) {
+			const pixel_pair_t *row0 = (const pixel_pair_t *)&bayer[2 * qy * width];
+			const pixel_pair_t *row1 = (const pixel_pair_t *)&bayer[(2 * qy + 1) * width];
+			for (unsigned int cx = 0; cx < cols; ++cx) {
+				uint32_t s = 0;
+				for (unsigned int qx = cx * quads; qx < (cx + 1) * quads; ++qx) {
+					s += ((row0[qx] >> registration->shift0) & PIXEL_MASK)
+						+ ((row1[qx] >> registration->shift1) & PIXEL_MASK);
+				}
+				sums[cx] += s;
+			}
+		}
+		float *out = &registration->image[cy * cols];
+		for (unsigned int cx = 0; cx < cols; ++cx) {
+			out[cx] = sums[cx] * scale;
+			total += out[cx];
+		}
+	}
+	const float mean = total / (cols * registration->rows);
+	for (unsigned int i = 0; i < cols * registration->rows; ++i) {
+		registration->image[i] -= mean;
+	}
+}
+
+// the spectrum of the windowed cells
+static void transform(registration_t *registration, const float *image, registration_complex_t *spectrum) {
+	const unsigned int n = registration->n;
+	const unsigned int cols = registration->cols;
+	memset(spectrum, 0, n * n * sizeof(registration_complex_t));
+	for (unsigned int y = 0; y < registration->rows; ++y) {
+		for (unsigned int x = 0; x < cols; ++x) {
+			spectrum[y * n + x].re = image[y * cols + x] * registration->window_y[y] * registration->window_x[x];
+		}
+	}
+	fft_2d(registration, spectrum, registration->rows, false);
+}
+
+// bilinear, zero outside
+static float sample(const float *image, unsigned int cols, unsigned int rows, float x, float y) {
+	const int x0 = floorf(x);
+	const int y0 = floorf(y);
+	if (x0 < 0 || y0 < 0 || x0 + 1 >= cols || y0 + 1 >= rows) {
+		return 0;
+	}
+	const float fx = x - x0;
+	const float fy = y - y0;
+	const float *p = &image[y0 * cols + x0];
+	return (p[0] * (1 - fx) + p[1] * fx) * (1 - fy) + (p[cols] * (1 - fx) + p[cols + 1] * fx) * fy;
+}
+
+// cells of the frame at R(angle) * (p - centre) + centre for each p
+static void rotate(registration_t *registration, double angle) {
+	const unsigned int cols = registration->cols;
+	const unsigned int rows = registration->rows;
+	const float c = cos(angle);
+	const float s = sin(angle);
+	// the centre of the frame, cell i is centred on raw pixel (i + 0.5) * bin
+	const float centre_x = registration->width / (2.0f * registration->bin) - 0.5f;
+	const float centre_y = registration->height / (2.0f * registration->bin) - 0.5f;
+	for (unsigned int y = 0; y < rows; ++y) {
+		const float dy = y - centre_y;
+		for (unsigned int x = 0; x < cols; ++x) {
+			const float dx = x - centre_x;
+			registration->rotated[y * cols + x] = sample(registration->image, cols, rows,
+								     c * dx - s * dy + centre_x,
+								     s * dx + c * dy + centre_y);
+		}
+	}
+}
+
+// offset of the vertex of a parabola through three points from the middle one
+static double parabola(double left, double middle, double right) {
+	const double d = left - 2 * middle + right;
+	return d < 0 ? 0.5 * (left - right) / d : 0;
+}
+
+// phase correlate two spectra, a against b, for where a is displaced from b
+static double correlate(registration_t *registration, const registration_complex_t *a,
+			const registration_complex_t *b, double *dx, double *dy) {
+	const unsigned int n = registration->n;
+	registration_complex_t *work = registration->work;
+	for (unsigned int i = 0; i < n * n; ++i) {
+		const float re = a[i].re * b[i].re + a[i].im * b[i].im;
+		const float im = a[i].im * b[i].re - a[i].re * b[i].im;
+		const float magnitude = sqrtf(re * re + im * im);
+		work[i].re = magnitude > 1e-20f ? re / magnitude : 0;
+		work[i].im = magnitude > 1e-20f ? im / magnitude : 0;
+	}
+	fft_2d(registration, work, n, true);
+
+	unsigned int best = 0;
+	for (unsigned int i = 1; i < n * n; ++i) {
+		if (work[i].re > work[best].re) {
+			best = i;
+		}
+	}
+	const unsigned int mask = n - 1;
+	const unsigned int x = best % n;
+	const unsigned int y = best / n;
+	const double fx = parabola(work[y * n + ((x - 1) & mask)].re, work[best].re,
+				   work[y * n + ((x + 1) & mask)].re);
+	const double fy = parabola(work[((y - 1) & mask) * n + x].re, work[best].re,
+				   work[((y + 1) & mask) * n + x].re);
+	*dx = (x < n / 2 ? (double)x : (double)x - n) + fx;
+	*dy = (y < n / 2 ? (double)y : (double)y - n) + fy;
+	return work[best].re / ((double)n * n);
+}
+
+// the log magnitude of a spectrum on n angles over a half turn, along
+// each row, and n radii, each row then transformed along the angle
+static void polar(registration_t *registration, const registration_complex_t *spectrum,
+		  registration_complex_t *out) {
+	const unsigned int n = registration->n;
+	const unsigned int mask = n - 1;
+	float *magnitude = registration->magnitude;
+	for (unsigned int i = 0; i < n * n; ++i) {
+		magnitude[i] = log1pf(sqrtf(spectrum[i].re * spectrum[i].re + spectrum[i].im * spectrum[i].im));
+	}
+
+	const float low = n / (float)POLAR_LOW;
+	const float high = n / 2.0f - 1;
+	for (unsigned int r = 0; r < n; ++r) {
+		const float radius = low + (high - low) * r / (n - 1);
+		registration_complex_t *row = &out[r * n];
+		for (unsigned int a = 0; a < n; ++a) {
+			// frequencies wrap, so negative ones index from the top
+			const float x = radius * registration->cosine[a];
+			const float y = radius * registration->sine[a];
+			const int x0 = floorf(x);
+			const int y0 = floorf(y);
+			const float fx = x - x0;
+			const float fy = y - y0;
+			const float *m0 = &magnitude[(y0 & mask) * n];
+			const float *m1 = &magnitude[((y0 + 1) & mask) * n];
+			row[a].re = (m0[x0 & mask] * (1 - fx) + m0[(x0 + 1) & mask] * fx) * (1 - fy)
+				+ (m1[x0 & mask] * (1 - fx) + m1[(x0 + 1) & mask] * fx) * fy;
+			row[a].im = 0;
+		}
+		fft(registration->plan, row, false);
+	}
+}
+
+// angle of the frame's polar rows in work against the reference's
+static double rotation_angle(registration_t *registration) {
+	const unsigned int n = registration->n;
+	registration_complex_t *line = registration->line;
+	memset(line, 0, n * sizeof(registration_complex_t));
+	for (unsigned int r = 0; r < n; ++r) {
+		const registration_complex_t *a = &registration->work[r * n];
+		const registration_complex_t *b = &registration->reference_polar[r * n];
+		for (unsigned int k = 0; k < n; ++k) {
+			line[k].re += a[k].re * b[k].re + a[k].im * b[k].im;
+			line[k].im += a[k].im * b[k].re - a[k].re * b[k].im;
+		}
+	}
+	for (unsigned int k = 0; k < n; ++k) {
+		const float magnitude = sqrtf(line[k].re * line[k].re + line[k].im * line[k].im);
+		line[k].re = magnitude > 1e-20f ? line[k].re / magnitude : 0;
+		line[k].im = magnitude > 1e-20f ? line[k].im / magnitude : 0;
+	}
+	fft(registration->plan, line, true);
+
+	unsigned int best = 0;
+	for (unsigned int k = 1; k < n; ++k) {
+		if (line[k].re > line[best].re) {
+			best = k;
+		}
+	}
+	const unsigned int mask = n - 1;
+	const double shift = (best < n / 2 ? (double)best : (double)best - n)
+		+ parabola(line[(best - 1) & mask].re, line[best].re, line[(best + 1) & mask].re);
+	return M_PI * shift / n;
+}
+
+
+bool registration_init(registration_t *registration, unsigned int width, unsigned int height,
+		       BayerTile tile, unsigned int bin, bool rotation) {
+	memset(registration, 0, sizeof(*registration));
+	registration->width = width;
+	registration->height = height;
+	registration->bin = bin;
+	registration->rotation = rotation;
+
+	unsigned int g0, g1;
+	if (!bayer_green(tile, &g0, &g1)) {
+		return fail(registration, "tile");
+	}
+	registration->shift0 = PAIR_SHIFT(g0);
+	registration->shift1 = PAIR_SHIFT(g1);
+
+	if (bin < 2 || 0 != bin % 2 || width / bin < 8 || height / bin < 8) {
+		errno = EINVAL;
+		return fail(registration, "bin");
+	}
+	const unsigned int cols = registration->cols = width / bin;
+	const unsigned int rows = registration->rows = height / bin;
+	unsigned int n = 1;
+	while (n < cols || n < rows) {
+		n *= 2;
+	}
+	registration->n = n;
+	registration->plan = plan_get(n);
+	if (NULL == registration->plan) {
+		return fail(registration, "plan");
+	}
+
+	const size_t spectrum_size = (size_t)n * n * sizeof(registration_complex_t);
+	registration->window_x = malloc(cols * sizeof(float));
+	registration->window_y = malloc(rows * sizeof(float));
+	registration->sums = malloc(cols * sizeof(uint32_t));
+	registration->image = malloc(cols * rows * sizeof(float));
+	registration->rotated = malloc(cols * rows * sizeof(float));
+	registration->line = malloc(n * sizeof(registration_complex_t));
+	registration->spectrum = malloc(spectrum_size);
+	registration->work = malloc(spectrum_size);
+	registration->reference = malloc(spectrum_size);
+	if (NULL == registration->window_x || NULL == registration->window_y
+	    || NULL == registration->sums || NULL == registration->image
+	    || NULL == registration->rotated || NULL == registration->line
+	    || NULL == registration->spectrum || NULL == registration->work
+	    || NULL == registration->reference) {
+		registration_free(registration);
+		errno = ENOMEM;
+		return fail(registration, "malloc");
+	}
+	if (rotation) {
+		registration->magnitude = malloc(n * n * sizeof(float));
+		registration->cosine = malloc(n * sizeof(float));
+		registration->sine = malloc(n * sizeof(float));
+		registration->reference_polar = malloc(spectrum_size);
+		if (NULL == registration->magnitude || NULL == registration->cosine
+		    || NULL == registration->sine || NULL == registration->reference_polar) {
+			registration_free(registration);
+			errno = ENOMEM;
+			return fail(registration, "malloc");
+		}
+		for (unsigned int a = 0; a < n; ++a) {
+			registration->cosine[a] = cos(M_PI * a / n);
+			registration->sine[a] = sin(M_PI * a / n);
+		}
+	}
+
+	for (unsigned int x = 0; x < cols; ++x) {
+		registration->window_x[x] = 0.5 - 0.5 * cos(2 * M_PI * (x + 0.5) / cols);
+	}
+	for (unsigned int y = 0; y < rows; ++y) {
+		registration->window_y[y] = 0.5 - 0.5 * cos(2 * M_PI * (y + 0.5) / rows);
+	}
+	return true;
+}
+
+
+bool registration_reference(registration_t *registration, const ahd_pixel_t *bayer) {
+	reduce(registration, bayer);
+	transform(registration, registration->image, registration->reference);
+	if (registration->rotation) {
+		polar(registration, registration->reference, registration->reference_polar);
+	}
+	registration->have_reference = true;
+	return true;
+}
+
+
+bool registration_estimate(registration_t *registration, const ahd_pixel_t *bayer,
+			   fingerprint_transform_t *result, double *peak) {
+	if (!registration->have_reference) {
+		errno = EINVAL;
+		return fail(registration, "no reference");
+	}
+	reduce(registration, bayer);
+
+	double angle = 0;
+	if (registration->rotation) {
+		transform(registration, registration->image, registration->spectrum);
+		polar(registration, registration->spectrum, registration->work);
+		angle = rotation_angle(registration);
+	}
+
+	// the magnitude spectrum cannot tell a half turn, so try both
+	double best = -1;
+	for (int turn = 0; turn < (registration->rotation ? 2 : 1); ++turn) {
+		const double a = angle + turn * M_PI;
+		const float *image = registration->image;
+		if (0 != a) {
+			rotate(registration, a);
+			image = registration->rotated;
+		}
+		transform(registration, image, registration->spectrum);
+
+		// the rotated back frame is the reference moved by e, and the
+		// frame has it moved by R(a) e
+		double ex, ey;
+		const double p = correlate(registration, registration->spectrum, registration->reference, &ex, &ey);
+		if (p > best) {
+			best = p;
+			result->dx = (cos(a) * ex - sin(a) * ey) * registration->bin;
+			result->dy = (sin(a) * ex + cos(a) * ey) * registration->bin;
+			result->angle = a > M_PI ? a - 2 * M_PI : a;
+		}
+	}
+	if (NULL != peak) {
+		*peak = best;
+	}
+	return true;
+}
+
+
+void registration_free(registration_t *registration) {
+	free(registration->window_x);
+	free(registration->window_y);
+	free(registration->sums);
+	free(registration->image);
+	free(registration->rotated);
+	free(registration->magnitude);
+	free(registration->cosine);
+	free(registration->sine);
+	free(registration->line);
+	free(registration->spectrum);
+	free(registration->work);
+	free(registration->reference);
+	free(registration->reference_polar);
+	memset(registration, 0, sizeof(*registration));
+}
@@ -0,0 +1,80 @@
+// estimate how a frame is displaced from a reference frame, so its
+// fingerprint can be taken of the same area of the sample
+//
+// both frames are reduced to the mean of the green sites in bin square
+// cells, windowed and phase correlated: the inverse FFT of their
+// normalised cross power spectrum peaks at the translation, found to a
+// fraction of a cell from a parabola through the peak.  For rotation the
+// magnitude spectra, which translation does not change, are resampled
+// to polar form and phase correlated along the angle first; the frame is
+// rotated back by the angle and by the angle plus a half turn and the
+// stronger translation peak decides between them
+//
+// the reference is transformed once.  FFT plans are made for each size
+// on first use and shared by every registration
+
+#ifndef _REGISTRATION_H_
+#define _REGISTRATION_H_ 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ahd_bayer.h"
+#include "fingerprint.h"
+
+// raw pixels across a cell, 240 * 135 cells in a 256 square FFT for a 1080p frame
+#define REGISTRATION_DEFAULT_BIN 8
+
+typedef struct {
+	float re;
+	float im;
+} registration_complex_t;
+
+typedef struct registration_plan_s registration_plan_t;
+
+typedef struct {
+	unsigned int width;          // of the Bayer frames
+	unsigned int height;
+	unsigned int bin;            // raw pixels across a cell, even
+	bool rotation;               // estimate the angle too
+	unsigned int shift0;         // green site in the first and second row of a quad
+	unsigned int shift1;
+	unsigned int cols;           // cells
+	unsigned int rows;
+	unsigned int n;              // FFT size, cols and rows are zero padded to it
+	const registration_plan_t *plan;
+
+	float *window_x;             // Hann window
+	float *window_y;
+	uint32_t *sums;              // cols
+	float *image;                // cols * rows cells, mean removed
+	float *rotated;
+	float *magnitude;            // n * n log magnitude spectrum
+	float *cosine;               // n polar angles over a half turn
+	float *sine;
+	registration_complex_t *spectrum;   // n * n
+	registration_complex_t *work;
+	registration_complex_t *line;       // n
+	registration_complex_t *reference;  // spectrum of the reference
+	registration_complex_t *reference_polar;  // its polar rows, transformed along the angle
+	bool have_reference;
+
+	const char *error;           // operation that failed, errno has the reason
+} registration_t;
+
+// returns false with registration->error and errno set
+bool registration_init(registration_t *registration, unsigned int width, unsigned int height,
+		       BayerTile tile, unsigned int bin, bool rotation);
+
+// the frame later frames are registered to
+bool registration_reference(registration_t *registration, const ahd_pixel_t *bayer);
+
+// the transform that takes reference positions to this frame's, peak is
+// the height of the correlation peak from 0 to 1, a measure of confidence
+bool registration_estimate(registration_t *registration, const ahd_pixel_t *bayer,
+			   fingerprint_transform_t *transform, double *peak);
+
+void registration_free(registration_t *registration);
+
+#endif
@@ -0,0 +1,186 @@
+// capture output split into segments of whole frames
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "segment.h"
+
+
+static bool fail(segment_t *segment, const char *operation) {
+	segment->error = operation;
+	return false;
+}
+
+static bool fail_errno(segment_t *segment, const char *operation, int error) {
+	errno = error;
+	return fail(segment, operation);
+}
+
+static uint64_t monotonic_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// split the name at the extension of its last component
+static bool split_name(segment_t *segment, const char *name) {
+	const char *slash = strrchr(name, '/');
+	const char *dot = strrchr(name, '.');
+	if (NULL == dot || (NULL != slash && dot < slash) || dot == name || dot == slash + 1) {
+		dot = name + strlen(name);
+	}
+	size_t n = dot - name;
+	if (n >= sizeof(segment->prefix) || strlen(dot) >= sizeof(segment->suffix)) {
+		return fail_errno(segment, "name too long", ENAMETOOLONG);
+	}
+	memcpy(segment->prefix, name, n);
+	segment->prefix[n] = '\0';
+	strcpy(segment->suffix, dot);
+	return true;
+}
+
+static bool time_reached(const segment_t *segment) {
+	const uint64_t seconds = segment->limits.seconds;
+	return 0 != seconds && monotonic_ns() - segment->opened_ns >= seconds * 1000000000ULL;
+}
+
+static bool limit_reached(const segment_t *segment, size_t size) {
+	const segment_limits_t *limits = &segment->limits;
+	if (0 == segment->frames) {
+		return false;  // a frame larger than the byte limit still gets written
+	}
+	if (0 != limits->frames && segment->frames >= limits->frames) {
+		return true;
+	}
+	if (0 != limits->bytes && segment->bytes + size > limits->bytes) {
+		return true;
+	}
+	return time_reached(segment);
+}
+
+// close the current segment and record it in the manifest
+static bool finish_segment(segment_t *segment) {
+	if (NULL == segment->file) {
+		return true;
+	}
+	FILE *f = segment->file;
+	segment->file = NULL;
+	if (0 != fclose(f)) {
+		return fail(segment, "segment close");
+	}
+	if (NULL == segment->manifest) {
+		return true;
+	}
+
+	// only the base name, the manifest sits beside the segments
+	const char *slash = strrchr(segment->name, '/');
+	fprintf(segment->manifest, "%s %llu %llu %llu\n",
+		NULL == slash ? segment->name : slash + 1,
+		(unsigned long long)segment->first_frame,
+		(unsigned long long)segment->frames,
+		(unsigned long long)segment->bytes);
+	if (0 != fflush(segment->manifest)) {
+		return fail(segment, "manifest write");
+	}
+	segment->first_frame += segment->frames;
+	++segment->index;
+	return true;
+}
+
+static bool start_segment(segment_t *segment) {
+	int n = snprintf(segment->name, sizeof(segment->name), "%s.%0*u%s",
+			 segment->prefix, SEGMENT_DIGITS, segment->index, segment->suffix);
+	if (n < 0 || n >= sizeof(segment->name)) {
+		return fail_errno(segment, "name too long", ENAMETOOLONG);
+	}
+	segment->file = fopen(segment->name, "wb");
+	if (NULL == segment->file) {
+		return fail(segment, "segment create");
+	}
+	segment->frames = 0;
+	segment->bytes = 0;
+	segment->opened_ns = monotonic_ns();
+	return true;
+}
+
+
+bool segment_enabled(const segment_limits_t *limits) {
+	return 0 != limits->frames || 0 != limits->bytes || 0 != limits->seconds;
+}
+
+
+bool segment_open(segment_t *segment, const char *name, const segment_limits_t *limits) {
+	memset(segment, 0, sizeof(*segment));
+	segment->limits = *limits;
+
+	if (!segment_enabled(limits)) {
+		if (strlen(name) >= sizeof(segment->name)) {
+			return fail_errno(segment, "name too long", ENAMETOOLONG);
+		}
+		strcpy(segment->name, name);
+		segment->file = fopen(name, "wb");
+		if (NULL == segment->file) {
+			return fail(segment, "create");
+		}
+		return true;
+	}
+
+	if (!split_name(segment, name)) {
+		return false;
+	}
+	char manifest[sizeof(segment->prefix) + 16];
+	snprintf(manifest, sizeof(manifest), "%s.manifest", segment->prefix);
+	segment->manifest = fopen(manifest, "w");
+	if (NULL == segment->manifest) {
+		return fail(segment, "manifest create");
+	}
+	// the first segment is created by the first frame
+	return true;
+}
+
+
+bool segment_write(segment_t *segment, const void *data, size_t size) {
+	if (NULL != segment->manifest) {
+		if (limit_reached(segment, size) && !finish_segment(segment)) {
+			return false;
+		}
+		if (NULL == segment->file && !start_segment(segment)) {
+			return false;
+		}
+	}
+	if (NULL == segment->file) {
+		return fail_errno(segment, "write", EBADF);
+	}
+	if (1 != fwrite(data, size, 1, segment->file)) {
+		return fail(segment, "write");
+	}
+	++segment->frames;
+	++segment->total_frames;
+	segment->bytes += size;
+	return true;
+}
+
+
+bool segment_tick(segment_t *segment) {
+	if (NULL == segment->manifest || NULL == segment->file || !time_reached(segment)) {
+		return true;
+	}
+	return finish_segment(segment);
+}
+
+
+bool segment_close(segment_t *segment) {
+	bool rc = finish_segment(segment);
+	if (NULL != segment->manifest) {
+		if (0 != fclose(segment->manifest) && rc) {
+			rc = fail(segment, "manifest close");
+		}
+		segment->manifest = NULL;
+	}
+	return rc;
+}
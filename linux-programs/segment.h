@@ -0,0 +1,62 @@
+// capture output split into segments of whole frames
+//
+// with no limits set frames go to the named file as before.  Otherwise
+// "frames.data" becomes frames.00000.data, frames.00001.data, ... and
+// each is rolled over after a number of frames, bytes or seconds.  A
+// segment holds only complete frames so it can be converted on its own.
+// Once a segment is closed a line is added to the manifest, named
+// frames.manifest here, so a reader can start on it while capture
+// continues:
+//
+//   segment-name first-frame frames bytes
+
+#ifndef _SEGMENT_H_
+#define _SEGMENT_H_ 1
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SEGMENT_DIGITS 5
+
+typedef struct {
+	uint64_t frames;         // per segment limits, 0 => none
+	uint64_t bytes;
+	uint64_t seconds;
+} segment_limits_t;
+
+typedef struct {
+	segment_limits_t limits;
+	char prefix[256];        // name up to the extension
+	char suffix[64];         // the extension, including the '.'
+	char name[320];          // of the current segment
+	FILE *file;
+	FILE *manifest;
+	unsigned int index;      // of the current segment
+	uint64_t first_frame;    // frames written before this segment
+	uint64_t frames;         // in the current segment
+	uint64_t bytes;
+	uint64_t opened_ns;      // CLOCK_MONOTONIC when the segment started
+	uint64_t total_frames;
+	const char *error;       // operation that failed, errno has the reason
+} segment_t;
+
+// all return false on failure with segment->error and errno set
+
+bool segment_open(segment_t *segment, const char *name, const segment_limits_t *limits);
+
+// write one frame, first starting a new segment if a limit was reached
+bool segment_write(segment_t *segment, const void *data, size_t size);
+
+// close the current segment once its time is up, call at least once a
+// second so segments end on time while no frames arrive.  The next
+// frame starts a new segment
+bool segment_tick(segment_t *segment);
+
+// close the current segment and the manifest
+bool segment_close(segment_t *segment);
+
+// true if any limit is set
+bool segment_enabled(const segment_limits_t *limits);
+
+#endif
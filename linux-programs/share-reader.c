@@ -0,0 +1,212 @@
+// connect to the buffers a capture exports and follow the stream: print
+// the embedded focus data of each frame and optionally archive the
+// frames, all read in place from the capture buffers
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+
+#include "bufshare.h"
+#include "embed.h"
+
+
+// seconds to wait for a frame before giving up
+#define DEFAULT_TIMEOUT 5
+
+static const char *program_name;
+
+
+// print usage message and exit
+static void usage(const char *message, ...) {
+	if (NULL != message) {
+		va_list ap;
+		va_start(ap, message);
+		fprintf(stderr, "error: ");
+		vfprintf(stderr, message, ap);
+		fprintf(stderr, "\n");
+		va_end(ap);
+	}
+	fprintf(stderr,
+		"Usage: %s [options] SOCKET\n\n"
+		"Options:\n"
+		"-h | --help          Print this message\n"
+		"-v | --verbose       Print a line for every frame\n"
+		"-c | --count N       Stop after N frames [until capture stops]\n"
+		"-o | --output F      Append the frames to file F\n"
+		"-e | --embed N       Embedded data pixel offset [%i]\n"
+		"-w | --wait S        Seconds to wait for a frame [%i]\n"
+		"-k | --keep MS       Hold each buffer for MS milliseconds,\n"
+		"                     to act as a slow consumer\n"
+		"",
+		program_name, EMBED_DEFAULT_OFFSET, DEFAULT_TIMEOUT);
+	exit(EXIT_FAILURE);
+}
+
+
+static const char short_options[] = "hvc:o:e:w:k:";
+
+static const struct option
+long_options[] = {
+	{ "help",       no_argument,       NULL, 'h' },
+	{ "verbose",    no_argument,       NULL, 'v' },
+	{ "count",      required_argument, NULL, 'c' },
+	{ "output",     required_argument, NULL, 'o' },
+	{ "embed",      required_argument, NULL, 'e' },
+	{ "wait",       required_argument, NULL, 'w' },
+	{ "keep",       required_argument, NULL, 'k' },
+	{ 0, 0, 0, 0 }
+};
+
+
+int main(int argc, char **argv) {
+	program_name = argv[0];
+
+	bool verbose = false;
+	unsigned long count = 0;
+	const char *output_name = NULL;
+	int embed_offset = EMBED_DEFAULT_OFFSET;
+	int timeout = DEFAULT_TIMEOUT;
+	long keep_ms = 0;
+
+	for (;;) {
+		int idx;
+		int c;
+
+		c = getopt_long(argc, argv, short_options, long_options, &idx);
+
+		if (-1 == c) {
+			break;
+		}
+
+		switch (c) {
+		case 0: // getopt_long() flag
+			break;
+
+		case 'h':
+			usage(NULL);
+
+		case 'v':
+			verbose = true;
+			break;
+
+		case 'c':
+			errno = 0;
+			count = strtoul(optarg, NULL, 0);
+			if (0 != errno) {
+				usage("invalid count '%s'", optarg);
+			}
+			break;
+
+		case 'o':
+			output_name = optarg;
+			break;
+
+		case 'e':
+			errno = 0;
+			embed_offset = strtol(optarg, NULL, 0);
+			if (0 != errno || embed_offset < 0) {
+				usage("invalid embed offset '%s'", optarg);
+			}
+			break;
+
+		case 'w':
+			errno = 0;
+			timeout = strtol(optarg, NULL, 0);
+			if (0 != errno || timeout <= 0) {
+				usage("invalid wait '%s'", optarg);
+			}
+			break;
+
+		case 'k':
+			errno = 0;
+			keep_ms = strtol(optarg, NULL, 0);
+			if (0 != errno || keep_ms < 0) {
+				usage("invalid keep time '%s'", optarg);
+			}
+			break;
+
+		default:
+			usage("invalid option: '%c'", c);
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage("exactly one socket path is required");
+	}
+	const char *socket_path = argv[optind];
+
+	FILE *fout = NULL;
+	if (NULL != output_name) {
+		fout = fopen(output_name, "ab");
+		if (NULL == fout) {
+			usage("unable to open output file: '%s'", output_name);
+		}
+	}
+
+	bufshare_consumer_t share;
+	if (!bufshare_attach(&share, socket_path)) {
+		fprintf(stderr, "%s: %s error %d, %s\n", socket_path, share.error, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (verbose) {
+		printf("%u buffers of %zu bytes, %ux%u\n",
+		       share.n_buffers, share.length, share.width, share.height);
+	}
+
+	const char *reason = "count reached";
+	while (0 == count || share.frames < count) {
+		bufshare_frame_t frame;
+		int r = bufshare_next(&share, &frame, timeout * 1000);
+		if (0 == r) {
+			reason = "timed out";
+			break;
+		}
+		if (r < 0) {
+			reason = NULL == share.error ? "capture stopped" : share.error;
+			break;
+		}
+
+		embed_t embed;
+		embed_decode(frame.data, frame.bytesused / sizeof(uint16_t), embed_offset, &embed);
+		if (NULL != fout) {
+			fwrite(frame.data, frame.bytesused, 1, fout);
+		}
+		if (keep_ms > 0) {
+			struct timespec delay = {
+				.tv_sec = keep_ms / 1000,
+				.tv_nsec = (keep_ms % 1000) * 1000000L,
+			};
+			nanosleep(&delay, NULL);
+		}
+		if (!bufshare_release(&share, &frame)) {
+			reason = "capture stopped";
+			break;
+		}
+
+		if (verbose) {
+			printf("frame %llu buffer %u sequence %u time %llu.%06llu",
+			       (unsigned long long)frame.frame, frame.index, frame.sequence,
+			       (unsigned long long)frame.timestamp_us / 1000000,
+			       (unsigned long long)frame.timestamp_us % 1000000);
+			if (embed.present) {
+				printf(" steps %u contrast %u", embed.steps, embed.contrast);
+			}
+			printf("\n");
+			fflush(stdout);
+		}
+	}
+
+	if (NULL != fout) {
+		fclose(fout);
+	}
+	fprintf(stderr, "%s: %llu frames, %llu not shared, %s\n", socket_path,
+		(unsigned long long)share.frames, (unsigned long long)share.gaps, reason);
+	bufshare_detach(&share);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,152 @@
+// focus measures of a raw frame
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+
+#include "ahd_bayer.h"
+#include "bayer_green.h"
+#include "sharpness.h"
+
+
+static const char *const metric_names[SHARPNESS_METRICS] = {
+	[SHARPNESS_TENENGRAD] = "tenengrad",
+	[SHARPNESS_LAPLACIAN] = "laplacian",
+	[SHARPNESS_BRENNER] = "brenner",
+};
+
+
+// green sum of each quad of one row of quads
+static void green_row(const uint16_t *bayer, unsigned int width, unsigned int qy,
+		      unsigned int qx0, unsigned int n, unsigned int shift0, unsigned int shift1,
+		      int16_t *row) {
+	const pixel_pair_t *row0 = (const pixel_pair_t *)&bayer[(size_t)2 * qy * width] + qx0;
+	const pixel_pair_t *row1 = (const pixel_pair_t *)&bayer[(size_t)(2 * qy + 1) * width] + qx0;
+	for (unsigned int i = 0; i < n; ++i) {
+		row[i] = ((row0[i] >> shift0) & PIXEL_MASK) + ((row1[i] >> shift1) & PIXEL_MASK);
+	}
+}
+
+
+bool sharpness_measure(const uint16_t *bayer, unsigned int width, unsigned int height, BayerTile tile,
+		       const sharpness_roi_t *roi, sharpness_t *sharpness) {
+	unsigned int g0, g1;
+	if (!bayer_green(tile, &g0, &g1)) {
+		return false;
+	}
+	const unsigned int shift0 = PAIR_SHIFT(g0);
+	const unsigned int shift1 = PAIR_SHIFT(g1);
+
+	const unsigned int quad_width = width / 2;
+	const unsigned int quad_height = height / 2;
+	unsigned int qx0 = 0;
+	unsigned int qy0 = 0;
+	unsigned int qx1 = quad_width;
+	unsigned int qy1 = quad_height;
+	if (NULL != roi) {
+		qx0 = roi->x / 2;
+		qy0 = roi->y / 2;
+		// widen the far edge out to a whole quad before clipping
+		const uint64_t x1 = ((uint64_t)roi->x + roi->width + 1) / 2;
+		const uint64_t y1 = ((uint64_t)roi->y + roi->height + 1) / 2;
+		qx1 = x1 < quad_width ? x1 : quad_width;
+		qy1 = y1 < quad_height ? y1 : quad_height;
+	}
+	if (qx0 + 3 > qx1 || qy0 + 3 > qy1) {
+		errno = EINVAL;
+		return false;
+	}
+
+	const unsigned int n = qx1 - qx0;
+	// green sums are 13 bits, so rows are 16 bit and the loops below
+	// can use 16 bit multiplies
+	int16_t *rows = malloc(3 * n * sizeof(int16_t));
+	uint32_t *terms = malloc(3 * n * sizeof(uint32_t));
+	if (NULL == rows || NULL == terms) {
+		free(rows);
+		free(terms);
+		return false;
+	}
+	int16_t *previous = rows;
+	int16_t *current = rows + n;
+	int16_t *next = rows + 2 * n;
+	uint32_t *gradient = terms;
+	uint32_t *curvature = terms + n;
+	uint32_t *difference = terms + 2 * n;
+	green_row(bayer, width, qy0, qx0, n, shift0, shift1, current);
+	green_row(bayer, width, qy0 + 1, qx0, n, shift0, shift1, next);
+
+	// exact integer sums, a full frame of the largest values fits easily
+	uint64_t tenengrad = 0;
+	int64_t laplacian = 0;
+	uint64_t laplacian2 = 0;
+	uint64_t brenner = 0;
+	for (unsigned int qy = qy0 + 1; qy + 1 < qy1; ++qy) {
+		int16_t *t = previous;
+		previous = current;
+		current = next;
+		next = t;
+		green_row(bayer, width, qy + 1, qx0, n, shift0, shift1, next);
+
+		// the magnitudes fit 16 bits and their squares 32, so this
+		// loop vectorises
+		int32_t row_laplacian = 0;
+		for (unsigned int x = 1; x + 1 < n; ++x) {
+			const int32_t gx = (previous[x + 1] + 2 * current[x + 1] + next[x + 1])
+				- (previous[x - 1] + 2 * current[x - 1] + next[x - 1]);
+			const int32_t gy = (next[x - 1] + 2 * next[x] + next[x + 1])
+				- (previous[x - 1] + 2 * previous[x] + previous[x + 1]);
+			const uint16_t ax = gx < 0 ? -gx : gx;
+			const uint16_t ay = gy < 0 ? -gy : gy;
+			gradient[x] = (uint32_t)ax * ax + (uint32_t)ay * ay;
+
+			const int32_t l = previous[x] + next[x] + current[x - 1] + current[x + 1] - 4 * current[x];
+			const uint16_t al = l < 0 ? -l : l;
+			row_laplacian += l;
+			curvature[x] = (uint32_t)al * al;
+
+			const int16_t across = current[x + 1] - current[x];
+			const int16_t down = next[x] - current[x];
+			difference[x] = across * across + down * down;
+		}
+		// their sums need 64 bits
+		for (unsigned int x = 1; x + 1 < n; ++x) {
+			tenengrad += gradient[x];
+			laplacian2 += curvature[x];
+			brenner += difference[x];
+		}
+		laplacian += row_laplacian;
+	}
+	free(rows);
+	free(terms);
+
+	const unsigned int quads = (n - 2) * (qy1 - qy0 - 2);
+	const double mean = (double)laplacian / quads;
+	sharpness->quads = quads;
+	sharpness->value[SHARPNESS_TENENGRAD] = (double)tenengrad / quads;
+	sharpness->value[SHARPNESS_LAPLACIAN] = (double)laplacian2 / quads - mean * mean;
+	sharpness->value[SHARPNESS_BRENNER] = (double)brenner / quads;
+	return true;
+}
+
+
+const char *sharpness_metric_name(sharpness_metric_t metric) {
+	if (metric < 0 || metric >= SHARPNESS_METRICS) {
+		return NULL;
+	}
+	return metric_names[metric];
+}
+
+
+bool sharpness_metric_parse(const char *name, sharpness_metric_t *metric) {
+	for (int i = 0; i < SHARPNESS_METRICS; ++i) {
+		if (0 == strcasecmp(name, metric_names[i])) {
+			*metric = i;
+			return true;
+		}
+	}
+	return false;
+}
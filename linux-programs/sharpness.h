@@ -0,0 +1,58 @@
+// focus measures of a raw frame, from the green sites only
+//
+// each Bayer quad contributes the sum of its two green sites, giving a
+// half size image of the one colour that is sampled at every quad, so
+// no demosaicing is needed and neighbouring quads are the nearest
+// pixels of the same colour.  Three measures are taken over a region
+// of interest, each higher when the region is sharper:
+//
+//   Tenengrad  mean squared Sobel gradient magnitude
+//   Laplacian  variance of the 4-neighbour Laplacian
+//   Brenner    mean squared difference to the next quad across and down
+//
+// the region is read row by row and only three rows of quads are kept,
+// so a measure costs about one pass over its pixels.  Measures only
+// read the frame and may run from many threads at once
+
+#ifndef _SHARPNESS_H_
+#define _SHARPNESS_H_ 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ahd_bayer.h"
+
+typedef enum {
+	SHARPNESS_TENENGRAD,
+	SHARPNESS_LAPLACIAN,
+	SHARPNESS_BRENNER,
+	SHARPNESS_METRICS        // number of measures
+} sharpness_metric_t;
+
+// in pixels, widened to whole quads and clipped to the frame
+typedef struct {
+	unsigned int x;
+	unsigned int y;
+	unsigned int width;
+	unsigned int height;
+} sharpness_roi_t;
+
+typedef struct {
+	double value[SHARPNESS_METRICS];
+	unsigned int quads;      // scored, the region less its edge
+} sharpness_t;
+
+// measure the region of a frame, or all of it if roi is NULL.  The
+// embedded data in the high nibbles is ignored.  Returns false with
+// errno set if the region is under three quads either way
+bool sharpness_measure(const uint16_t *bayer, unsigned int width, unsigned int height, BayerTile tile,
+		       const sharpness_roi_t *roi, sharpness_t *sharpness);
+
+// lower case name of a measure, NULL if out of range
+const char *sharpness_metric_name(sharpness_metric_t metric);
+
+// the measure called name, returns false if there is none
+bool sharpness_metric_parse(const char *name, sharpness_metric_t *metric);
+
+#endif
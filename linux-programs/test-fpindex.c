@@ -0,0 +1,357 @@
+// test program comparing fingerprint index searches with brute force
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "fingerprint.h"
+#include "fpindex.h"
+
+
+// file header size, as in fpindex.c
+#define HEADER_SIZE 32
+
+// fingerprints are near one of these, so small radii find something
+#define CLUSTERS 64
+
+static char *program_name = NULL;
+static const char *directory = "/tmp";
+static unsigned int count = 4000;
+static unsigned int queries = 50;
+static unsigned int max_radius = 40;
+static unsigned int seed = 1;
+static int verbose = 0;
+static int failures = 0;
+
+static void usage(const char *message, ...)
+{
+	if (NULL != message) {
+		va_list ap;
+		va_start(ap, message);
+		fprintf(stderr, "error: ");
+		vfprintf(stderr, message, ap);
+		fprintf(stderr, "\n");
+		va_end(ap);
+	}
+	fprintf(stderr,
+		 "usage: %s [options]\n\n"
+		 "options:\n"
+		 "-h | --help          this message\n"
+		 "-v | --verbose       verbose output\n"
+		 "-d | --directory D   where the test index is saved [%s]\n"
+		 "-n | --count N       fingerprints in the index [%u]\n"
+		 "-q | --queries N     queries for each substring count [%u]\n"
+		 "-r | --radius R      radius queries from 0 to R [%u]\n"
+		 "-s | --seed S        random seed [%u]\n"
+		 "", program_name, directory, count, queries, max_radius, seed);
+	exit(EXIT_FAILURE);
+}
+
+
+static const char short_options[] = "hvd:n:q:r:s:";
+
+static const struct option
+long_options[] = {
+	{ "help",       no_argument,       NULL, 'h' },
+	{ "verbose",    no_argument,       NULL, 'v' },
+	{ "directory",  required_argument, NULL, 'd' },
+	{ "count",      required_argument, NULL, 'n' },
+	{ "queries",    required_argument, NULL, 'q' },
+	{ "radius",     required_argument, NULL, 'r' },
+	{ "seed",       required_argument, NULL, 's' },
+	{ 0, 0, 0, 0 }
+};
+
+
+static unsigned int number(const char *name, const char *text, unsigned int low, unsigned int high) {
+	errno = 0;
+	char *end;
+	unsigned long n = strtoul(text, &end, 0);
+	if (0 != errno || end == text || '\0' != *end || n < low || n > high) {
+		usage("invalid %s '%s', %u to %u", name, text, low, high);
+	}
+	return n;
+}
+
+static void check(bool condition, const char *test, const char *what) {
+	if (!condition) {
+		fprintf(stderr, "FAIL %s: %s\n", test, what);
+		++failures;
+	} else if (verbose > 1) {
+		fprintf(stderr, "ok   %s: %s\n", test, what);
+	}
+}
+
+static void index_exit(const fpindex_t *index, const char *test) {
+	fprintf(stderr, "FAIL %s: %s error %d, %s\n", test, index->error, errno, strerror(errno));
+	exit(EXIT_FAILURE);
+}
+
+
+static void random_fingerprint(fingerprint_t *fingerprint) {
+	for (int w = 0; w < FINGERPRINT_WORDS; ++w) {
+		fingerprint->bits[w] = (uint64_t)random() << 62 ^ (uint64_t)random() << 31 ^ random();
+	}
+}
+
+// a copy of from with up to flips random bits changed
+static void near_fingerprint(fingerprint_t *fingerprint, const fingerprint_t *from, unsigned int flips) {
+	*fingerprint = *from;
+	for (unsigned int i = 0; i < flips; ++i) {
+		const unsigned int bit = random() % FINGERPRINT_BITS;
+		fingerprint->bits[bit / 64] ^= (uint64_t)1 << (bit % 64);
+	}
+}
+
+static int compare_match(const void *a, const void *b) {
+	const fpindex_match_t *x = a;
+	const fpindex_match_t *y = b;
+	if (x->distance != y->distance) {
+		return (x->distance > y->distance) - (x->distance < y->distance);
+	}
+	return (x->id > y->id) - (x->id < y->id);
+}
+
+// every fingerprint nearest first, ties by id as the index orders them
+static void brute_force(const fingerprint_t *codes, unsigned int n, const fingerprint_t *query,
+			fpindex_match_t *all) {
+	for (unsigned int id = 0; id < n; ++id) {
+		all[id].id = id;
+		all[id].distance = fingerprint_distance(query, &codes[id]);
+	}
+	qsort(all, n, sizeof(fpindex_match_t), compare_match);
+}
+
+static bool same(const fpindex_match_t *a, const fpindex_match_t *b, size_t n) {
+	for (size_t i = 0; i < n; ++i) {
+		if (a[i].id != b[i].id || a[i].distance != b[i].distance) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+// radius and k nearest queries agree with brute force
+static void test_queries(const fpindex_t *index, const fingerprint_t *codes, const fingerprint_t *query,
+			 const char *test) {
+	const unsigned int n = index->count;
+	fpindex_match_t *all = malloc(n * sizeof(fpindex_match_t));
+	fpindex_match_t *found = malloc(n * sizeof(fpindex_match_t));
+	if (NULL == all || NULL == found) {
+		fprintf(stderr, "FAIL %s: out of memory\n", test);
+		exit(EXIT_FAILURE);
+	}
+	brute_force(codes, n, query, all);
+
+	size_t within = 0;
+	for (unsigned int radius = 0; radius <= max_radius; ++radius) {
+		while (within < n && all[within].distance <= radius) {
+			++within;
+		}
+		size_t total = 0;
+		ssize_t got = fpindex_radius(index, query, radius, found, n, &total);
+		check(got == (ssize_t)within && total == within && same(found, all, within),
+		      test, "radius matches brute force");
+
+		// a short result is the nearest of them
+		if (within > 1) {
+			got = fpindex_radius(index, query, radius, found, within / 2, &total);
+			check(got == (ssize_t)(within / 2) && total == within && same(found, all, within / 2),
+			      test, "bounded radius keeps the nearest");
+		}
+	}
+
+	static const unsigned int ks[] = { 1, 2, 7, 64 };
+	for (unsigned int i = 0; i < sizeof(ks) / sizeof(ks[0]); ++i) {
+		const unsigned int k = ks[i] < n ? ks[i] : n;
+		ssize_t got = fpindex_nearest(index, query, k, found);
+		check(got == (ssize_t)k && same(found, all, k), test, "k nearest matches brute force");
+	}
+	free(all);
+	free(found);
+}
+
+// the batch answers are those of single queries
+static void test_batch(const fpindex_t *index, const fingerprint_t *query, unsigned int n, const char *test) {
+	const unsigned int k = 5;
+	fpindex_match_t *matches = malloc(n * k * sizeof(fpindex_match_t));
+	unsigned int *found = malloc(n * sizeof(unsigned int));
+	if (NULL == matches || NULL == found) {
+		fprintf(stderr, "FAIL %s: out of memory\n", test);
+		exit(EXIT_FAILURE);
+	}
+	if (!fpindex_nearest_batch(index, query, n, k, matches, found, 4)) {
+		index_exit(index, test);
+	}
+	for (unsigned int i = 0; i < n; ++i) {
+		fpindex_match_t single[5];
+		ssize_t got = fpindex_nearest(index, &query[i], k, single);
+		check(got == (ssize_t)found[i] && same(single, &matches[i * k], found[i]),
+		      test, "batch matches single queries");
+	}
+	free(matches);
+	free(found);
+}
+
+// a saved index answers as before, and one with a table id out of
+// range is refused
+static void test_file(fpindex_t *index, const char *path, const fingerprint_t *codes,
+		      const fingerprint_t *query, const char *test) {
+	if (!fpindex_save(index, path)) {
+		index_exit(index, test);
+	}
+	fpindex_t loaded;
+	bool ok = fpindex_load(&loaded, path);
+	check(ok, test, "saved index loads");
+	if (ok) {
+		check(loaded.count == index->count && loaded.substrings == index->substrings,
+		      test, "loaded index has the same size");
+		test_queries(&loaded, codes, query, test);
+		fpindex_free(&loaded);
+	}
+
+	// the first id of the first table, after the header and fingerprints
+	const off_t offset = HEADER_SIZE + (off_t)index->count * sizeof(fingerprint_t) + index->count * sizeof(uint32_t);
+	const uint32_t bad = index->count;
+	int fd = open(path, O_WRONLY);
+	if (-1 == fd || sizeof(bad) != pwrite(fd, &bad, sizeof(bad), offset) || -1 == close(fd)) {
+		fprintf(stderr, "FAIL %s: write '%s' error %d, %s\n", test, path, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	ok = fpindex_load(&loaded, path);
+	check(!ok && EINVAL == errno, test, "index with a bad id is refused");
+	if (ok) {
+		fpindex_free(&loaded);
+	}
+	unlink(path);
+}
+
+
+static void test_substrings(unsigned int substrings, const fingerprint_t *codes, const fingerprint_t *query,
+			    const char *path) {
+	char test[64];
+	snprintf(test, sizeof(test), "%u substrings", substrings);
+
+	fpindex_t index;
+	if (!fpindex_init(&index, substrings)) {
+		index_exit(&index, test);
+	}
+	// the last eighth stays out of the tables, to be scanned
+	const unsigned int built = count - count / 8;
+	for (unsigned int i = 0; i < count; ++i) {
+		uint32_t id;
+		if (!fpindex_add(&index, &codes[i], &id)) {
+			index_exit(&index, test);
+		}
+		check(id == i, test, "ids are in order of adding");
+		if (i + 1 == built && !fpindex_build(&index)) {
+			index_exit(&index, test);
+		}
+	}
+	for (unsigned int q = 0; q < queries; ++q) {
+		test_queries(&index, codes, &query[q], test);
+	}
+	test_batch(&index, query, queries, test);
+	test_file(&index, path, codes, &query[0], test);
+	fpindex_free(&index);
+	if (verbose > 0) {
+		fprintf(stderr, "done %s\n", test);
+	}
+}
+
+
+int main(int argc, char **argv) {
+	program_name = argv[0];
+
+	for (;;) {
+		int idx = 0;
+		int c = getopt_long(argc, argv, short_options, long_options, &idx);
+
+		if (-1 == c) {
+			break;
+		}
+
+		switch (c) {
+		case 0: // getopt_long() flag
+			break;
+
+		case 'h':
+			usage(NULL);
+
+		case 'v':
+			++verbose;
+			break;
+
+		case 'd':
+			directory = optarg;
+			break;
+
+		case 'n':
+			count = number("count", optarg, 8, 10000000);
+			break;
+
+		case 'q':
+			queries = number("queries", optarg, 1, 100000);
+			break;
+
+		case 'r':
+			max_radius = number("radius", optarg, 0, FINGERPRINT_BITS);
+			break;
+
+		case 's':
+			seed = number("seed", optarg, 0, UINT32_MAX);
+			break;
+
+		default:
+			usage("invalid option: '%c'", c);
+		}
+	}
+
+	// fingerprints and queries a few bits from a cluster centre, with
+	// repeats, and some queries far from everything
+	srandom(seed);
+	fingerprint_t centre[CLUSTERS];
+	for (int i = 0; i < CLUSTERS; ++i) {
+		random_fingerprint(&centre[i]);
+	}
+	fingerprint_t *codes = malloc(count * sizeof(fingerprint_t));
+	fingerprint_t *query = malloc(queries * sizeof(fingerprint_t));
+	if (NULL == codes || NULL == query) {
+		usage("failed to allocate %u fingerprints", count);
+	}
+	for (unsigned int i = 0; i < count; ++i) {
+		near_fingerprint(&codes[i], &centre[random() % CLUSTERS], random() % 48);
+	}
+	for (unsigned int q = 0; q < queries; ++q) {
+		if (0 == q % 5) {
+			random_fingerprint(&query[q]);
+		} else {
+			near_fingerprint(&query[q], &codes[random() % count], random() % 24);
+		}
+	}
+
+	char path[1024];
+	snprintf(path, sizeof(path), "%s/test-fpindex-%d.index", directory, getpid());
+
+	test_substrings(8, codes, query, path);
+	test_substrings(16, codes, query, path);
+	test_substrings(32, codes, query, path);
+
+	free(codes);
+	free(query);
+
+	if (0 != failures) {
+		fprintf(stderr, "%d failed\n", failures);
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "all passed\n");
+	return EXIT_SUCCESS;
+}
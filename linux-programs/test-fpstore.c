@@ -0,0 +1,234 @@
+// test program for the crash safety and locking of fingerprint stores
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "fpstore.h"
+
+
+// header slot size, as in fpstore.c
+#define SLOT_SIZE 4096
+
+static char *program_name = NULL;
+static const char *directory = "/tmp";
+static int verbose = 0;
+static int failures = 0;
+
+static void usage(const char *message, ...)
+{
+	if (NULL != message) {
+		va_list ap;
+		va_start(ap, message);
+		fprintf(stderr, "error: ");
+		vfprintf(stderr, message, ap);
+		fprintf(stderr, "\n");
+		va_end(ap);
+	}
+	fprintf(stderr,
+		 "usage: %s [options]\n\n"
+		 "options:\n"
+		 "-h | --help          this message\n"
+		 "-v | --verbose       verbose output\n"
+		 "-d | --directory D   where the test stores are made [%s]\n"
+		 "", program_name, directory);
+	exit(EXIT_FAILURE);
+}
+
+
+static const char short_options[] = "hvd:";
+
+static const struct option
+long_options[] = {
+	{ "help",       no_argument,       NULL, 'h' },
+	{ "verbose",    no_argument,       NULL, 'v' },
+	{ "directory",  required_argument, NULL, 'd' },
+	{ 0, 0, 0, 0 }
+};
+
+
+static void check(bool condition, const char *test, const char *what) {
+	if (!condition) {
+		fprintf(stderr, "FAIL %s: %s\n", test, what);
+		++failures;
+	} else if (verbose > 0) {
+		fprintf(stderr, "ok   %s: %s\n", test, what);
+	}
+}
+
+static void store_exit(const fpstore_t *store, const char *test) {
+	fprintf(stderr, "FAIL %s: %s error %d, %s\n", test, store->error, errno, strerror(errno));
+	exit(EXIT_FAILURE);
+}
+
+// a new store holding count records, committed one at a time
+static unsigned int make_store(const char *path, const char *test, unsigned int count) {
+	unlink(path);
+	fpstore_t store;
+	if (!fpstore_open(&store, path, true, true)) {
+		store_exit(&store, test);
+	}
+	for (unsigned int i = 0; i < count; ++i) {
+		fingerprint_t fingerprint;
+		memset(&fingerprint, i, sizeof(fingerprint));
+		fpstore_meta_t meta = { .device = i };
+		if (!fpstore_append(&store, &fingerprint, &meta, NULL) || !fpstore_sync(&store)) {
+			store_exit(&store, test);
+		}
+	}
+	const unsigned int slot = store.slot;
+	if (!fpstore_close(&store)) {
+		store_exit(&store, test);
+	}
+	return slot;
+}
+
+// spoil the magic number of a header slot, as a torn write would
+static void corrupt_slot(const char *path, const char *test, unsigned int slot) {
+	int fd = open(path, O_RDWR);
+	uint8_t byte;
+	if (-1 == fd || 1 != pread(fd, &byte, 1, slot * SLOT_SIZE)) {
+		fprintf(stderr, "FAIL %s: read '%s' error %d, %s\n", test, path, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	byte ^= 0xff;
+	if (1 != pwrite(fd, &byte, 1, slot * SLOT_SIZE) || -1 == close(fd)) {
+		fprintf(stderr, "FAIL %s: write '%s' error %d, %s\n", test, path, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+// losing the newest header leaves the store as it was one commit earlier
+static void test_torn_commit(const char *path, const char *test, unsigned int count) {
+	unsigned int slot = make_store(path, test, count);
+	corrupt_slot(path, test, slot);
+
+	fpstore_t store;
+	bool opened = fpstore_open(&store, path, false, false);
+	check(opened, test, "reopens from the other slot");
+	if (opened) {
+		check(count - 1 == store.committed, test, "has the records of the previous commit");
+		check(count < 2 || count - 2 == fpstore_meta(&store, count - 2)->device,
+		      test, "earlier records are intact");
+		fpstore_close(&store);
+	}
+}
+
+// a crash after the file was sized but before its first header was
+// written leaves an empty store, not a broken one
+static void test_torn_create(const char *path, const char *test) {
+	unlink(path);
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (-1 == fd || -1 == ftruncate(fd, 4 * SLOT_SIZE) || -1 == close(fd)) {
+		fprintf(stderr, "FAIL %s: create '%s' error %d, %s\n", test, path, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	fpstore_t store;
+	bool opened = fpstore_open(&store, path, false, false);
+	check(opened, test, "opens for reading");
+	if (opened) {
+		check(0 == store.committed, test, "is empty");
+		fpstore_close(&store);
+	}
+
+	opened = fpstore_open(&store, path, true, true);
+	check(opened, test, "opens for writing");
+	if (opened) {
+		fingerprint_t fingerprint;
+		memset(&fingerprint, 1, sizeof(fingerprint));
+		fpstore_meta_t meta = { .device = 7 };
+		check(fpstore_append(&store, &fingerprint, &meta, NULL) && fpstore_close(&store),
+		      test, "takes a record");
+	}
+	opened = fpstore_open(&store, path, false, false);
+	check(opened && 1 == store.committed && 7 == fpstore_meta(&store, 0)->device,
+	      test, "keeps the record");
+	if (opened) {
+		fpstore_close(&store);
+	}
+}
+
+static void test_one_writer(const char *path, const char *test) {
+	make_store(path, test, 1);
+
+	fpstore_t writer;
+	if (!fpstore_open(&writer, path, true, false)) {
+		store_exit(&writer, test);
+	}
+	fpstore_t second;
+	bool opened = fpstore_open(&second, path, true, false);
+	check(!opened && EBUSY == errno, test, "a second writer is refused");
+	if (opened) {
+		fpstore_close(&second);
+	}
+	fpstore_t reader;
+	opened = fpstore_open(&reader, path, false, false);
+	check(opened, test, "readers are not blocked");
+	if (opened) {
+		fpstore_close(&reader);
+	}
+	fpstore_close(&writer);
+
+	opened = fpstore_open(&second, path, true, false);
+	check(opened, test, "a writer may open once the first has closed");
+	if (opened) {
+		fpstore_close(&second);
+	}
+}
+
+
+int main(int argc, char **argv) {
+	program_name = argv[0];
+
+	for (;;) {
+		int idx = 0;
+		int c = getopt_long(argc, argv, short_options, long_options, &idx);
+
+		if (-1 == c) {
+			break;
+		}
+
+		switch (c) {
+		case 0: // getopt_long() flag
+			break;
+
+		case 'h':
+			usage(NULL);
+
+		case 'v':
+			++verbose;
+			break;
+
+		case 'd':
+			directory = optarg;
+			break;
+
+		default:
+			usage("invalid option: '%c'", c);
+		}
+	}
+
+	char path[1024];
+	snprintf(path, sizeof(path), "%s/test-fpstore-%d.store", directory, getpid());
+
+	test_torn_commit(path, "first commit torn", 1);
+	test_torn_commit(path, "later commit torn", 3);
+	test_torn_create(path, "creation torn");
+	test_one_writer(path, "writer lock");
+	unlink(path);
+
+	if (0 != failures) {
+		fprintf(stderr, "%d failed\n", failures);
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "all passed\n");
+	return EXIT_SUCCESS;
+}
@@ -20,9 +20,12 @@
 
 #include <linux/videodev2.h>
 
+#include "controls.h"
+
 
 static char *program_name = NULL;
 static char *device_name = NULL;
+static controls_t controls;
 
 static void usage(const char *message, ...)
 {
@@ -76,16 +79,15 @@ static void *allocate(size_t length) {
 }
 
 // returns the default value
-#define CHECK(fd, control) check_control(fd, #control, control)
-static uint32_t check_control(int fd, const char *name, uint32_t id) {
+#define CHECK(control) check_control(#control, control)
+static uint32_t check_control(const char *name, uint32_t id) {
 
 	uint32_t result = 0;
 
 	struct v4l2_queryctrl queryctrl;
-	memset(&queryctrl, 0, sizeof(queryctrl));
-	queryctrl.id = id;
+	int32_t value = 0;
 
-	if (-1 == ioctl(fd, VIDIOC_QUERYCTRL, &queryctrl)) {
+	if (!controls_query(&controls, id, &queryctrl)) {
 		if (errno != EINVAL) {
 			usage("VIDIOC_QUERYCTRL(%s) error: (%d) '%s'",  name, errno, strerror(errno));
 		} else {
@@ -94,12 +96,8 @@ static uint32_t check_control(int fd, const char *name, uint32_t id) {
 	} else if (queryctrl.flags & V4L2_CTRL_FLAG_DISABLED) {
 		usage("%s is not supported", name);
 	} else {
-		struct v4l2_control control;
-		memset(&control, 0, sizeof (control));
-		control.id = id;
-		control.value = 0;
-		if (-1 == ioctl(fd, VIDIOC_G_CTRL, &control)) {
-			usage("VIDIOC_G_CTRL: (%d) '%s'", errno, strerror(errno));
+		if (!controls_get(&controls, id, &value)) {
+			usage("%s: (%d) '%s'", controls.error, errno, strerror(errno));
 		}
 		printf("%s type: 0x%08x\n"
 		       "  minimum: 0x%08x  %10d\n"
@@ -114,7 +112,7 @@ static uint32_t check_control(int fd, const char *name, uint32_t id) {
 		       queryctrl.maximum, queryctrl.maximum,
 		       queryctrl.step, queryctrl.step,
 		       queryctrl.default_value, queryctrl.default_value,
-		       control.value, control.value,
+		       value, value,
 		       queryctrl.flags, queryctrl.flags);
 		result = queryctrl.default_value;
 	}
@@ -122,19 +120,32 @@ static uint32_t check_control(int fd, const char *name, uint32_t id) {
 }
 
 
-static void set_control(int fd, uint32_t id, uint32_t value) {
-	struct v4l2_control control;
-	memset(&control, 0, sizeof (control));
-	control.id = id;
-	control.value = value;
-	if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control) && errno != ERANGE) {
-		usage("VIDIOC_S_CTRL: (%d) '%s'", errno, strerror(errno));
+// set several controls in one transfer.  Values out of range are
+// ignored, as a value the device rejects fails the whole batch the
+// controls are then sent one at a time so the others still take effect
+static void apply_controls(const uint32_t *ids, const int32_t *values, unsigned int n) {
+	for (unsigned int i = 0; i < n; ++i) {
+		controls_set(&controls, ids[i], values[i]);
+	}
+	if (controls_apply(&controls)) {
+		return;
+	}
+	if (errno != ERANGE) {
+		usage("%s: (%d) '%s'", controls.error, errno, strerror(errno));
+	}
+	for (unsigned int i = 0; i < n; ++i) {
+		controls_set(&controls, ids[i], values[i]);
+		if (!controls_apply(&controls) && errno != ERANGE) {
+			usage("%s: (%d) '%s'", controls.error, errno, strerror(errno));
+		}
 	}
 }
 
 
-static void set_leds(int fd, uint32_t value) {
-	set_control(fd, V4L2_CID_HUE, value);
+static void set_leds(uint32_t value) {
+	const uint32_t id = V4L2_CID_HUE;
+	const int32_t v = value;
+	apply_controls(&id, &v, 1);
 }
 
 
@@ -206,11 +217,20 @@ int main(int argc, char *argv[]) {
 	}
 
 	int fd = open_device(device_name);
+	controls_init(&controls, fd);
 
-	uint32_t default_hue = CHECK(fd, V4L2_CID_HUE);
-	uint32_t default_contrast = CHECK(fd, V4L2_CID_CONTRAST);
-	uint32_t default_sharpness = CHECK(fd, V4L2_CID_SHARPNESS);
-	uint32_t default_brightness = CHECK(fd, V4L2_CID_BRIGHTNESS);
+	// fetch the current values together
+	static const uint32_t ids[] = {
+		V4L2_CID_HUE, V4L2_CID_CONTRAST, V4L2_CID_SHARPNESS, V4L2_CID_BRIGHTNESS
+	};
+	if (!controls_read(&controls, ids, sizeof(ids) / sizeof(ids[0]))) {
+		usage("%s: (%d) '%s'", controls.error, errno, strerror(errno));
+	}
+
+	uint32_t default_hue = CHECK(V4L2_CID_HUE);
+	uint32_t default_contrast = CHECK(V4L2_CID_CONTRAST);
+	uint32_t default_sharpness = CHECK(V4L2_CID_SHARPNESS);
+	uint32_t default_brightness = CHECK(V4L2_CID_BRIGHTNESS);
 
 	for (int n = 0; n < count; ++n) {
 
@@ -218,19 +238,19 @@ int main(int argc, char *argv[]) {
 
 		for (int32_t value = 1; value < 16; value <<= 1) {
 			printf("  set: 0x%04x\n", value);
-			set_leds(fd, value);
+			set_leds(value);
 			usleep(500000);
 		}
 	}
 
 	// set all off
 	printf("turn off\n");
-	set_leds(fd, 0);
+	set_leds(0);
 
-	set_control(fd, V4L2_CID_HUE, default_hue);
-	set_control(fd, V4L2_CID_CONTRAST, default_contrast);
-	set_control(fd, V4L2_CID_SHARPNESS, default_sharpness);
-	set_control(fd, V4L2_CID_BRIGHTNESS, default_brightness);
+	const int32_t defaults[] = {
+		default_hue, default_contrast, default_sharpness, default_brightness
+	};
+	apply_controls(ids, defaults, sizeof(ids) / sizeof(ids[0]));
 
 
 	// finished
@@ -0,0 +1,293 @@
+// verify-load.c: load test a verification daemon with many clients
+// sending verify requests at once, and report the latency and rate
+// they saw
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#if defined(__linux__)
+#include <bsd/string.h>
+#endif
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "latency.h"
+
+
+#define DEFAULT_SOCKET "/tmp/verifyd.sock"
+#define DEFAULT_CLIENTS 4
+#define DEFAULT_REQUESTS 100
+
+#define MAX_CLIENTS 64
+#define MAX_LINE 2048
+
+typedef struct {
+	const char *socket_name;
+	char **inputs;           // cycled through by request number
+	int n_inputs;
+	const char *key;         // input or share
+	const char *extra;       // appended to every request
+	uint64_t total;
+	uint64_t next;           // next request number, atomic
+	bool failed;             // a client could not talk to the daemon, atomic
+	pthread_mutex_t lock;    // the rest
+	latency_t latency;
+	uint64_t ok;
+	uint64_t errors;
+} load_t;
+
+static const char *program_name;
+static int verbose = 0; // incremented by --verbose / -v
+
+
+// print usage message and exit
+static void usage(const char *message, ...) {
+	if (NULL != message) {
+		va_list ap;
+		va_start(ap, message);
+		fprintf(stderr, "error: ");
+		vfprintf(stderr, message, ap);
+		fprintf(stderr, "\n");
+		va_end(ap);
+	}
+	fprintf(stderr,
+		"Usage: %s [options] FILE...\n\n"
+		"Options:\n"
+		"-h | --help          Print this message\n"
+		"-v | --verbose       Print every reply\n"
+		"-k | --socket path   Daemon socket [%s]\n"
+		"-c | --clients N     Connections sending at once [%d]\n"
+		"-n | --requests N    Requests in all [%d]\n"
+		"-s | --share         The files are buffer share sockets, not captures\n"
+		"-x | --extra WORDS   Added to every request, such as 'k=1 fuse=4'\n"
+		"Requests cycle through the files, which are paths the daemon can\n"
+		"read; synthetic captures from capture -d synthetic do\n"
+		"",
+		program_name, DEFAULT_SOCKET, DEFAULT_CLIENTS, DEFAULT_REQUESTS);
+	exit(EXIT_FAILURE);
+}
+
+
+static const char short_options[] = "hvk:c:n:sx:";
+
+static const struct option
+long_options[] = {
+	{ "help",       no_argument,       NULL, 'h' },
+	{ "verbose",    no_argument,       NULL, 'v' },
+	{ "socket",     required_argument, NULL, 'k' },
+	{ "clients",    required_argument, NULL, 'c' },
+	{ "requests",   required_argument, NULL, 'n' },
+	{ "share",      no_argument,       NULL, 's' },
+	{ "extra",      required_argument, NULL, 'x' },
+	{ 0, 0, 0, 0 }
+};
+
+
+static unsigned long number(const char *name, const char *text, unsigned long low, unsigned long high) {
+	errno = 0;
+	char *end;
+	unsigned long n = strtoul(text, &end, 0);
+	if (0 != errno || end == text || '\0' != *end || n < low || n > high) {
+		usage("invalid %s '%s', %lu to %lu", name, text, low, high);
+	}
+	return n;
+}
+
+
+static int connect_socket(const char *path) {
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlcpy(address.sun_path, path, sizeof(address.sun_path)) >= sizeof(address.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (-1 == fd) {
+		return -1;
+	}
+	if (-1 == connect(fd, (struct sockaddr *)&address, sizeof(address))) {
+		int error = errno;
+		close(fd);
+		errno = error;
+		return -1;
+	}
+	return fd;
+}
+
+
+// read one reply line, the daemon sends nothing else
+static bool read_line(int fd, char *line, size_t size) {
+	size_t length = 0;
+	while (length < size - 1) {
+		ssize_t n = recv(fd, &line[length], 1, 0);
+		if (-1 == n && EINTR == errno) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		if ('\n' == line[length]) {
+			break;
+		}
+		++length;
+	}
+	line[length] = '\0';
+	return true;
+}
+
+
+static void *client_main(void *arg) {
+	load_t *load = arg;
+	int fd = connect_socket(load->socket_name);
+	if (-1 == fd) {
+		fprintf(stderr, "connect: '%s' error %d, %s\n", load->socket_name, errno, strerror(errno));
+		__atomic_store_n(&load->failed, true, __ATOMIC_SEQ_CST);
+		return NULL;
+	}
+
+	for (;;) {
+		uint64_t n = __atomic_fetch_add(&load->next, 1, __ATOMIC_SEQ_CST);
+		if (n >= load->total) {
+			break;
+		}
+		char request[MAX_LINE];
+		int length = snprintf(request, sizeof(request), "verify %s=%s %s\n", load->key,
+				      load->inputs[n % load->n_inputs], load->extra);
+		if (length >= sizeof(request)) {
+			fprintf(stderr, "request too long: '%s'\n", load->inputs[n % load->n_inputs]);
+			__atomic_store_n(&load->failed, true, __ATOMIC_SEQ_CST);
+			break;
+		}
+
+		struct timespec start;
+		struct timespec end;
+		char line[MAX_LINE];
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (length != send(fd, request, length, MSG_NOSIGNAL) || !read_line(fd, line, sizeof(line))) {
+			fprintf(stderr, "lost connection error %d, %s\n", errno, strerror(errno));
+			__atomic_store_n(&load->failed, true, __ATOMIC_SEQ_CST);
+			break;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		const double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+
+		const bool ok = 0 == strncmp(line, "ok", 2);
+		pthread_mutex_lock(&load->lock);
+		latency_record(&load->latency, ms);
+		if (ok) {
+			++load->ok;
+		} else {
+			++load->errors;
+		}
+		pthread_mutex_unlock(&load->lock);
+		if (verbose > 0 || !ok) {
+			printf("%llu %s\n", (unsigned long long)n, line);
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+
+int main(int argc, char **argv) {
+	program_name = argv[0];
+
+	load_t load = {
+		.socket_name = DEFAULT_SOCKET,
+		.key = "input",
+		.extra = "",
+		.total = DEFAULT_REQUESTS,
+	};
+	unsigned int n_clients = DEFAULT_CLIENTS;
+
+	for (;;) {
+		int idx = 0;
+		int c = getopt_long(argc, argv, short_options, long_options, &idx);
+
+		if (-1 == c) {
+			break;
+		}
+
+		switch (c) {
+		case 0: // getopt_long() flag
+			break;
+
+		case 'h':
+			usage(NULL);
+
+		case 'v':
+			++verbose;
+			break;
+
+		case 'k':
+			load.socket_name = optarg;
+			break;
+
+		case 'c':
+			n_clients = number("clients", optarg, 1, MAX_CLIENTS);
+			break;
+
+		case 'n':
+			load.total = number("requests", optarg, 1, UINT32_MAX);
+			break;
+
+		case 's':
+			load.key = "share";
+			break;
+
+		case 'x':
+			load.extra = optarg;
+			break;
+
+		default:
+			usage("invalid option: '%c'", c);
+		}
+	}
+
+	if (optind >= argc) {
+		usage("missing arguments");
+	}
+	load.inputs = &argv[optind];
+	load.n_inputs = argc - optind;
+	pthread_mutex_init(&load.lock, NULL);
+	latency_init(&load.latency);
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pthread_t threads[MAX_CLIENTS];
+	unsigned int started = 0;
+	for (; started < n_clients; ++started) {
+		int rc = pthread_create(&threads[started], NULL, client_main, &load);
+		if (0 != rc) {
+			fprintf(stderr, "pthread_create error %d, %s\n", rc, strerror(rc));
+			__atomic_store_n(&load.failed, true, __ATOMIC_SEQ_CST);
+			break;
+		}
+	}
+	for (unsigned int i = 0; i < started; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	const double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	latency_summary_t s;
+	latency_summary(&load.latency, &s);
+	printf("%llu ok %llu errors from %u clients in %.3f s, %.2f requests/s\n",
+	       (unsigned long long)load.ok, (unsigned long long)load.errors, started, seconds,
+	       0 == seconds ? 0.0 : (load.ok + load.errors) / seconds);
+	printf("latency ms: mean %.1f p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+	       s.mean, s.p50, s.p90, s.p99, s.max);
+
+	return load.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,1206 @@
+// verification daemon: match captures against a fingerprint database
+// on request from a Unix domain socket
+//
+// requests are single lines, each answered by a single line:
+//
+//   verify input=PATH [k=N] [fuse=N]
+//   verify share=PATH [frames=N] [k=N] [fuse=N]
+//     -> ok frame=N steps=N [peak=P] distance=D confidence=C ms=N
+//        matches=ID:D,...
+//   stats
+//     -> ok requests=N completed=N failed=N rejected=N outstanding=N
+//        batches=N batched=N frames=N rate=R mean=MS p50=MS p90=MS
+//        p99=MS max=MS
+//
+// stats counts since the start: batches is the index lookups made and
+// batched the fingerprints looked up in them, frames the frames read in
+// full, rate the completed requests a second and the rest the latency
+// of answered requests
+//   quit
+//     -> ok
+//
+// any failure is answered with: error MESSAGE
+//
+// input is a capture file or segment manifest, share the socket of a
+// capture exporting its buffers, from which frames=N frames are taken.
+// Frames are chosen from the embedded data and fused as by
+// create-fingerprint --fuse, registered to the reference if --align is
+// given, and fingerprinted; the options must be the ones the database
+// was made with.  frame is the best focused frame, matches the k
+// nearest database records, and confidence is one less the number of
+// records expected at distance D or closer by chance, so near 1 only
+// when the best match could not be a coincidence in a database of
+// this size.
+//
+// a fixed pool of workers takes requests in order of arrival, and one
+// thread looks up every fingerprint the workers have finished since
+// its last lookup in a single batch.  Requests beyond --queue waiting
+// or in progress are refused rather than queued
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#if defined(__linux__)
+#include <bsd/string.h>
+#endif
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "physicalhasher.h"
+
+
+#define FRAME_WIDTH  1920
+#define FRAME_HEIGHT 1080
+
+#define DEFAULT_SOCKET "/tmp/verifyd.sock"
+#define DEFAULT_NEAREST 5
+#define DEFAULT_QUEUE 64
+#define DEFAULT_BATCH 64
+#define DEFAULT_STREAM_FRAMES 16
+
+#define MAX_JOBS 64
+#define MAX_NEAREST 64
+#define MAX_BATCH 1024
+#define MAX_STREAM_FRAMES 64
+#define MAX_CLIENTS 64
+#define MAX_LINE 1024
+
+// milliseconds to wait for a frame from a buffer share
+#define STREAM_TIMEOUT 2000
+
+// short frames a buffer share may send during one request before the
+// request fails, so a capture sending only partial frames cannot hold a
+// worker forever
+#define MAX_SHORT_FRAMES 64
+
+#define CLEAR(x) memset(&(x), 0, sizeof(x))
+
+typedef struct client_s client_t;
+
+// one verify request, passed from queue to queue until answered
+typedef struct job_s {
+	struct job_s *next;
+	client_t *client;
+	uint64_t serial;                   // of the client's connection
+	char input[MAX_LINE];              // capture file or manifest
+	char share[MAX_LINE];              // or buffer share socket
+	unsigned int k;
+	unsigned int fuse;
+	unsigned int frames;               // from a share
+	struct timespec received;
+
+	// results
+	char error[MAX_LINE];              // empty on success
+	fingerprint_t fingerprint;
+	uint64_t frame;                    // best focused
+	int steps;                         // -1 if no embedded data
+	double peak;                       // of the registration, < 0 if not aligned
+	unsigned int found;
+	fpindex_match_t matches[MAX_NEAREST];
+} job_t;
+
+// jobs between threads
+typedef struct {
+	job_t *head;
+	job_t *tail;
+	bool closed;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+} queue_t;
+
+struct client_s {
+	int fd;
+	uint64_t serial;
+	char line[MAX_LINE];
+	size_t length;
+	bool overflow;  // discarding the rest of an over long line
+};
+
+// each worker's buffers, kept from one request to the next
+typedef struct {
+	pthread_t thread;
+	decoder_t decoder;
+	fusion_t fusion;
+	registration_t registration;
+	uint16_t *stream[MAX_STREAM_FRAMES];
+} worker_t;
+
+// the frames of one request
+typedef struct {
+	job_t *job;
+	framefile_t *files;      // a capture file or the segments of a manifest
+	int n_files;
+	uint16_t **frames;       // or frames copied from a share
+	uint64_t n;
+} source_t;
+
+static const char *program_name;
+static int verbose = 0; // incremented by --verbose / -v
+
+// how fingerprints are made, fixed at start up
+static int embed_offset = EMBED_DEFAULT_OFFSET;
+static unsigned int default_fuse = FUSION_DEFAULT_FRAMES;
+static unsigned int default_nearest = DEFAULT_NEAREST;
+static bool rgb = false;
+static bool align = false;
+
+static fpindex_t database;
+static double chance[FINGERPRINT_BITS + 1];  // P(distance <= d) between unrelated fingerprints
+
+static worker_t workers[MAX_JOBS];
+static unsigned int n_workers;
+static pthread_t index_thread;
+static unsigned int batch_limit = DEFAULT_BATCH;
+
+static queue_t pending;      // waiting for a worker
+static queue_t lookups;      // fingerprinted, waiting for the index
+static queue_t done;         // to be answered
+static int done_fd = -1;     // eventfd, readable when done has jobs
+
+static client_t clients[MAX_CLIENTS];
+static uint64_t serials = 0;
+static unsigned int queue_limit = DEFAULT_QUEUE;
+static unsigned int outstanding = 0;
+static volatile sig_atomic_t quit = 0;
+
+// counters, all but the atomic ones belong to the main thread
+static struct timespec started;
+static uint64_t requests = 0;
+static uint64_t completed = 0;
+static uint64_t failed = 0;
+static uint64_t rejected = 0;
+static uint64_t batches = 0; // index lookups, atomic
+static uint64_t batched = 0; // fingerprints looked up, atomic
+static uint64_t frames = 0;  // read in full by the workers, atomic
+static latency_t latency;
+
+
+static void errno_exit(const char *s) {
+	fprintf(stderr, "%s error %d, %s\n", s, errno, strerror(errno));
+	exit(EXIT_FAILURE);
+}
+
+static void quit_handler(int sig) {
+	quit = 1;
+}
+
+static double elapsed_ms(const struct timespec *from, const struct timespec *to) {
+	return (to->tv_sec - from->tv_sec) * 1e3 + (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+
+static void queue_init(queue_t *q) {
+	CLEAR(*q);
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->ready, NULL);
+}
+
+static void queue_push(queue_t *q, job_t *job) {
+	job->next = NULL;
+	pthread_mutex_lock(&q->lock);
+	if (NULL == q->tail) {
+		q->head = job;
+	} else {
+		q->tail->next = job;
+	}
+	q->tail = job;
+	pthread_cond_signal(&q->ready);
+	pthread_mutex_unlock(&q->lock);
+}
+
+// take up to max jobs, waiting for at least one if wait is set
+// returns 0 once the queue is closed and empty
+static unsigned int queue_take(queue_t *q, job_t **jobs, unsigned int max, bool wait) {
+	pthread_mutex_lock(&q->lock);
+	while (wait && NULL == q->head && !q->closed) {
+		pthread_cond_wait(&q->ready, &q->lock);
+	}
+	unsigned int n = 0;
+	for (; n < max && NULL != q->head; ++n) {
+		jobs[n] = q->head;
+		q->head = q->head->next;
+	}
+	if (NULL == q->head) {
+		q->tail = NULL;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return n;
+}
+
+// wake everyone waiting, they take what is left and then get nothing
+static void queue_close(queue_t *q) {
+	pthread_mutex_lock(&q->lock);
+	q->closed = true;
+	pthread_cond_broadcast(&q->ready);
+	pthread_mutex_unlock(&q->lock);
+}
+
+
+// hand a job back to the main thread to answer
+static void job_done(job_t *job) {
+	queue_push(&done, job);
+	uint64_t one = 1;
+	if (sizeof(one) != write(done_fd, &one, sizeof(one))) {
+		fprintf(stderr, "eventfd write error %d, %s\n", errno, strerror(errno));
+	}
+}
+
+// returns false so failures can be returned directly
+static bool job_fail(job_t *job, const char *format, ...) {
+	va_list ap;
+	va_start(ap, format);
+	vsnprintf(job->error, sizeof(job->error), format, ap);
+	va_end(ap);
+	return false;
+}
+
+
+// the segments of a manifest, names are kept until the source is closed
+static bool add_file(void *context, char *name) {
+	source_t *source = context;
+	framefile_t *files = realloc(source->files, (source->n_files + 1) * sizeof(framefile_t));
+	if (NULL == files) {
+		free(name);
+		return job_fail(source->job, "out of memory");
+	}
+	source->files = files;
+
+	framefile_t *file = &files[source->n_files];
+	if (!framefile_open(file, name, FRAME_WIDTH, FRAME_HEIGHT)) {
+		job_fail(source->job, "cannot open '%s': %s", name, strerror(errno));
+		free(name);
+		return false;
+	}
+	++source->n_files;
+	source->n += file->frames;
+	return true;
+}
+
+static bool open_files(source_t *source) {
+	job_t *job = source->job;
+	if (!framefile_is_manifest(job->input)) {
+		char *name = strdup(job->input);
+		if (NULL == name) {
+			return job_fail(job, "out of memory");
+		}
+		return add_file(source, name);
+	}
+	if (!framefile_manifest(job->input, add_file, source)) {
+		if ('\0' == job->error[0]) {
+			job_fail(job, "cannot read manifest '%s': %s", job->input, strerror(errno));
+		}
+		return false;
+	}
+	return true;
+}
+
+// copy the frames out of the shared buffers so they go straight back
+static bool stream_frames(worker_t *worker, source_t *source) {
+	job_t *job = source->job;
+	bufshare_consumer_t consumer;
+	if (!bufshare_attach(&consumer, job->share)) {
+		return job_fail(job, "cannot attach '%s': %s %s", job->share, consumer.error, strerror(errno));
+	}
+	source->frames = worker->stream;
+
+	const size_t size = FRAME_WIDTH * FRAME_HEIGHT * sizeof(uint16_t);
+	bool ok = true;
+	if (FRAME_WIDTH != consumer.width || FRAME_HEIGHT != consumer.height) {
+		ok = job_fail(job, "'%s' shares %ux%u frames", job->share, consumer.width, consumer.height);
+	}
+	unsigned int skipped = 0;
+	while (ok && source->n < job->frames) {
+		bufshare_frame_t frame;
+		int rc = bufshare_next(&consumer, &frame, STREAM_TIMEOUT);
+		if (rc <= 0) {
+			ok = job_fail(job, "'%s' %s after %llu frames", job->share,
+				      0 == rc ? "stalled" : "closed", (unsigned long long)source->n);
+			break;
+		}
+		if (frame.bytesused < size) {
+			if (++skipped >= MAX_SHORT_FRAMES) {
+				ok = job_fail(job, "'%s' sent %u short frames", job->share, skipped);
+			}
+		} else {
+			uint16_t **copy = &worker->stream[source->n];
+			if (NULL == *copy) {
+				*copy = malloc(size);
+			}
+			if (NULL == *copy) {
+				ok = job_fail(job, "out of memory");
+			} else {
+				memcpy(*copy, frame.data, size);
+				++source->n;
+			}
+		}
+		if (!bufshare_release(&consumer, &frame)) {
+			ok = job_fail(job, "release '%s': %s %s", job->share, consumer.error, strerror(errno));
+		}
+	}
+	bufshare_detach(&consumer);
+	return ok;
+}
+
+static void close_source(source_t *source) {
+	for (int i = 0; i < source->n_files; ++i) {
+		char *name = (char *)source->files[i].name;
+		framefile_close(&source->files[i]);
+		free(name);
+	}
+	free(source->files);
+}
+
+// read part of frame i of all the source's frames
+static bool source_read(source_t *source, uint64_t i, size_t first, size_t count, uint16_t *pixels) {
+	if (NULL != source->frames) {
+		memcpy(pixels, source->frames[i] + first, count * sizeof(uint16_t));
+		return true;
+	}
+	framefile_t *file = source->files;
+	while (i >= file->frames) {
+		i -= file->frames;
+		++file;
+	}
+	if (!framefile_read_pixels(file, i, first, count, pixels)) {
+		return job_fail(source->job, "read frame %llu of '%s': %s %s",
+				(unsigned long long)i, file->name, file->error, strerror(errno));
+	}
+	return true;
+}
+
+
+// choose the frames from their embedded data alone, then read, fuse
+// and fingerprint only those
+static bool fingerprint_source(worker_t *worker, source_t *source) {
+	job_t *job = source->job;
+	if (0 == source->n) {
+		return job_fail(job, "no frames");
+	}
+	embed_t *embeds = malloc(source->n * sizeof(embed_t));
+	if (NULL == embeds) {
+		return job_fail(job, "out of memory");
+	}
+	for (uint64_t i = 0; i < source->n; ++i) {
+		uint16_t pixels[EMBED_NIBBLES];
+		if (!source_read(source, i, embed_offset, EMBED_NIBBLES, pixels)) {
+			free(embeds);
+			return false;
+		}
+		embed_decode(pixels, EMBED_NIBBLES, 0, &embeds[i]);
+	}
+	size_t first;
+	size_t best;
+	const size_t count = fusion_select(embeds, source->n, job->fuse, &first, &best);
+	job->frame = best;
+	job->steps = embeds[best].present ? embeds[best].steps : -1;
+	free(embeds);
+
+	decoder_t *decoder = &worker->decoder;
+	fusion_reset(&worker->fusion);
+	for (size_t i = first; i < first + count; ++i) {
+		if (!source_read(source, i, 0, FRAME_WIDTH * FRAME_HEIGHT, decoder->bayer)) {
+			return false;
+		}
+		fusion_add(&worker->fusion, decoder->bayer);
+	}
+	fusion_result(&worker->fusion, decoder->bayer);
+	__atomic_add_fetch(&frames, count, __ATOMIC_RELAXED);
+
+	job->peak = -1;
+	if (align) {
+		fingerprint_transform_t transform;
+		fingerprint_grid_t grid;
+		if (!registration_estimate(&worker->registration, decoder->bayer, &transform, &job->peak)) {
+			return job_fail(job, "register: %s %s", worker->registration.error, strerror(errno));
+		}
+		if (!fingerprint_green_grid_transformed(decoder->bayer, FRAME_WIDTH, FRAME_HEIGHT,
+							decoder->tile, &transform, grid)) {
+			return job_fail(job, "fingerprint: %s", strerror(errno));
+		}
+		fingerprint_from_grid(grid, &job->fingerprint);
+	} else if (rgb) {
+		// as create-fingerprint --rgb: no decode_frame() overlays of the
+		// focus steps in the image that is hashed
+		embed_strip(decoder->bayer, FRAME_WIDTH * FRAME_HEIGHT, embed_offset);
+		if (!ahd_decode(decoder->bayer, FRAME_WIDTH, FRAME_HEIGHT, decoder->rgb, decoder->tile)) {
+			return job_fail(job, "demosaic failed");
+		}
+		fingerprint_grid_t grid;
+		if (!fingerprint_rgb_grid(decoder->rgb, FRAME_WIDTH, FRAME_HEIGHT, grid)) {
+			return job_fail(job, "fingerprint: %s", strerror(errno));
+		}
+		fingerprint_from_grid(grid, &job->fingerprint);
+	} else if (!fingerprint_bayer(decoder->bayer, FRAME_WIDTH, FRAME_HEIGHT,
+				      decoder->tile, &job->fingerprint)) {
+		return job_fail(job, "fingerprint: %s", strerror(errno));
+	}
+	return true;
+}
+
+
+static void *worker_main(void *arg) {
+	worker_t *worker = arg;
+	job_t *job;
+	while (0 != queue_take(&pending, &job, 1, true)) {
+		source_t source = {
+			.job = job,
+		};
+		bool ok = '\0' != job->share[0] ? stream_frames(worker, &source) : open_files(&source);
+		ok = ok && fingerprint_source(worker, &source);
+		close_source(&source);
+		if (ok) {
+			queue_push(&lookups, job);
+		} else {
+			job_done(job);
+		}
+	}
+	return NULL;
+}
+
+
+// look up everything fingerprinted since the last batch in one go
+static void *index_main(void *arg) {
+	job_t **jobs = malloc(batch_limit * sizeof(job_t *));
+	fingerprint_t *queries = malloc(batch_limit * sizeof(fingerprint_t));
+	fpindex_match_t *matches = malloc(batch_limit * MAX_NEAREST * sizeof(fpindex_match_t));
+	unsigned int *found = malloc(batch_limit * sizeof(unsigned int));
+	if (NULL == jobs || NULL == queries || NULL == matches || NULL == found) {
+		errno_exit("index thread malloc");
+	}
+
+	for (;;) {
+		const unsigned int n = queue_take(&lookups, jobs, batch_limit, true);
+		if (0 == n) {
+			break;
+		}
+		unsigned int k = 1;
+		for (unsigned int i = 0; i < n; ++i) {
+			queries[i] = jobs[i]->fingerprint;
+			k = jobs[i]->k > k ? jobs[i]->k : k;
+		}
+		// threads only pay for themselves on big batches
+		unsigned int threads = (n + 15) / 16;
+		threads = threads > n_workers ? n_workers : threads;
+		const bool ok = fpindex_nearest_batch(&database, queries, n, k, matches, found, threads);
+		__atomic_fetch_add(&batches, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&batched, n, __ATOMIC_RELAXED);
+		for (unsigned int i = 0; i < n; ++i) {
+			job_t *job = jobs[i];
+			if (!ok) {
+				job_fail(job, "index: %s", strerror(errno));
+			} else {
+				job->found = found[i] < job->k ? found[i] : job->k;
+				memcpy(job->matches, &matches[i * k], job->found * sizeof(fpindex_match_t));
+			}
+			job_done(job);
+		}
+	}
+
+	free(jobs);
+	free(queries);
+	free(matches);
+	free(found);
+	return NULL;
+}
+
+
+// send one reply line, a client that cannot take it is dropped later
+static void reply(client_t *client, const char *format, ...) {
+	char buffer[MAX_LINE * 2];
+	va_list ap;
+	va_start(ap, format);
+	int n = vsnprintf(buffer, sizeof(buffer) - 1, format, ap);
+	va_end(ap);
+	if (n < 0) {
+		return;
+	}
+	if (n > sizeof(buffer) - 2) {
+		n = sizeof(buffer) - 2;
+	}
+	buffer[n++] = '\n';
+	if (-1 == send(client->fd, buffer, n, MSG_NOSIGNAL | MSG_DONTWAIT)) {
+		fprintf(stderr, "client %d: send error %d, %s\n", client->fd, errno, strerror(errno));
+	}
+}
+
+
+// answer a finished job if its client is still connected, then free it
+static void job_answer(job_t *job) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	const double ms = elapsed_ms(&job->received, &now);
+	latency_record(&latency, ms);
+	--outstanding;
+
+	client_t *client = job->client;
+	const bool connected = -1 != client->fd && job->serial == client->serial;
+	if ('\0' != job->error[0]) {
+		++failed;
+		if (connected) {
+			reply(client, "error %s", job->error);
+		}
+		if (verbose > 0) {
+			fprintf(stderr, "%s: error %s\n", job->input[0] ? job->input : job->share, job->error);
+		}
+		free(job);
+		return;
+	}
+	++completed;
+	if (connected) {
+		char steps[16] = "-";
+		if (job->steps >= 0) {
+			snprintf(steps, sizeof(steps), "%d", job->steps);
+		}
+		char peak[32] = "";
+		if (job->peak >= 0) {
+			snprintf(peak, sizeof(peak), " peak=%.3f", job->peak);
+		}
+		char distance[16] = "-";
+		double confidence = 0;
+		if (job->found > 0) {
+			const unsigned int d = job->matches[0].distance;
+			snprintf(distance, sizeof(distance), "%u", d);
+			const double expected = database.count * chance[d];
+			confidence = expected < 1 ? 1 - expected : 0;
+		}
+		char matches[MAX_NEAREST * 24] = "";
+		size_t length = 0;
+		for (unsigned int i = 0; i < job->found && length < sizeof(matches); ++i) {
+			length += snprintf(matches + length, sizeof(matches) - length, "%s%u:%u",
+					   0 == i ? "" : ",", job->matches[i].id, job->matches[i].distance);
+		}
+		reply(client, "ok frame=%llu steps=%s%s distance=%s confidence=%.6f ms=%.1f matches=%s",
+		      (unsigned long long)job->frame, steps, peak, distance, confidence, ms, matches);
+	}
+	free(job);
+}
+
+
+static bool parse_number(const char *s, long *value) {
+	char *end;
+	errno = 0;
+	*value = strtol(s, &end, 0);
+	return 0 == errno && end != s && '\0' == *end;
+}
+
+// parse the words following "verify" into a new job
+static job_t *parse_verify(client_t *client, char *words) {
+	job_t *job = calloc(1, sizeof(job_t));
+	if (NULL == job) {
+		reply(client, "error out of memory");
+		return NULL;
+	}
+	job->client = client;
+	job->serial = client->serial;
+	job->k = default_nearest;
+	job->fuse = default_fuse;
+	job->frames = DEFAULT_STREAM_FRAMES;
+
+	char *save = NULL;
+	for (char *word = strtok_r(words, " \t", &save); NULL != word; word = strtok_r(NULL, " \t", &save)) {
+		char *value = strchr(word, '=');
+		if (NULL == value) {
+			reply(client, "error expected key=value: '%s'", word);
+			free(job);
+			return NULL;
+		}
+		*value++ = '\0';
+
+		char *path = 0 == strcmp(word, "input") ? job->input : 0 == strcmp(word, "share") ? job->share : NULL;
+		if (NULL != path) {
+			if ('\0' == *value || strlcpy(path, value, MAX_LINE) >= MAX_LINE) {
+				reply(client, "error invalid %s", word);
+				free(job);
+				return NULL;
+			}
+			continue;
+		}
+
+		long n;
+		if (!parse_number(value, &n)) {
+			reply(client, "error invalid number: %s=%s", word, value);
+			free(job);
+			return NULL;
+		}
+		if (0 == strcmp(word, "k") && n > 0 && n <= MAX_NEAREST) {
+			job->k = n;
+		} else if (0 == strcmp(word, "fuse") && n > 0) {
+			job->fuse = n;
+		} else if (0 == strcmp(word, "frames") && n > 0 && n <= MAX_STREAM_FRAMES) {
+			job->frames = n;
+		} else {
+			reply(client, "error invalid parameter: %s=%s", word, value);
+			free(job);
+			return NULL;
+		}
+	}
+
+	if (('\0' == job->input[0]) == ('\0' == job->share[0])) {
+		reply(client, "error expected one of input=PATH or share=PATH");
+		free(job);
+		return NULL;
+	}
+	return job;
+}
+
+static void handle_line(client_t *client, char *line) {
+	char *save = NULL;
+	char *command = strtok_r(line, " \t", &save);
+	char *rest = strtok_r(NULL, "", &save);
+
+	if (NULL == command) {
+		return;
+	}
+
+	if (0 == strcmp(command, "verify")) {
+		++requests;
+		if (outstanding >= queue_limit) {
+			++rejected;
+			reply(client, "error busy: %u requests outstanding", outstanding);
+			return;
+		}
+		job_t *job = parse_verify(client, NULL == rest ? "" : rest);
+		if (NULL == job) {
+			++rejected;
+			return;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &job->received);
+		++outstanding;
+		queue_push(&pending, job);
+	} else if (0 == strcmp(command, "stats")) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		const double seconds = elapsed_ms(&started, &now) / 1e3;
+		latency_summary_t s;
+		latency_summary(&latency, &s);
+		reply(client, "ok requests=%llu completed=%llu failed=%llu rejected=%llu outstanding=%u"
+		      " batches=%llu batched=%llu frames=%llu rate=%.2f"
+		      " mean=%.1f p50=%.1f p90=%.1f p99=%.1f max=%.1f",
+		      (unsigned long long)requests, (unsigned long long)completed,
+		      (unsigned long long)failed, (unsigned long long)rejected, outstanding,
+		      (unsigned long long)__atomic_load_n(&batches, __ATOMIC_RELAXED),
+		      (unsigned long long)__atomic_load_n(&batched, __ATOMIC_RELAXED),
+		      (unsigned long long)__atomic_load_n(&frames, __ATOMIC_RELAXED),
+		      seconds > 0 ? completed / seconds : 0.0,
+		      s.mean, s.p50, s.p90, s.p99, s.max);
+	} else if (0 == strcmp(command, "quit")) {
+		reply(client, "ok");
+		quit = 1;
+	} else {
+		reply(client, "error unknown command: '%s'", command);
+	}
+}
+
+
+// jobs still queued or running keep their client pointer, the serial
+// tells them the connection has gone
+static void close_client(int epfd, client_t *client) {
+	epoll_ctl(epfd, EPOLL_CTL_DEL, client->fd, NULL);
+	close(client->fd);
+	client->fd = -1;
+}
+
+// read from a client and act on each complete line
+static void client_input(int epfd, client_t *client) {
+	char buffer[MAX_LINE];
+	ssize_t n = recv(client->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+
+	if (-1 == n && (EAGAIN == errno || EINTR == errno)) {
+		return;
+	}
+	if (n <= 0) {
+		close_client(epfd, client);
+		return;
+	}
+
+	for (ssize_t i = 0; i < n; ++i) {
+		char c = buffer[i];
+		if ('\n' != c) {
+			if (client->length < sizeof(client->line) - 1) {
+				client->line[client->length++] = c;
+			} else {
+				client->overflow = true;
+			}
+			continue;
+		}
+		if (client->length > 0 && '\r' == client->line[client->length - 1]) {
+			--client->length;
+		}
+		client->line[client->length] = '\0';
+		if (client->overflow) {
+			reply(client, "error line too long");
+		} else {
+			handle_line(client, client->line);
+		}
+		client->length = 0;
+		client->overflow = false;
+	}
+}
+
+static void accept_client(int epfd, int listen_fd) {
+	int fd = accept(listen_fd, NULL, NULL);
+	if (-1 == fd) {
+		return;
+	}
+
+	client_t *client = NULL;
+	for (int i = 0; i < MAX_CLIENTS; ++i) {
+		if (-1 == clients[i].fd) {
+			client = &clients[i];
+			break;
+		}
+	}
+	if (NULL == client) {
+		const char *busy = "error too many clients\n";
+		send(fd, busy, strlen(busy), MSG_NOSIGNAL | MSG_DONTWAIT);
+		close(fd);
+		return;
+	}
+
+	CLEAR(*client);
+	client->fd = fd;
+	client->serial = ++serials;
+
+	struct epoll_event ev;
+	CLEAR(ev);
+	ev.events = EPOLLIN;
+	ev.data.ptr = client;
+	if (-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		errno_exit("epoll_ctl");
+	}
+}
+
+
+// answer everything the workers and the index have finished
+static void answer_done(void) {
+	uint64_t count;
+	if (-1 == read(done_fd, &count, sizeof(count)) && EAGAIN != errno) {
+		errno_exit("eventfd read");
+	}
+	job_t *job;
+	while (0 != queue_take(&done, &job, 1, false)) {
+		job_answer(job);
+	}
+}
+
+
+static int listen_socket(const char *path) {
+	struct sockaddr_un address;
+	CLEAR(address);
+	address.sun_family = AF_UNIX;
+	if (strlcpy(address.sun_path, path, sizeof(address.sun_path)) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "socket path too long: '%s'\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (-1 == fd) {
+		errno_exit("socket");
+	}
+	unlink(path);  // left over from a previous run
+	if (-1 == bind(fd, (struct sockaddr *)&address, sizeof(address))) {
+		errno_exit(path);
+	}
+	if (-1 == listen(fd, MAX_CLIENTS)) {
+		errno_exit("listen");
+	}
+	return fd;
+}
+
+
+static void mainloop(int listen_fd) {
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (-1 == epfd) {
+		errno_exit("epoll_create1");
+	}
+
+	struct epoll_event ev;
+	CLEAR(ev);
+	ev.events = EPOLLIN;
+	ev.data.ptr = &listen_fd;
+	if (-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev)) {
+		errno_exit("epoll_ctl");
+	}
+	CLEAR(ev);
+	ev.events = EPOLLIN;
+	ev.data.ptr = &done_fd;
+	if (-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, done_fd, &ev)) {
+		errno_exit("epoll_ctl");
+	}
+
+	while (!quit) {
+		struct epoll_event events[MAX_CLIENTS + 2];
+		int n = epoll_wait(epfd, events, MAX_CLIENTS + 2, 1000);
+
+		if (-1 == n) {
+			if (EINTR == errno) {
+				continue;
+			}
+			errno_exit("epoll_wait");
+		}
+
+		for (int i = 0; i < n; ++i) {
+			void *p = events[i].data.ptr;
+			if (&listen_fd == p) {
+				accept_client(epfd, listen_fd);
+			} else if (&done_fd == p) {
+				answer_done();
+			} else {
+				client_t *client = p;
+				if (-1 != client->fd) {
+					client_input(epfd, client);
+				}
+			}
+		}
+	}
+
+	// refuse what no worker has started, let the rest finish
+	job_t *job;
+	while (0 != queue_take(&pending, &job, 1, false)) {
+		job_fail(job, "shutting down");
+		job_answer(job);
+	}
+	queue_close(&pending);
+	for (unsigned int i = 0; i < n_workers; ++i) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	queue_close(&lookups);
+	pthread_join(index_thread, NULL);
+	while (0 != queue_take(&done, &job, 1, false)) {
+		job_answer(job);
+	}
+
+	for (int i = 0; i < MAX_CLIENTS; ++i) {
+		if (-1 != clients[i].fd) {
+			close(clients[i].fd);
+			clients[i].fd = -1;
+		}
+	}
+	close(epfd);
+}
+
+
+// print usage message and exit
+static void usage(const char *message, ...) {
+	if (NULL != message) {
+		va_list ap;
+		va_start(ap, message);
+		fprintf(stderr, "error: ");
+		vfprintf(stderr, message, ap);
+		fprintf(stderr, "\n");
+		va_end(ap);
+	}
+	fprintf(stderr,
+		"Usage: %s [options]\n\n"
+		"Options:\n"
+		"-h | --help          Print this message\n"
+		"-v | --verbose       Print failed requests\n"
+		"-k | --socket path   Unix domain socket for requests [%s]\n"
+		"-s | --store F       Database is fingerprint store F\n"
+		"-i | --index F       Database is fingerprint index F, ids are lines\n"
+		"                     of the fingerprints it was built from\n"
+		"-m | --substrings N  Index substrings for a store, 8, 16 or 32 [%d]\n"
+		"-j | --jobs N        Workers [one per processor]\n"
+		"-q | --queue N       Requests waiting or in progress before more\n"
+		"                     are refused [%d]\n"
+		"-b | --batch N       Most fingerprints in one index lookup [%d]\n"
+		"-n | --nearest K     Matches to return unless a request sets k [%d]\n"
+		"-f | --fuse K        Frames to fuse unless a request sets fuse [%d]\n"
+		"-e | --embed N       Embedded data pixel offset [%d]\n"
+		"-r | --rgb           Demosaic and hash the luma, as create-fingerprint -r\n"
+		"-a | --align F       Register to the first frame of capture file F,\n"
+		"                     as create-fingerprint -a\n"
+		"-t | --rotation      Estimate rotation as well when aligning\n"
+		"",
+		program_name, DEFAULT_SOCKET, FPINDEX_DEFAULT_SUBSTRINGS, DEFAULT_QUEUE, DEFAULT_BATCH,
+		DEFAULT_NEAREST, FUSION_DEFAULT_FRAMES, EMBED_DEFAULT_OFFSET);
+	exit(EXIT_FAILURE);
+}
+
+
+static const char short_options[] = "hvk:s:i:m:j:q:b:n:f:e:ra:t";
+
+static const struct option
+long_options[] = {
+	{ "help",       no_argument,       NULL, 'h' },
+	{ "verbose",    no_argument,       NULL, 'v' },
+	{ "socket",     required_argument, NULL, 'k' },
+	{ "store",      required_argument, NULL, 's' },
+	{ "index",      required_argument, NULL, 'i' },
+	{ "substrings", required_argument, NULL, 'm' },
+	{ "jobs",       required_argument, NULL, 'j' },
+	{ "queue",      required_argument, NULL, 'q' },
+	{ "batch",      required_argument, NULL, 'b' },
+	{ "nearest",    required_argument, NULL, 'n' },
+	{ "fuse",       required_argument, NULL, 'f' },
+	{ "embed",      required_argument, NULL, 'e' },
+	{ "rgb",        no_argument,       NULL, 'r' },
+	{ "align",      required_argument, NULL, 'a' },
+	{ "rotation",   no_argument,       NULL, 't' },
+	{ 0, 0, 0, 0 }
+};
+
+
+static unsigned long number(const char *name, const char *text, unsigned long low, unsigned long high) {
+	errno = 0;
+	char *end;
+	unsigned long n = strtoul(text, &end, 0);
+	if (0 != errno || end == text || '\0' != *end || n < low || n > high) {
+		usage("invalid %s '%s', %lu to %lu", name, text, low, high);
+	}
+	return n;
+}
+
+
+// every fingerprint of the store, with the record numbers as ids
+static void index_store(const char *name, unsigned int substrings) {
+	fpstore_t store;
+	if (!fpstore_open(&store, name, false, false)) {
+		usage("failed to open store: '%s': %s error %d, %s", name, store.error, errno, strerror(errno));
+	}
+	if (!fpindex_init(&database, substrings)) {
+		usage("failed to create index: %s error %d, %s", database.error, errno, strerror(errno));
+	}
+	for (uint64_t i = 0; i < store.count;) {
+		uint64_t n;
+		const fingerprint_t *fingerprints = fpstore_fingerprints(&store, i, &n);
+		for (uint64_t j = 0; j < n; ++j) {
+			if (!fpindex_add(&database, &fingerprints[j], NULL)) {
+				usage("failed to index: %s error %d, %s", database.error, errno, strerror(errno));
+			}
+		}
+		i += n;
+	}
+	fpstore_close(&store);
+	if (!fpindex_build(&database)) {
+		usage("failed to build index: %s error %d, %s", database.error, errno, strerror(errno));
+	}
+}
+
+
+// binomial distribution of the distance between unrelated fingerprints
+static void chance_init(void) {
+	double cumulative = 0;
+	for (int d = 0; d <= FINGERPRINT_BITS; ++d) {
+		cumulative += exp(lgamma(FINGERPRINT_BITS + 1) - lgamma(d + 1) - lgamma(FINGERPRINT_BITS - d + 1)
+				  - FINGERPRINT_BITS * log(2));
+		chance[d] = cumulative;
+	}
+}
+
+
+int main(int argc, char **argv) {
+	program_name = argv[0];
+
+	const char *socket_name = DEFAULT_SOCKET;
+	const char *store_name = NULL;
+	const char *index_name = NULL;
+	const char *align_name = NULL;
+	unsigned int substrings = FPINDEX_DEFAULT_SUBSTRINGS;
+	bool rotation = false;
+
+	for (;;) {
+		int idx = 0;
+		int c = getopt_long(argc, argv, short_options, long_options, &idx);
+
+		if (-1 == c) {
+			break;
+		}
+
+		switch (c) {
+		case 0: // getopt_long() flag
+			break;
+
+		case 'h':
+			usage(NULL);
+
+		case 'v':
+			++verbose;
+			break;
+
+		case 'k':
+			socket_name = optarg;
+			break;
+
+		case 's':
+			store_name = optarg;
+			break;
+
+		case 'i':
+			index_name = optarg;
+			break;
+
+		case 'm':
+			substrings = number("substrings", optarg, 8, 32);
+			if (8 != substrings && 16 != substrings && 32 != substrings) {
+				usage("invalid substrings '%s', 8, 16 or 32", optarg);
+			}
+			break;
+
+		case 'j':
+			n_workers = number("jobs", optarg, 1, MAX_JOBS);
+			break;
+
+		case 'q':
+			queue_limit = number("queue", optarg, 1, UINT32_MAX);
+			break;
+
+		case 'b':
+			batch_limit = number("batch", optarg, 1, MAX_BATCH);
+			break;
+
+		case 'n':
+			default_nearest = number("nearest", optarg, 1, MAX_NEAREST);
+			break;
+
+		case 'f':
+			default_fuse = number("fuse", optarg, 1, UINT32_MAX);
+			break;
+
+		case 'e':
+			embed_offset = number("embed offset", optarg, 0, FRAME_WIDTH * FRAME_HEIGHT - EMBED_NIBBLES);
+			break;
+
+		case 'r':
+			rgb = true;
+			break;
+
+		case 'a':
+			align_name = optarg;
+			break;
+
+		case 't':
+			rotation = true;
+			break;
+
+		default:
+			usage("invalid option: '%c'", c);
+		}
+	}
+
+	if (optind < argc) {
+		usage("unexpected argument: '%s'", argv[optind]);
+	}
+	if ((NULL == store_name) == (NULL == index_name)) {
+		usage("expected one of --store or --index");
+	}
+	if (NULL != align_name && rgb) {
+		usage("--align works on the raw green sites, not with --rgb");
+	}
+
+	for (int i = 0; i < MAX_CLIENTS; ++i) {
+		clients[i].fd = -1;
+	}
+	chance_init();
+
+	// all setup cost is paid once here rather than per request
+	if (NULL != store_name) {
+		index_store(store_name, substrings);
+	} else if (!fpindex_load(&database, index_name)) {
+		usage("failed to load index: '%s': %s error %d, %s",
+		      index_name, database.error, errno, strerror(errno));
+	}
+
+	if (0 == n_workers) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		n_workers = n < 1 ? 1 : n > MAX_JOBS ? MAX_JOBS : n;
+	}
+	uint16_t *reference = NULL;
+	if (NULL != align_name) {
+		reference = malloc(FRAME_WIDTH * FRAME_HEIGHT * sizeof(uint16_t));
+		framefile_t file;
+		if (NULL == reference
+		    || !framefile_open(&file, align_name, FRAME_WIDTH, FRAME_HEIGHT)
+		    || !framefile_read(&file, 0, reference)) {
+			usage("failed to read reference: '%s': %d, %s", align_name, errno, strerror(errno));
+		}
+		framefile_close(&file);
+		align = true;
+	}
+	// only the buffers are used
+	decode_options_t options = { 0 };
+	for (unsigned int i = 0; i < n_workers; ++i) {
+		worker_t *worker = &workers[i];
+		if (!decode_init(&worker->decoder, FRAME_WIDTH, FRAME_HEIGHT, &options)) {
+			usage("failed to create decoder: %s error %d, %s",
+			      worker->decoder.error, errno, strerror(errno));
+		}
+		if (!fusion_init(&worker->fusion, FRAME_WIDTH, FRAME_HEIGHT)) {
+			usage("failed to create fusion: %s error %d, %s",
+			      worker->fusion.error, errno, strerror(errno));
+		}
+		if (align && (!registration_init(&worker->registration, FRAME_WIDTH, FRAME_HEIGHT,
+						 worker->decoder.tile, REGISTRATION_DEFAULT_BIN, rotation)
+			      || !registration_reference(&worker->registration, reference))) {
+			usage("failed to create registration: %s error %d, %s",
+			      worker->registration.error, errno, strerror(errno));
+		}
+	}
+	free(reference);
+
+	queue_init(&pending);
+	queue_init(&lookups);
+	queue_init(&done);
+	done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (-1 == done_fd) {
+		errno_exit("eventfd");
+	}
+	latency_init(&latency);
+
+	struct sigaction action;
+	CLEAR(action);
+	action.sa_handler = quit_handler;
+	sigemptyset(&action.sa_mask);
+	if (-1 == sigaction(SIGINT, &action, NULL) || -1 == sigaction(SIGTERM, &action, NULL)) {
+		errno_exit("sigaction");
+	}
+
+	for (unsigned int i = 0; i < n_workers; ++i) {
+		int rc = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+		if (0 != rc) {
+			fprintf(stderr, "pthread_create error %d, %s\n", rc, strerror(rc));
+			exit(EXIT_FAILURE);
+		}
+	}
+	int rc = pthread_create(&index_thread, NULL, index_main, NULL);
+	if (0 != rc) {
+		fprintf(stderr, "pthread_create error %d, %s\n", rc, strerror(rc));
+		exit(EXIT_FAILURE);
+	}
+
+	int listen_fd = listen_socket(socket_name);
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	fprintf(stderr, "%s: %llu fingerprints, %u workers, ready on %s\n", program_name,
+		(unsigned long long)database.count, n_workers, socket_name);
+
+	mainloop(listen_fd);
+
+	close(listen_fd);
+	unlink(socket_name);
+	close(done_fd);
+
+	for (unsigned int i = 0; i < n_workers; ++i) {
+		worker_t *worker = &workers[i];
+		decode_free(&worker->decoder);
+		fusion_free(&worker->fusion);
+		registration_free(&worker->registration);
+		for (int j = 0; j < MAX_STREAM_FRAMES; ++j) {
+			free(worker->stream[j]);
+		}
+	}
+	fpindex_free(&database);
+	return EXIT_SUCCESS;
+}
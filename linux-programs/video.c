@@ -0,0 +1,845 @@
+// V4L2 video device handling shared by the capture programs
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+
+#include <linux/memfd.h>
+
+#include <linux/videodev2.h>
+
+#include "video.h"
+#include "video_source.h"
+
+
+#define CLEAR(x) memset(&(x), 0, sizeof(x))
+
+// frames being filled and being processed on top of the latency
+#define SPARE_BUFFERS 2
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+#define ROUND_UP(n, a) (((n) + (a) - 1) / (a) * (a))
+
+
+bool video_fail(video_device_t *dev, const char *operation) {
+	dev->error = operation;
+	return false;
+}
+
+bool video_fail_errno(video_device_t *dev, const char *operation, int error) {
+	errno = error;
+	return video_fail(dev, operation);
+}
+
+
+bool video_open(video_device_t *dev, const char *name, video_io_t io) {
+	struct stat st;
+
+	memset(dev, 0, sizeof(*dev));
+	dev->name = name;
+	dev->fd = -1;
+	dev->io = io;
+	dev->rate = VIDEO_DEFAULT_RATE;
+	dev->latency_ms = VIDEO_DEFAULT_LATENCY;
+
+	if (0 == strcmp(name, VIDEO_SYNTHETIC_NAME)) {
+		dev->source = &video_synthetic_source;
+	} else if (-1 == stat(name, &st)) {
+		return video_fail(dev, "cannot identify device");
+	} else if (S_ISREG(st.st_mode)) {
+		dev->source = &video_replay_source;
+	} else {
+		dev->source = &video_v4l2_source;
+	}
+	return dev->source->open(dev);
+}
+
+bool video_init(video_device_t *dev, video_format_t format) {
+	return dev->source->init(dev, format);
+}
+
+bool video_start(video_device_t *dev) {
+	if (!dev->source->start(dev)) {
+		return false;
+	}
+	dev->streaming = true;
+	return true;
+}
+
+bool video_stop(video_device_t *dev) {
+	if (!dev->streaming) {
+		return true;
+	}
+	dev->streaming = false;
+	return dev->source->stop(dev);
+}
+
+int video_dequeue(video_device_t *dev, video_frame_t *frame) {
+	memset(frame, 0, sizeof(*frame));
+	return dev->source->dequeue(dev, frame);
+}
+
+bool video_export(video_device_t *dev) {
+	return dev->source->export(dev);
+}
+
+bool video_requeue(video_device_t *dev, video_frame_t *frame) {
+	if (!dev->source->requeue(dev, frame)) {
+		return false;
+	}
+	frame->data = NULL;
+	return true;
+}
+
+void video_uninit(video_device_t *dev) {
+	if (NULL != dev->source) {
+		dev->source->uninit(dev);
+	}
+}
+
+void video_close(video_device_t *dev) {
+	if (NULL != dev->source) {
+		dev->source->close(dev);
+	}
+	if (-1 != dev->fd) {
+		close(dev->fd);
+		dev->fd = -1;
+	}
+}
+
+int video_control_fd(const video_device_t *dev) {
+	return dev->source->controls ? dev->fd : -1;
+}
+
+const char *video_source_name(const video_device_t *dev) {
+	return dev->source->name;
+}
+
+
+void video_timestamp(struct timeval *tv) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	tv->tv_sec = ts.tv_sec;
+	tv->tv_usec = ts.tv_nsec / 1000;
+}
+
+bool video_pace_open(video_device_t *dev) {
+	dev->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (-1 == dev->fd) {
+		return video_fail(dev, "timerfd_create");
+	}
+	return true;
+}
+
+bool video_pace_start(video_device_t *dev) {
+	struct itimerspec period;
+	CLEAR(period);
+	if (0 == dev->rate) {
+		period.it_interval.tv_nsec = 1;  // always expired
+	} else if (1 == dev->rate) {
+		period.it_interval.tv_sec = 1;
+	} else {
+		period.it_interval.tv_nsec = 1000000000L / dev->rate;
+	}
+	period.it_value = period.it_interval;
+	if (-1 == timerfd_settime(dev->fd, 0, &period, NULL)) {
+		return video_fail(dev, "timerfd_settime");
+	}
+	return true;
+}
+
+bool video_pace_stop(video_device_t *dev) {
+	struct itimerspec off;
+	CLEAR(off);
+	if (-1 == timerfd_settime(dev->fd, 0, &off, NULL)) {
+		return video_fail(dev, "timerfd_settime");
+	}
+	return true;
+}
+
+int64_t video_pace_wait(video_device_t *dev) {
+	uint64_t expirations = 0;
+	if (-1 == read(dev->fd, &expirations, sizeof(expirations))) {
+		if (EAGAIN == errno) {
+			return 0;
+		}
+		video_fail(dev, "timerfd read");
+		return -1;
+	}
+	return 0 == dev->rate ? 1 : expirations;
+}
+
+void video_pace_frame(video_device_t *dev, video_frame_t *frame, int64_t periods) {
+	// missed timer periods look like dropped frames
+	dev->sequence += periods;
+	frame->sequence = dev->sequence - 1;
+	frame->flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+	video_timestamp(&frame->timestamp);
+}
+
+
+unsigned int video_latency_buffers(const video_device_t *dev, unsigned int fps) {
+	if (0 != dev->buffer_count) {
+		return dev->buffer_count;
+	}
+	unsigned int count = (fps * dev->latency_ms + 999) / 1000 + SPARE_BUFFERS;
+	return count > VIDEO_MAX_FRAME ? VIDEO_MAX_FRAME : count;
+}
+
+bool video_pool_init(video_device_t *dev, size_t size) {
+	unsigned int count = video_latency_buffers(dev, 0 == dev->rate ? VIDEO_DEFAULT_RATE : dev->rate);
+
+	dev->buffers = calloc(count, sizeof(*dev->buffers));
+	if (NULL == dev->buffers) {
+		return video_fail_errno(dev, "out of memory", ENOMEM);
+	}
+
+	for (dev->n_buffers = 0; dev->n_buffers < count; ++dev->n_buffers) {
+		video_buffer_t *b = &dev->buffers[dev->n_buffers];
+		b->export_fd = syscall(SYS_memfd_create, "video-buffer", MFD_CLOEXEC);
+		if (-1 == b->export_fd) {
+			return video_fail(dev, "memfd_create");
+		}
+		if (-1 == ftruncate(b->export_fd, size)) {
+			close(b->export_fd);
+			return video_fail(dev, "ftruncate");
+		}
+		b->start = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, b->export_fd, 0);
+		if (MAP_FAILED == b->start) {
+			close(b->export_fd);
+			return video_fail(dev, "mmap");
+		}
+		b->length = size;
+		b->queued = true;
+	}
+	return true;
+}
+
+void video_pool_uninit(video_device_t *dev) {
+	for (unsigned int i = 0; i < dev->n_buffers; ++i) {
+		munmap(dev->buffers[i].start, dev->buffers[i].length);
+		close(dev->buffers[i].export_fd);
+	}
+	free(dev->buffers);
+	dev->buffers = NULL;
+	dev->n_buffers = 0;
+}
+
+int video_pool_take(video_device_t *dev) {
+	for (unsigned int i = 0; i < dev->n_buffers; ++i) {
+		if (dev->buffers[i].queued) {
+			dev->buffers[i].queued = false;
+			return i;
+		}
+	}
+	return -1;
+}
+
+bool video_pool_requeue(video_device_t *dev, video_frame_t *frame) {
+	if (frame->index >= dev->n_buffers) {
+		return video_fail_errno(dev, "requeue", EINVAL);
+	}
+	dev->buffers[frame->index].queued = true;
+	return true;
+}
+
+bool video_pool_export(video_device_t *dev) {
+	return true;  // memfds from the start
+}
+
+
+// V4L2 device
+
+static int xioctl(int fh, int request, void *arg) {
+	int r;
+
+	do {
+		r = ioctl(fh, request, arg);
+	} while (-1 == r && EINTR == errno);
+
+	return r;
+}
+
+
+static bool v4l2_open(video_device_t *dev) {
+	struct stat st;
+
+	if (-1 == stat(dev->name, &st)) {
+		return video_fail(dev, "cannot identify device");
+	}
+	if (!S_ISCHR(st.st_mode)) {
+		return video_fail_errno(dev, "not a device", ENODEV);
+	}
+
+	dev->fd = open(dev->name, O_RDWR /* required */ | O_NONBLOCK | O_CLOEXEC, 0);
+
+	if (-1 == dev->fd) {
+		return video_fail(dev, "cannot open device");
+	}
+	return true;
+}
+
+static void v4l2_close(video_device_t *dev) {
+	// only the descriptor, closed by video_close()
+}
+
+
+static bool init_read(video_device_t *dev, unsigned int buffer_size) {
+	dev->buffers = calloc(1, sizeof(*dev->buffers));
+
+	if (!dev->buffers) {
+		return video_fail_errno(dev, "out of memory", ENOMEM);
+	}
+
+	dev->buffers[0].length = buffer_size;
+	dev->buffers[0].start = malloc(buffer_size);
+
+	if (!dev->buffers[0].start) {
+		return video_fail_errno(dev, "out of memory", ENOMEM);
+	}
+	dev->n_buffers = 1;
+	return true;
+}
+
+// buffers to cover the latency at the frame rate the driver reports
+static unsigned int buffer_count(video_device_t *dev) {
+	unsigned int fps = VIDEO_DEFAULT_RATE;
+	struct v4l2_streamparm parm;
+	CLEAR(parm);
+	parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (0 == xioctl(dev->fd, VIDIOC_G_PARM, &parm)) {
+		const struct v4l2_fract *tpf = &parm.parm.capture.timeperframe;
+		if (0 != tpf->numerator && 0 != tpf->denominator) {
+			fps = (tpf->denominator + tpf->numerator - 1) / tpf->numerator;
+		}
+	}
+
+	return video_latency_buffers(dev, fps);
+}
+
+// one anonymous mapping for all USERPTR buffers, each starting on a
+// huge page boundary when hugepages are wanted.  Explicit huge pages
+// need a reserved pool, otherwise transparent huge pages are asked for
+static bool init_arena(video_device_t *dev, size_t slot_size, unsigned int count) {
+	const int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE;
+	size_t size = slot_size * count;
+	void *p = MAP_FAILED;
+
+	if (dev->hugepages) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+		dev->arena_pages = "hugetlb";
+	}
+	if (MAP_FAILED == p && dev->hugepages) {
+		// align by hand, trimming the excess either side
+		uint8_t *q = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+				  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (MAP_FAILED == q) {
+			return video_fail(dev, "mmap arena");
+		}
+		uint8_t *aligned = (uint8_t *)ROUND_UP((uintptr_t)q, HUGE_PAGE_SIZE);
+		if (aligned != q) {
+			munmap(q, aligned - q);
+		}
+		munmap(aligned + size, q + HUGE_PAGE_SIZE - aligned);
+		p = aligned;
+
+		dev->arena_pages = 0 == madvise(p, size, MADV_HUGEPAGE) ? "thp" : "normal";
+		memset(p, 0, size);  // fault it in now rather than during capture
+	}
+	if (MAP_FAILED == p) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+		dev->arena_pages = "normal";
+		if (MAP_FAILED == p) {
+			return video_fail(dev, "mmap arena");
+		}
+	}
+	dev->arena = p;
+	dev->arena_size = size;
+	return true;
+}
+
+static bool init_mmap(video_device_t *dev) {
+	struct v4l2_requestbuffers req;
+
+	CLEAR(req);
+
+	req.count = buffer_count(dev);
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = V4L2_MEMORY_MMAP;
+
+	if (-1 == xioctl(dev->fd, VIDIOC_REQBUFS, &req)) {
+		if (EINVAL == errno) {
+			return video_fail(dev, "memory mapping not supported");
+		}
+		return video_fail(dev, "VIDIOC_REQBUFS");
+	}
+
+	if (req.count < 2) {
+		return video_fail_errno(dev, "insufficient buffer memory", ENOMEM);
+	}
+
+	dev->buffers = calloc(req.count, sizeof(*dev->buffers));
+
+	if (!dev->buffers) {
+		return video_fail_errno(dev, "out of memory", ENOMEM);
+	}
+
+	for (dev->n_buffers = 0; dev->n_buffers < req.count; ++dev->n_buffers) {
+		struct v4l2_buffer buf;
+
+		CLEAR(buf);
+
+		buf.type        = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory      = V4L2_MEMORY_MMAP;
+		buf.index       = dev->n_buffers;
+
+		if (-1 == xioctl(dev->fd, VIDIOC_QUERYBUF, &buf)) {
+			return video_fail(dev, "VIDIOC_QUERYBUF");
+		}
+
+		void *start =
+			mmap(NULL,                   // start anywhere
+			     buf.length,
+			     PROT_READ | PROT_WRITE, // required
+			     MAP_SHARED,             // recommended
+			     dev->fd, buf.m.offset);
+
+		if (MAP_FAILED == start) {
+			return video_fail(dev, "mmap");
+		}
+		dev->buffers[dev->n_buffers].length = buf.length;
+		dev->buffers[dev->n_buffers].start = start;
+		dev->buffers[dev->n_buffers].export_fd = -1;
+	}
+	return true;
+}
+
+static bool init_userp(video_device_t *dev, unsigned int buffer_size) {
+	struct v4l2_requestbuffers req;
+
+	CLEAR(req);
+
+	req.count  = buffer_count(dev);
+	req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = V4L2_MEMORY_USERPTR;
+
+	if (-1 == xioctl(dev->fd, VIDIOC_REQBUFS, &req)) {
+		if (EINVAL == errno) {
+			return video_fail(dev, "user pointer i/o not supported");
+		}
+		return video_fail(dev, "VIDIOC_REQBUFS");
+	}
+
+	dev->buffers = calloc(req.count, sizeof(*dev->buffers));
+
+	if (!dev->buffers) {
+		return video_fail_errno(dev, "out of memory", ENOMEM);
+	}
+
+	size_t slot_size = ROUND_UP(buffer_size, dev->hugepages ? HUGE_PAGE_SIZE : getpagesize());
+	if (!init_arena(dev, slot_size, req.count)) {
+		return false;
+	}
+
+	for (dev->n_buffers = 0; dev->n_buffers < req.count; ++dev->n_buffers) {
+		dev->buffers[dev->n_buffers].length = buffer_size;
+		dev->buffers[dev->n_buffers].start = (uint8_t *)dev->arena + dev->n_buffers * slot_size;
+	}
+	return true;
+}
+
+
+static bool v4l2_init(video_device_t *dev, video_format_t format) {
+	struct v4l2_capability cap;
+	struct v4l2_cropcap cropcap;
+	struct v4l2_crop crop;
+	struct v4l2_format fmt;
+	unsigned int min;
+
+	if (-1 == xioctl(dev->fd, VIDIOC_QUERYCAP, &cap)) {
+		if (EINVAL == errno) {
+			return video_fail(dev, "not a V4L2 device");
+		}
+		return video_fail(dev, "VIDIOC_QUERYCAP");
+	}
+
+	if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
+		return video_fail_errno(dev, "not a video capture device", ENODEV);
+	}
+
+	switch (dev->io) {
+	case VIDEO_IO_READ:
+		if (!(cap.capabilities & V4L2_CAP_READWRITE)) {
+			return video_fail_errno(dev, "read i/o not supported", EINVAL);
+		}
+		break;
+
+	case VIDEO_IO_MMAP:
+	case VIDEO_IO_USERPTR:
+		if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
+			return video_fail_errno(dev, "streaming i/o not supported", EINVAL);
+		}
+		break;
+	}
+
+
+	// Select video input, video standard and tune here
+
+
+	CLEAR(cropcap);
+
+	cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+	if (0 == xioctl(dev->fd, VIDIOC_CROPCAP, &cropcap)) {
+		crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		crop.c = cropcap.defrect; // reset to default
+
+		if (-1 == xioctl(dev->fd, VIDIOC_S_CROP, &crop)) {
+			switch (errno) {
+			case EINVAL:
+				// Cropping not supported
+				break;
+			default:
+				// Errors ignored
+				break;
+			}
+		}
+	} else {
+		// Errors ignored
+	}
+
+
+	CLEAR(fmt);
+
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	switch (format) {
+	case VIDEO_FORMAT_YUYV:
+		fmt.fmt.pix.width       = 640;
+		fmt.fmt.pix.height      = 480;
+		fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+		fmt.fmt.pix.field       = V4L2_FIELD_INTERLACED;
+
+		if (-1 == xioctl(dev->fd, VIDIOC_S_FMT, &fmt)) {
+			return video_fail(dev, "VIDIOC_S_FMT");
+		}
+		break;
+
+	case VIDEO_FORMAT_BAYER12:
+		fmt.fmt.pix.width       = VIDEO_WIDTH;
+		fmt.fmt.pix.height      = VIDEO_HEIGHT;
+		fmt.fmt.pix.field       = V4L2_PIX_FMT_SRGGB12;
+		fmt.fmt.pix.field       = V4L2_FIELD_ANY;
+
+		// Note VIDIOC_S_FMT may change width and height
+		if (-1 == xioctl(dev->fd, VIDIOC_S_FMT, &fmt)) {
+			return video_fail(dev, "VIDIOC_S_FMT 1080");
+		}
+		break;
+
+	case VIDEO_FORMAT_CURRENT:
+	default:
+		// Preserve original settings as set by v4l2-ctl for example
+		if (-1 == xioctl(dev->fd, VIDIOC_G_FMT, &fmt)) {
+			return video_fail(dev, "VIDIOC_G_FMT");
+		}
+	}
+
+	// Buggy driver paranoia
+	min = fmt.fmt.pix.width * 2;
+	if (fmt.fmt.pix.bytesperline < min) {
+		fmt.fmt.pix.bytesperline = min;
+	}
+	min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
+	if (fmt.fmt.pix.sizeimage < min) {
+		fmt.fmt.pix.sizeimage = min;
+	}
+
+	dev->width = fmt.fmt.pix.width;
+	dev->height = fmt.fmt.pix.height;
+	dev->frame_size = fmt.fmt.pix.sizeimage;
+
+	switch (dev->io) {
+	case VIDEO_IO_READ:
+		return init_read(dev, fmt.fmt.pix.sizeimage);
+
+	case VIDEO_IO_MMAP:
+		return init_mmap(dev);
+
+	case VIDEO_IO_USERPTR:
+		return init_userp(dev, fmt.fmt.pix.sizeimage);
+	}
+	return true;
+}
+
+
+static void v4l2_uninit(video_device_t *dev) {
+	unsigned int i;
+
+	if (NULL == dev->buffers) {
+		return;
+	}
+
+	switch (dev->io) {
+	case VIDEO_IO_READ:
+		free(dev->buffers[0].start);
+		break;
+
+	case VIDEO_IO_MMAP:
+		for (i = 0; i < dev->n_buffers; ++i) {
+			munmap(dev->buffers[i].start, dev->buffers[i].length);
+			if (-1 != dev->buffers[i].export_fd) {
+				close(dev->buffers[i].export_fd);
+			}
+		}
+		break;
+
+	case VIDEO_IO_USERPTR:
+		if (NULL != dev->arena) {
+			munmap(dev->arena, dev->arena_size);
+			dev->arena = NULL;
+		}
+		break;
+	}
+
+	free(dev->buffers);
+	dev->buffers = NULL;
+	dev->n_buffers = 0;
+}
+
+
+static bool v4l2_start(video_device_t *dev) {
+	unsigned int i;
+	enum v4l2_buf_type type;
+
+	switch (dev->io) {
+	case VIDEO_IO_READ:
+		// Nothing to do
+		break;
+
+	case VIDEO_IO_MMAP:
+		for (i = 0; i < dev->n_buffers; ++i) {
+			struct v4l2_buffer buf;
+
+			CLEAR(buf);
+			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			buf.memory = V4L2_MEMORY_MMAP;
+			buf.index = i;
+
+			if (-1 == xioctl(dev->fd, VIDIOC_QBUF, &buf)) {
+				return video_fail(dev, "VIDIOC_QBUF");
+			}
+		}
+		type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		if (-1 == xioctl(dev->fd, VIDIOC_STREAMON, &type)) {
+			return video_fail(dev, "VIDIOC_STREAMON");
+		}
+		break;
+
+	case VIDEO_IO_USERPTR:
+		for (i = 0; i < dev->n_buffers; ++i) {
+			struct v4l2_buffer buf;
+
+			CLEAR(buf);
+			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			buf.memory = V4L2_MEMORY_USERPTR;
+			buf.index = i;
+			buf.m.userptr = (unsigned long)dev->buffers[i].start;
+			buf.length = dev->buffers[i].length;
+
+			if (-1 == xioctl(dev->fd, VIDIOC_QBUF, &buf)) {
+				return video_fail(dev, "VIDIOC_QBUF");
+			}
+		}
+		type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		if (-1 == xioctl(dev->fd, VIDIOC_STREAMON, &type)) {
+			return video_fail(dev, "VIDIOC_STREAMON");
+		}
+		break;
+	}
+	return true;
+}
+
+
+static bool v4l2_stop(video_device_t *dev) {
+	enum v4l2_buf_type type;
+
+	switch (dev->io) {
+	case VIDEO_IO_READ:
+		// Nothing to do
+		break;
+
+	case VIDEO_IO_MMAP:
+	case VIDEO_IO_USERPTR:
+		type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		if (-1 == xioctl(dev->fd, VIDIOC_STREAMOFF, &type)) {
+			return video_fail(dev, "VIDIOC_STREAMOFF");
+		}
+		break;
+	}
+	return true;
+}
+
+
+static int v4l2_dequeue(video_device_t *dev, video_frame_t *frame) {
+	struct v4l2_buffer *buf = &frame->buf;
+	unsigned int i;
+
+	switch (dev->io) {
+	case VIDEO_IO_READ:
+		if (-1 == read(dev->fd, dev->buffers[0].start, dev->buffers[0].length)) {
+			switch (errno) {
+			case EAGAIN:
+				return 0;
+
+			case EIO:
+				// Could ignore EIO, see spec
+				// fall through
+
+			default:
+				video_fail(dev, "read");
+				return -1;
+			}
+		}
+
+		// read() has no buffer metadata so use the arrival time
+		frame->data = dev->buffers[0].start;
+		frame->bytesused = dev->buffers[0].length;
+		frame->index = 0;
+		frame->sequence = dev->sequence++;
+		frame->flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+		video_timestamp(&frame->timestamp);
+		return 1;
+
+	case VIDEO_IO_MMAP:
+		buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf->memory = V4L2_MEMORY_MMAP;
+
+		if (-1 == xioctl(dev->fd, VIDIOC_DQBUF, buf)) {
+			switch (errno) {
+			case EAGAIN:
+				return 0;
+
+			case EIO:
+				// Could ignore EIO, see spec
+				// fall through
+
+			default:
+				video_fail(dev, "VIDIOC_DQBUF");
+				return -1;
+			}
+		}
+
+		assert(buf->index < dev->n_buffers);
+
+		frame->data = dev->buffers[buf->index].start;
+		frame->index = buf->index;
+		break;
+
+	case VIDEO_IO_USERPTR:
+		buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf->memory = V4L2_MEMORY_USERPTR;
+
+		if (-1 == xioctl(dev->fd, VIDIOC_DQBUF, buf)) {
+			switch (errno) {
+			case EAGAIN:
+				return 0;
+
+			case EIO:
+				// Could ignore EIO, see spec
+				// fall through
+
+			default:
+				video_fail(dev, "VIDIOC_DQBUF");
+				return -1;
+			}
+		}
+
+		for (i = 0; i < dev->n_buffers; ++i) {
+			if (buf->m.userptr == (unsigned long)dev->buffers[i].start
+			    && buf->length == dev->buffers[i].length) {
+				break;
+			}
+		}
+
+		assert(i < dev->n_buffers);
+
+		frame->data = (void *)buf->m.userptr;
+		frame->index = i;
+		break;
+	}
+
+	frame->bytesused = buf->bytesused;
+	frame->sequence = buf->sequence;
+	frame->timestamp = buf->timestamp;
+	frame->flags = buf->flags;
+	return 1;
+}
+
+
+static bool v4l2_requeue(video_device_t *dev, video_frame_t *frame) {
+	switch (dev->io) {
+	case VIDEO_IO_READ:
+		break;
+
+	case VIDEO_IO_MMAP:
+	case VIDEO_IO_USERPTR:
+		if (-1 == xioctl(dev->fd, VIDIOC_QBUF, &frame->buf)) {
+			return video_fail(dev, "VIDIOC_QBUF");
+		}
+		break;
+	}
+	return true;
+}
+
+
+static bool v4l2_export(video_device_t *dev) {
+	if (VIDEO_IO_MMAP != dev->io) {
+		return video_fail_errno(dev, "export needs memory mapped buffers", EINVAL);
+	}
+
+	for (unsigned int i = 0; i < dev->n_buffers; ++i) {
+		struct v4l2_exportbuffer expbuf;
+
+		if (-1 != dev->buffers[i].export_fd) {
+			continue;
+		}
+		CLEAR(expbuf);
+		expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		expbuf.index = i;
+		expbuf.flags = O_RDONLY | O_CLOEXEC;
+
+		if (-1 == xioctl(dev->fd, VIDIOC_EXPBUF, &expbuf)) {
+			return video_fail(dev, "VIDIOC_EXPBUF");
+		}
+		dev->buffers[i].export_fd = expbuf.fd;
+	}
+	return true;
+}
+
+
+const video_source_t video_v4l2_source = {
+	.name = "v4l2",
+	.controls = true,
+	.open = v4l2_open,
+	.init = v4l2_init,
+	.start = v4l2_start,
+	.stop = v4l2_stop,
+	.dequeue = v4l2_dequeue,
+	.requeue = v4l2_requeue,
+	.export = v4l2_export,
+	.uninit = v4l2_uninit,
+	.close = v4l2_close,
+};
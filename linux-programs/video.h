@@ -0,0 +1,115 @@
+// V4L2 video device handling shared by the capture programs
+
+#ifndef _VIDEO_H_
+#define _VIDEO_H_ 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/time.h>
+
+#include <linux/videodev2.h>
+
+// frame geometry of the microscope, also used by the replay and
+// synthetic sources
+#define VIDEO_WIDTH  1920
+#define VIDEO_HEIGHT 1080
+
+// default frames per second of the replay and synthetic sources
+#define VIDEO_DEFAULT_RATE 30
+
+// time the driver buffers can hold frames for while the program is
+// busy, sets the number of buffers unless it is given explicitly
+#define VIDEO_DEFAULT_LATENCY 500  // ms
+
+// device name that selects the synthetic Bayer generator, a regular
+// file selects replay of a capture file, anything else is V4L2
+#define VIDEO_SYNTHETIC_NAME "synthetic"
+
+// V4L2 buffer handling, ignored by the other sources
+typedef enum {
+	VIDEO_IO_READ,
+	VIDEO_IO_MMAP,
+	VIDEO_IO_USERPTR,
+} video_io_t;
+
+typedef enum {
+	VIDEO_FORMAT_CURRENT,  // as set by v4l2-ctl for example
+	VIDEO_FORMAT_YUYV,     // 640x480 YUYV
+	VIDEO_FORMAT_BAYER12,  // 1920x1080 Bayer12
+} video_format_t;
+
+typedef struct {
+	void *start;
+	size_t length;
+	int export_fd;            // dmabuf or memfd, -1 => not exported
+	bool queued;              // replay and synthetic: free to be filled
+} video_buffer_t;
+
+typedef struct video_source_s video_source_t;
+
+typedef struct {
+	const char *name;
+	const video_source_t *source;
+	int fd;                   // poll this for frames
+	video_io_t io;
+	video_buffer_t *buffers;
+	unsigned int n_buffers;
+	size_t frame_size;        // sizeimage
+	unsigned int width;
+	unsigned int height;
+	bool streaming;
+	const char *error;        // operation that failed, errno has the reason
+
+	// V4L2 streaming buffers, may be changed before video_init()
+	unsigned int buffer_count;  // 0 => enough for latency_ms of frames
+	unsigned int latency_ms;
+	bool hugepages;             // USERPTR buffers from 2 MB pages
+	void *arena;                // USERPTR buffers, one mapping
+	size_t arena_size;
+	const char *arena_pages;    // "hugetlb", "thp" or "normal"
+
+	// replay and synthetic sources
+	unsigned int rate;        // frames per second, 0 => as fast as possible
+	uint32_t sequence;        // next frame, also for read() i/o
+	void *state;              // source private data
+} video_device_t;
+
+// one dequeued frame, pass back to video_requeue() when finished
+typedef struct {
+	const void *data;
+	size_t bytesused;
+	uint32_t sequence;
+	struct timeval timestamp;
+	uint32_t flags;           // V4L2_BUF_FLAG_*
+	unsigned int index;       // of the buffer holding the data
+	struct v4l2_buffer buf;
+} video_frame_t;
+
+// all return false on failure with dev->error and errno set
+// dev->rate may be changed between video_open() and video_start(),
+// the buffer settings between video_open() and video_init()
+bool video_open(video_device_t *dev, const char *name, video_io_t io);
+bool video_init(video_device_t *dev, video_format_t format);
+bool video_start(video_device_t *dev);
+bool video_stop(video_device_t *dev);
+void video_uninit(video_device_t *dev);
+void video_close(video_device_t *dev);
+
+// make each buffer available as a descriptor another process can map,
+// after video_init().  V4L2 needs MMAP i/o and uses VIDIOC_EXPBUF, the
+// replay and synthetic buffers are memfds.  The descriptors are in
+// dev->buffers[].export_fd and are closed by video_uninit()
+bool video_export(video_device_t *dev);
+
+// descriptor for control ioctls, -1 for sources without controls
+int video_control_fd(const video_device_t *dev);
+
+// "v4l2", "replay" or "synthetic"
+const char *video_source_name(const video_device_t *dev);
+
+// returns 1 for a frame, 0 if none is ready (EAGAIN) and -1 on error
+int video_dequeue(video_device_t *dev, video_frame_t *frame);
+bool video_requeue(video_device_t *dev, video_frame_t *frame);
+
+#endif
@@ -0,0 +1,127 @@
+// frame source replaying a capture file, wrapping round at the end
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "video.h"
+#include "video_source.h"
+
+
+typedef struct {
+	int file_fd;
+	off_t file_size;
+	off_t offset;
+} replay_t;
+
+
+static bool replay_open(video_device_t *dev) {
+	replay_t *r = calloc(1, sizeof(replay_t));
+	if (NULL == r) {
+		return video_fail_errno(dev, "out of memory", ENOMEM);
+	}
+	r->file_fd = -1;
+	dev->state = r;
+
+	r->file_fd = open(dev->name, O_RDONLY | O_CLOEXEC);
+	if (-1 == r->file_fd) {
+		return video_fail(dev, "cannot open file");
+	}
+
+	struct stat st;
+	if (-1 == fstat(r->file_fd, &st)) {
+		return video_fail(dev, "fstat");
+	}
+	r->file_size = st.st_size;
+	return video_pace_open(dev);
+}
+
+static void replay_close(video_device_t *dev) {
+	replay_t *r = dev->state;
+	if (NULL == r) {
+		return;
+	}
+	if (-1 != r->file_fd) {
+		close(r->file_fd);
+	}
+	free(r);
+	dev->state = NULL;
+}
+
+
+static bool replay_init(video_device_t *dev, video_format_t format) {
+	replay_t *r = dev->state;
+
+	// capture files carry no header, they are always full size Bayer
+	dev->width = VIDEO_WIDTH;
+	dev->height = VIDEO_HEIGHT;
+	dev->frame_size = 2 * VIDEO_WIDTH * VIDEO_HEIGHT;
+	if (r->file_size < dev->frame_size) {
+		return video_fail_errno(dev, "file is shorter than one frame", EINVAL);
+	}
+	return video_pool_init(dev, dev->frame_size);
+}
+
+static void replay_uninit(video_device_t *dev) {
+	video_pool_uninit(dev);
+}
+
+
+static int replay_dequeue(video_device_t *dev, video_frame_t *frame) {
+	replay_t *r = dev->state;
+	int64_t periods = video_pace_wait(dev);
+	if (periods <= 0) {
+		return periods;
+	}
+
+	if (r->offset + dev->frame_size > r->file_size) {
+		r->offset = 0;
+	}
+
+	int index = video_pool_take(dev);
+	if (index < 0) {
+		// every buffer is held, the frame is lost as a driver would
+		r->offset += dev->frame_size;
+		dev->sequence += periods;
+		return 0;
+	}
+	void *buffer = dev->buffers[index].start;
+
+	ssize_t n = pread(r->file_fd, buffer, dev->frame_size, r->offset);
+	if (n != dev->frame_size) {
+		if (n >= 0) {
+			errno = EIO;
+		}
+		dev->buffers[index].queued = true;
+		video_fail(dev, "file read");
+		return -1;
+	}
+	r->offset += dev->frame_size;
+
+	frame->data = buffer;
+	frame->bytesused = dev->frame_size;
+	frame->index = index;
+	video_pace_frame(dev, frame, periods);
+	return 1;
+}
+
+
+const video_source_t video_replay_source = {
+	.name = "replay",
+	.controls = false,
+	.open = replay_open,
+	.init = replay_init,
+	.start = video_pace_start,
+	.stop = video_pace_stop,
+	.dequeue = replay_dequeue,
+	.requeue = video_pool_requeue,
+	.export = video_pool_export,
+	.uninit = replay_uninit,
+	.close = replay_close,
+};
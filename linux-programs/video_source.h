@@ -0,0 +1,66 @@
+// frame source backends behind video.h, private to the video module
+
+#ifndef _VIDEO_SOURCE_H_
+#define _VIDEO_SOURCE_H_ 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/time.h>
+
+#include "video.h"
+
+struct video_source_s {
+	const char *name;
+	bool controls;           // accepts V4L2 controls
+	bool (*open)(video_device_t *dev);
+	bool (*init)(video_device_t *dev, video_format_t format);
+	bool (*start)(video_device_t *dev);
+	bool (*stop)(video_device_t *dev);
+	int (*dequeue)(video_device_t *dev, video_frame_t *frame);
+	bool (*requeue)(video_device_t *dev, video_frame_t *frame);
+	bool (*export)(video_device_t *dev);
+	void (*uninit)(video_device_t *dev);
+	void (*close)(video_device_t *dev);
+};
+
+extern const video_source_t video_v4l2_source;
+extern const video_source_t video_replay_source;
+extern const video_source_t video_synthetic_source;
+
+// record the failing operation, errno is left as the reason
+bool video_fail(video_device_t *dev, const char *operation);
+
+// as video_fail() for conditions that do not set errno
+bool video_fail_errno(video_device_t *dev, const char *operation, int error);
+
+// the monotonic clock as a V4L2 timestamp
+void video_timestamp(struct timeval *tv);
+
+// frame pacing for sources without hardware: dev->fd becomes a timer
+// firing at dev->rate, or continuously for a rate of zero
+bool video_pace_open(video_device_t *dev);
+bool video_pace_start(video_device_t *dev);
+bool video_pace_stop(video_device_t *dev);
+
+// frame periods since the last call, 0 if none (EAGAIN) and -1 on error
+// as fast as possible always gives one period
+int64_t video_pace_wait(video_device_t *dev);
+
+// give a paced frame its sequence, timestamp and flags
+void video_pace_frame(video_device_t *dev, video_frame_t *frame, int64_t periods);
+
+// buffers of a paced source: memfds so they can be exported, as many as
+// the latency calls for at dev->rate.  A buffer is taken to be filled
+// and comes back with video_pool_requeue()
+bool video_pool_init(video_device_t *dev, size_t size);
+void video_pool_uninit(video_device_t *dev);
+
+// index of a free buffer, -1 if all are in use and the frame is lost
+int video_pool_take(video_device_t *dev);
+bool video_pool_requeue(video_device_t *dev, video_frame_t *frame);
+bool video_pool_export(video_device_t *dev);
+
+// buffers needed to hold latency_ms of frames at fps
+unsigned int video_latency_buffers(const video_device_t *dev, unsigned int fps);
+
+#endif
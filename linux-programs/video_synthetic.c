@@ -0,0 +1,191 @@
+// frame source generating 12 bit GRBG Bayer frames of a fixed scene
+//
+// the scene is a block texture whose contrast follows a simulated
+// focus motor, which is also written as embedded data in the same way
+// as the firmware: the motor sweeps out and back, then holds at the
+// best position before the cycle repeats
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "embed.h"
+#include "video.h"
+#include "video_source.h"
+
+
+// focus cycle in frames: sweep 0..SWEEP, back to 0, then hold at BEST
+#define FOCUS_SWEEP 60
+#define FOCUS_BEST  30
+#define FOCUS_HOLD  60
+#define FOCUS_CYCLE (2 * FOCUS_SWEEP + FOCUS_HOLD)
+
+// texture block sizes in pixels, grain is per Bayer quad so it has no colour
+#define BLOCK_FINE    8
+#define BLOCK_COARSE 64
+
+typedef struct {
+	int16_t *texture;   // signed detail added to the base level
+	uint32_t n;         // frames generated
+} synthetic_t;
+
+// mean levels of the G R / B G sites
+static const uint16_t base_level[4] = { 2000, 1500, 1000, 2000 };
+
+
+// integer hash for repeatable noise
+static uint32_t hash(uint32_t x) {
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
+static uint8_t focus_steps(uint32_t n) {
+	uint32_t t = n % FOCUS_CYCLE;
+	if (t < FOCUS_SWEEP) {
+		return t;
+	}
+	if (t < 2 * FOCUS_SWEEP) {
+		return 2 * FOCUS_SWEEP - t;
+	}
+	return FOCUS_BEST;
+}
+
+// write the firmware's embedded nibbles
+static void embed_write(uint16_t *pixels, uint8_t steps, uint32_t contrast) {
+	uint8_t nibble[EMBED_NIBBLES];
+	nibble[0] = steps & 0x0f;
+	nibble[1] = steps >> 4;
+	for (int i = 0; i < 6; ++i) {
+		nibble[2 + i] = (contrast >> (4 * i)) & 0x0f;
+	}
+	nibble[8] = EMBED_FLAG;
+	for (int i = 0; i < EMBED_NIBBLES; ++i) {
+		uint16_t *p = &pixels[EMBED_DEFAULT_OFFSET + i];
+		*p = (*p & 0x0fff) | (nibble[i] << 12);
+	}
+}
+
+
+static bool synthetic_open(video_device_t *dev) {
+	dev->state = calloc(1, sizeof(synthetic_t));
+	if (NULL == dev->state) {
+		return video_fail_errno(dev, "out of memory", ENOMEM);
+	}
+	return video_pace_open(dev);
+}
+
+static void synthetic_close(video_device_t *dev) {
+	free(dev->state);
+	dev->state = NULL;
+}
+
+
+static bool synthetic_init(video_device_t *dev, video_format_t format) {
+	synthetic_t *s = dev->state;
+	const size_t n_pixels = VIDEO_WIDTH * VIDEO_HEIGHT;
+
+	dev->width = VIDEO_WIDTH;
+	dev->height = VIDEO_HEIGHT;
+	dev->frame_size = n_pixels * sizeof(uint16_t);
+
+	s->texture = malloc(n_pixels * sizeof(int16_t));
+	if (NULL == s->texture) {
+		return video_fail_errno(dev, "out of memory", ENOMEM);
+	}
+
+	// two sizes of blocks for edges plus fine grain
+	for (uint32_t y = 0; y < VIDEO_HEIGHT; ++y) {
+		for (uint32_t x = 0; x < VIDEO_WIDTH; ++x) {
+			uint32_t fine = hash((y / BLOCK_FINE) * VIDEO_WIDTH + x / BLOCK_FINE);
+			uint32_t coarse = hash((y / BLOCK_COARSE) * VIDEO_WIDTH + x / BLOCK_COARSE + 0x5bd1e995);
+			uint32_t grain = hash((y / 2) * VIDEO_WIDTH + x / 2 + 0x9e3779b9);
+			s->texture[y * VIDEO_WIDTH + x] = (int)(fine & 511) - 256
+				+ (int)(coarse & 1023) - 512
+				+ (int)(grain & 127) - 64;
+		}
+	}
+	return video_pool_init(dev, dev->frame_size);
+}
+
+static void synthetic_uninit(video_device_t *dev) {
+	synthetic_t *s = dev->state;
+	if (NULL != s) {
+		free(s->texture);
+		s->texture = NULL;
+	}
+	video_pool_uninit(dev);
+}
+
+
+static void generate(synthetic_t *s, uint16_t *frame) {
+	uint8_t steps = focus_steps(s->n);
+	int distance = steps > FOCUS_BEST ? steps - FOCUS_BEST : FOCUS_BEST - steps;
+	int gain = 256 - distance * 256 / FOCUS_BEST;  // detail kept, /256
+	if (gain < 0) {
+		gain = 0;
+	}
+
+	uint32_t seed = hash(s->n);
+	for (uint32_t y = 0; y < VIDEO_HEIGHT; ++y) {
+		uint16_t *row = &frame[y * VIDEO_WIDTH];
+		const int16_t *tex = &s->texture[y * VIDEO_WIDTH];
+		const uint16_t *level = &base_level[2 * (y & 1)];
+		for (uint32_t x = 0; x < VIDEO_WIDTH; ++x) {
+			seed ^= seed << 13;
+			seed ^= seed >> 17;
+			seed ^= seed << 5;
+			int v = level[x & 1] + (tex[x] * gain) / 256 + (int)(seed & 15) - 8;
+			row[x] = v < 0 ? 0 : v > 4095 ? 4095 : v;
+		}
+	}
+	embed_write(frame, steps, gain * 1000);
+	++s->n;
+}
+
+static int synthetic_dequeue(video_device_t *dev, video_frame_t *frame) {
+	synthetic_t *s = dev->state;
+	int64_t periods = video_pace_wait(dev);
+	if (periods <= 0) {
+		return periods;
+	}
+
+	// frames for missed periods are skipped, not generated
+	s->n += periods - 1;
+
+	int index = video_pool_take(dev);
+	if (index < 0) {
+		// every buffer is held, the frame is lost as a driver would
+		++s->n;
+		dev->sequence += periods;
+		return 0;
+	}
+	generate(s, dev->buffers[index].start);
+
+	frame->data = dev->buffers[index].start;
+	frame->bytesused = dev->frame_size;
+	frame->index = index;
+	video_pace_frame(dev, frame, periods);
+	return 1;
+}
+
+
+const video_source_t video_synthetic_source = {
+	.name = "synthetic",
+	.controls = false,
+	.open = synthetic_open,
+	.init = synthetic_init,
+	.start = video_pace_start,
+	.stop = video_pace_stop,
+	.dequeue = synthetic_dequeue,
+	.requeue = video_pool_requeue,
+	.export = video_pool_export,
+	.uninit = synthetic_uninit,
+	.close = synthetic_close,
+};